@@ -15,6 +15,7 @@ static const uint32_t N_POINTS = 1000000;
 static const uint32_t N_QUERIES = 5;
 static const uint32_t DESIRED_RESULT_SIZE = 5;
 static const uint32_t MAX_REGIONS = 8;
+static const uint32_t N_LOAD_THREADS = 4;
 static SpatialObjectTypes spatial_object_types;
 static SessionMemory<SpatialObjectPointer> memory;
 static InMemorySpatialObjectReferenceManager spatial_object_reference_manager;
@@ -67,22 +68,19 @@ static OrderedIndex<SpatialObjectPointer>* createIndex()
                                                  &memory);
 }
 
-static void loadRandomPoints(SpatialIndex<SpatialObjectPointer>* spatial_index, 
-                             SessionMemory<SpatialObjectPointer>* memory)
+static void loadRandomPoints(SpatialIndex<SpatialObjectPointer>* spatial_index)
 {
     srand(419);
     stopwatch.reset();
-    int64_t id = 0;
     for (uint32_t id = 0; id < N_POINTS; id++) {
         double x = rand() % X_MAX;
         double y = rand() % Y_MAX;
-        // Add a point in the heap, that will be owned by the index.
+        // Create a point in the heap, that will be owned by the index.
         Point2* point = new Point2(x, y);
         point->id(id);
-        spatial_index->add(point, memory);
         points[id] = point;
     }
-    spatial_index->freeze();
+    spatial_index->load((const SpatialObject* const*) points, N_POINTS, N_LOAD_THREADS);
     stopwatch.stop();
     double sec = stopwatch.usec() / 1000000.0;
     printf("Loaded %d points in %f sec (%f points/sec)\n",
@@ -146,7 +144,7 @@ int main(int32_t argc, const char** argv)
                                                index, 
                                                &spatial_object_reference_manager);
     SessionMemory<SpatialObjectPointer> memory;
-    loadRandomPoints(spatial_index, &memory);
+    loadRandomPoints(spatial_index);
     runQueries(spatial_index, &memory);
     delete index;
     delete space;
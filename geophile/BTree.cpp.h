@@ -0,0 +1,572 @@
+#include <stdlib.h>
+#include <new>
+#include "BTree.h"
+#include "GeophileException.h"
+#include "SpatialObjectReferenceManager.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR>
+    void BTree<SOR>::add(Z z, const SOR& sor)
+    {
+        SpatialObjectKey key(z, sor.spatialObjectId());
+        if (_root == NULL) {
+            _root = newLeaf();
+            _height = 0;
+        }
+        SpatialObjectKey separator;
+        void* sibling = insert(_root, _height, key, sor, &separator);
+        if (sibling) {
+            Inner* root = newInner();
+            root->separators[0] = separator;
+            root->children[0] = _root;
+            root->children[1] = sibling;
+            root->n = 1;
+            _root = root;
+            _height++;
+        }
+        _n++;
+        _modifications++;
+    }
+
+    template <class SOR>
+    SOR BTree<SOR>::remove(Z z, int64_t soid)
+    {
+        SOR removed;
+        removed.setNull();
+        if (_root) {
+            SpatialObjectKey key(z, soid);
+            if (remove(_root, _height, key, &removed)) {
+                _root = NULL;
+                _height = 0;
+            } else {
+                while (_height > 0 && ((Inner*) _root)->n == 0) {
+                    Inner* root = (Inner*) _root;
+                    _root = root->children[0];
+                    deleteInner(root);
+                    _height--;
+                }
+            }
+            if (!removed.isNull()) {
+                _n--;
+                _modifications++;
+            }
+        }
+        return removed;
+    }
+
+    template <class SOR>
+    void BTree<SOR>::freeze()
+    {
+        // A BTree is always ready for retrieval.
+    }
+
+    template <class SOR>
+    void BTree<SOR>::load(const Record<SOR>* records, uint32_t n)
+    {
+        if (_root != NULL) {
+            OrderedIndex<SOR>::load(records, n);
+            return;
+        }
+        if (n == 0) {
+            return;
+        }
+        // Build the tree bottom-up: full leaves, then each level of inner
+        // nodes over the level below. nodes[i] and min_keys[i] are the
+        // nodes of the level being built, and the smallest key in each.
+        uint32_t n_nodes = (n + NODE_CAPACITY - 1) / NODE_CAPACITY;
+        void** nodes = new void*[n_nodes];
+        SpatialObjectKey* min_keys = new SpatialObjectKey[n_nodes];
+        Leaf* previous = NULL;
+        for (uint32_t i = 0; i < n_nodes; i++) {
+            Leaf* leaf = newLeaf();
+            uint32_t first = i * NODE_CAPACITY;
+            uint32_t count = n - first < NODE_CAPACITY ? n - first : NODE_CAPACITY;
+            for (uint32_t r = 0; r < count; r++) {
+                const Record<SOR>& record = records[first + r];
+                leaf->keys[r] = record.key();
+                leaf->sors[r] = record.spatialObjectReference();
+            }
+            leaf->n = count;
+            leaf->previous = previous;
+            if (previous) {
+                previous->next = leaf;
+            }
+            previous = leaf;
+            nodes[i] = leaf;
+            min_keys[i] = leaf->keys[0];
+        }
+        uint32_t height = 0;
+        while (n_nodes > 1) {
+            uint32_t n_parents = (n_nodes + NODE_CAPACITY) / (NODE_CAPACITY + 1);
+            for (uint32_t p = 0; p < n_parents; p++) {
+                Inner* inner = newInner();
+                uint32_t first = p * (NODE_CAPACITY + 1);
+                uint32_t count =
+                    n_nodes - first < NODE_CAPACITY + 1 ? n_nodes - first : NODE_CAPACITY + 1;
+                for (uint32_t c = 0; c < count; c++) {
+                    inner->children[c] = nodes[first + c];
+                    if (c > 0) {
+                        inner->separators[c - 1] = min_keys[first + c];
+                    }
+                }
+                inner->n = count - 1;
+                // p <= first, so nodes and min_keys can be overwritten in place.
+                nodes[p] = inner;
+                min_keys[p] = min_keys[first];
+            }
+            n_nodes = n_parents;
+            height++;
+        }
+        _root = nodes[0];
+        _height = height;
+        _n = n;
+        _modifications++;
+        delete [] nodes;
+        delete [] min_keys;
+    }
+
+    template <class SOR>
+    Cursor<SOR>* BTree<SOR>::cursor()
+    {
+        return new BTreeCursor<SOR>(*this);
+    }
+
+    template <class SOR>
+    BTree<SOR>::~BTree()
+    {
+        if (_root) {
+            destroy(_root, _height);
+        }
+    }
+
+    template <class SOR>
+    uint32_t BTree<SOR>::nRecords() const
+    {
+        return _n;
+    }
+
+    template <class SOR>
+    BTree<SOR>::BTree(const SpatialObjectTypes* spatial_object_types,
+                      const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                      SessionMemory<SOR>* memory)
+        : OrderedIndex<SOR>(spatial_object_types, memory, spatial_object_reference_manager),
+          _root(NULL),
+          _height(0),
+          _n(0),
+          _modifications(0)
+    {}
+
+    template <class SOR>
+    void BTree<SOR>::findForward(const SpatialObjectKey& key,
+                                 int32_t include_key,
+                                 Leaf** leaf,
+                                 int32_t* position) const
+    {
+        descend(key, include_key, leaf, position);
+        if (*leaf && *position == (int32_t) (*leaf)->n) {
+            *leaf = (*leaf)->next;
+            *position = 0;
+        }
+    }
+
+    template <class SOR>
+    void BTree<SOR>::findBackward(const SpatialObjectKey& key,
+                                  int32_t include_key,
+                                  Leaf** leaf,
+                                  int32_t* position) const
+    {
+        // The last key <= key precedes the first key > key, and the last
+        // key < key precedes the first key >= key.
+        descend(key, !include_key, leaf, position);
+        if (*leaf) {
+            (*position)--;
+            if (*position < 0) {
+                *leaf = (*leaf)->previous;
+                if (*leaf) {
+                    *position = (*leaf)->n - 1;
+                }
+            }
+        }
+    }
+
+    template <class SOR>
+    void BTree<SOR>::descend(const SpatialObjectKey& key,
+                             int32_t include_key,
+                             Leaf** leaf,
+                             int32_t* position) const
+    {
+        if (_root == NULL) {
+            *leaf = NULL;
+            return;
+        }
+        void* node = _root;
+        for (uint32_t level = _height; level > 0; level--) {
+            Inner* inner = (Inner*) node;
+            node = inner->children[search(inner->separators, inner->n, key, include_key)];
+        }
+        *leaf = (Leaf*) node;
+        *position = search((*leaf)->keys, (*leaf)->n, key, include_key);
+    }
+
+    template <class SOR>
+    void* BTree<SOR>::insert(void* node,
+                             uint32_t level,
+                             const SpatialObjectKey& key,
+                             const SOR& sor,
+                             SpatialObjectKey* separator)
+    {
+        if (level == 0) {
+            Leaf* leaf = (Leaf*) node;
+            uint32_t position = search(leaf->keys, leaf->n, key, false);
+            if (leaf->n == NODE_CAPACITY) {
+                // Split. If keys are arriving in order, leave the left
+                // leaf full instead of half full.
+                Leaf* right = newLeaf();
+                uint32_t split =
+                    position == NODE_CAPACITY && leaf->next == NULL
+                    ? NODE_CAPACITY
+                    : NODE_CAPACITY / 2;
+                for (uint32_t i = split; i < NODE_CAPACITY; i++) {
+                    right->keys[i - split] = leaf->keys[i];
+                    right->sors[i - split] = leaf->sors[i];
+                }
+                right->n = NODE_CAPACITY - split;
+                leaf->n = split;
+                right->next = leaf->next;
+                if (right->next) {
+                    right->next->previous = right;
+                }
+                right->previous = leaf;
+                leaf->next = right;
+                if (position >= split) {
+                    leaf = right;
+                    position -= split;
+                }
+                for (uint32_t i = leaf->n; i > position; i--) {
+                    leaf->keys[i] = leaf->keys[i - 1];
+                    leaf->sors[i] = leaf->sors[i - 1];
+                }
+                leaf->keys[position] = key;
+                leaf->sors[position] = sor;
+                leaf->n++;
+                *separator = right->keys[0];
+                return right;
+            } else {
+                for (uint32_t i = leaf->n; i > position; i--) {
+                    leaf->keys[i] = leaf->keys[i - 1];
+                    leaf->sors[i] = leaf->sors[i - 1];
+                }
+                leaf->keys[position] = key;
+                leaf->sors[position] = sor;
+                leaf->n++;
+                return NULL;
+            }
+        } else {
+            Inner* inner = (Inner*) node;
+            uint32_t c = search(inner->separators, inner->n, key, false);
+            SpatialObjectKey child_separator;
+            void* child = insert(inner->children[c], level - 1, key, sor, &child_separator);
+            if (child == NULL) {
+                return NULL;
+            }
+            if (inner->n < NODE_CAPACITY) {
+                for (uint32_t i = inner->n; i > c; i--) {
+                    inner->separators[i] = inner->separators[i - 1];
+                    inner->children[i + 1] = inner->children[i];
+                }
+                inner->separators[c] = child_separator;
+                inner->children[c + 1] = child;
+                inner->n++;
+                return NULL;
+            }
+            // Split. Gather the separators and children, including the new
+            // ones, move the upper half to a new node, and promote the
+            // separator between the halves.
+            SpatialObjectKey separators[NODE_CAPACITY + 1];
+            void* children[NODE_CAPACITY + 2];
+            for (uint32_t i = 0, j = 0; i <= NODE_CAPACITY; i++) {
+                if (i == c) {
+                    separators[i] = child_separator;
+                } else {
+                    separators[i] = inner->separators[j++];
+                }
+            }
+            for (uint32_t i = 0, j = 0; i <= NODE_CAPACITY + 1; i++) {
+                if (i == c + 1) {
+                    children[i] = child;
+                } else {
+                    children[i] = inner->children[j++];
+                }
+            }
+            uint32_t split = NODE_CAPACITY / 2;
+            Inner* right = newInner();
+            for (uint32_t i = 0; i < split; i++) {
+                inner->separators[i] = separators[i];
+                inner->children[i] = children[i];
+            }
+            inner->children[split] = children[split];
+            inner->n = split;
+            *separator = separators[split];
+            for (uint32_t i = split + 1; i <= NODE_CAPACITY; i++) {
+                right->separators[i - split - 1] = separators[i];
+                right->children[i - split - 1] = children[i];
+            }
+            right->children[NODE_CAPACITY - split] = children[NODE_CAPACITY + 1];
+            right->n = NODE_CAPACITY - split;
+            return right;
+        }
+    }
+
+    template <class SOR>
+    bool BTree<SOR>::remove(void* node, uint32_t level, const SpatialObjectKey& key, SOR* removed)
+    {
+        if (level == 0) {
+            Leaf* leaf = (Leaf*) node;
+            uint32_t position = search(leaf->keys, leaf->n, key, true);
+            if (position == leaf->n || leaf->keys[position].compare(key) != 0) {
+                return false;
+            }
+            *removed = leaf->sors[position];
+            leaf->n--;
+            for (uint32_t i = position; i < leaf->n; i++) {
+                leaf->keys[i] = leaf->keys[i + 1];
+                leaf->sors[i] = leaf->sors[i + 1];
+            }
+            if (leaf->n > 0) {
+                return false;
+            }
+            if (leaf->previous) {
+                leaf->previous->next = leaf->next;
+            }
+            if (leaf->next) {
+                leaf->next->previous = leaf->previous;
+            }
+            deleteLeaf(leaf);
+            return true;
+        } else {
+            Inner* inner = (Inner*) node;
+            uint32_t c = search(inner->separators, inner->n, key, true);
+            bool emptied = remove(inner->children[c], level - 1, key, removed);
+            // Duplicates of a separator can be on both sides of it.
+            while (!emptied && removed->isNull() &&
+                   c < inner->n && inner->separators[c].compare(key) == 0) {
+                c++;
+                emptied = remove(inner->children[c], level - 1, key, removed);
+            }
+            if (!emptied) {
+                return false;
+            }
+            if (inner->n == 0) {
+                deleteInner(inner);
+                return true;
+            }
+            // Remove child c, and one of the separators bounding it.
+            for (uint32_t i = c > 0 ? c - 1 : 0; i < inner->n - 1; i++) {
+                inner->separators[i] = inner->separators[i + 1];
+            }
+            for (uint32_t i = c; i < inner->n; i++) {
+                inner->children[i] = inner->children[i + 1];
+            }
+            inner->n--;
+            return false;
+        }
+    }
+
+    template <class SOR>
+    void BTree<SOR>::destroy(void* node, uint32_t level)
+    {
+        if (level == 0) {
+            Leaf* leaf = (Leaf*) node;
+            for (uint32_t i = 0; i < leaf->n; i++) {
+                this->_spatial_object_reference_manager->cleanupSpatialObjectReference(leaf->sors[i]);
+            }
+            deleteLeaf(leaf);
+        } else {
+            Inner* inner = (Inner*) node;
+            for (uint32_t i = 0; i <= inner->n; i++) {
+                destroy(inner->children[i], level - 1);
+            }
+            deleteInner(inner);
+        }
+    }
+
+    template <class SOR>
+    typename BTree<SOR>::Leaf* BTree<SOR>::newLeaf()
+    {
+        void* memory;
+        if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(Leaf)) != 0) {
+            throw GeophileException("Unable to allocate BTree leaf");
+        }
+        Leaf* leaf = new (memory) Leaf();
+        leaf->n = 0;
+        leaf->previous = NULL;
+        leaf->next = NULL;
+        return leaf;
+    }
+
+    template <class SOR>
+    typename BTree<SOR>::Inner* BTree<SOR>::newInner()
+    {
+        void* memory;
+        if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(Inner)) != 0) {
+            throw GeophileException("Unable to allocate BTree node");
+        }
+        Inner* inner = new (memory) Inner();
+        inner->n = 0;
+        return inner;
+    }
+
+    template <class SOR>
+    void BTree<SOR>::deleteLeaf(Leaf* leaf)
+    {
+        leaf->~Leaf();
+        free(leaf);
+    }
+
+    template <class SOR>
+    void BTree<SOR>::deleteInner(Inner* inner)
+    {
+        inner->~Inner();
+        free(inner);
+    }
+
+    template <class SOR>
+    uint64_t BTree<SOR>::modifications() const
+    {
+        return _modifications;
+    }
+
+    template <class SOR>
+    uint32_t BTree<SOR>::search(const SpatialObjectKey* keys,
+                                uint32_t n,
+                                const SpatialObjectKey& key,
+                                int32_t include_key)
+    {
+        uint32_t lo = 0;
+        uint32_t hi = n;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            int32_t c = keys[mid].compare(key);
+            if (c < 0 || (c == 0 && !include_key)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    template <class SOR>
+    Record<SOR> BTreeCursor<SOR>::next()
+    {
+        return neighbor(true);
+    }
+
+    template <class SOR>
+    Record<SOR> BTreeCursor<SOR>::previous()
+    {
+        return neighbor(false);
+    }
+
+    template <class SOR>
+    void BTreeCursor<SOR>::goTo(const SpatialObjectKey& key)
+    {
+        _start_at = key;
+        _start_inclusive = true;
+        this->state(NEVER_USED);
+    }
+
+    template <class SOR>
+    void BTreeCursor<SOR>::skipTo(const SpatialObjectKey& key)
+    {
+        if (this->state() == IN_USE && _forward && _modifications == _btree.modifications()) {
+            // _position is the position of the next record to be returned by next().
+            // Search the rest of the current leaf if the key is there, otherwise
+            // search from the root.
+            int32_t n = _leaf->n;
+            if (_position < n && _leaf->keys[n - 1].compare(key) >= 0) {
+                _position += BTree<SOR>::search(&_leaf->keys[_position], n - _position, key, true);
+            } else {
+                _btree.findForward(key, true, &_leaf, &_position);
+                if (_leaf == NULL) {
+                    this->close();
+                }
+            }
+            _start_at = key;
+            _start_inclusive = true;
+        } else {
+            goTo(key);
+        }
+    }
+
+    template <class SOR>
+    BTreeCursor<SOR>::BTreeCursor(BTree<SOR>& btree)
+        : _btree(btree),
+          _leaf(NULL),
+          _position(0),
+          _start_at(),
+          _start_inclusive(true),
+          _forward(true),
+          _modifications(0)
+    {}
+
+    template <class SOR>
+    Record<SOR> BTreeCursor<SOR>::neighbor(int32_t forward_move)
+    {
+        switch (this->state()) {
+            case NEVER_USED:
+                startIteration(forward_move, true);
+                break;
+            case IN_USE:
+                if ((_forward && !forward_move) || (!_forward && forward_move)) {
+                    startIteration(forward_move, false);
+                } else if (_modifications != _btree.modifications()) {
+                    // The BTree has changed since _leaf and _position were
+                    // computed, so find the position again.
+                    startIteration(forward_move, _start_inclusive);
+                }
+                break;
+            case DONE:
+                GEOPHILE_ASSERT(this->current().eof());
+                return this->current();
+        }
+        if (forward_move) {
+            if (_leaf && _position == (int32_t) _leaf->n) {
+                _leaf = _leaf->next;
+                _position = 0;
+            }
+        } else {
+            if (_leaf && _position < 0) {
+                _leaf = _leaf->previous;
+                if (_leaf) {
+                    _position = _leaf->n - 1;
+                }
+            }
+        }
+        if (_leaf) {
+            const SpatialObjectKey& key = _leaf->keys[_position];
+            this->current(key.z(), _leaf->sors[_position]);
+            _position += forward_move ? 1 : -1;
+            this->state(IN_USE);
+            _start_at = key;
+            _start_inclusive = false;
+        } else {
+            this->close();
+        }
+        _forward = forward_move;
+        return this->current();
+    }
+
+    template <class SOR>
+    void BTreeCursor<SOR>::startIteration(int32_t forward_move, int32_t include_start_key)
+    {
+        if (forward_move) {
+            _btree.findForward(_start_at, include_start_key, &_leaf, &_position);
+        } else {
+            _btree.findBackward(_start_at, include_start_key, &_leaf, &_position);
+        }
+        _modifications = _btree.modifications();
+    }
+}
@@ -0,0 +1,177 @@
+#ifndef _BTREE_H
+#define _BTREE_H
+
+#include <stdint.h>
+#include "OrderedIndex.h"
+#include "Record.h"
+#include "Cursor.h"
+#include "SpatialObjectKey.h"
+#include "SpatialObjectTypes.h"
+
+namespace geophile
+{
+    template <class SOR> class BTreeCursor;
+    template <class SOR> class SessionMemory;
+    template <class SOR> class SpatialObjectReferenceManager;
+    class SpatialObjectTypes;
+
+    /*
+     * An in-memory B+tree implementation of OrderedIndex. Unlike
+     * RecordArray (in test/ and examples/), a BTree is searchable at
+     * all times: add and remove keep it in key order, freeze does
+     * nothing, and adds and removes may be interleaved with cursor
+     * scans.
+     *
+     * Nodes are allocated on cache-line boundaries, and keys are
+     * stored separately from SORs, so that the binary search within
+     * a node touches a few consecutive cache lines of keys. Leaves
+     * are linked in both directions, so cursors scan leaves
+     * sequentially, without returning to the upper levels of the
+     * tree.
+     *
+     * Nodes are not merged on remove. A node is freed once it is
+     * empty.
+     *
+     * As for other OrderedIndexes, retrieval doesn't modify the
+     * BTree, so concurrent retrieval is possible, as long as there
+     * are no concurrent adds or removes.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class BTree : public OrderedIndex<SOR>
+    {
+    public:
+        // OrderedIndex
+        virtual void add(Z z, const SOR& sor);
+        virtual SOR remove(Z z, int64_t soid);
+        virtual void freeze();
+        virtual void load(const Record<SOR>* records, uint32_t n);
+        virtual Cursor<SOR>* cursor();
+        virtual ~BTree();
+
+        // BTree
+        uint32_t nRecords() const;
+        BTree(const SpatialObjectTypes* spatial_object_types,
+              const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+              SessionMemory<SOR>* memory);
+
+    private:
+        static const uint32_t CACHE_LINE_SIZE = 64;
+        // The keys of a node fill KEY_CACHE_LINES cache lines.
+        static const uint32_t KEY_CACHE_LINES = 4;
+        static const uint32_t NODE_CAPACITY =
+            KEY_CACHE_LINES * CACHE_LINE_SIZE / sizeof(SpatialObjectKey);
+
+        struct Leaf
+        {
+            SpatialObjectKey keys[NODE_CAPACITY];
+            SOR sors[NODE_CAPACITY];
+            uint32_t n;
+            Leaf* previous;
+            Leaf* next;
+        };
+
+        // Child i contains keys k such that separators[i-1] <= k <= separators[i].
+        // (Keys equal to a separator can appear on both sides of it if
+        // the BTree contains duplicates.)
+        struct Inner
+        {
+            SpatialObjectKey separators[NODE_CAPACITY];
+            void* children[NODE_CAPACITY + 1];
+            uint32_t n; // Number of separators. There are n + 1 children.
+        };
+
+    private:
+        // Position of the first record with a key >= key (include_key) or
+        // > key (!include_key), moving to the following leaf if necessary.
+        // Sets *leaf to NULL if there is no such record.
+        void findForward(const SpatialObjectKey& key,
+                         int32_t include_key,
+                         Leaf** leaf,
+                         int32_t* position) const;
+        // Position of the last record with a key <= key (include_key) or
+        // < key (!include_key), moving to the preceding leaf if necessary.
+        // Sets *leaf to NULL if there is no such record.
+        void findBackward(const SpatialObjectKey& key,
+                          int32_t include_key,
+                          Leaf** leaf,
+                          int32_t* position) const;
+        // Leaf that would contain the first key >= key (include_key) or
+        // > key (!include_key), and the position within the leaf, which
+        // may be the leaf's n.
+        void descend(const SpatialObjectKey& key,
+                     int32_t include_key,
+                     Leaf** leaf,
+                     int32_t* position) const;
+        // Insert into the subtree rooted at node. If node splits, returns the
+        // new right sibling, and sets *separator to its smallest key.
+        void* insert(void* node,
+                     uint32_t level,
+                     const SpatialObjectKey& key,
+                     const SOR& sor,
+                     SpatialObjectKey* separator);
+        // Remove key from the subtree rooted at node. Returns true if node
+        // is now empty, (and has been freed).
+        bool remove(void* node, uint32_t level, const SpatialObjectKey& key, SOR* removed);
+        void destroy(void* node, uint32_t level);
+        Leaf* newLeaf();
+        Inner* newInner();
+        void deleteLeaf(Leaf* leaf);
+        void deleteInner(Inner* inner);
+        uint64_t modifications() const;
+
+        // First position in keys[0 .. n-1] with a key >= key (include_key)
+        // or > key (!include_key).
+        static uint32_t search(const SpatialObjectKey* keys,
+                               uint32_t n,
+                               const SpatialObjectKey& key,
+                               int32_t include_key);
+
+    private:
+        void* _root; // NULL if the BTree is empty
+        uint32_t _height; // 0 if _root is a Leaf
+        uint32_t _n;
+        // Incremented by add and remove. Cursors use this to detect that their
+        // positions may be stale.
+        uint64_t _modifications;
+
+        template <class> friend class BTreeCursor;
+    };
+
+    template <class SOR>
+    class BTreeCursor : public Cursor<SOR>
+    {
+    public:
+        virtual Record<SOR> next();
+        virtual Record<SOR> previous();
+        virtual void goTo(const SpatialObjectKey& key);
+        virtual void skipTo(const SpatialObjectKey& key);
+        BTreeCursor(BTree<SOR>& btree);
+
+    private:
+        typedef typename BTree<SOR>::Leaf Leaf;
+
+    private:
+        Record<SOR> neighbor(int32_t forward_move);
+        void startIteration(int32_t forward_move, int32_t include_start_key);
+
+    private:
+        BTree<SOR>& _btree;
+        // Position of the next record to return, in the direction of
+        // _forward. _position may be off either end of _leaf.
+        Leaf* _leaf;
+        int32_t _position;
+        SpatialObjectKey _start_at;
+        // True if the next record may have key _start_at, (after goTo or
+        // skipTo), false if _start_at is the key of the last record returned.
+        int32_t _start_inclusive;
+        int32_t _forward;
+        // _btree's modification count when _leaf and _position were
+        // computed.
+        uint64_t _modifications;
+    };
+}
+
+// So that the functions can be instantiated
+#include "BTree.cpp.h"
+
+#endif
@@ -70,6 +70,28 @@ RegionComparison Box2::compare(const Region* region) const
     }
 }
 
+int32_t Box2::containsRegion(const Region* region) const
+{
+    // A grid cell at the edge of the box, (e.g. the cell containing _xlo),
+    // may extend beyond the box, unless the box extends to the edge of the
+    // space.
+    const Space* space = region->space();
+    return
+        (region->lo(0) > (uint64_t) space->appToZ(0, _xlo) || _xlo <= space->lo(0)) &&
+        (region->hi(0) < (uint64_t) space->appToZ(0, _xhi) || _xhi >= space->hi(0)) &&
+        (region->lo(1) > (uint64_t) space->appToZ(1, _ylo) || _ylo <= space->lo(1)) &&
+        (region->hi(1) < (uint64_t) space->appToZ(1, _yhi) || _yhi >= space->hi(1));
+}
+
+int32_t Box2::boxBounds(double* lo, double* hi) const
+{
+    lo[0] = _xlo;
+    lo[1] = _ylo;
+    hi[0] = _xhi;
+    hi[1] = _yhi;
+    return true;
+}
+
 int32_t Box2::typeId() const
 {
     return TYPE_ID;
@@ -23,6 +23,8 @@ namespace geophile
         virtual void copyFrom(const SpatialObject* spatial_object);
         virtual bool isNull() const;
         virtual void setNull();
+        virtual int32_t containsRegion(const Region* region) const;
+        virtual int32_t boxBounds(double* lo, double* hi) const;
 
     public: // Box2
         double xlo() const;
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "BufferPool.h"
+#include "GeophileException.h"
+#include "util.h"
+
+using namespace geophile;
+
+uint8_t* BufferPool::pin(uint32_t page)
+{
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        int32_t frame = find(page);
+        if (frame != NO_FRAME) {
+            Frame* f = &_frames[frame];
+            if (f->io) {
+                // Being read, (or written back by flush). Check again afterward,
+                // since a failed read leaves the page out of the pool.
+                pthread_cond_wait(&_io_done, &_mutex);
+                continue;
+            }
+            f->pins++;
+            f->referenced = true;
+            pthread_mutex_unlock(&_mutex);
+            return &_data[(uint64_t) frame * _page_size];
+        }
+        frame = victim();
+        if (frame == NO_FRAME) {
+            pthread_mutex_unlock(&_mutex);
+            throw GeophileException("BufferPool: all frames are pinned");
+        }
+        Frame* f = &_frames[frame];
+        if (f->page != NO_PAGE && f->dirty) {
+            // Write back the evicted page, which stays in the pool, (and is
+            // waited for), until written. Then start over: Another thread
+            // may have read the page meanwhile.
+            f->pins++;
+            bool written = writeUnlocked(frame);
+            f->pins--;
+            if (!written) {
+                pthread_mutex_unlock(&_mutex);
+                throw GeophileException("BufferPool: unable to write page");
+            }
+            f->referenced = false;
+            continue;
+        }
+        if (f->page != NO_PAGE) {
+            hashRemove(frame);
+        }
+        f->page = page;
+        f->dirty = false;
+        f->referenced = true;
+        f->pins = 1;
+        f->io = true;
+        hashInsert(frame);
+        pthread_mutex_unlock(&_mutex);
+        uint8_t* data = &_data[(uint64_t) frame * _page_size];
+        ssize_t n = pread(_fd, data, _page_size, (off_t) page * _page_size);
+        if (n >= 0) {
+            // Past the end of the file
+            memset(data + n, 0, _page_size - n);
+        }
+        pthread_mutex_lock(&_mutex);
+        f->io = false;
+        pthread_cond_broadcast(&_io_done);
+        if (n < 0) {
+            hashRemove(frame);
+            f->page = NO_PAGE;
+            f->pins = 0;
+            pthread_mutex_unlock(&_mutex);
+            throw GeophileException("BufferPool: unable to read page");
+        }
+        _reads++;
+        pthread_mutex_unlock(&_mutex);
+        return data;
+    }
+}
+
+void BufferPool::unpin(uint32_t page, bool dirty)
+{
+    pthread_mutex_lock(&_mutex);
+    int32_t frame = find(page);
+    bool pinned = frame != NO_FRAME && _frames[frame].pins > 0;
+    if (pinned) {
+        Frame* f = &_frames[frame];
+        f->pins--;
+        f->dirty = f->dirty || dirty;
+    }
+    pthread_mutex_unlock(&_mutex);
+    GEOPHILE_ASSERT(pinned);
+}
+
+void BufferPool::flush()
+{
+    pthread_mutex_lock(&_mutex);
+    bool written = writeModified();
+    pthread_mutex_unlock(&_mutex);
+    if (!written) {
+        throw GeophileException("BufferPool: unable to write page");
+    }
+}
+
+uint64_t BufferPool::nReads() const
+{
+    pthread_mutex_lock(&_mutex);
+    uint64_t reads = _reads;
+    pthread_mutex_unlock(&_mutex);
+    return reads;
+}
+
+uint32_t BufferPool::nFrames() const
+{
+    return _n_frames;
+}
+
+uint32_t BufferPool::pageSize() const
+{
+    return _page_size;
+}
+
+BufferPool::~BufferPool()
+{
+    pthread_mutex_lock(&_mutex);
+    writeModified();
+    pthread_mutex_unlock(&_mutex);
+    free(_data);
+    delete [] _frames;
+    delete [] _buckets;
+    pthread_cond_destroy(&_io_done);
+    pthread_mutex_destroy(&_mutex);
+}
+
+BufferPool::BufferPool(int fd, uint32_t page_size, uint64_t memory)
+    : _fd(fd),
+      _page_size(page_size),
+      _n_frames(memory / page_size < MIN_FRAMES ? MIN_FRAMES : (uint32_t) (memory / page_size)),
+      _frames(NULL),
+      _data(NULL),
+      _buckets(NULL),
+      _n_buckets(1),
+      _clock(0),
+      _reads(0)
+{
+    void* data;
+    if (posix_memalign(&data, page_size, (uint64_t) _n_frames * page_size) != 0) {
+        throw GeophileException("BufferPool: unable to allocate frames");
+    }
+    _data = (uint8_t*) data;
+    _frames = new Frame[_n_frames];
+    for (uint32_t frame = 0; frame < _n_frames; frame++) {
+        Frame* f = &_frames[frame];
+        f->page = NO_PAGE;
+        f->pins = 0;
+        f->dirty = false;
+        f->referenced = false;
+        f->io = false;
+        f->next = NO_FRAME;
+    }
+    while (_n_buckets < 2 * _n_frames) {
+        _n_buckets *= 2;
+    }
+    _buckets = new int32_t[_n_buckets];
+    for (uint32_t b = 0; b < _n_buckets; b++) {
+        _buckets[b] = NO_FRAME;
+    }
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_io_done, NULL);
+}
+
+int32_t BufferPool::find(uint32_t page) const
+{
+    int32_t frame = _buckets[bucket(page)];
+    while (frame != NO_FRAME && _frames[frame].page != page) {
+        frame = _frames[frame].next;
+    }
+    return frame;
+}
+
+int32_t BufferPool::victim()
+{
+    // Two sweeps: the first may only clear referenced bits.
+    for (uint32_t i = 0; i < 2 * _n_frames; i++) {
+        int32_t frame = _clock;
+        _clock = (_clock + 1) % _n_frames;
+        Frame* f = &_frames[frame];
+        if (f->pins == 0 && !f->io) {
+            if (f->referenced) {
+                f->referenced = false;
+            } else {
+                return frame;
+            }
+        }
+    }
+    return NO_FRAME;
+}
+
+bool BufferPool::writeUnlocked(int32_t frame)
+{
+    Frame* f = &_frames[frame];
+    f->io = true;
+    f->dirty = false;
+    uint32_t page = f->page;
+    pthread_mutex_unlock(&_mutex);
+    ssize_t n = pwrite(_fd, &_data[(uint64_t) frame * _page_size], _page_size, (off_t) page * _page_size);
+    pthread_mutex_lock(&_mutex);
+    bool written = n == (ssize_t) _page_size;
+    if (!written) {
+        f->dirty = true;
+    }
+    f->io = false;
+    pthread_cond_broadcast(&_io_done);
+    return written;
+}
+
+bool BufferPool::writeModified()
+{
+    bool written = true;
+    for (uint32_t frame = 0; frame < _n_frames; frame++) {
+        Frame* f = &_frames[frame];
+        if (f->page != NO_PAGE && f->dirty && !f->io) {
+            written = writeUnlocked(frame) && written;
+        }
+    }
+    return written;
+}
+
+void BufferPool::hashInsert(int32_t frame)
+{
+    uint32_t b = bucket(_frames[frame].page);
+    _frames[frame].next = _buckets[b];
+    _buckets[b] = frame;
+}
+
+void BufferPool::hashRemove(int32_t frame)
+{
+    int32_t* link = &_buckets[bucket(_frames[frame].page)];
+    while (*link != frame) {
+        link = &_frames[*link].next;
+    }
+    *link = _frames[frame].next;
+    _frames[frame].next = NO_FRAME;
+}
+
+uint32_t BufferPool::bucket(uint32_t page) const
+{
+    // Fibonacci hashing, so that consecutive pages spread out.
+    return (uint32_t) ((page * 2654435769U) & (_n_buckets - 1));
+}
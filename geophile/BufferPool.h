@@ -0,0 +1,128 @@
+#ifndef _BUFFER_POOL_H
+#define _BUFFER_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+namespace geophile
+{
+    /*
+     * A fixed-size cache of the pages of a file, for disk-resident
+     * structures, (e.g. DiskBTree). A page is read into a frame by
+     * pin, and stays there until it is unpinned. Unpinned pages are
+     * evicted by the clock algorithm when a frame is needed: The
+     * clock hand sweeps the frames, giving each recently used page a
+     * second chance, and evicts the first unpinned page not used
+     * since the last sweep. Modified pages are written back when
+     * evicted, and by flush.
+     *
+     * Memory use is bounded by the number of frames, fixed when the
+     * BufferPool is created. If every frame is pinned, pin throws
+     * GeophileException.
+     *
+     * pin and unpin can be called by several threads at once. Pages
+     * are read and written without holding the pool's mutex: A frame
+     * being read or written is marked, and only threads needing that
+     * frame wait for the I/O to finish.
+     */
+    class BufferPool
+    {
+    public:
+        /*
+         * Returns the contents of the page, which stay in memory, at
+         * the same address, until a matching call to unpin. A page
+         * past the end of the file reads as zeros.
+         */
+        uint8_t* pin(uint32_t page);
+
+        /*
+         * Ends one pin of the page. dirty indicates that the page was
+         * modified while pinned.
+         */
+        void unpin(uint32_t page, bool dirty);
+
+        /*
+         * Writes modified pages to the file. Throws GeophileException if
+         * a page can't be written, (it stays modified).
+         */
+        void flush();
+
+        /*
+         * Number of pages read from the file. For testing.
+         */
+        uint64_t nReads() const;
+
+        /*
+         * Number of frames, (the most pages that can be in memory at
+         * once).
+         */
+        uint32_t nFrames() const;
+
+        uint32_t pageSize() const;
+
+        /*
+         * Destructor. Modified pages are written to the file, which is
+         * not closed. Pages that can't be written are lost.
+         */
+        ~BufferPool();
+
+        /*
+         * Constructor.
+         *     fd: An open file, with pages of page_size bytes.
+         *     page_size: Size of a page.
+         *     memory: Memory available for frames. There are at least
+         *         MIN_FRAMES frames.
+         */
+        BufferPool(int fd, uint32_t page_size, uint64_t memory);
+
+    public:
+        static const uint32_t MIN_FRAMES = 16;
+
+    private:
+        static const uint32_t NO_PAGE = 0xffffffff;
+        static const int32_t NO_FRAME = -1;
+
+        struct Frame
+        {
+            uint32_t page;
+            uint32_t pins;
+            bool dirty;
+            // Set when the frame is used, cleared by the clock hand.
+            bool referenced;
+            // Set while the frame is being read or written, without the mutex.
+            bool io;
+            // Next frame in the same hash bucket
+            int32_t next;
+        };
+
+    private:
+        int32_t find(uint32_t page) const;
+        int32_t victim();
+        // Writes the frame's page, with the mutex held on entry and exit, but
+        // not during the write. Returns false if the write fails, leaving
+        // the page modified.
+        bool writeUnlocked(int32_t frame);
+        // Writes all modified pages. Returns false if any write fails.
+        bool writeModified();
+        void hashInsert(int32_t frame);
+        void hashRemove(int32_t frame);
+        uint32_t bucket(uint32_t page) const;
+
+    private:
+        int _fd;
+        uint32_t _page_size;
+        uint32_t _n_frames;
+        Frame* _frames;
+        uint8_t* _data;
+        // Frames by page number: bucket heads, chained through Frame::next.
+        int32_t* _buckets;
+        uint32_t _n_buckets; // A power of 2
+        uint32_t _clock;
+        uint64_t _reads;
+        mutable pthread_mutex_t _mutex;
+        // Signalled when I/O on a frame finishes.
+        pthread_cond_t _io_done;
+    };
+}
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <new>
+#include "ConcurrentSkipList.h"
+#include "Epoch.h"
+#include "GeophileException.h"
+#include "SpatialObjectReferenceManager.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR>
+    void ConcurrentSkipList<SOR>::add(Z z, const SOR& sor)
+    {
+        SpatialObjectKey key(z, sor.spatialObjectId());
+        Node* preds[MAX_HEIGHT];
+        Node* succs[MAX_HEIGHT];
+        Node* node = NULL;
+        Epoch::enter();
+        // Link the node at level 0, which makes it visible.
+        bool linked = false;
+        while (!linked) {
+            if (find(key, preds, succs)) {
+                if (node) {
+                    // Never visible to other threads
+                    freeNode(node);
+                }
+                Epoch::exit();
+                return;
+            }
+            if (node == NULL) {
+                node = newNode(key, sor, randomHeight());
+            }
+            for (uint32_t level = 0; level < node->height; level++) {
+                node->next[level].store((uintptr_t) succs[level], std::memory_order_relaxed);
+            }
+            uintptr_t expected = (uintptr_t) succs[0];
+            linked = preds[0]->next[0].compare_exchange_strong(expected, (uintptr_t) node);
+        }
+        _n.fetch_add(1);
+        // Link the upper levels, giving up if the node is removed meanwhile.
+        bool abandoned = false;
+        for (uint32_t level = 1; level < node->height && !abandoned; level++) {
+            linked = false;
+            while (!linked && !abandoned) {
+                Node* succ = succs[level];
+                uintptr_t next = node->next[level].load();
+                // The only change other threads make to the node's next
+                // pointers is marking them, so a failed CAS means removal.
+                if (marked(next) ||
+                    (pointer(next) != succ &&
+                     !node->next[level].compare_exchange_strong(next, (uintptr_t) succ))) {
+                    abandoned = true;
+                } else {
+                    uintptr_t expected = (uintptr_t) succ;
+                    linked = preds[level]->next[level].compare_exchange_strong(expected, (uintptr_t) node);
+                    if (!linked) {
+                        find(key, preds, succs);
+                        abandoned = succs[0] != node;
+                    }
+                }
+            }
+        }
+        if (removed(node)) {
+            // The remover's search may have preceded the linking of an
+            // upper level, so search again to unlink it.
+            find(key, preds, succs);
+        }
+        finish(node, INSERTED);
+        Epoch::exit();
+    }
+
+    template <class SOR>
+    SOR ConcurrentSkipList<SOR>::remove(Z z, int64_t soid)
+    {
+        SOR removed_sor;
+        removed_sor.setNull();
+        SpatialObjectKey key(z, soid);
+        Node* preds[MAX_HEIGHT];
+        Node* succs[MAX_HEIGHT];
+        Epoch::enter();
+        if (find(key, preds, succs)) {
+            Node* node = succs[0];
+            // Mark the upper levels, top down, then level 0. Whoever marks
+            // level 0 has removed the record.
+            for (uint32_t level = node->height - 1; level > 0; level--) {
+                uintptr_t next = node->next[level].load();
+                while (!marked(next)) {
+                    node->next[level].compare_exchange_weak(next, next | MARK);
+                }
+            }
+            uintptr_t next = node->next[0].load();
+            while (!marked(next)) {
+                if (node->next[0].compare_exchange_weak(next, next | MARK)) {
+                    removed_sor = node->sor;
+                    _n.fetch_sub(1);
+                    // Unlink the node
+                    find(key, preds, succs);
+                    finish(node, UNLINKED);
+                    break;
+                }
+            }
+        }
+        Epoch::exit();
+        return removed_sor;
+    }
+
+    template <class SOR>
+    void ConcurrentSkipList<SOR>::freeze()
+    {
+        // A ConcurrentSkipList is always ready for retrieval.
+    }
+
+    template <class SOR>
+    Cursor<SOR>* ConcurrentSkipList<SOR>::cursor()
+    {
+        return new ConcurrentSkipListCursor<SOR>(*this);
+    }
+
+    template <class SOR>
+    ConcurrentSkipList<SOR>::~ConcurrentSkipList()
+    {
+        // There must be no concurrent access at this point. Removed nodes
+        // have been unlinked, and are freed by Epoch.
+        Node* node = pointer(_head->next[0].load());
+        while (node) {
+            Node* next = pointer(node->next[0].load());
+            this->_spatial_object_reference_manager->cleanupSpatialObjectReference(node->sor);
+            freeNode(node);
+            node = next;
+        }
+        freeNode(_head);
+    }
+
+    template <class SOR>
+    uint32_t ConcurrentSkipList<SOR>::nRecords() const
+    {
+        return _n.load();
+    }
+
+    template <class SOR>
+    ConcurrentSkipList<SOR>::ConcurrentSkipList
+    (const SpatialObjectTypes* spatial_object_types,
+     const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+     SessionMemory<SOR>* memory)
+        : OrderedIndex<SOR>(spatial_object_types, memory, spatial_object_reference_manager),
+          _head(NULL),
+          _n(0)
+    {
+        SOR null_sor;
+        null_sor.setNull();
+        _head = newNode(SpatialObjectKey(), null_sor, MAX_HEIGHT);
+    }
+
+    template <class SOR>
+    bool ConcurrentSkipList<SOR>::find(const SpatialObjectKey& key, Node** preds, Node** succs)
+    {
+        bool restart;
+        do {
+            restart = false;
+            Node* pred = _head;
+            for (int32_t level = MAX_HEIGHT - 1; level >= 0 && !restart; level--) {
+                Node* curr = pointer(pred->next[level].load(std::memory_order_acquire));
+                while (curr) {
+                    uintptr_t succ = curr->next[level].load(std::memory_order_acquire);
+                    if (marked(succ)) {
+                        // curr has been removed. Unlink it at this level. If
+                        // pred has changed, (e.g. it has been removed too),
+                        // start over.
+                        uintptr_t expected = (uintptr_t) curr;
+                        if (!pred->next[level].compare_exchange_strong(expected, (uintptr_t) pointer(succ))) {
+                            restart = true;
+                            break;
+                        }
+                        curr = pointer(succ);
+                    } else if (curr->key.compare(key) < 0) {
+                        pred = curr;
+                        curr = pointer(succ);
+                    } else {
+                        break;
+                    }
+                }
+                preds[level] = pred;
+                succs[level] = curr;
+            }
+        } while (restart);
+        return succs[0] && succs[0]->key.compare(key) == 0;
+    }
+
+    template <class SOR>
+    typename ConcurrentSkipList<SOR>::Node*
+    ConcurrentSkipList<SOR>::findForward(const SpatialObjectKey& key, int32_t include_key) const
+    {
+        Node* pred = _head;
+        Node* curr = NULL;
+        for (int32_t level = MAX_HEIGHT - 1; level >= 0; level--) {
+            curr = pointer(pred->next[level].load(std::memory_order_acquire));
+            while (curr) {
+                int32_t c = curr->key.compare(key);
+                if (c < 0 || (c == 0 && !include_key)) {
+                    pred = curr;
+                    curr = pointer(curr->next[level].load(std::memory_order_acquire));
+                } else {
+                    break;
+                }
+            }
+        }
+        while (curr && removed(curr)) {
+            curr = pointer(curr->next[0].load(std::memory_order_acquire));
+        }
+        return curr;
+    }
+
+    template <class SOR>
+    typename ConcurrentSkipList<SOR>::Node*
+    ConcurrentSkipList<SOR>::findBackward(const SpatialObjectKey& key, int32_t include_key) const
+    {
+        SpatialObjectKey bound = key;
+        int32_t include_bound = include_key;
+        while (true) {
+            Node* pred = _head;
+            for (int32_t level = MAX_HEIGHT - 1; level >= 0; level--) {
+                Node* curr = pointer(pred->next[level].load(std::memory_order_acquire));
+                while (curr) {
+                    int32_t c = curr->key.compare(bound);
+                    if (c < 0 || (c == 0 && include_bound)) {
+                        pred = curr;
+                        curr = pointer(curr->next[level].load(std::memory_order_acquire));
+                    } else {
+                        break;
+                    }
+                }
+            }
+            if (pred == _head) {
+                return NULL;
+            }
+            if (!removed(pred)) {
+                return pred;
+            }
+            // Nodes aren't linked backward, so search again for the
+            // preceding node.
+            bound = pred->key;
+            include_bound = false;
+        }
+    }
+
+    template <class SOR>
+    typename ConcurrentSkipList<SOR>::Node* ConcurrentSkipList<SOR>::successor(const Node* node)
+    {
+        Node* next = pointer(node->next[0].load(std::memory_order_acquire));
+        while (next && removed(next)) {
+            next = pointer(next->next[0].load(std::memory_order_acquire));
+        }
+        return next;
+    }
+
+    template <class SOR>
+    bool ConcurrentSkipList<SOR>::removed(const Node* node)
+    {
+        return marked(node->next[0].load(std::memory_order_acquire));
+    }
+
+    template <class SOR>
+    typename ConcurrentSkipList<SOR>::Node*
+    ConcurrentSkipList<SOR>::newNode(const SpatialObjectKey& key, const SOR& sor, uint32_t height)
+    {
+        void* memory = malloc(sizeof(Node) + (height - 1) * sizeof(Link));
+        if (memory == NULL) {
+            throw GeophileException("Unable to allocate skiplist node");
+        }
+        Node* node = new (memory) Node();
+        node->key = key;
+        node->sor = sor;
+        node->state.store(0, std::memory_order_relaxed);
+        node->height = height;
+        for (uint32_t level = 0; level < height; level++) {
+            new (&node->next[level]) Link(0);
+        }
+        return node;
+    }
+
+    template <class SOR>
+    void ConcurrentSkipList<SOR>::freeNode(Node* node)
+    {
+        free(node);
+    }
+
+    template <class SOR>
+    uint32_t ConcurrentSkipList<SOR>::randomHeight()
+    {
+        // xorshift64*, one generator per thread
+        static thread_local uint64_t random = 0;
+        if (random == 0) {
+            random = ((uint64_t) (uintptr_t) &random) * 0x9e3779b97f4a7c15ULL | 1;
+        }
+        uint32_t height = 1;
+        while (height < MAX_HEIGHT) {
+            random ^= random >> 12;
+            random ^= random << 25;
+            random ^= random >> 27;
+            if (((random * 0x2545f4914f6cdd1dULL) >> 32) % BRANCHING != 0) {
+                break;
+            }
+            height++;
+        }
+        return height;
+    }
+
+    template <class SOR>
+    void ConcurrentSkipList<SOR>::finish(Node* node, uint32_t step)
+    {
+        uint32_t previous = node->state.fetch_or(step);
+        if ((previous | step) == (INSERTED | UNLINKED)) {
+            Epoch::retire(node);
+        }
+    }
+
+    template <class SOR>
+    Record<SOR> ConcurrentSkipListCursor<SOR>::next()
+    {
+        return neighbor(true);
+    }
+
+    template <class SOR>
+    Record<SOR> ConcurrentSkipListCursor<SOR>::previous()
+    {
+        return neighbor(false);
+    }
+
+    template <class SOR>
+    void ConcurrentSkipListCursor<SOR>::goTo(const SpatialObjectKey& key)
+    {
+        _start_at = key;
+        this->state(NEVER_USED);
+    }
+
+    template <class SOR>
+    void ConcurrentSkipListCursor<SOR>::skipTo(const SpatialObjectKey& key)
+    {
+        if (this->state() == IN_USE && _forward) {
+            // Walk forward a few nodes. If key isn't reached, search
+            // from the top.
+            Node* node = _node;
+            Node* next = ConcurrentSkipList<SOR>::successor(node);
+            uint32_t steps = 0;
+            while (next && next->key.compare(key) < 0 && steps < MAX_SKIP_STEPS) {
+                node = next;
+                next = ConcurrentSkipList<SOR>::successor(node);
+                steps++;
+            }
+            if (next == NULL || next->key.compare(key) >= 0) {
+                // next() resumes after node, skipping keys < _start_at.
+                _node = node;
+                _start_at = key;
+            } else {
+                goTo(key);
+            }
+        } else {
+            goTo(key);
+        }
+    }
+
+    template <class SOR>
+    void ConcurrentSkipListCursor<SOR>::close()
+    {
+        exit();
+        Cursor<SOR>::close();
+    }
+
+    template <class SOR>
+    ConcurrentSkipListCursor<SOR>::~ConcurrentSkipListCursor()
+    {
+        exit();
+    }
+
+    template <class SOR>
+    ConcurrentSkipListCursor<SOR>::ConcurrentSkipListCursor(ConcurrentSkipList<SOR>& skiplist)
+        : _skiplist(skiplist),
+          _node(NULL),
+          _start_at(),
+          _forward(true),
+          _entered(false)
+    {}
+
+    template <class SOR>
+    Record<SOR> ConcurrentSkipListCursor<SOR>::neighbor(int32_t forward_move)
+    {
+        Node* node = NULL;
+        switch (this->state()) {
+            case NEVER_USED:
+                enter();
+                node =
+                    forward_move
+                    ? _skiplist.findForward(_start_at, true)
+                    : _skiplist.findBackward(_start_at, true);
+                break;
+            case IN_USE:
+                if (forward_move) {
+                    // _node may have been removed since it was returned, but
+                    // it hasn't been freed, and its next pointer still leads
+                    // to the following records.
+                    node = ConcurrentSkipList<SOR>::successor(_node);
+                    while (node && node->key.compare(_start_at) < 0) {
+                        node = ConcurrentSkipList<SOR>::successor(node);
+                    }
+                } else {
+                    node = _skiplist.findBackward(_start_at, false);
+                }
+                break;
+            case DONE:
+                GEOPHILE_ASSERT(this->current().eof());
+                return this->current();
+        }
+        if (node) {
+            _node = node;
+            _start_at = node->key;
+            this->current(node->key.z(), node->sor);
+            this->state(IN_USE);
+        } else {
+            this->close();
+        }
+        _forward = forward_move;
+        return this->current();
+    }
+
+    template <class SOR>
+    void ConcurrentSkipListCursor<SOR>::enter()
+    {
+        if (!_entered) {
+            Epoch::enter();
+            _entered = true;
+        }
+    }
+
+    template <class SOR>
+    void ConcurrentSkipListCursor<SOR>::exit()
+    {
+        if (_entered) {
+            Epoch::exit();
+            _entered = false;
+            _node = NULL;
+        }
+    }
+}
@@ -0,0 +1,165 @@
+#ifndef _CONCURRENT_SKIP_LIST_H
+#define _CONCURRENT_SKIP_LIST_H
+
+#include <stdint.h>
+#include <atomic>
+#include "OrderedIndex.h"
+#include "Record.h"
+#include "Cursor.h"
+#include "SpatialObjectKey.h"
+#include "SpatialObjectTypes.h"
+
+namespace geophile
+{
+    template <class SOR> class ConcurrentSkipListCursor;
+    template <class SOR> class SessionMemory;
+    template <class SOR> class SpatialObjectReferenceManager;
+    class SpatialObjectTypes;
+
+    /*
+     * A lock-free skiplist implementation of OrderedIndex. add,
+     * remove and retrieval can all run concurrently, from any number
+     * of threads, so there is no need to stop writers and freeze
+     * the index before searching it. freeze does nothing.
+     *
+     * Removal is in two steps, following Fraser and Harris: A node
+     * is logically removed by marking its next pointers, (the low
+     * bit of each pointer), and is then unlinked, by the remover or
+     * by any other thread whose search runs into it. Inserts and
+     * searches never wait for each other. Unlinked nodes are freed
+     * using epoch-based reclamation (Epoch), so a node is not freed
+     * while a thread might still be reading it.
+     *
+     * Each key is present at most once. Adding a key that is already
+     * present has no effect.
+     *
+     * A Cursor holds an Epoch (Epoch::enter) from its first use
+     * until it is closed (by running off the end of the index, or by
+     * close()) or deleted, so it must be used and deleted by a
+     * single thread. While a Cursor is open, memory retired by any
+     * thread is not freed, so long-lived open Cursors should be
+     * avoided. A Cursor returns records in key order. Records present
+     * for the whole scan are returned. Records added or removed
+     * during the scan may or may not be.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class ConcurrentSkipList : public OrderedIndex<SOR>
+    {
+    public:
+        // OrderedIndex
+        virtual void add(Z z, const SOR& sor);
+        virtual SOR remove(Z z, int64_t soid);
+        virtual void freeze();
+        virtual Cursor<SOR>* cursor();
+        virtual ~ConcurrentSkipList();
+
+        // ConcurrentSkipList
+        // Number of records. Exact only when there are no concurrent updates.
+        uint32_t nRecords() const;
+        ConcurrentSkipList(const SpatialObjectTypes* spatial_object_types,
+                           const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                           SessionMemory<SOR>* memory);
+
+    private:
+        // A node's next pointers, with the low bit marking removal.
+        typedef std::atomic<uintptr_t> Link;
+
+        struct Node
+        {
+            SpatialObjectKey key;
+            SOR sor;
+            // INSERTED and UNLINKED bits. The thread setting the
+            // second of these frees the node.
+            std::atomic<uint32_t> state;
+            uint32_t height;
+            Link next[1]; // Actually next[height]
+        };
+
+        static const uint32_t MAX_HEIGHT = 16;
+        // A node of height h is also given height h + 1 with probability
+        // 1 / BRANCHING.
+        static const uint32_t BRANCHING = 4;
+        static const uint32_t INSERTED = 1;
+        static const uint32_t UNLINKED = 2;
+        static const uintptr_t MARK = 1;
+
+    private:
+        // Finds, at each level, the last node with a key < key (preds) and
+        // the node following it (succs), unlinking removed nodes along the
+        // way. Returns true if succs[0] has the given key.
+        bool find(const SpatialObjectKey& key, Node** preds, Node** succs);
+        // First node with a key >= key (include_key) or > key
+        // (!include_key), that hasn't been removed. Doesn't modify
+        // the skiplist.
+        Node* findForward(const SpatialObjectKey& key, int32_t include_key) const;
+        // Last node with a key <= key (include_key) or < key
+        // (!include_key), that hasn't been removed. Doesn't modify the
+        // skiplist.
+        Node* findBackward(const SpatialObjectKey& key, int32_t include_key) const;
+        // Following node that hasn't been removed.
+        static Node* successor(const Node* node);
+        static bool removed(const Node* node);
+        static Node* newNode(const SpatialObjectKey& key, const SOR& sor, uint32_t height);
+        static void freeNode(Node* node);
+        static uint32_t randomHeight();
+        // A node is freed once both its insert and its removal are complete.
+        static void finish(Node* node, uint32_t step);
+
+        static Node* pointer(uintptr_t link)
+        {
+            return (Node*) (link & ~MARK);
+        }
+
+        static bool marked(uintptr_t link)
+        {
+            return (link & MARK) != 0;
+        }
+
+    private:
+        Node* _head; // Has height MAX_HEIGHT, and no key
+        std::atomic<uint32_t> _n;
+
+        template <class> friend class ConcurrentSkipListCursor;
+    };
+
+    template <class SOR>
+    class ConcurrentSkipListCursor : public Cursor<SOR>
+    {
+    public:
+        virtual Record<SOR> next();
+        virtual Record<SOR> previous();
+        virtual void goTo(const SpatialObjectKey& key);
+        virtual void skipTo(const SpatialObjectKey& key);
+        virtual void close();
+        virtual ~ConcurrentSkipListCursor();
+        ConcurrentSkipListCursor(ConcurrentSkipList<SOR>& skiplist);
+
+    private:
+        typedef typename ConcurrentSkipList<SOR>::Node Node;
+
+    private:
+        Record<SOR> neighbor(int32_t forward_move);
+        void enter();
+        void exit();
+
+    private:
+        // skipTo walks at most this many nodes before searching from the top.
+        static const uint32_t MAX_SKIP_STEPS = 16;
+
+    private:
+        ConcurrentSkipList<SOR>& _skiplist;
+        // Node of the last record returned.
+        Node* _node;
+        // Key of the last record returned, or the key passed to goTo or
+        // skipTo, whichever is more recent.
+        SpatialObjectKey _start_at;
+        int32_t _forward;
+        // True between Epoch::enter and Epoch::exit.
+        bool _entered;
+    };
+}
+
+// So that the functions can be instantiated
+#include "ConcurrentSkipList.cpp.h"
+
+#endif
@@ -31,13 +31,25 @@ namespace geophile
 
         virtual void goTo(const SpatialObjectKey& key) = 0;
 
+        /*
+         * Like goTo, but for moving forward: key must not precede the
+         * key of the last record returned. Implementations can
+         * exploit the fact that the target is usually close to the
+         * current position, instead of searching the entire
+         * index. The default implementation is goTo(key).
+         */
+        virtual void skipTo(const SpatialObjectKey& key)
+        {
+            goTo(key);
+        }
+
         virtual void close()
         {
             _current.setEOF();
             _state = DONE;
         }
 
-        ~Cursor()
+        virtual ~Cursor()
         {}
 
         const Record<SOR>& current()
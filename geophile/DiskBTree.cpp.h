@@ -0,0 +1,810 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "DiskBTree.h"
+#include "BufferPool.h"
+#include "ByteBuffer.h"
+#include "ByteBufferOverflowException.h"
+#include "GeophileException.h"
+#include "SpatialObject.h"
+#include "SpatialObjectReferenceManager.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR>
+    void DiskBTree<SOR>::add(Z z, const SOR& sor)
+    {
+        SpatialObjectKey key(z, sor.spatialObjectId());
+        uint64_t object = storeObject(sor.spatialObject());
+        // The DiskBTree keeps its own copy of the SpatialObject.
+        this->_spatial_object_reference_manager->cleanupSpatialObjectReference(sor);
+        if (_meta.root == NO_PAGE) {
+            _meta.root = newPage(PAGE_LEAF);
+            _meta.height = 0;
+        }
+        SpatialObjectKey separator;
+        uint32_t sibling = insert(_meta.root, _meta.height, key, object, &separator);
+        if (sibling != NO_PAGE) {
+            uint32_t page = newPage(PAGE_INNER);
+            Inner* root = (Inner*) pin(page);
+            root->separators[0] = separator;
+            root->children[0] = _meta.root;
+            root->children[1] = sibling;
+            root->header.n = 1;
+            unpin(page, true);
+            _meta.root = page;
+            _meta.height++;
+        }
+        _meta.n_records++;
+        _meta.z_lengths |= 1ULL << z.length();
+        _modifications++;
+    }
+
+    template <class SOR>
+    SOR DiskBTree<SOR>::remove(Z z, int64_t soid)
+    {
+        SOR removed;
+        removed.setNull();
+        if (_meta.root != NO_PAGE) {
+            SpatialObjectKey key(z, soid);
+            uint64_t object = 0;
+            if (remove(_meta.root, _meta.height, key, &object)) {
+                _meta.root = NO_PAGE;
+                _meta.height = 0;
+            } else {
+                while (_meta.height > 0) {
+                    uint32_t page = _meta.root;
+                    Inner* root = (Inner*) pin(page);
+                    uint32_t n = root->header.n;
+                    uint32_t child = root->children[0];
+                    unpin(page, false);
+                    if (n > 0) {
+                        break;
+                    }
+                    freePage(page);
+                    _meta.root = child;
+                    _meta.height--;
+                }
+            }
+            if (object != 0) {
+                SpatialObject* spatial_object = readObject(object, NULL);
+                removed = this->_spatial_object_reference_manager->newSpatialObjectReference(spatial_object);
+                delete spatial_object;
+                removeObject(object);
+                _meta.n_records--;
+                _modifications++;
+            }
+        }
+        return removed;
+    }
+
+    template <class SOR>
+    void DiskBTree<SOR>::freeze()
+    {
+        writeMeta();
+        _pool->flush();
+    }
+
+    template <class SOR>
+    void DiskBTree<SOR>::load(const Record<SOR>* records, uint32_t n)
+    {
+        if (_meta.root != NO_PAGE) {
+            OrderedIndex<SOR>::load(records, n);
+            return;
+        }
+        if (n == 0) {
+            return;
+        }
+        // Build the tree bottom-up, as in BTree::load. pages[i] and
+        // min_keys[i] are the nodes of the level being built, and the
+        // smallest key in each.
+        uint32_t n_pages = (n + LEAF_CAPACITY - 1) / LEAF_CAPACITY;
+        uint32_t* pages = new uint32_t[n_pages];
+        SpatialObjectKey* min_keys = new SpatialObjectKey[n_pages];
+        uint32_t previous = NO_PAGE;
+        Leaf* previous_leaf = NULL;
+        for (uint32_t i = 0; i < n_pages; i++) {
+            uint32_t page = newPage(PAGE_LEAF);
+            Leaf* leaf = (Leaf*) pin(page);
+            uint32_t first = i * LEAF_CAPACITY;
+            uint32_t count = n - first < LEAF_CAPACITY ? n - first : LEAF_CAPACITY;
+            for (uint32_t r = 0; r < count; r++) {
+                const Record<SOR>& record = records[first + r];
+                const SOR& sor = record.spatialObjectReference();
+                leaf->keys[r] = record.key();
+                _meta.z_lengths |= 1ULL << record.key().z().length();
+                leaf->objects[r] = storeObject(sor.spatialObject());
+                this->_spatial_object_reference_manager->cleanupSpatialObjectReference(sor);
+            }
+            leaf->header.n = count;
+            leaf->header.previous = previous;
+            if (previous_leaf) {
+                previous_leaf->header.next = page;
+                unpin(previous, true);
+            }
+            previous = page;
+            previous_leaf = leaf;
+            pages[i] = page;
+            min_keys[i] = leaf->keys[0];
+        }
+        unpin(previous, true);
+        uint32_t height = 0;
+        while (n_pages > 1) {
+            uint32_t n_parents = (n_pages + INNER_CAPACITY) / (INNER_CAPACITY + 1);
+            for (uint32_t p = 0; p < n_parents; p++) {
+                uint32_t page = newPage(PAGE_INNER);
+                Inner* inner = (Inner*) pin(page);
+                uint32_t first = p * (INNER_CAPACITY + 1);
+                uint32_t count =
+                    n_pages - first < INNER_CAPACITY + 1 ? n_pages - first : INNER_CAPACITY + 1;
+                for (uint32_t c = 0; c < count; c++) {
+                    inner->children[c] = pages[first + c];
+                    if (c > 0) {
+                        inner->separators[c - 1] = min_keys[first + c];
+                    }
+                }
+                inner->header.n = count - 1;
+                unpin(page, true);
+                // p <= first, so pages and min_keys can be overwritten in place.
+                pages[p] = page;
+                min_keys[p] = min_keys[first];
+            }
+            n_pages = n_parents;
+            height++;
+        }
+        _meta.root = pages[0];
+        _meta.height = height;
+        _meta.n_records = n;
+        _modifications++;
+        delete [] pages;
+        delete [] min_keys;
+    }
+
+    template <class SOR>
+    Cursor<SOR>* DiskBTree<SOR>::cursor()
+    {
+        return new DiskBTreeCursor<SOR>(*this);
+    }
+
+    template <class SOR>
+    uint64_t DiskBTree<SOR>::zLengths() const
+    {
+        return _meta.z_lengths;
+    }
+
+    template <class SOR>
+    DiskBTree<SOR>::~DiskBTree()
+    {
+        writeMeta();
+        delete _pool;
+        close(_fd);
+        delete [] _buffer;
+    }
+
+    template <class SOR>
+    uint64_t DiskBTree<SOR>::nRecords() const
+    {
+        return _meta.n_records;
+    }
+
+    template <class SOR>
+    const BufferPool* DiskBTree<SOR>::bufferPool() const
+    {
+        return _pool;
+    }
+
+    template <class SOR>
+    DiskBTree<SOR>::DiskBTree(const SpatialObjectTypes* spatial_object_types,
+                              const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                              SessionMemory<SOR>* memory,
+                              const char* path,
+                              uint64_t memory_budget)
+        : OrderedIndex<SOR>(spatial_object_types, memory, spatial_object_reference_manager),
+          _fd(-1),
+          _pool(NULL),
+          _modifications(0),
+          _buffer(NULL),
+          _buffer_size(1000)
+    {
+        GEOPHILE_ASSERT(sizeof(Leaf) <= PAGE_SIZE);
+        GEOPHILE_ASSERT(sizeof(Inner) <= PAGE_SIZE);
+        GEOPHILE_ASSERT(sizeof(Heap) <= PAGE_SIZE);
+        _fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (_fd < 0) {
+            throw GeophileException("Unable to open DiskBTree file");
+        }
+        struct stat file_stat;
+        if (fstat(_fd, &file_stat) != 0) {
+            close(_fd);
+            throw GeophileException("Unable to open DiskBTree file");
+        }
+        if (file_stat.st_size == 0) {
+            memset(&_meta, 0, sizeof(Meta));
+            _meta.magic = MAGIC;
+            _meta.version = FORMAT_VERSION;
+            _meta.page_size = PAGE_SIZE;
+            _meta.root = NO_PAGE;
+            _meta.n_pages = 1;
+            _meta.free_pages = NO_PAGE;
+            _meta.heap = NO_PAGE;
+        } else if (pread(_fd, &_meta, sizeof(Meta), 0) != (ssize_t) sizeof(Meta) ||
+                   _meta.magic != MAGIC ||
+                   _meta.version != FORMAT_VERSION ||
+                   _meta.page_size != PAGE_SIZE ||
+                   (uint64_t) file_stat.st_size < (uint64_t) _meta.n_pages * PAGE_SIZE) {
+            close(_fd);
+            throw GeophileException("Not a DiskBTree file");
+        }
+        _pool = new BufferPool(_fd, PAGE_SIZE, memory_budget);
+        _buffer = new uint8_t[_buffer_size];
+    }
+
+    template <class SOR>
+    uint32_t DiskBTree<SOR>::findForward(const SpatialObjectKey& key,
+                                         int32_t include_key,
+                                         Leaf** leaf,
+                                         int32_t* position)
+    {
+        uint32_t page = descend(key, include_key, leaf, position);
+        if (page != NO_PAGE && *position == (int32_t) (*leaf)->header.n) {
+            uint32_t next = (*leaf)->header.next;
+            unpin(page, false);
+            page = next;
+            *leaf = page == NO_PAGE ? NULL : (Leaf*) pin(page);
+            *position = 0;
+        }
+        return page;
+    }
+
+    template <class SOR>
+    uint32_t DiskBTree<SOR>::findBackward(const SpatialObjectKey& key,
+                                          int32_t include_key,
+                                          Leaf** leaf,
+                                          int32_t* position)
+    {
+        // The last key <= key precedes the first key > key, and the last
+        // key < key precedes the first key >= key.
+        uint32_t page = descend(key, !include_key, leaf, position);
+        if (page != NO_PAGE) {
+            (*position)--;
+            if (*position < 0) {
+                uint32_t previous = (*leaf)->header.previous;
+                unpin(page, false);
+                page = previous;
+                *leaf = page == NO_PAGE ? NULL : (Leaf*) pin(page);
+                if (*leaf) {
+                    *position = (*leaf)->header.n - 1;
+                }
+            }
+        }
+        return page;
+    }
+
+    template <class SOR>
+    uint32_t DiskBTree<SOR>::descend(const SpatialObjectKey& key,
+                                     int32_t include_key,
+                                     Leaf** leaf,
+                                     int32_t* position)
+    {
+        if (_meta.root == NO_PAGE) {
+            *leaf = NULL;
+            return NO_PAGE;
+        }
+        uint32_t page = _meta.root;
+        for (uint32_t level = _meta.height; level > 0; level--) {
+            Inner* inner = (Inner*) pin(page);
+            uint32_t child = inner->children[search(inner->separators, inner->header.n, key, include_key)];
+            unpin(page, false);
+            page = child;
+        }
+        *leaf = (Leaf*) pin(page);
+        *position = search((*leaf)->keys, (*leaf)->header.n, key, include_key);
+        return page;
+    }
+
+    template <class SOR>
+    uint32_t DiskBTree<SOR>::insert(uint32_t page,
+                                    uint32_t level,
+                                    const SpatialObjectKey& key,
+                                    uint64_t object,
+                                    SpatialObjectKey* separator)
+    {
+        if (level == 0) {
+            Leaf* leaf = (Leaf*) pin(page);
+            uint32_t position = search(leaf->keys, leaf->header.n, key, false);
+            uint32_t right_page = NO_PAGE;
+            Leaf* right = NULL;
+            if (leaf->header.n == LEAF_CAPACITY) {
+                // Split. If keys are arriving in order, leave the left
+                // leaf full instead of half full.
+                right_page = newPage(PAGE_LEAF);
+                right = (Leaf*) pin(right_page);
+                uint32_t split =
+                    position == LEAF_CAPACITY && leaf->header.next == NO_PAGE
+                    ? LEAF_CAPACITY
+                    : LEAF_CAPACITY / 2;
+                uint32_t moved = LEAF_CAPACITY - split;
+                memcpy(right->keys, &leaf->keys[split], moved * sizeof(SpatialObjectKey));
+                memcpy(right->objects, &leaf->objects[split], moved * sizeof(uint64_t));
+                right->header.n = moved;
+                leaf->header.n = split;
+                right->header.next = leaf->header.next;
+                if (right->header.next != NO_PAGE) {
+                    Leaf* next = (Leaf*) pin(right->header.next);
+                    next->header.previous = right_page;
+                    unpin(right->header.next, true);
+                }
+                right->header.previous = page;
+                leaf->header.next = right_page;
+            }
+            Leaf* target = leaf;
+            if (right && position >= leaf->header.n) {
+                target = right;
+                position -= leaf->header.n;
+            }
+            uint32_t n = target->header.n;
+            memmove(&target->keys[position + 1], &target->keys[position],
+                    (n - position) * sizeof(SpatialObjectKey));
+            memmove(&target->objects[position + 1], &target->objects[position],
+                    (n - position) * sizeof(uint64_t));
+            target->keys[position] = key;
+            target->objects[position] = object;
+            target->header.n++;
+            if (right) {
+                *separator = right->keys[0];
+                unpin(right_page, true);
+            }
+            unpin(page, true);
+            return right_page;
+        } else {
+            Inner* inner = (Inner*) pin(page);
+            uint32_t c = search(inner->separators, inner->header.n, key, false);
+            SpatialObjectKey child_separator;
+            uint32_t child = insert(inner->children[c], level - 1, key, object, &child_separator);
+            if (child == NO_PAGE) {
+                unpin(page, false);
+                return NO_PAGE;
+            }
+            uint32_t n = inner->header.n;
+            if (n < INNER_CAPACITY) {
+                memmove(&inner->separators[c + 1], &inner->separators[c],
+                        (n - c) * sizeof(SpatialObjectKey));
+                memmove(&inner->children[c + 2], &inner->children[c + 1],
+                        (n - c) * sizeof(uint32_t));
+                inner->separators[c] = child_separator;
+                inner->children[c + 1] = child;
+                inner->header.n++;
+                unpin(page, true);
+                return NO_PAGE;
+            }
+            // Split. Gather the separators and children, including the new
+            // ones, move the upper half to a new node, and promote the
+            // separator between the halves.
+            SpatialObjectKey separators[INNER_CAPACITY + 1];
+            uint32_t children[INNER_CAPACITY + 2];
+            for (uint32_t i = 0, j = 0; i <= INNER_CAPACITY; i++) {
+                if (i == c) {
+                    separators[i] = child_separator;
+                } else {
+                    separators[i] = inner->separators[j++];
+                }
+            }
+            for (uint32_t i = 0, j = 0; i <= INNER_CAPACITY + 1; i++) {
+                if (i == c + 1) {
+                    children[i] = child;
+                } else {
+                    children[i] = inner->children[j++];
+                }
+            }
+            uint32_t split = INNER_CAPACITY / 2;
+            uint32_t right_page = newPage(PAGE_INNER);
+            Inner* right = (Inner*) pin(right_page);
+            memcpy(inner->separators, separators, split * sizeof(SpatialObjectKey));
+            memcpy(inner->children, children, (split + 1) * sizeof(uint32_t));
+            inner->header.n = split;
+            *separator = separators[split];
+            memcpy(right->separators, &separators[split + 1],
+                   (INNER_CAPACITY - split) * sizeof(SpatialObjectKey));
+            memcpy(right->children, &children[split + 1],
+                   (INNER_CAPACITY - split + 1) * sizeof(uint32_t));
+            right->header.n = INNER_CAPACITY - split;
+            unpin(right_page, true);
+            unpin(page, true);
+            return right_page;
+        }
+    }
+
+    template <class SOR>
+    bool DiskBTree<SOR>::remove(uint32_t page, uint32_t level, const SpatialObjectKey& key, uint64_t* object)
+    {
+        if (level == 0) {
+            Leaf* leaf = (Leaf*) pin(page);
+            uint32_t n = leaf->header.n;
+            uint32_t position = search(leaf->keys, n, key, true);
+            if (position == n || leaf->keys[position].compare(key) != 0) {
+                unpin(page, false);
+                return false;
+            }
+            *object = leaf->objects[position];
+            n--;
+            memmove(&leaf->keys[position], &leaf->keys[position + 1],
+                    (n - position) * sizeof(SpatialObjectKey));
+            memmove(&leaf->objects[position], &leaf->objects[position + 1],
+                    (n - position) * sizeof(uint64_t));
+            leaf->header.n = n;
+            if (n > 0) {
+                unpin(page, true);
+                return false;
+            }
+            uint32_t previous = leaf->header.previous;
+            uint32_t next = leaf->header.next;
+            unpin(page, true);
+            if (previous != NO_PAGE) {
+                Leaf* previous_leaf = (Leaf*) pin(previous);
+                previous_leaf->header.next = next;
+                unpin(previous, true);
+            }
+            if (next != NO_PAGE) {
+                Leaf* next_leaf = (Leaf*) pin(next);
+                next_leaf->header.previous = previous;
+                unpin(next, true);
+            }
+            freePage(page);
+            return true;
+        } else {
+            Inner* inner = (Inner*) pin(page);
+            uint32_t c = search(inner->separators, inner->header.n, key, true);
+            bool emptied = remove(inner->children[c], level - 1, key, object);
+            // Duplicates of a separator can be on both sides of it.
+            while (!emptied && *object == 0 &&
+                   c < inner->header.n && inner->separators[c].compare(key) == 0) {
+                c++;
+                emptied = remove(inner->children[c], level - 1, key, object);
+            }
+            if (!emptied) {
+                unpin(page, false);
+                return false;
+            }
+            uint32_t n = inner->header.n;
+            if (n == 0) {
+                unpin(page, false);
+                freePage(page);
+                return true;
+            }
+            // Remove child c, and one of the separators bounding it.
+            uint32_t s = c > 0 ? c - 1 : 0;
+            memmove(&inner->separators[s], &inner->separators[s + 1],
+                    (n - 1 - s) * sizeof(SpatialObjectKey));
+            memmove(&inner->children[c], &inner->children[c + 1],
+                    (n - c) * sizeof(uint32_t));
+            inner->header.n--;
+            unpin(page, true);
+            return false;
+        }
+    }
+
+    template <class SOR>
+    uint32_t DiskBTree<SOR>::newPage(PageType type)
+    {
+        uint32_t page;
+        if (_meta.free_pages != NO_PAGE) {
+            page = _meta.free_pages;
+            PageHeader* header = (PageHeader*) pin(page);
+            GEOPHILE_ASSERT(header->type == PAGE_FREE);
+            _meta.free_pages = header->next;
+            unpin(page, false);
+        } else {
+            if (_meta.n_pages == 0xffffffff) {
+                throw GeophileException("DiskBTree file is full");
+            }
+            page = _meta.n_pages++;
+        }
+        uint8_t* data = pin(page);
+        memset(data, 0, PAGE_SIZE);
+        PageHeader* header = (PageHeader*) data;
+        header->type = type;
+        header->previous = NO_PAGE;
+        header->next = NO_PAGE;
+        unpin(page, true);
+        return page;
+    }
+
+    template <class SOR>
+    void DiskBTree<SOR>::freePage(uint32_t page)
+    {
+        PageHeader* header = (PageHeader*) pin(page);
+        header->type = PAGE_FREE;
+        header->n = 0;
+        header->previous = NO_PAGE;
+        header->next = _meta.free_pages;
+        unpin(page, true);
+        _meta.free_pages = page;
+    }
+
+    template <class SOR>
+    uint8_t* DiskBTree<SOR>::pin(uint32_t page)
+    {
+        return _pool->pin(page);
+    }
+
+    template <class SOR>
+    void DiskBTree<SOR>::unpin(uint32_t page, bool dirty)
+    {
+        _pool->unpin(page, dirty);
+    }
+
+    template <class SOR>
+    uint64_t DiskBTree<SOR>::storeObject(const SpatialObject* spatial_object)
+    {
+        uint32_t size = 0;
+        int32_t serialized = false;
+        do {
+            ByteBuffer byte_buffer(_buffer, _buffer_size);
+            try {
+                byte_buffer.putInt32(spatial_object->typeId());
+                spatial_object->writeTo(byte_buffer);
+                size = byte_buffer.position();
+                serialized = true;
+            } catch (ByteBufferOverflowException e) {
+                if (_buffer_size >= HEAP_CAPACITY) {
+                    throw GeophileException("SpatialObject is too large for a DiskBTree page");
+                }
+                delete [] _buffer;
+                _buffer_size *= 2;
+                _buffer = new uint8_t[_buffer_size];
+            }
+        } while (!serialized);
+        if (size > HEAP_CAPACITY) {
+            throw GeophileException("SpatialObject is too large for a DiskBTree page");
+        }
+        Heap* heap = NULL;
+        if (_meta.heap != NO_PAGE) {
+            heap = (Heap*) pin(_meta.heap);
+            if (heap->header.n + size > HEAP_CAPACITY) {
+                // A page whose objects have all been removed would have
+                // been freed if it weren't the current heap page.
+                bool empty = heap->header.previous == 0;
+                unpin(_meta.heap, false);
+                if (empty) {
+                    freePage(_meta.heap);
+                }
+                heap = NULL;
+            }
+        }
+        if (heap == NULL) {
+            _meta.heap = newPage(PAGE_HEAP);
+            heap = (Heap*) pin(_meta.heap);
+            // previous counts the objects in the page.
+            heap->header.previous = 0;
+        }
+        uint32_t offset = heap->header.n;
+        memcpy(&heap->bytes[offset], _buffer, size);
+        heap->header.n += size;
+        heap->header.previous++;
+        uint64_t address = ((uint64_t) _meta.heap << 32) | (offset << 16) | size;
+        unpin(_meta.heap, true);
+        return address;
+    }
+
+    template <class SOR>
+    SpatialObject* DiskBTree<SOR>::readObject(uint64_t address, SpatialObject* spatial_object)
+    {
+        uint32_t page = (uint32_t) (address >> 32);
+        uint32_t offset = (uint32_t) (address >> 16) & 0xffff;
+        uint32_t size = (uint32_t) address & 0xffff;
+        Heap* heap = (Heap*) pin(page);
+        GEOPHILE_ASSERT(heap->header.type == PAGE_HEAP && offset + size <= heap->header.n);
+        ByteBuffer byte_buffer((byte*) &heap->bytes[offset], size);
+        int32_t type_id = byte_buffer.getInt32();
+        if (spatial_object == NULL || spatial_object->typeId() != type_id) {
+            delete spatial_object;
+            spatial_object = this->newSpatialObject(type_id);
+        }
+        spatial_object->readFrom(byte_buffer);
+        unpin(page, false);
+        return spatial_object;
+    }
+
+    template <class SOR>
+    void DiskBTree<SOR>::removeObject(uint64_t address)
+    {
+        uint32_t page = (uint32_t) (address >> 32);
+        Heap* heap = (Heap*) pin(page);
+        GEOPHILE_ASSERT(heap->header.type == PAGE_HEAP && heap->header.previous > 0);
+        heap->header.previous--;
+        bool empty = heap->header.previous == 0;
+        unpin(page, true);
+        if (empty && page != _meta.heap) {
+            freePage(page);
+        }
+    }
+
+    template <class SOR>
+    void DiskBTree<SOR>::writeMeta()
+    {
+        uint8_t* data = pin(0);
+        memcpy(data, &_meta, sizeof(Meta));
+        unpin(0, true);
+    }
+
+    template <class SOR>
+    uint64_t DiskBTree<SOR>::modifications() const
+    {
+        return _modifications;
+    }
+
+    template <class SOR>
+    uint32_t DiskBTree<SOR>::search(const SpatialObjectKey* keys,
+                                    uint32_t n,
+                                    const SpatialObjectKey& key,
+                                    int32_t include_key)
+    {
+        uint32_t lo = 0;
+        uint32_t hi = n;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            int32_t c = keys[mid].compare(key);
+            if (c < 0 || (c == 0 && !include_key)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    template <class SOR>
+    Record<SOR> DiskBTreeCursor<SOR>::next()
+    {
+        return neighbor(true);
+    }
+
+    template <class SOR>
+    Record<SOR> DiskBTreeCursor<SOR>::previous()
+    {
+        return neighbor(false);
+    }
+
+    template <class SOR>
+    void DiskBTreeCursor<SOR>::goTo(const SpatialObjectKey& key)
+    {
+        _start_at = key;
+        _start_inclusive = true;
+        this->state(NEVER_USED);
+    }
+
+    template <class SOR>
+    void DiskBTreeCursor<SOR>::skipTo(const SpatialObjectKey& key)
+    {
+        if (this->state() == IN_USE && _forward && _modifications == _disk_btree.modifications()) {
+            // _position is the position of the next record to be returned by next().
+            // Search the rest of the current leaf if the key is there, otherwise
+            // search from the root.
+            int32_t n = _leaf ? _leaf->header.n : 0;
+            if (_position < n && _leaf->keys[n - 1].compare(key) >= 0) {
+                _position += DiskBTree<SOR>::search(&_leaf->keys[_position], n - _position, key, true);
+            } else {
+                release();
+                _page = _disk_btree.findForward(key, true, &_leaf, &_position);
+                if (_page == DiskBTree<SOR>::NO_PAGE) {
+                    this->close();
+                }
+            }
+            _start_at = key;
+            _start_inclusive = true;
+        } else {
+            goTo(key);
+        }
+    }
+
+    template <class SOR>
+    void DiskBTreeCursor<SOR>::close()
+    {
+        release();
+        Cursor<SOR>::close();
+    }
+
+    template <class SOR>
+    DiskBTreeCursor<SOR>::~DiskBTreeCursor()
+    {
+        release();
+        delete _spatial_object;
+    }
+
+    template <class SOR>
+    DiskBTreeCursor<SOR>::DiskBTreeCursor(DiskBTree<SOR>& disk_btree)
+        : _disk_btree(disk_btree),
+          _page(DiskBTree<SOR>::NO_PAGE),
+          _leaf(NULL),
+          _position(0),
+          _start_at(),
+          _start_inclusive(true),
+          _forward(true),
+          _modifications(0),
+          _spatial_object(NULL)
+    {}
+
+    template <class SOR>
+    Record<SOR> DiskBTreeCursor<SOR>::neighbor(int32_t forward_move)
+    {
+        switch (this->state()) {
+            case NEVER_USED:
+                startIteration(forward_move, true);
+                break;
+            case IN_USE:
+                if ((_forward && !forward_move) || (!_forward && forward_move)) {
+                    startIteration(forward_move, false);
+                } else if (_modifications != _disk_btree.modifications()) {
+                    // The DiskBTree has changed since _page and _position were
+                    // computed, so find the position again.
+                    startIteration(forward_move, _start_inclusive);
+                }
+                break;
+            case DONE:
+                GEOPHILE_ASSERT(this->current().eof());
+                return this->current();
+        }
+        if (forward_move) {
+            if (_leaf && _position == (int32_t) _leaf->header.n) {
+                moveTo(_leaf->header.next);
+                _position = 0;
+            }
+        } else {
+            if (_leaf && _position < 0) {
+                moveTo(_leaf->header.previous);
+                if (_leaf) {
+                    _position = _leaf->header.n - 1;
+                }
+            }
+        }
+        if (_leaf) {
+            const SpatialObjectKey& key = _leaf->keys[_position];
+            _spatial_object = _disk_btree.readObject(_leaf->objects[_position], _spatial_object);
+            this->current(key.z(),
+                          _disk_btree._spatial_object_reference_manager->newSpatialObjectReference(_spatial_object));
+            _position += forward_move ? 1 : -1;
+            this->state(IN_USE);
+            _start_at = key;
+            _start_inclusive = false;
+        } else {
+            this->close();
+        }
+        _forward = forward_move;
+        return this->current();
+    }
+
+    template <class SOR>
+    void DiskBTreeCursor<SOR>::startIteration(int32_t forward_move, int32_t include_start_key)
+    {
+        release();
+        if (forward_move) {
+            _page = _disk_btree.findForward(_start_at, include_start_key, &_leaf, &_position);
+        } else {
+            _page = _disk_btree.findBackward(_start_at, include_start_key, &_leaf, &_position);
+        }
+        _modifications = _disk_btree.modifications();
+    }
+
+    template <class SOR>
+    void DiskBTreeCursor<SOR>::moveTo(uint32_t page)
+    {
+        release();
+        if (page != DiskBTree<SOR>::NO_PAGE) {
+            _page = page;
+            _leaf = (Leaf*) _disk_btree.pin(page);
+        }
+    }
+
+    template <class SOR>
+    void DiskBTreeCursor<SOR>::release()
+    {
+        if (_page != DiskBTree<SOR>::NO_PAGE) {
+            _disk_btree.unpin(_page, false);
+            _page = DiskBTree<SOR>::NO_PAGE;
+            _leaf = NULL;
+        }
+    }
+}
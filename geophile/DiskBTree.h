@@ -0,0 +1,266 @@
+#ifndef _DISK_BTREE_H
+#define _DISK_BTREE_H
+
+#include <stdint.h>
+#include "OrderedIndex.h"
+#include "Record.h"
+#include "Cursor.h"
+#include "SpatialObjectKey.h"
+#include "SpatialObjectTypes.h"
+
+namespace geophile
+{
+    template <class SOR> class DiskBTreeCursor;
+    template <class SOR> class SessionMemory;
+    template <class SOR> class SpatialObjectReferenceManager;
+    class BufferPool;
+    class SpatialObject;
+    class SpatialObjectTypes;
+
+    /*
+     * A B+tree implementation of OrderedIndex, stored in a file, for
+     * indexes larger than memory. Pages are cached by a BufferPool,
+     * whose size is given by the constructor's memory_budget, so
+     * memory use doesn't grow with the index. The file persists: A
+     * DiskBTree created on an existing file contains the records
+     * saved by the previous one, (as of its last freeze, or its
+     * destruction).
+     *
+     * The tree is organized like BTree: Leaves contain keys, and the
+     * addresses of serialized SpatialObjects, and are linked in both
+     * directions. Nodes are not merged on remove, and a node is freed
+     * once it is empty. SpatialObjects are serialized, (type id
+     * followed by SpatialObject::writeTo), into heap pages, one copy
+     * per record. A heap page is freed once all of its objects have
+     * been removed.
+     *
+     * A Cursor keeps the current leaf pinned, and deserializes each
+     * record's SpatialObject into an object that it reuses, (created
+     * by SpatialObjectTypes::newSpatialObject). The SOR returned is
+     * created from this object by the SpatialObjectReferenceManager,
+     * so the manager must copy the object, since the object is
+     * overwritten by the next record. InlineSpatialObjectReferenceManager
+     * is the natural choice. With BufferingSpatialObjectReferenceManager,
+     * the caller owns the copies. The same goes for the SOR returned
+     * by remove. add and load serialize each SpatialObject, and then
+     * clean up the SOR passed in.
+     *
+     * The lengths of the z-values added are saved with the records,
+     * and reported by zLengths, so that a SpatialIndex over a
+     * reopened DiskBTree finds records at every level.
+     *
+     * freeze writes modified pages to the file. As for other
+     * OrderedIndexes, concurrent retrieval is possible, as long as
+     * there are no concurrent adds or removes, and adds and removes
+     * may be interleaved with cursor scans.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class DiskBTree : public OrderedIndex<SOR>
+    {
+    public:
+        // OrderedIndex
+        virtual void add(Z z, const SOR& sor);
+        virtual SOR remove(Z z, int64_t soid);
+        virtual void freeze();
+        virtual void load(const Record<SOR>* records, uint32_t n);
+        virtual Cursor<SOR>* cursor();
+        virtual uint64_t zLengths() const;
+        virtual ~DiskBTree();
+
+        // DiskBTree
+        uint64_t nRecords() const;
+        const BufferPool* bufferPool() const;
+        // Opens the index in the file at path, creating the file if
+        // it doesn't exist. memory_budget is the size of the BufferPool.
+        // Throws GeophileException if the file can't be opened, or
+        // doesn't contain a DiskBTree.
+        DiskBTree(const SpatialObjectTypes* spatial_object_types,
+                  const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                  SessionMemory<SOR>* memory,
+                  const char* path,
+                  uint64_t memory_budget);
+
+    public:
+        static const uint32_t PAGE_SIZE = 4096;
+
+    private:
+        static const uint64_t MAGIC = 0x45455254424b5344ULL; // "DSKBTREE"
+        static const uint32_t FORMAT_VERSION = 2;
+        // Page 0 is the Meta page, so it is never a node.
+        static const uint32_t NO_PAGE = 0;
+
+        typedef enum {
+            PAGE_FREE,
+            PAGE_LEAF,
+            PAGE_INNER,
+            PAGE_HEAP
+        } PageType;
+
+        struct PageHeader
+        {
+            uint32_t type;
+            // Leaf: number of records. Inner: number of separators. Heap:
+            // bytes used.
+            uint32_t n;
+            // Leaf: the neighboring leaves. Heap: previous is the number of
+            // objects not yet removed. Free: next is the next free page.
+            uint32_t previous;
+            uint32_t next;
+        };
+
+        static const uint32_t LEAF_CAPACITY =
+            (PAGE_SIZE - sizeof(PageHeader)) / (sizeof(SpatialObjectKey) + sizeof(uint64_t));
+        static const uint32_t INNER_CAPACITY =
+            (PAGE_SIZE - sizeof(PageHeader) - sizeof(uint32_t)) / (sizeof(SpatialObjectKey) + sizeof(uint32_t));
+        static const uint32_t HEAP_CAPACITY = PAGE_SIZE - sizeof(PageHeader);
+
+        // objects[i] is the address of the SpatialObject of the record
+        // with key keys[i]: (heap page << 32) | (offset << 16) | size.
+        struct Leaf
+        {
+            PageHeader header;
+            SpatialObjectKey keys[LEAF_CAPACITY];
+            uint64_t objects[LEAF_CAPACITY];
+        };
+
+        // Child i contains keys k such that separators[i-1] <= k <= separators[i].
+        struct Inner
+        {
+            PageHeader header;
+            SpatialObjectKey separators[INNER_CAPACITY];
+            uint32_t children[INNER_CAPACITY + 1];
+        };
+
+        struct Heap
+        {
+            PageHeader header;
+            uint8_t bytes[HEAP_CAPACITY];
+        };
+
+        struct Meta
+        {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t page_size;
+            uint64_t n_records;
+            uint32_t root; // NO_PAGE if the DiskBTree is empty
+            uint32_t height; // 0 if root is a Leaf
+            uint32_t n_pages;
+            uint32_t free_pages; // First page of the free list
+            uint32_t heap; // Heap page receiving new objects
+            // Bit i is set if a z-value of length i has been added, (see
+            // OrderedIndex::zLengths). Not cleared by remove.
+            uint64_t z_lengths;
+        };
+
+    private:
+        // Leaf containing the first record with a key >= key (include_key)
+        // or > key (!include_key), and its position, moving to the
+        // following leaf if necessary. The leaf's page is returned, and
+        // stays pinned, or NO_PAGE if there is no such record.
+        uint32_t findForward(const SpatialObjectKey& key,
+                             int32_t include_key,
+                             Leaf** leaf,
+                             int32_t* position);
+        // As findForward, for the last record with a key <= key (include_key)
+        // or < key (!include_key).
+        uint32_t findBackward(const SpatialObjectKey& key,
+                              int32_t include_key,
+                              Leaf** leaf,
+                              int32_t* position);
+        // Leaf that would contain the first key >= key (include_key) or
+        // > key (!include_key), pinned, and the position within the leaf,
+        // which may be the leaf's n.
+        uint32_t descend(const SpatialObjectKey& key,
+                         int32_t include_key,
+                         Leaf** leaf,
+                         int32_t* position);
+        // Insert into the subtree rooted at page. If it splits, returns the
+        // new right sibling, and sets *separator to its smallest key.
+        uint32_t insert(uint32_t page,
+                        uint32_t level,
+                        const SpatialObjectKey& key,
+                        uint64_t object,
+                        SpatialObjectKey* separator);
+        // Remove key from the subtree rooted at page. Returns true if the page
+        // is now empty, (and has been freed). *object is set to the address of
+        // the removed record's object, if any.
+        bool remove(uint32_t page, uint32_t level, const SpatialObjectKey& key, uint64_t* object);
+        uint32_t newPage(PageType type);
+        void freePage(uint32_t page);
+        uint8_t* pin(uint32_t page);
+        void unpin(uint32_t page, bool dirty);
+        // Serializes spatial_object into the heap, returning its address.
+        uint64_t storeObject(const SpatialObject* spatial_object);
+        // Deserializes the object at address, reusing spatial_object if it has
+        // the right type, (deleting it otherwise).
+        SpatialObject* readObject(uint64_t address, SpatialObject* spatial_object);
+        void removeObject(uint64_t address);
+        void writeMeta();
+        uint64_t modifications() const;
+
+        // First position in keys[0 .. n-1] with a key >= key (include_key)
+        // or > key (!include_key).
+        static uint32_t search(const SpatialObjectKey* keys,
+                               uint32_t n,
+                               const SpatialObjectKey& key,
+                               int32_t include_key);
+
+    private:
+        int _fd;
+        BufferPool* _pool;
+        Meta _meta;
+        // Incremented by add and remove. Cursors use this to detect that their
+        // positions may be stale.
+        uint64_t _modifications;
+        // For serialization by add and load.
+        uint8_t* _buffer;
+        uint32_t _buffer_size;
+
+        template <class> friend class DiskBTreeCursor;
+    };
+
+    template <class SOR>
+    class DiskBTreeCursor : public Cursor<SOR>
+    {
+    public:
+        virtual Record<SOR> next();
+        virtual Record<SOR> previous();
+        virtual void goTo(const SpatialObjectKey& key);
+        virtual void skipTo(const SpatialObjectKey& key);
+        virtual void close();
+        virtual ~DiskBTreeCursor();
+        DiskBTreeCursor(DiskBTree<SOR>& disk_btree);
+
+    private:
+        typedef typename DiskBTree<SOR>::Leaf Leaf;
+
+    private:
+        Record<SOR> neighbor(int32_t forward_move);
+        void startIteration(int32_t forward_move, int32_t include_start_key);
+        // Unpins the current leaf, and pins page instead.
+        void moveTo(uint32_t page);
+        void release();
+
+    private:
+        DiskBTree<SOR>& _disk_btree;
+        // Pinned leaf, or NO_PAGE
+        uint32_t _page;
+        Leaf* _leaf;
+        int32_t _position;
+        SpatialObjectKey _start_at;
+        // True if the next record may have key _start_at, (after goTo or
+        // skipTo), false if _start_at is the key of the last record returned.
+        int32_t _start_inclusive;
+        int32_t _forward;
+        // _disk_btree's modifications when _page and _position were computed.
+        uint64_t _modifications;
+        // Reused for the SpatialObject of each record.
+        SpatialObject* _spatial_object;
+    };
+}
+
+// So that the functions can be instantiated
+#include "DiskBTree.cpp.h"
+
+#endif
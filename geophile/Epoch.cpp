@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <atomic>
+#include "Epoch.h"
+#include "util.h"
+
+using namespace geophile;
+
+namespace
+{
+    // Retired memory, tagged with the epoch in which it was retired.
+    struct Retired
+    {
+        void* memory;
+        uint64_t epoch;
+    };
+
+    // A list of retired memory. Each thread has one, and memory
+    // retired by threads that have ended goes to a shared one.
+    struct RetiredList
+    {
+        Retired* retired;
+        uint32_t n;
+        uint32_t capacity;
+
+        void append(void* memory, uint64_t epoch)
+        {
+            if (n == capacity) {
+                uint32_t new_capacity = capacity == 0 ? 64 : capacity * 2;
+                Retired* new_retired = new Retired[new_capacity];
+                for (uint32_t i = 0; i < n; i++) {
+                    new_retired[i] = retired[i];
+                }
+                delete [] retired;
+                retired = new_retired;
+                capacity = new_capacity;
+            }
+            retired[n].memory = memory;
+            retired[n].epoch = epoch;
+            n++;
+        }
+
+        // Frees the memory retired before epoch safe_epoch.
+        void reclaim(uint64_t safe_epoch)
+        {
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                if (retired[i].epoch < safe_epoch) {
+                    free(retired[i].memory);
+                } else {
+                    retired[kept++] = retired[i];
+                }
+            }
+            n = kept;
+        }
+
+        RetiredList()
+            : retired(NULL),
+              n(0),
+              capacity(0)
+        {}
+    };
+
+    // The state of a thread that has used Epoch. ThreadStates are
+    // never freed. When a thread ends, its ThreadState can be
+    // reused by another thread.
+    struct ThreadState
+    {
+        // (epoch << 1) | 1 while the thread is between enter and
+        // exit, 0 otherwise.
+        std::atomic<uint64_t> published;
+        std::atomic<bool> in_use;
+        ThreadState* next;
+        // Only used by the owning thread
+        uint32_t depth;
+        uint32_t retired_since_advance;
+        RetiredList retired;
+
+        ThreadState()
+            : published(0),
+              in_use(true),
+              next(NULL),
+              depth(0),
+              retired_since_advance(0)
+        {}
+    };
+
+    // Try advancing the epoch after this many calls to retire.
+    const uint32_t RETIRES_PER_ADVANCE = 64;
+
+    std::atomic<uint64_t> global_epoch(2);
+    std::atomic<ThreadState*> thread_states(NULL);
+    // Memory retired by threads that have ended.
+    pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+    RetiredList orphans;
+
+    ThreadState* acquireThreadState()
+    {
+        for (ThreadState* state = thread_states.load(std::memory_order_acquire);
+             state;
+             state = state->next) {
+            bool in_use = false;
+            if (!state->in_use.load(std::memory_order_relaxed) &&
+                state->in_use.compare_exchange_strong(in_use, true)) {
+                return state;
+            }
+        }
+        ThreadState* state = new ThreadState();
+        ThreadState* head = thread_states.load(std::memory_order_relaxed);
+        do {
+            state->next = head;
+        } while (!thread_states.compare_exchange_weak(head, state));
+        return state;
+    }
+
+    // Hands a thread's ThreadState back when the thread ends.
+    struct ThreadStateOwner
+    {
+        ThreadState* state;
+
+        ~ThreadStateOwner()
+        {
+            if (state) {
+                // A thread shouldn't end between enter and exit, but if it
+                // does, it must not hold back the epoch forever.
+                state->depth = 0;
+                state->published.store(0, std::memory_order_release);
+                pthread_mutex_lock(&orphans_mutex);
+                for (uint32_t i = 0; i < state->retired.n; i++) {
+                    orphans.append(state->retired.retired[i].memory,
+                                   state->retired.retired[i].epoch);
+                }
+                pthread_mutex_unlock(&orphans_mutex);
+                state->retired.n = 0;
+                state->in_use.store(false, std::memory_order_release);
+            }
+        }
+
+        ThreadStateOwner()
+            : state(NULL)
+        {}
+    };
+
+    thread_local ThreadStateOwner owner;
+
+    ThreadState* threadState()
+    {
+        if (owner.state == NULL) {
+            owner.state = acquireThreadState();
+        }
+        return owner.state;
+    }
+
+    // Advance the global epoch if every thread between enter and exit has seen
+    // the current epoch. Returns the global epoch.
+    uint64_t tryAdvance()
+    {
+        uint64_t epoch = global_epoch.load(std::memory_order_acquire);
+        for (ThreadState* state = thread_states.load(std::memory_order_acquire);
+             state;
+             state = state->next) {
+            uint64_t published = state->published.load(std::memory_order_acquire);
+            if ((published & 1) && (published >> 1) != epoch) {
+                return epoch;
+            }
+        }
+        if (global_epoch.compare_exchange_strong(epoch, epoch + 1)) {
+            epoch++;
+        }
+        return epoch;
+    }
+}
+
+void Epoch::enter()
+{
+    ThreadState* state = threadState();
+    if (state->depth++ == 0) {
+        uint64_t epoch = global_epoch.load(std::memory_order_relaxed);
+        state->published.store((epoch << 1) | 1, std::memory_order_relaxed);
+        // The published epoch must be visible before any shared
+        // pointers are read.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+void Epoch::exit()
+{
+    ThreadState* state = threadState();
+    GEOPHILE_ASSERT(state->depth > 0);
+    if (--state->depth == 0) {
+        state->published.store(0, std::memory_order_release);
+    }
+}
+
+void Epoch::retire(void* memory)
+{
+    ThreadState* state = threadState();
+    state->retired.append(memory, global_epoch.load(std::memory_order_acquire));
+    if (++state->retired_since_advance == RETIRES_PER_ADVANCE) {
+        state->retired_since_advance = 0;
+        uint64_t safe_epoch = tryAdvance() - 1;
+        state->retired.reclaim(safe_epoch);
+        if (pthread_mutex_trylock(&orphans_mutex) == 0) {
+            orphans.reclaim(safe_epoch);
+            pthread_mutex_unlock(&orphans_mutex);
+        }
+    }
+}
+
+uint64_t Epoch::current()
+{
+    return global_epoch.load(std::memory_order_acquire);
+}
@@ -0,0 +1,55 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include <stdint.h>
+
+namespace geophile
+{
+    /*
+     * Epoch-based reclamation of memory shared by threads without
+     * locks, (e.g. the nodes of a ConcurrentSkipList).
+     *
+     * A thread calls enter before reading or modifying a shared
+     * structure, and exit when it no longer holds pointers into the
+     * structure. Calls nest. Memory unlinked from a structure is
+     * passed to retire, and is freed (using free()) once every thread
+     * that might still hold a pointer to it has called exit.
+     *
+     * There is a global epoch counter. A thread inside enter/exit
+     * publishes the epoch it saw on entry, and the counter only
+     * advances when all such threads have seen the current epoch.
+     * Memory retired in epoch e is freed once the counter reaches
+     * e + 2. enter and exit don't block, and don't write to memory
+     * shared with other threads, other than the thread's own
+     * published epoch.
+     */
+    class Epoch
+    {
+    public:
+        /*
+         * Marks the calling thread as holding pointers into shared
+         * structures.
+         */
+        static void enter();
+
+        /*
+         * Ends the matching call to enter.
+         */
+        static void exit();
+
+        /*
+         * Arranges for memory, obtained by malloc or posix_memalign,
+         * and already unreachable from any shared structure, to be
+         * freed once no thread can be accessing it. The calling thread
+         * need not be inside enter/exit.
+         */
+        static void retire(void* memory);
+
+        /*
+         * The current value of the global epoch counter. For testing.
+         */
+        static uint64_t current();
+    };
+}
+
+#endif
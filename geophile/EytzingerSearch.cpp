@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include "EytzingerSearch.h"
+#include "GeophileException.h"
+#include "util.h"
+
+using namespace geophile;
+
+void EytzingerSearch::build(const SpatialObjectKey* keys, uint32_t n)
+{
+    clear();
+    if (n == 0) {
+        return;
+    }
+    void* memory;
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, (uint64_t) (n + 1) * sizeof(Key)) != 0) {
+        throw GeophileException("Unable to allocate EytzingerSearch");
+    }
+    _keys = (Key*) memory;
+    _positions = new uint32_t[n + 1];
+    _n = n;
+    uint32_t filled = fill(keys, 0, 1);
+    GEOPHILE_ASSERT(filled == n);
+}
+
+void EytzingerSearch::clear()
+{
+    free(_keys);
+    delete [] _positions;
+    _keys = NULL;
+    _positions = NULL;
+    _n = 0;
+}
+
+uint32_t EytzingerSearch::size() const
+{
+    return _n;
+}
+
+void EytzingerSearch::range(const SpatialObjectKey& key,
+                            int32_t include_key,
+                            uint32_t* lo,
+                            uint32_t* hi) const
+{
+    *lo = lowerBound(key, include_key);
+    *hi = *lo;
+}
+
+uint32_t EytzingerSearch::lowerBound(const SpatialObjectKey& key, int32_t include_key) const
+{
+    int64_t z = key.z().asInteger();
+    int64_t soid = key.soid();
+    // Go right past each node preceding the target, left otherwise.
+    uint64_t k = 1;
+    while (k <= _n) {
+        __builtin_prefetch(_keys + PREFETCH_DISTANCE * k);
+        const Key& node = _keys[k];
+        uint64_t precedes =
+            node.z < z ||
+            (node.z == z && (node.soid < soid || (node.soid == soid && !include_key)));
+        k = 2 * k + precedes;
+    }
+    // k's path ends with the right moves past the nodes below the answer,
+    // (the last node where the path went left). Strip them, and the left
+    // move. If there was no left move, every key precedes the target.
+    k >>= __builtin_ffsll(~k);
+    return k == 0 ? _n : _positions[k];
+}
+
+EytzingerSearch::~EytzingerSearch()
+{
+    clear();
+}
+
+EytzingerSearch::EytzingerSearch()
+    : _n(0),
+      _keys(NULL),
+      _positions(NULL)
+{}
+
+uint32_t EytzingerSearch::fill(const SpatialObjectKey* keys, uint32_t i, uint64_t k)
+{
+    if (k <= _n) {
+        i = fill(keys, i, 2 * k);
+        _keys[k].z = keys[i].z().asInteger();
+        _keys[k].soid = keys[i].soid();
+        _positions[k] = i;
+        i = fill(keys, i + 1, 2 * k + 1);
+    }
+    return i;
+}
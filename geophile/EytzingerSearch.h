@@ -0,0 +1,74 @@
+#ifndef _EYTZINGER_SEARCH_H
+#define _EYTZINGER_SEARCH_H
+
+#include <stdint.h>
+#include "KeySearch.h"
+#include "SpatialObjectKey.h"
+
+namespace geophile
+{
+    /*
+     * A KeySearch that finds a key's exact position, faster than by
+     * bisecting the index's records. The keys are copied into an
+     * array in Eytzinger, (BFS), order: The root is at 1, and the
+     * children of node k are at 2k and 2k + 1. A search walks down
+     * from the root without branches.
+     * Nodes four levels down are contiguous, so each step prefetches
+     * them, and the memory latency of the descent overlaps with the
+     * comparisons. Bisection instead touches a new cache line at
+     * nearly every step, (and in an array of records, it touches the
+     * records' SORs along with their keys).
+     */
+    class EytzingerSearch : public KeySearch
+    {
+    public:
+        // KeySearch
+        virtual void build(const SpatialObjectKey* keys, uint32_t n);
+        virtual void clear();
+        virtual uint32_t size() const;
+        // Sets *lo and *hi to lowerBound(key, include_key).
+        virtual void range(const SpatialObjectKey& key,
+                           int32_t include_key,
+                           uint32_t* lo,
+                           uint32_t* hi) const;
+        virtual ~EytzingerSearch();
+
+        // EytzingerSearch
+
+        /*
+         * Position, in the array given to build, of the first key
+         * >= key (include_key) or > key (!include_key). Returns
+         * size() if there is no such key.
+         */
+        uint32_t lowerBound(const SpatialObjectKey& key, int32_t include_key) const;
+
+        EytzingerSearch();
+
+    private:
+        // Key as two integers, so that comparisons don't go through Z.
+        struct Key
+        {
+            int64_t z;
+            int64_t soid;
+        };
+
+    private:
+        // Fills the subtree rooted at node k with keys[i ...], in order.
+        // Returns the position of the next unused key.
+        uint32_t fill(const SpatialObjectKey* keys, uint32_t i, uint64_t k);
+
+    private:
+        // The descendants of node k, four levels down, start at 16k.
+        static const uint32_t PREFETCH_DISTANCE = 16;
+        static const uint32_t CACHE_LINE_SIZE = 64;
+
+    private:
+        uint32_t _n;
+        // _keys[k] and _positions[k], 1 <= k <= _n, are the key at node k
+        // and its position in the sorted keys.
+        Key* _keys;
+        uint32_t* _positions;
+    };
+}
+
+#endif
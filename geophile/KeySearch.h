@@ -0,0 +1,52 @@
+#ifndef _KEY_SEARCH_H
+#define _KEY_SEARCH_H
+
+#include <stdint.h>
+#include "SpatialObjectKey.h"
+
+namespace geophile
+{
+    /*
+     * A search structure built over the sorted keys of a frozen
+     * index, used to find a key's position without bisecting the
+     * index itself. A KeySearch narrows the search to a range of
+     * positions, which the index then searches, (or uses directly, if
+     * the range contains one position). A KeySearch is read-only
+     * once built, so any number of threads can use it concurrently.
+     */
+    class KeySearch
+    {
+    public:
+        /*
+         * Builds the search structure over keys[0 .. n-1], which
+         * must be sorted. Replaces any previous contents.
+         */
+        virtual void build(const SpatialObjectKey* keys, uint32_t n) = 0;
+
+        /*
+         * Discards the contents.
+         */
+        virtual void clear() = 0;
+
+        /*
+         * Number of keys, (0 if empty or cleared).
+         */
+        virtual uint32_t size() const = 0;
+
+        /*
+         * Sets [*lo, *hi] to a range of positions, in the array given
+         * to build, containing the position of the first key >= key
+         * (include_key) or > key (!include_key), which is size() if
+         * there is no such key.
+         */
+        virtual void range(const SpatialObjectKey& key,
+                           int32_t include_key,
+                           uint32_t* lo,
+                           uint32_t* hi) const = 0;
+
+        virtual ~KeySearch()
+        {}
+    };
+}
+
+#endif
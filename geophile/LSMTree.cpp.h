@@ -0,0 +1,559 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "LSMTree.h"
+#include "GeophileException.h"
+#include "SpatialObjectReferenceManager.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR>
+    void LSMTree<SOR>::add(Z z, const SOR& sor)
+    {
+        SpatialObjectKey key(z, sor.spatialObjectId());
+        uint32_t position = search(_memtable, _memtable_n, key, true);
+        if (position == _memtable_n || _memtable[position].key.compare(key) != 0) {
+            memmove(&_memtable[position + 1],
+                    &_memtable[position],
+                    (_memtable_n - position) * sizeof(Entry));
+            _memtable_n++;
+        }
+        // A new entry, or a replacement of an older version of the key.
+        new (&_memtable[position]) Entry();
+        _memtable[position].key = key;
+        _memtable[position].sor = sor;
+        _version++;
+        if (_memtable_n == _memtable_capacity) {
+            flush();
+        }
+    }
+
+    template <class SOR>
+    SOR LSMTree<SOR>::remove(Z z, int64_t soid)
+    {
+        SOR removed_sor;
+        removed_sor.setNull();
+        SpatialObjectKey key(z, soid);
+        uint32_t position = search(_memtable, _memtable_n, key, true);
+        if (position < _memtable_n && _memtable[position].key.compare(key) == 0) {
+            removed_sor = _memtable[position].sor;
+        } else {
+            // The newest version of the key is in the newest run containing it.
+            pthread_mutex_lock(&_mutex);
+            bool found = false;
+            for (uint32_t r = 0; r < _n_runs && !found; r++) {
+                const Run* run = _runs[r];
+                uint32_t p = search(run->entries, run->n, key, true);
+                if (p < run->n && run->entries[p].key.compare(key) == 0) {
+                    removed_sor = run->entries[p].sor;
+                    found = true;
+                }
+            }
+            pthread_mutex_unlock(&_mutex);
+        }
+        if (!removed_sor.isNull()) {
+            SOR tombstone;
+            tombstone.setNull();
+            if (position == _memtable_n || _memtable[position].key.compare(key) != 0) {
+                memmove(&_memtable[position + 1],
+                        &_memtable[position],
+                        (_memtable_n - position) * sizeof(Entry));
+                _memtable_n++;
+                new (&_memtable[position]) Entry();
+                _memtable[position].key = key;
+            }
+            _memtable[position].sor = tombstone;
+            _version++;
+            if (_memtable_n == _memtable_capacity) {
+                flush();
+            }
+        }
+        return removed_sor;
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::freeze()
+    {
+        // An LSMTree is always ready for retrieval. Finish pending merges so
+        // that retrievals search as few runs as possible.
+        waitForMerges();
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::load(const Record<SOR>* records, uint32_t n)
+    {
+        if (n == 0) {
+            return;
+        }
+        // The loaded records are newer than everything already in the
+        // LSMTree, including the memtable.
+        if (_memtable_n > 0) {
+            flush();
+        }
+        Run* run = newRun(n);
+        for (uint32_t i = 0; i < n; i++) {
+            GEOPHILE_ASSERT(i == 0 || records[i - 1].key().compare(records[i].key()) < 0);
+            new (&run->entries[i]) Entry();
+            run->entries[i].key = records[i].key();
+            run->entries[i].sor = records[i].spatialObjectReference();
+        }
+        run->n = n;
+        pthread_mutex_lock(&_mutex);
+        addRun(run);
+        pthread_mutex_unlock(&_mutex);
+        _version++;
+    }
+
+    template <class SOR>
+    Cursor<SOR>* LSMTree<SOR>::cursor()
+    {
+        return new LSMTreeCursor<SOR>(*this);
+    }
+
+    template <class SOR>
+    LSMTree<SOR>::~LSMTree()
+    {
+        if (_merge_thread_running) {
+            pthread_mutex_lock(&_mutex);
+            _stopping = true;
+            pthread_cond_signal(&_work);
+            pthread_mutex_unlock(&_mutex);
+            pthread_join(_merge_thread, NULL);
+        }
+        // Cleanup the SORs of the records still present, i.e. those visible
+        // to a Cursor.
+        LSMTreeCursor<SOR> cursor(*this);
+        cursor.goTo(SpatialObjectKey(Z(0, 0)));
+        cursor.startIteration(true, true);
+        const Entry* entry;
+        while ((entry = cursor.nextEntry(true))) {
+            this->_spatial_object_reference_manager->cleanupSpatialObjectReference(entry->sor);
+        }
+        for (uint32_t r = 0; r < _n_runs; r++) {
+            release(_runs[r]);
+        }
+        delete [] _runs;
+        free(_memtable);
+        pthread_cond_destroy(&_merged);
+        pthread_cond_destroy(&_work);
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    template <class SOR>
+    uint32_t LSMTree<SOR>::nRuns()
+    {
+        pthread_mutex_lock(&_mutex);
+        uint32_t n_runs = _n_runs;
+        pthread_mutex_unlock(&_mutex);
+        return n_runs;
+    }
+
+    template <class SOR>
+    LSMTree<SOR>::LSMTree(const SpatialObjectTypes* spatial_object_types,
+                          const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                          SessionMemory<SOR>* memory,
+                          uint32_t memtable_capacity)
+        : OrderedIndex<SOR>(spatial_object_types, memory, spatial_object_reference_manager),
+          _memtable(NULL),
+          _memtable_n(0),
+          _memtable_capacity(memtable_capacity),
+          _runs(new Run*[MAX_RUNS + 1]),
+          _n_runs(0),
+          _runs_capacity(MAX_RUNS + 1),
+          _version(0),
+          _generation(0),
+          _merge_thread_running(false),
+          _merging(false),
+          _stopping(false)
+    {
+        GEOPHILE_ASSERT(memtable_capacity > 0);
+        _memtable = (Entry*) malloc(memtable_capacity * sizeof(Entry));
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_work, NULL);
+        pthread_cond_init(&_merged, NULL);
+        // Without a merge thread, merges are done by flush.
+        _merge_thread_running = pthread_create(&_merge_thread, NULL, runMerges, this) == 0;
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::flush()
+    {
+        Run* run = newRun(_memtable_n);
+        memcpy(run->entries, _memtable, _memtable_n * sizeof(Entry));
+        run->n = _memtable_n;
+        _memtable_n = 0;
+        _version++;
+        pthread_mutex_lock(&_mutex);
+        addRun(run);
+        if (_merge_thread_running) {
+            // Don't let the merge thread fall too far behind.
+            while (_n_runs > MAX_RUNS) {
+                pthread_cond_wait(&_merged, &_mutex);
+            }
+        } else {
+            int32_t i;
+            while ((i = mergeCandidate()) >= 0) {
+                mergeRuns(i);
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::addRun(Run* run)
+    {
+        if (_n_runs == _runs_capacity) {
+            Run** runs = new Run*[_runs_capacity * 2];
+            memcpy(runs, _runs, _n_runs * sizeof(Run*));
+            delete [] _runs;
+            _runs = runs;
+            _runs_capacity *= 2;
+        }
+        memmove(&_runs[1], &_runs[0], _n_runs * sizeof(Run*));
+        _runs[0] = run;
+        _n_runs++;
+        _generation++;
+        pthread_cond_signal(&_work);
+    }
+
+    template <class SOR>
+    int32_t LSMTree<SOR>::mergeCandidate() const
+    {
+        for (uint32_t i = 0; i + 1 < _n_runs; i++) {
+            if ((uint64_t) _runs[i]->n * GROWTH > _runs[i + 1]->n) {
+                return i;
+            }
+        }
+        return _n_runs > MAX_RUNS ? 0 : -1;
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::mergeRuns(int32_t i)
+    {
+        // Only merges remove runs, and there is one merge at a time, so
+        // newer and older stay adjacent while _mutex is released. Newer runs
+        // may be added, changing their positions.
+        Run* newer = _runs[i];
+        Run* older = _runs[i + 1];
+        bool oldest = i + 2 == (int32_t) _n_runs;
+        _merging = true;
+        pthread_mutex_unlock(&_mutex);
+        Run* merged = newRun(newer->n + older->n);
+        uint32_t a = 0;
+        uint32_t b = 0;
+        uint32_t n = 0;
+        while (a < newer->n || b < older->n) {
+            const Entry* entry;
+            if (b == older->n) {
+                entry = &newer->entries[a++];
+            } else if (a == newer->n) {
+                entry = &older->entries[b++];
+            } else {
+                int32_t c = newer->entries[a].key.compare(older->entries[b].key);
+                if (c < 0) {
+                    entry = &newer->entries[a++];
+                } else if (c > 0) {
+                    entry = &older->entries[b++];
+                } else {
+                    // The newer version replaces the older one.
+                    entry = &newer->entries[a++];
+                    b++;
+                }
+            }
+            // A tombstone has nothing left to hide once it reaches the oldest
+            // run.
+            if (!(oldest && entry->sor.isNull())) {
+                memcpy(&merged->entries[n++], entry, sizeof(Entry));
+            }
+        }
+        merged->n = n;
+        pthread_mutex_lock(&_mutex);
+        uint32_t position = 0;
+        while (_runs[position] != newer) {
+            position++;
+        }
+        _runs[position] = merged;
+        memmove(&_runs[position + 1], &_runs[position + 2], (_n_runs - position - 2) * sizeof(Run*));
+        _n_runs--;
+        _generation++;
+        _merging = false;
+        release(newer);
+        release(older);
+        pthread_cond_broadcast(&_merged);
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::waitForMerges()
+    {
+        pthread_mutex_lock(&_mutex);
+        if (_merge_thread_running) {
+            while (_merging || mergeCandidate() >= 0) {
+                pthread_cond_wait(&_merged, &_mutex);
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::mergeLoop()
+    {
+        pthread_mutex_lock(&_mutex);
+        while (!_stopping) {
+            int32_t i = mergeCandidate();
+            if (i >= 0) {
+                mergeRuns(i);
+            } else {
+                pthread_cond_wait(&_work, &_mutex);
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    template <class SOR>
+    void* LSMTree<SOR>::runMerges(void* arg)
+    {
+        ((LSMTree<SOR>*) arg)->mergeLoop();
+        return NULL;
+    }
+
+    template <class SOR>
+    typename LSMTree<SOR>::Run* LSMTree<SOR>::newRun(uint32_t capacity)
+    {
+        Run* run = new Run;
+        // Entries are only copied with memcpy, so they don't need to be
+        // constructed.
+        run->entries = (Entry*) malloc((capacity == 0 ? 1 : capacity) * sizeof(Entry));
+        if (run->entries == NULL) {
+            delete run;
+            throw std::bad_alloc();
+        }
+        run->n = 0;
+        run->references = 1;
+        return run;
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::acquire(Run* run)
+    {
+        run->references++;
+    }
+
+    template <class SOR>
+    void LSMTree<SOR>::release(Run* run)
+    {
+        if (--run->references == 0) {
+            free(run->entries);
+            delete run;
+        }
+    }
+
+    template <class SOR>
+    uint32_t LSMTree<SOR>::search(const Entry* entries,
+                                  uint32_t n,
+                                  const SpatialObjectKey& key,
+                                  int32_t include_key)
+    {
+        uint32_t lo = 0;
+        uint32_t hi = n;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            int32_t c = entries[mid].key.compare(key);
+            if (c < 0 || (c == 0 && !include_key)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    template <class SOR>
+    Record<SOR> LSMTreeCursor<SOR>::next()
+    {
+        return neighbor(true);
+    }
+
+    template <class SOR>
+    Record<SOR> LSMTreeCursor<SOR>::previous()
+    {
+        return neighbor(false);
+    }
+
+    template <class SOR>
+    void LSMTreeCursor<SOR>::goTo(const SpatialObjectKey& key)
+    {
+        _start_at = key;
+        _start_inclusive = true;
+        this->state(NEVER_USED);
+    }
+
+    template <class SOR>
+    void LSMTreeCursor<SOR>::skipTo(const SpatialObjectKey& key)
+    {
+        if (this->state() == IN_USE && _forward && _version == _lsm_tree._version.load()) {
+            // Move each source forward from its current position.
+            for (uint32_t s = 0; s < _n_sources; s++) {
+                Source* source = &_sources[s];
+                source->position +=
+                    LSMTree<SOR>::search(&source->entries[source->position],
+                                         source->n - source->position,
+                                         key,
+                                         true);
+            }
+            _start_at = key;
+            _start_inclusive = true;
+        } else {
+            goTo(key);
+        }
+    }
+
+    template <class SOR>
+    LSMTreeCursor<SOR>::~LSMTreeCursor()
+    {
+        releaseRuns();
+        delete [] _sources;
+        delete [] _runs;
+    }
+
+    template <class SOR>
+    LSMTreeCursor<SOR>::LSMTreeCursor(LSMTree<SOR>& lsm_tree)
+        : _lsm_tree(lsm_tree),
+          _sources(NULL),
+          _n_sources(0),
+          _runs(NULL),
+          _n_runs(0),
+          _capacity(0),
+          _version(0),
+          _generation(0),
+          _start_at(),
+          _start_inclusive(true),
+          _forward(true)
+    {}
+
+    template <class SOR>
+    Record<SOR> LSMTreeCursor<SOR>::neighbor(int32_t forward_move)
+    {
+        switch (this->state()) {
+            case NEVER_USED:
+                startIteration(forward_move, true);
+                break;
+            case IN_USE:
+                if (forward_move != _forward || _version != _lsm_tree._version.load()) {
+                    // Changing direction, or the LSMTree has changed:
+                    // reposition relative to _start_at.
+                    startIteration(forward_move, _start_inclusive);
+                }
+                break;
+            case DONE:
+                GEOPHILE_ASSERT(this->current().eof());
+                return this->current();
+        }
+        const Entry* entry = nextEntry(forward_move);
+        if (entry) {
+            this->current(entry->key.z(), entry->sor);
+            this->state(IN_USE);
+        } else {
+            this->close();
+        }
+        return this->current();
+    }
+
+    template <class SOR>
+    const typename LSMTreeCursor<SOR>::Entry* LSMTreeCursor<SOR>::nextEntry(int32_t forward_move)
+    {
+        const Entry* entry = NULL;
+        do {
+            // Find the next key among all sources. On a tie, the newest
+            // source wins.
+            entry = NULL;
+            for (uint32_t s = 0; s < _n_sources; s++) {
+                const Source* source = &_sources[s];
+                if (source->position >= 0 && source->position < (int32_t) source->n) {
+                    const Entry* candidate = &source->entries[source->position];
+                    if (entry == NULL) {
+                        entry = candidate;
+                    } else {
+                        int32_t c = candidate->key.compare(entry->key);
+                        if (forward_move ? c < 0 : c > 0) {
+                            entry = candidate;
+                        }
+                    }
+                }
+            }
+            if (entry) {
+                // Move past the key in all sources, hiding older versions.
+                int32_t step = forward_move ? 1 : -1;
+                for (uint32_t s = 0; s < _n_sources; s++) {
+                    Source* source = &_sources[s];
+                    if (source->position >= 0 &&
+                        source->position < (int32_t) source->n &&
+                        source->entries[source->position].key.compare(entry->key) == 0) {
+                        source->position += step;
+                    }
+                }
+                _start_at = entry->key;
+                _start_inclusive = false;
+            }
+            // Skip tombstones
+        } while (entry && entry->sor.isNull());
+        return entry;
+    }
+
+    template <class SOR>
+    void LSMTreeCursor<SOR>::startIteration(int32_t forward_move, int32_t include_start_key)
+    {
+        if (_version != _lsm_tree._version.load() ||
+            _generation != _lsm_tree._generation.load() ||
+            _sources == NULL) {
+            snapshot();
+        }
+        for (uint32_t s = 0; s < _n_sources; s++) {
+            Source* source = &_sources[s];
+            source->position =
+                forward_move
+                ? LSMTree<SOR>::search(source->entries, source->n, _start_at, include_start_key)
+                : LSMTree<SOR>::search(source->entries, source->n, _start_at, !include_start_key) - 1;
+        }
+        _forward = forward_move;
+    }
+
+    template <class SOR>
+    void LSMTreeCursor<SOR>::snapshot()
+    {
+        releaseRuns();
+        pthread_mutex_lock(&_lsm_tree._mutex);
+        uint32_t n_runs = _lsm_tree._n_runs;
+        if (n_runs + 1 > _capacity) {
+            delete [] _sources;
+            delete [] _runs;
+            _capacity = n_runs + 1;
+            _sources = new Source[_capacity];
+            _runs = new Run*[_capacity];
+        }
+        _sources[0].entries = _lsm_tree._memtable;
+        _sources[0].n = _lsm_tree._memtable_n;
+        for (uint32_t r = 0; r < n_runs; r++) {
+            Run* run = _lsm_tree._runs[r];
+            LSMTree<SOR>::acquire(run);
+            _runs[r] = run;
+            _sources[r + 1].entries = run->entries;
+            _sources[r + 1].n = run->n;
+        }
+        _n_runs = n_runs;
+        _n_sources = n_runs + 1;
+        _version = _lsm_tree._version.load();
+        _generation = _lsm_tree._generation.load();
+        pthread_mutex_unlock(&_lsm_tree._mutex);
+    }
+
+    template <class SOR>
+    void LSMTreeCursor<SOR>::releaseRuns()
+    {
+        for (uint32_t r = 0; r < _n_runs; r++) {
+            LSMTree<SOR>::release(_runs[r]);
+        }
+        _n_runs = 0;
+        _n_sources = 0;
+    }
+}
@@ -0,0 +1,200 @@
+#ifndef _LSM_TREE_H
+#define _LSM_TREE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "OrderedIndex.h"
+#include "Record.h"
+#include "Cursor.h"
+#include "SpatialObjectKey.h"
+#include "SpatialObjectTypes.h"
+
+namespace geophile
+{
+    template <class SOR> class LSMTreeCursor;
+    template <class SOR> class SessionMemory;
+    template <class SOR> class SpatialObjectReferenceManager;
+    class SpatialObjectTypes;
+
+    /*
+     * A log-structured merge tree implementation of OrderedIndex, for
+     * write-heavy workloads.
+     *
+     * add and remove go to the memtable, a small sorted array. A
+     * remove adds a tombstone, which hides older versions of the
+     * record. When the memtable fills up, it is written out as a run,
+     * an immutable sorted array, and the memtable is emptied. Runs
+     * are merged by a background thread, which keeps the sizes of
+     * runs, from newest to oldest, growing by a factor of at least
+     * GROWTH. That bounds the number of runs, and so the cost of
+     * retrieval, while each record is rewritten only a few times.
+     * Tombstones are dropped when merged into the oldest run. So the
+     * cost of add and remove is bounded by the memtable size, (and
+     * a binary search of each run, for remove), instead of by the
+     * size of the index. If the background thread falls behind,
+     * (more than MAX_RUNS runs), writing out the memtable waits for
+     * it.
+     *
+     * A Cursor merges the memtable and the runs, presenting a single
+     * z-ordered view, in which the newest version of each key is
+     * visible, and keys whose newest version is a tombstone are
+     * skipped.
+     *
+     * An LSMTree is always ready for retrieval. freeze waits for
+     * pending merges, leaving the fewest runs to be searched. As for
+     * other OrderedIndexes, retrieval can be done by several threads
+     * concurrently, as long as there are no concurrent adds or
+     * removes. Background merges don't affect retrieval.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class LSMTree : public OrderedIndex<SOR>
+    {
+    public:
+        // OrderedIndex
+        virtual void add(Z z, const SOR& sor);
+        virtual SOR remove(Z z, int64_t soid);
+        virtual void freeze();
+        virtual void load(const Record<SOR>* records, uint32_t n);
+        virtual Cursor<SOR>* cursor();
+        virtual ~LSMTree();
+
+        // LSMTree
+        // Number of runs, not counting the memtable. For testing.
+        uint32_t nRuns();
+        LSMTree(const SpatialObjectTypes* spatial_object_types,
+                const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                SessionMemory<SOR>* memory,
+                uint32_t memtable_capacity = DEFAULT_MEMTABLE_CAPACITY);
+
+    public:
+        static const uint32_t DEFAULT_MEMTABLE_CAPACITY = 4096;
+        // Runs, from newest to oldest, grow by at least this factor.
+        static const uint32_t GROWTH = 4;
+        static const uint32_t MAX_RUNS = 32;
+
+    private:
+        struct Entry
+        {
+            SpatialObjectKey key;
+            SOR sor; // Null for a tombstone
+        };
+
+        // Runs are shared by the LSMTree and Cursors, and freed when
+        // no longer referenced.
+        struct Run
+        {
+            Entry* entries;
+            uint32_t n;
+            std::atomic<uint32_t> references;
+        };
+
+    private:
+        // Writes the memtable out as the newest run.
+        void flush();
+        // Adds run as the newest run. Called with _mutex held.
+        void addRun(Run* run);
+        // Index of the newer of two adjacent runs to be merged, or -1. Called
+        // with _mutex held.
+        int32_t mergeCandidate() const;
+        // Merges runs i and i + 1. Called with _mutex held, which is released
+        // during the merge.
+        void mergeRuns(int32_t i);
+        void waitForMerges();
+        void mergeLoop();
+        static void* runMerges(void* arg);
+        static Run* newRun(uint32_t capacity);
+        static void acquire(Run* run);
+        static void release(Run* run);
+        // First position in entries[0 .. n-1] with a key >= key (include_key)
+        // or > key (!include_key).
+        static uint32_t search(const Entry* entries,
+                               uint32_t n,
+                               const SpatialObjectKey& key,
+                               int32_t include_key);
+
+    private:
+        Entry* _memtable;
+        uint32_t _memtable_n;
+        uint32_t _memtable_capacity;
+        // Runs, newest first. The array is modified only with _mutex held.
+        Run** _runs;
+        uint32_t _n_runs;
+        uint32_t _runs_capacity;
+        // Incremented when the contents of the LSMTree change, (add, remove,
+        // flush, load). Cursors use this to detect that their positions may be
+        // stale.
+        std::atomic<uint64_t> _version;
+        // Incremented when _runs changes, including by merges.
+        std::atomic<uint64_t> _generation;
+        pthread_mutex_t _mutex;
+        // Signaled when there may be merge work.
+        pthread_cond_t _work;
+        // Signaled when a merge completes.
+        pthread_cond_t _merged;
+        pthread_t _merge_thread;
+        bool _merge_thread_running;
+        bool _merging;
+        bool _stopping;
+
+        template <class> friend class LSMTreeCursor;
+    };
+
+    template <class SOR>
+    class LSMTreeCursor : public Cursor<SOR>
+    {
+    public:
+        virtual Record<SOR> next();
+        virtual Record<SOR> previous();
+        virtual void goTo(const SpatialObjectKey& key);
+        virtual void skipTo(const SpatialObjectKey& key);
+        virtual ~LSMTreeCursor();
+        LSMTreeCursor(LSMTree<SOR>& lsm_tree);
+
+    private:
+        typedef typename LSMTree<SOR>::Entry Entry;
+        typedef typename LSMTree<SOR>::Run Run;
+
+        // The memtable or a run
+        struct Source
+        {
+            const Entry* entries;
+            uint32_t n;
+            // Next entry to consider, moving in the direction of _forward.
+            int32_t position;
+        };
+
+    private:
+        Record<SOR> neighbor(int32_t forward_move);
+        // Next entry that isn't a tombstone, or NULL.
+        const Entry* nextEntry(int32_t forward_move);
+        void startIteration(int32_t forward_move, int32_t include_start_key);
+        // Takes references to the LSMTree's current memtable and runs.
+        void snapshot();
+        void releaseRuns();
+
+    private:
+        LSMTree<SOR>& _lsm_tree;
+        // _sources[0] is the memtable, followed by the runs, newest first.
+        Source* _sources;
+        uint32_t _n_sources;
+        Run** _runs;
+        uint32_t _n_runs;
+        uint32_t _capacity;
+        // _lsm_tree's version and generation when the snapshot was taken.
+        uint64_t _version;
+        uint64_t _generation;
+        SpatialObjectKey _start_at;
+        // True if the next record may have key _start_at, (after goTo or
+        // skipTo), false if _start_at is the key of the last record returned.
+        int32_t _start_inclusive;
+        int32_t _forward;
+
+        template <class> friend class LSMTree;
+    };
+}
+
+// So that the functions can be instantiated
+#include "LSMTree.cpp.h"
+
+#endif
@@ -0,0 +1,473 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MappedIndex.h"
+#include "ByteBuffer.h"
+#include "ByteBufferOverflowException.h"
+#include "GeophileException.h"
+#include "SpatialObject.h"
+#include "SpatialObjectReferenceManager.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR>
+    void MappedIndex<SOR>::add(Z z, const SOR& sor)
+    {
+        throw GeophileException("MappedIndex is read-only");
+    }
+
+    template <class SOR>
+    SOR MappedIndex<SOR>::remove(Z z, int64_t soid)
+    {
+        throw GeophileException("MappedIndex is read-only");
+    }
+
+    template <class SOR>
+    void MappedIndex<SOR>::freeze()
+    {
+        // A MappedIndex is always ready for retrieval.
+    }
+
+    template <class SOR>
+    void MappedIndex<SOR>::load(const Record<SOR>* records, uint32_t n)
+    {
+        throw GeophileException("MappedIndex is read-only");
+    }
+
+    template <class SOR>
+    Cursor<SOR>* MappedIndex<SOR>::cursor()
+    {
+        return new MappedIndexCursor<SOR>(*this);
+    }
+
+    template <class SOR>
+    uint64_t MappedIndex<SOR>::zLengths() const
+    {
+        return _header->z_lengths;
+    }
+
+    template <class SOR>
+    MappedIndex<SOR>::~MappedIndex()
+    {
+        for (uint64_t i = 0; i < _header->n_objects; i++) {
+            delete _spatial_objects[i].load();
+        }
+        free(_spatial_objects);
+        munmap((void*) _mapping, _size);
+        close(_fd);
+    }
+
+    template <class SOR>
+    uint64_t MappedIndex<SOR>::nRecords() const
+    {
+        return _header->n_records;
+    }
+
+    template <class SOR>
+    void MappedIndex<SOR>::write(OrderedIndex<SOR>* index, const char* path)
+    {
+        // Read the records
+        uint64_t n = 0;
+        uint64_t capacity = BLOCK_SIZE;
+        SpatialObjectKey* keys = new SpatialObjectKey[capacity];
+        SOR* sors = new SOR[capacity];
+        Cursor<SOR>* cursor = index->cursor();
+        cursor->goTo(SpatialObjectKey(Z(0, 0)));
+        Record<SOR> record;
+        uint64_t z_lengths = 0;
+        while (!(record = cursor->next()).eof()) {
+            if (n == capacity) {
+                SpatialObjectKey* new_keys = new SpatialObjectKey[capacity * 2];
+                SOR* new_sors = new SOR[capacity * 2];
+                memcpy(new_keys, keys, n * sizeof(SpatialObjectKey));
+                memcpy(new_sors, sors, n * sizeof(SOR));
+                delete [] keys;
+                delete [] sors;
+                keys = new_keys;
+                sors = new_sors;
+                capacity *= 2;
+            }
+            keys[n] = record.key();
+            sors[n] = record.spatialObjectReference();
+            z_lengths |= 1ULL << record.key().z().length();
+            n++;
+        }
+        delete cursor;
+        // Number the SpatialObjects in order of id. first_records[i] is a
+        // record of object i.
+        ObjectRecord* object_records = new ObjectRecord[n];
+        for (uint64_t i = 0; i < n; i++) {
+            object_records[i].soid = keys[i].soid();
+            object_records[i].record = i;
+        }
+        qsort(object_records, n, sizeof(ObjectRecord), objectRecordCompare);
+        uint32_t* objects = new uint32_t[n];
+        uint64_t* first_records = new uint64_t[n];
+        uint64_t n_objects = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            if (i == 0 || object_records[i].soid != object_records[i - 1].soid) {
+                GEOPHILE_ASSERT(n_objects < 0xffffffffULL);
+                first_records[n_objects++] = object_records[i].record;
+            }
+            objects[object_records[i].record] = (uint32_t) (n_objects - 1);
+        }
+        delete [] object_records;
+        uint64_t n_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        SpatialObjectKey* fences = new SpatialObjectKey[n_blocks];
+        for (uint64_t b = 0; b < n_blocks; b++) {
+            fences[b] = keys[b * BLOCK_SIZE];
+        }
+        // Write the file. The header is written last, once the offsets are
+        // known.
+        FILE* file = fopen(path, "wb");
+        if (file == NULL) {
+            throw GeophileException("Unable to create MappedIndex file");
+        }
+        Header header;
+        memset(&header, 0, sizeof(Header));
+        uint64_t offset = 0;
+        writeSection(file, &header, sizeof(Header), &offset);
+        header.keys_offset = offset;
+        writeSection(file, keys, n * sizeof(SpatialObjectKey), &offset);
+        header.objects_offset = offset;
+        writeSection(file, objects, n * sizeof(uint32_t), &offset);
+        header.fences_offset = offset;
+        writeSection(file, fences, n_blocks * sizeof(SpatialObjectKey), &offset);
+        header.payloads_offset = offset;
+        uint64_t* payload_offsets = new uint64_t[n_objects + 1];
+        uint32_t buffer_size = 1000;
+        byte* buffer = new byte[buffer_size];
+        uint64_t payload_offset = 0;
+        for (uint64_t i = 0; i < n_objects; i++) {
+            const SpatialObject* spatial_object = sors[first_records[i]].spatialObject();
+            int32_t serialized = false;
+            uint32_t payload_size = 0;
+            do {
+                ByteBuffer byte_buffer(buffer, buffer_size);
+                try {
+                    byte_buffer.putInt32(spatial_object->typeId());
+                    spatial_object->writeTo(byte_buffer);
+                    payload_size = byte_buffer.position();
+                    serialized = true;
+                } catch (ByteBufferOverflowException e) {
+                    delete [] buffer;
+                    buffer_size *= 2;
+                    buffer = new byte[buffer_size];
+                }
+            } while (!serialized);
+            payload_offsets[i] = payload_offset;
+            if (fwrite(buffer, 1, payload_size, file) != payload_size) {
+                throw GeophileException("Unable to write MappedIndex file");
+            }
+            payload_offset += payload_size;
+        }
+        payload_offsets[n_objects] = payload_offset;
+        offset += payload_offset;
+        writeSection(file, NULL, 0, &offset);
+        header.payload_offsets_offset = offset;
+        writeSection(file, payload_offsets, (n_objects + 1) * sizeof(uint64_t), &offset);
+        header.magic = MAGIC;
+        header.version = FORMAT_VERSION;
+        header.block_size = BLOCK_SIZE;
+        header.n_records = n;
+        header.n_objects = n_objects;
+        header.n_blocks = n_blocks;
+        header.z_lengths = z_lengths;
+        header.file_size = offset;
+        if (fseek(file, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(Header), 1, file) != 1 ||
+            fclose(file) != 0) {
+            throw GeophileException("Unable to write MappedIndex file");
+        }
+        delete [] buffer;
+        delete [] payload_offsets;
+        delete [] fences;
+        delete [] first_records;
+        delete [] objects;
+        delete [] sors;
+        delete [] keys;
+    }
+
+    template <class SOR>
+    MappedIndex<SOR>::MappedIndex(const SpatialObjectTypes* spatial_object_types,
+                                  const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                                  SessionMemory<SOR>* memory,
+                                  const char* path)
+        : OrderedIndex<SOR>(spatial_object_types, memory, spatial_object_reference_manager),
+          _fd(-1),
+          _mapping(NULL),
+          _size(0),
+          _header(NULL),
+          _keys(NULL),
+          _objects(NULL),
+          _fences(NULL),
+          _payloads(NULL),
+          _payload_offsets(NULL),
+          _spatial_objects(NULL)
+    {
+        _fd = open(path, O_RDONLY);
+        if (_fd < 0) {
+            throw GeophileException("Unable to open MappedIndex file");
+        }
+        struct stat file_stat;
+        void* mapping = MAP_FAILED;
+        if (fstat(_fd, &file_stat) == 0 && file_stat.st_size >= (off_t) sizeof(Header)) {
+            _size = file_stat.st_size;
+            mapping = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+        }
+        if (mapping == MAP_FAILED) {
+            close(_fd);
+            throw GeophileException("Unable to map MappedIndex file");
+        }
+        _mapping = (const uint8_t*) mapping;
+        _header = (const Header*) _mapping;
+        const Header* h = _header;
+        // Check the header only. The rest of the file isn't touched until
+        // it's needed, (object numbers and payload offsets are checked when
+        // used). Counts come from the file, so the checks avoid overflow.
+        if (h->magic != MAGIC ||
+            h->version != FORMAT_VERSION ||
+            h->block_size != BLOCK_SIZE ||
+            h->file_size != _size ||
+            h->keys_offset < sizeof(Header) ||
+            !sectionFits(h->keys_offset, h->n_records, sizeof(SpatialObjectKey), h->objects_offset) ||
+            h->n_blocks != (h->n_records + BLOCK_SIZE - 1) / BLOCK_SIZE ||
+            !sectionFits(h->objects_offset, h->n_records, sizeof(uint32_t), h->fences_offset) ||
+            !sectionFits(h->fences_offset, h->n_blocks, sizeof(SpatialObjectKey), h->payloads_offset) ||
+            !sectionFits(h->payloads_offset, 0, 1, h->payload_offsets_offset) ||
+            h->n_objects > 0xffffffffULL ||
+            !sectionFits(h->payload_offsets_offset, h->n_objects + 1, sizeof(uint64_t), _size)) {
+            munmap(mapping, _size);
+            close(_fd);
+            throw GeophileException("Not a MappedIndex file, or unsupported version");
+        }
+        _keys = (const SpatialObjectKey*) (_mapping + h->keys_offset);
+        _objects = (const uint32_t*) (_mapping + h->objects_offset);
+        _fences = (const SpatialObjectKey*) (_mapping + h->fences_offset);
+        _payloads = _mapping + h->payloads_offset;
+        _payload_offsets = (const uint64_t*) (_mapping + h->payload_offsets_offset);
+        _spatial_objects =
+            (std::atomic<SpatialObject*>*) calloc(h->n_objects + 1, sizeof(std::atomic<SpatialObject*>));
+    }
+
+    template <class SOR>
+    uint64_t MappedIndex<SOR>::search(const SpatialObjectKey& key, int32_t include_key) const
+    {
+        // Find the first block whose fence follows the target position. The
+        // target is in the preceding block, or at the start of this one.
+        uint64_t lo = 0;
+        uint64_t hi = _header->n_blocks;
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            int32_t c = _fences[mid].compare(key);
+            if (c < 0 || (c == 0 && !include_key)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            return 0;
+        }
+        uint64_t block_start = (lo - 1) * BLOCK_SIZE;
+        lo = block_start;
+        hi = block_start + BLOCK_SIZE;
+        if (hi > _header->n_records) {
+            hi = _header->n_records;
+        }
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            int32_t c = _keys[mid].compare(key);
+            if (c < 0 || (c == 0 && !include_key)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    template <class SOR>
+    uint64_t MappedIndex<SOR>::forwardPosition(const SpatialObjectKey& key, uint64_t start) const
+    {
+        // Gallop: find an interval (lo, hi] containing the target, doubling the
+        // step each time, then binary search within it. Far targets are found
+        // through the fences instead.
+        uint64_t n = _header->n_records;
+        uint64_t lo = start;
+        uint64_t hi = start;
+        uint64_t step = 1;
+        while (hi < n && _keys[hi].compare(key) < 0) {
+            if (step > BLOCK_SIZE) {
+                return search(key, true);
+            }
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        if (hi > n) {
+            hi = n;
+        }
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if (_keys[mid].compare(key) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    template <class SOR>
+    const SpatialObjectKey& MappedIndex<SOR>::key(uint64_t position) const
+    {
+        return _keys[position];
+    }
+
+    template <class SOR>
+    SOR MappedIndex<SOR>::spatialObjectReference(uint64_t position) const
+    {
+        uint32_t object = _objects[position];
+        GEOPHILE_ASSERT(object < _header->n_objects);
+        SpatialObject* spatial_object = _spatial_objects[object].load(std::memory_order_acquire);
+        if (spatial_object == NULL) {
+            // Another thread may deserialize the same object concurrently.
+            // The first one stored is kept.
+            SpatialObject* expected = NULL;
+            spatial_object = deserialize(object);
+            if (!_spatial_objects[object].compare_exchange_strong(expected, spatial_object)) {
+                delete spatial_object;
+                spatial_object = expected;
+            }
+        }
+        return this->_spatial_object_reference_manager->newSpatialObjectReference(spatial_object);
+    }
+
+    template <class SOR>
+    SpatialObject* MappedIndex<SOR>::deserialize(uint32_t object) const
+    {
+        uint64_t start = _payload_offsets[object];
+        uint64_t end = _payload_offsets[object + 1];
+        GEOPHILE_ASSERT(start <= end && end <= _header->payload_offsets_offset - _header->payloads_offset);
+        ByteBuffer byte_buffer((byte*) &_payloads[start], (uint32_t) (end - start));
+        int32_t type_id = byte_buffer.getInt32();
+        SpatialObject* spatial_object = this->newSpatialObject(type_id);
+        spatial_object->readFrom(byte_buffer);
+        return spatial_object;
+    }
+
+    template <class SOR>
+    bool MappedIndex<SOR>::sectionFits(uint64_t offset, uint64_t n, uint64_t element_size, uint64_t end)
+    {
+        return offset % 8 == 0 && offset <= end && n <= (end - offset) / element_size;
+    }
+
+    template <class SOR>
+    void MappedIndex<SOR>::writeSection(FILE* file, const void* data, uint64_t size, uint64_t* offset)
+    {
+        if (size > 0 && fwrite(data, 1, size, file) != size) {
+            throw GeophileException("Unable to write MappedIndex file");
+        }
+        *offset += size;
+        // Align the next section
+        static const uint8_t PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        uint64_t padding = (8 - *offset % 8) % 8;
+        if (padding > 0 && fwrite(PADDING, 1, padding, file) != padding) {
+            throw GeophileException("Unable to write MappedIndex file");
+        }
+        *offset += padding;
+    }
+
+    template <class SOR>
+    int32_t MappedIndex<SOR>::objectRecordCompare(const void* x, const void* y)
+    {
+        const ObjectRecord* r = (const ObjectRecord*) x;
+        const ObjectRecord* s = (const ObjectRecord*) y;
+        return
+            r->soid < s->soid ? -1 :
+            r->soid > s->soid ? 1 :
+            r->record < s->record ? -1 :
+            r->record > s->record ? 1 : 0;
+    }
+
+    template <class SOR>
+    Record<SOR> MappedIndexCursor<SOR>::next()
+    {
+        return neighbor(true);
+    }
+
+    template <class SOR>
+    Record<SOR> MappedIndexCursor<SOR>::previous()
+    {
+        return neighbor(false);
+    }
+
+    template <class SOR>
+    void MappedIndexCursor<SOR>::goTo(const SpatialObjectKey& key)
+    {
+        _start_at = key;
+        this->state(NEVER_USED);
+    }
+
+    template <class SOR>
+    void MappedIndexCursor<SOR>::skipTo(const SpatialObjectKey& key)
+    {
+        if (this->state() == IN_USE && _forward) {
+            _position = _mapped_index.forwardPosition(key, _position);
+            _start_at = key;
+        } else {
+            goTo(key);
+        }
+    }
+
+    template <class SOR>
+    MappedIndexCursor<SOR>::MappedIndexCursor(MappedIndex<SOR>& mapped_index)
+        : _mapped_index(mapped_index),
+          _position(0),
+          _start_at(),
+          _forward(true)
+    {}
+
+    template <class SOR>
+    Record<SOR> MappedIndexCursor<SOR>::neighbor(int32_t forward_move)
+    {
+        switch (this->state()) {
+            case NEVER_USED:
+                startIteration(forward_move, true);
+                break;
+            case IN_USE:
+                if (forward_move != _forward) {
+                    startIteration(forward_move, false);
+                }
+                break;
+            case DONE:
+                GEOPHILE_ASSERT(this->current().eof());
+                return this->current();
+        }
+        if (_position >= 0 && _position < (int64_t) _mapped_index.nRecords()) {
+            const SpatialObjectKey& key = _mapped_index.key(_position);
+            this->current(key.z(), _mapped_index.spatialObjectReference(_position));
+            this->state(IN_USE);
+            _start_at = key;
+            _position += forward_move ? 1 : -1;
+        } else {
+            this->close();
+        }
+        _forward = forward_move;
+        return this->current();
+    }
+
+    template <class SOR>
+    void MappedIndexCursor<SOR>::startIteration(int32_t forward_move, int32_t include_start_key)
+    {
+        _position =
+            forward_move
+            ? _mapped_index.search(_start_at, include_start_key)
+            : (int64_t) _mapped_index.search(_start_at, !include_start_key) - 1;
+    }
+}
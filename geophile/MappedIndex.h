@@ -0,0 +1,172 @@
+#ifndef _MAPPED_INDEX_H
+#define _MAPPED_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include "OrderedIndex.h"
+#include "Record.h"
+#include "Cursor.h"
+#include "SpatialObjectKey.h"
+#include "SpatialObjectTypes.h"
+
+namespace geophile
+{
+    template <class SOR> class MappedIndexCursor;
+    template <class SOR> class SessionMemory;
+    template <class SOR> class SpatialObjectReferenceManager;
+    class SpatialObject;
+    class SpatialObjectTypes;
+
+    /*
+     * A read-only OrderedIndex stored in a file, and accessed through
+     * mmap. write saves the contents of any frozen OrderedIndex in
+     * this format, and a MappedIndex opens the file. Nothing is read
+     * or deserialized when the file is opened, so startup time
+     * doesn't depend on the size of the index. Pages are read as
+     * retrieval touches them.
+     *
+     * File format (version FORMAT_VERSION), in native byte order,
+     * each section aligned to 8 bytes:
+     *     Header
+     *     keys: The SpatialObjectKey of each record, in key order.
+     *         The keys are divided into blocks of BLOCK_SIZE keys.
+     *     objects: For each record, the number of its SpatialObject.
+     *         Objects are numbered in order of id.
+     *     fences: The first key of each block. A search
+     *         bisects the fences, (a small array that stays
+     *         cached), and then one block of keys.
+     *     payloads: Each SpatialObject, serialized once, as its type id
+     *         followed by the output of SpatialObject::writeTo.
+     *     payload offsets: n_objects + 1 offsets of the payloads,
+     *         relative to the start of the payloads section.
+     *
+     * A SpatialObject is deserialized the first time a Cursor
+     * returns one of its records, and is kept, (and owned), by the
+     * MappedIndex until it is destroyed. SORs are created by the
+     * SpatialObjectReferenceManager each time a record is returned,
+     * so the manager should not copy the SpatialObject, (e.g.
+     * InMemorySpatialObjectReferenceManager, or
+     * InlineSpatialObjectReferenceManager).
+     *
+     * add, remove and load throw GeophileException. Any number of
+     * threads can search a MappedIndex concurrently, each using its
+     * own Cursor.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class MappedIndex : public OrderedIndex<SOR>
+    {
+    public:
+        // OrderedIndex
+        virtual void add(Z z, const SOR& sor);
+        virtual SOR remove(Z z, int64_t soid);
+        virtual void freeze();
+        virtual void load(const Record<SOR>* records, uint32_t n);
+        virtual Cursor<SOR>* cursor();
+        virtual uint64_t zLengths() const;
+        virtual ~MappedIndex();
+
+        // MappedIndex
+        uint64_t nRecords() const;
+        // Writes the records of index, which must be frozen, to a file, in
+        // the format read by MappedIndex.
+        static void write(OrderedIndex<SOR>* index, const char* path);
+        // Opens the file at path, created by write. Throws GeophileException
+        // if the file can't be mapped, or isn't in the expected format.
+        MappedIndex(const SpatialObjectTypes* spatial_object_types,
+                    const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                    SessionMemory<SOR>* memory,
+                    const char* path);
+
+    public:
+        static const uint64_t MAGIC = 0x58444e4948504f47ULL; // "GOPHINDX"
+        static const uint32_t FORMAT_VERSION = 1;
+        // 4KB of keys
+        static const uint32_t BLOCK_SIZE = 256;
+
+    private:
+        struct Header
+        {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t block_size;
+            uint64_t n_records;
+            uint64_t n_objects;
+            uint64_t n_blocks;
+            // Bit i is set if a record's z-value has length i.
+            uint64_t z_lengths;
+            uint64_t keys_offset;
+            uint64_t objects_offset;
+            uint64_t fences_offset;
+            uint64_t payloads_offset;
+            uint64_t payload_offsets_offset;
+            uint64_t file_size;
+        };
+
+        // Used by write to number the SpatialObjects.
+        struct ObjectRecord
+        {
+            int64_t soid;
+            uint64_t record;
+        };
+
+    private:
+        // First position with a key >= key (include_key) or > key
+        // (!include_key).
+        uint64_t search(const SpatialObjectKey& key, int32_t include_key) const;
+        // First position >= start with a key >= key.
+        uint64_t forwardPosition(const SpatialObjectKey& key, uint64_t start) const;
+        const SpatialObjectKey& key(uint64_t position) const;
+        SOR spatialObjectReference(uint64_t position) const;
+        SpatialObject* deserialize(uint32_t object) const;
+        static void writeSection(FILE* file, const void* data, uint64_t size, uint64_t* offset);
+        // True if n elements of element_size bytes, starting at offset, end by
+        // end, (without overflow), and offset is 8-byte aligned.
+        static bool sectionFits(uint64_t offset, uint64_t n, uint64_t element_size, uint64_t end);
+        static int32_t objectRecordCompare(const void* x, const void* y);
+
+    private:
+        int _fd;
+        const uint8_t* _mapping;
+        uint64_t _size;
+        const Header* _header;
+        const SpatialObjectKey* _keys;
+        const uint32_t* _objects;
+        const SpatialObjectKey* _fences;
+        const uint8_t* _payloads;
+        const uint64_t* _payload_offsets;
+        // Deserialized SpatialObjects, indexed by object number. Allocated
+        // with calloc, so the pages of objects never touched aren't used.
+        std::atomic<SpatialObject*>* _spatial_objects;
+
+        template <class> friend class MappedIndexCursor;
+    };
+
+    template <class SOR>
+    class MappedIndexCursor : public Cursor<SOR>
+    {
+    public:
+        virtual Record<SOR> next();
+        virtual Record<SOR> previous();
+        virtual void goTo(const SpatialObjectKey& key);
+        virtual void skipTo(const SpatialObjectKey& key);
+        MappedIndexCursor(MappedIndex<SOR>& mapped_index);
+
+    private:
+        Record<SOR> neighbor(int32_t forward_move);
+        void startIteration(int32_t forward_move, int32_t include_start_key);
+
+    private:
+        MappedIndex<SOR>& _mapped_index;
+        // Position of the next record to be returned, moving in the direction
+        // of _forward.
+        int64_t _position;
+        SpatialObjectKey _start_at;
+        int32_t _forward;
+    };
+}
+
+// So that the functions can be instantiated
+#include "MappedIndex.cpp.h"
+
+#endif
@@ -0,0 +1,115 @@
+#include <math.h>
+#include "OccupancyMap.h"
+#include "util.h"
+
+using namespace geophile;
+
+void OccupancyMap::add(Z z)
+{
+    uint32_t length = z.length();
+    uint32_t max_level = length < _levels ? length : _levels;
+    for (uint32_t level = 0; level <= max_level; level++) {
+        set(_occupied, bit(z, level));
+    }
+    uint32_t max_count_level = length < _count_levels ? length : _count_levels;
+    for (uint32_t level = 0; level <= max_count_level; level++) {
+        _counts[bit(z, level)].fetch_add(1, std::memory_order_relaxed);
+    }
+    if (length < _levels) {
+        set(_exact, bit(z, length));
+        uint64_t length_bit = 1ULL << length;
+        if ((_exact_lengths.load(std::memory_order_relaxed) & length_bit) == 0) {
+            _exact_lengths.fetch_or(length_bit);
+        }
+    }
+}
+
+bool OccupancyMap::mayOverlap(Z z) const
+{
+    uint32_t length = z.length();
+    uint32_t level = length < _levels ? length : _levels;
+    if (isSet(_occupied, bit(z, level))) {
+        return true;
+    }
+    // Shorter z-values containing z
+    uint64_t exact_lengths = _exact_lengths.load() & ((1ULL << level) - 1);
+    while (exact_lengths != 0) {
+        uint32_t exact_length = __builtin_ctzll(exact_lengths);
+        exact_lengths &= exact_lengths - 1;
+        if (isSet(_exact, bit(z, exact_length))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double OccupancyMap::records(Z z) const
+{
+    uint32_t length = z.length();
+    if (length <= _count_levels) {
+        return _counts[bit(z, length)].load(std::memory_order_relaxed);
+    }
+    return ldexp(_counts[bit(z, _count_levels)].load(std::memory_order_relaxed),
+                 (int32_t) _count_levels - (int32_t) length);
+}
+
+void OccupancyMap::clear()
+{
+    for (uint64_t i = 0; i < _n_words; i++) {
+        _occupied[i].store(0, std::memory_order_relaxed);
+        _exact[i].store(0, std::memory_order_relaxed);
+    }
+    for (uint64_t i = 0; i < (2ULL << _count_levels) - 1; i++) {
+        _counts[i].store(0, std::memory_order_relaxed);
+    }
+    _exact_lengths.store(0);
+}
+
+uint32_t OccupancyMap::levels() const
+{
+    return _levels;
+}
+
+OccupancyMap::~OccupancyMap()
+{
+    delete [] _occupied;
+    delete [] _exact;
+    delete [] _counts;
+}
+
+OccupancyMap::OccupancyMap(uint32_t levels)
+    : _levels(levels),
+      _n_words(((2ULL << levels) - 1 + 63) / 64),
+      _occupied(NULL),
+      _exact(NULL),
+      _exact_lengths(0),
+      _count_levels(levels < MAX_COUNT_LEVELS ? levels : MAX_COUNT_LEVELS),
+      _counts(NULL)
+{
+    GEOPHILE_ASSERT(levels <= MAX_LEVELS);
+    _occupied = new std::atomic<uint64_t>[_n_words];
+    _exact = new std::atomic<uint64_t>[_n_words];
+    _counts = new std::atomic<uint32_t>[(2ULL << _count_levels) - 1];
+    clear();
+}
+
+uint64_t OccupancyMap::bit(Z z, uint32_t level)
+{
+    // The MSB of a z-value is unused, so the prefix of length 0 is 0.
+    uint64_t prefix = ((uint64_t) z.asInteger()) >> (63 - level);
+    return (1ULL << level) - 1 + prefix;
+}
+
+void OccupancyMap::set(std::atomic<uint64_t>* bits, uint64_t bit)
+{
+    std::atomic<uint64_t>& word = bits[bit / 64];
+    uint64_t mask = 1ULL << (bit % 64);
+    if ((word.load(std::memory_order_relaxed) & mask) == 0) {
+        word.fetch_or(mask);
+    }
+}
+
+bool OccupancyMap::isSet(const std::atomic<uint64_t>* bits, uint64_t bit)
+{
+    return (bits[bit / 64].load() & (1ULL << (bit % 64))) != 0;
+}
@@ -0,0 +1,75 @@
+#ifndef _OCCUPANCY_MAP_H
+#define _OCCUPANCY_MAP_H
+
+#include <stdint.h>
+#include <atomic>
+#include "Z.h"
+
+namespace geophile
+{
+    /*
+     * A hierarchical bitmap recording which z-value prefixes are
+     * occupied by the records of a SpatialIndex, so that a query
+     * z-value overlapping no record can be dropped without searching
+     * the index.
+     *
+     * Level l, 0 <= l <= levels, has a bit for each prefix of length l.
+     * Adding a z-value of length L sets the bit of each of its
+     * ancestors, (and itself), at levels up to min(L, levels). A
+     * z-value of length L < levels also sets an "exact" bit at level L,
+     * since a record with that z-value overlaps every z-value it
+     * contains, including those under unoccupied prefixes.
+     *
+     * A query z-value of length Q overlaps no record if its ancestor at
+     * level m = min(Q, levels) is unoccupied, and none of its shorter
+     * ancestors is an added z-value. The answer is conservative: Bits
+     * are never cleared, except by clear, so a removed z-value leaves
+     * its bits set until the map is rebuilt.
+     *
+     * add and mayOverlap can run concurrently. A bit is set before
+     * add returns, so a record added after its z-value's add is found.
+     *
+     * The map also counts the z-values added under each prefix, for
+     * levels up to min(levels, MAX_COUNT_LEVELS), so that data-aware
+     * decomposition, (Space::DATA_AWARE), can estimate the records in a
+     * query region. Like the bits, counts are only reset by clear.
+     */
+    class OccupancyMap
+    {
+    public:
+        void add(Z z);
+        // False only if no added z-value contains, or is contained by, z.
+        bool mayOverlap(Z z) const;
+        // Estimated number of added z-values at or below z, (in z's region).
+        // Below the counted levels, z-values are assumed to be evenly
+        // distributed. Shorter z-values containing z aren't counted.
+        double records(Z z) const;
+        void clear();
+        uint32_t levels() const;
+        ~OccupancyMap();
+        OccupancyMap(uint32_t levels);
+
+    public:
+        static const uint32_t MAX_LEVELS = 24;
+        static const uint32_t MAX_COUNT_LEVELS = 12;
+
+    private:
+        static uint64_t bit(Z z, uint32_t level);
+        static void set(std::atomic<uint64_t>* bits, uint64_t bit);
+        static bool isSet(const std::atomic<uint64_t>* bits, uint64_t bit);
+
+    private:
+        const uint32_t _levels;
+        const uint64_t _n_words;
+        // Bit (1 << l) - 1 + p is for the prefix p of length l.
+        std::atomic<uint64_t>* _occupied;
+        std::atomic<uint64_t>* _exact;
+        // Bit l is set if a z-value of length l < _levels has been added.
+        std::atomic<uint64_t> _exact_lengths;
+        const uint32_t _count_levels;
+        // Indexed like the bits, for levels up to _count_levels.
+        std::atomic<uint32_t>* _counts;
+    };
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define _ORDERED_INDEX_H
 
 #include "Z.h"
+#include "Record.h"
 #include "SpatialObjectTypes.h"
 #include "ByteBuffer.h"
 #include "ByteBufferOverflowException.h"
@@ -26,6 +27,12 @@ namespace geophile
      * Before an OrderedIndex can be used for retrieval, freeze() must
      * be called. Then, access to OrderedIndex contents is
      * accomplished using a Cursor, obtained by cursor().
+     *
+     * Once frozen, and as long as there are no further calls to add
+     * or remove, an OrderedIndex must support concurrent retrieval:
+     * cursor() may be called from several threads, and each
+     * thread's Cursor used independently. State shared with writers,
+     * such as _memory, must only be used by add and remove.
      */
     template <class SOR> // SOR: Spatial Object Reference
         class OrderedIndex
@@ -49,11 +56,37 @@ namespace geophile
          * freeze, and add/remove may work after the call..
          */
         virtual void freeze() = 0;
+        /*
+         * Adds n records, which must be sorted by key, and prepares
+         * the index for retrievals, as freeze does. This is how
+         * SpatialIndex::load builds an index. An implementation can
+         * take advantage of the ordering, e.g. by building its
+         * structure directly, without searching. The default adds
+         * the records one at a time, and then calls freeze.
+         */
+        virtual void load(const Record<SOR>* records, uint32_t n)
+        {
+            for (uint32_t i = 0; i < n; i++) {
+                add(records[i].key().z(), records[i].spatialObjectReference());
+            }
+            freeze();
+        }
         /*
          * Return a Cursor object, which can be used for retrieval
          * from this OrderedIndex..
          */
         virtual Cursor<SOR>* cursor() = 0;
+        /*
+         * Bit i is set if the index may contain records with
+         * z-values of length i that were not added through a
+         * SpatialIndex, (which keeps track of the lengths it adds),
+         * e.g. records of an index read from a file. The default,
+         * for an index that starts out empty, is 0.
+         */
+        virtual uint64_t zLengths() const
+        {
+            return 0;
+        }
         /*
          * Destructor
          */
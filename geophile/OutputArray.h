@@ -64,7 +64,7 @@ namespace geophile
             }
         }
 
-    private:
+    protected:
         SOR* _contents;
     };
 }
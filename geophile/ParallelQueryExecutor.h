@@ -0,0 +1,301 @@
+#ifndef _PARALLEL_QUERY_EXECUTOR_H
+#define _PARALLEL_QUERY_EXECUTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "SessionMemory.h"
+#include "SpatialIndex.h"
+#include "PartitionedOutputArray.h"
+#include "WorkStealingDeque.h"
+#include "GeophileException.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR> class SpatialIndex;
+    class SpatialIndexFilter;
+    class SpatialObject;
+
+    /*
+     * A ParallelQueryExecutor evaluates a batch of queries against a
+     * frozen SpatialIndex using several threads. The batch is cut
+     * into tasks, each a run of consecutive queries, which are
+     * evaluated using SpatialIndex::findOverlappingBatch. Each thread
+     * has its own SessionMemory, and its own deque of tasks. A
+     * thread that runs out of tasks steals from the other threads,
+     * so threads that get cheap queries don't sit idle while others
+     * work through expensive ones.
+     *
+     * Each thread keeps the results of the tasks it evaluated. Once
+     * all tasks are done, the length of each query's output is known,
+     * and the threads copy their results directly into their
+     * queries' partitions of the output, in parallel.
+     *
+     * The SpatialIndex must not be modified while a batch is being
+     * evaluated.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class ParallelQueryExecutor
+    {
+    public:
+        /*
+         * Find, for each of n_queries query objects, all the
+         * SpatialObjects in the SpatialIndex that overlap it. False
+         * positives are removed by the filter, which must be safe to
+         * call from several threads at once. The results are
+         * returned in output, in which partition q contains the
+         * output for query_objects[q], as for
+         * SpatialIndex::findOverlappingBatch. If evaluation of a
+         * query throws, the remaining tasks are abandoned, and once
+         * all threads have finished, GeophileException is thrown,
+         * with the message of the first failure.
+         */
+        void findOverlapping(const SpatialObject* const* query_objects,
+                             uint32_t n_queries,
+                             const SpatialIndexFilter* filter,
+                             PartitionedOutputArray<SOR>* output)
+        {
+            _query_objects = query_objects;
+            _n_queries = n_queries;
+            _filter = filter;
+            _failed.store(false);
+            if (n_queries > _lengths_capacity) {
+                delete [] _lengths;
+                _lengths_capacity = n_queries;
+                _lengths = new uint32_t[_lengths_capacity];
+            }
+            _queries_per_task = _task_size;
+            if (_queries_per_task == 0) {
+                _queries_per_task = n_queries / (_n_threads * TASKS_PER_THREAD);
+                if (_queries_per_task == 0) {
+                    _queries_per_task = 1;
+                }
+            }
+            // Deal out contiguous runs of tasks, so that each thread
+            // starts on a different part of the batch.
+            uint32_t n_tasks = (n_queries + _queries_per_task - 1) / _queries_per_task;
+            for (uint32_t t = 0; t < _n_threads; t++) {
+                Worker* worker = &_workers[t];
+                worker->tasks.clear();
+                uint32_t first = (uint32_t) (((uint64_t) n_tasks * t) / _n_threads);
+                uint32_t last = (uint32_t) (((uint64_t) n_tasks * (t + 1)) / _n_threads);
+                for (uint32_t task = first; task < last; task++) {
+                    worker->tasks.push(task);
+                }
+                worker->results.clear();
+                worker->evaluated.clear();
+                delete worker->failure;
+                worker->failure = NULL;
+            }
+            // If a thread couldn't be started, the threads that did
+            // start steal its tasks, so the results are still complete.
+            uint32_t n_started = runWorkers(evaluateTasks);
+            if (n_started == 0) {
+                throw GeophileException("Unable to create query threads");
+            }
+            for (uint32_t t = 0; t < n_started; t++) {
+                if (_workers[t].failure) {
+                    throw GeophileException(*_workers[t].failure);
+                }
+            }
+            // Each query was evaluated by one thread, so its partition
+            // of output is a run of that thread's results.
+            output->start(n_queries, _lengths);
+            _output = output;
+            n_started = runWorkers(copyResults);
+            for (uint32_t t = n_started; t < _n_threads; t++) {
+                copyResults(&_workers[t]);
+            }
+            _output = NULL;
+        }
+
+        /*
+         * Destructor
+         */
+        ~ParallelQueryExecutor()
+        {
+            for (uint32_t t = 0; t < _n_threads; t++) {
+                delete _workers[t].failure;
+            }
+            delete [] _workers;
+            delete [] _lengths;
+        }
+
+        /*
+         * Constructor.
+         *     spatial_index: The SpatialIndex to be searched.
+         *     n_threads: Number of threads evaluating queries.
+         *     queries_per_task: Number of queries in each task. 0
+         *         chooses a task size giving each thread
+         *         TASKS_PER_THREAD tasks.
+         */
+        ParallelQueryExecutor(const SpatialIndex<SOR>* spatial_index,
+                              uint32_t n_threads,
+                              uint32_t queries_per_task = 0)
+            : _spatial_index(spatial_index),
+              _n_threads(n_threads),
+              _task_size(queries_per_task),
+              _workers(NULL),
+              _query_objects(NULL),
+              _n_queries(0),
+              _filter(NULL),
+              _queries_per_task(0),
+              _lengths_capacity(0),
+              _lengths(NULL),
+              _output(NULL),
+              _failed(false)
+        {
+            GEOPHILE_ASSERT(n_threads > 0);
+            _workers = new Worker[n_threads];
+            for (uint32_t t = 0; t < n_threads; t++) {
+                _workers[t].executor = this;
+                _workers[t].id = t;
+                _workers[t].failure = NULL;
+            }
+        }
+
+    public:
+        static const uint32_t TASKS_PER_THREAD = 16;
+
+    private:
+        struct Worker
+        {
+            ParallelQueryExecutor<SOR>* executor;
+            uint32_t id;
+            pthread_t thread;
+            WorkStealingDeque tasks;
+            SessionMemory<SOR> memory;
+            // Results of the tasks evaluated, in the order evaluated, and
+            // in query order within each task.
+            OutputArray<SOR> results;
+            OutputArray<uint32_t> evaluated;
+            // Set if evaluation threw, and rethrown by findOverlapping.
+            GeophileException* failure;
+        };
+
+        // Runs function on a thread per worker, and waits for the threads
+        // to finish. Returns the number of threads started, (the first
+        // workers).
+        uint32_t runWorkers(void* (*function)(void*))
+        {
+            uint32_t n_started = 0;
+            while (n_started < _n_threads &&
+                   pthread_create(&_workers[n_started].thread, NULL, function, &_workers[n_started]) == 0) {
+                n_started++;
+            }
+            for (uint32_t t = 0; t < n_started; t++) {
+                pthread_join(_workers[t].thread, NULL);
+            }
+            return n_started;
+        }
+
+        static void* evaluateTasks(void* arg)
+        {
+            Worker* worker = (Worker*) arg;
+            ParallelQueryExecutor<SOR>* executor = worker->executor;
+            // An exception must not escape the thread, (std::terminate).
+            try {
+                uint32_t task;
+                while (executor->nextTask(worker, &task)) {
+                    executor->evaluate(worker, task);
+                }
+            } catch (const std::exception& e) {
+                worker->failure = new GeophileException(e.what());
+                executor->_failed.store(true);
+            } catch (...) {
+                worker->failure = new GeophileException("Query evaluation failed");
+                executor->_failed.store(true);
+            }
+            return NULL;
+        }
+
+        static void* copyResults(void* arg)
+        {
+            Worker* worker = (Worker*) arg;
+            ParallelQueryExecutor<SOR>* executor = worker->executor;
+            uint32_t position = 0;
+            for (uint32_t t = 0; t < worker->evaluated.length(); t++) {
+                uint32_t first;
+                uint32_t n;
+                executor->taskQueries(worker->evaluated.at(t), &first, &n);
+                for (uint32_t q = first; q < first + n; q++) {
+                    uint32_t length = executor->_lengths[q];
+                    for (uint32_t i = 0; i < length; i++) {
+                        executor->_output->set(q, i, worker->results.at(position++));
+                    }
+                }
+            }
+            return NULL;
+        }
+
+        bool nextTask(Worker* worker, uint32_t* task)
+        {
+            if (_failed.load()) {
+                return false;
+            }
+            if (worker->tasks.take(task)) {
+                return true;
+            }
+            // Tasks are never added once the threads start, so one
+            // unsuccessful pass over the victims means all the work
+            // has been claimed.
+            for (uint32_t i = 1; i < _n_threads; i++) {
+                Worker* victim = &_workers[(worker->id + i) % _n_threads];
+                if (victim->tasks.steal(task)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Queries first .. first + n - 1 make up the task.
+        void taskQueries(uint32_t task, uint32_t* first, uint32_t* n) const
+        {
+            *first = task * _queries_per_task;
+            *n = _queries_per_task;
+            if (*first + *n > _n_queries) {
+                *n = _n_queries - *first;
+            }
+        }
+
+        void evaluate(Worker* worker, uint32_t task)
+        {
+            uint32_t first;
+            uint32_t n;
+            taskQueries(task, &first, &n);
+            _spatial_index->findOverlappingBatch(_query_objects + first,
+                                                 n,
+                                                 _filter,
+                                                 &worker->memory);
+            const PartitionedOutputArray<SOR>* batch_output = worker->memory.batchOutput();
+            for (uint32_t q = 0; q < n; q++) {
+                uint32_t length = batch_output->partitionLength(q);
+                for (uint32_t i = 0; i < length; i++) {
+                    worker->results.append(batch_output->at(q, i));
+                }
+                _lengths[first + q] = length;
+            }
+            worker->evaluated.append(task);
+        }
+
+    private:
+        const SpatialIndex<SOR>* _spatial_index;
+        uint32_t _n_threads;
+        uint32_t _task_size;
+        Worker* _workers;
+        // State of the batch being evaluated
+        const SpatialObject* const* _query_objects;
+        uint32_t _n_queries;
+        const SpatialIndexFilter* _filter;
+        uint32_t _queries_per_task;
+        uint32_t _lengths_capacity;
+        // _lengths[q] is the length of query q's output.
+        uint32_t* _lengths;
+        PartitionedOutputArray<SOR>* _output;
+        // Set when a thread fails, so that the others stop.
+        std::atomic<bool> _failed;
+    };
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef _PARTITIONED_OUTPUT_ARRAY_H
+#define _PARTITIONED_OUTPUT_ARRAY_H
+
+#include <stdint.h>
+#include <string.h>
+#include "OutputArray.h"
+#include "util.h"
+
+namespace geophile
+{
+    /*
+     * A PartitionedOutputArray accumulates the output of a batch of
+     * retrievals, e.g. from SpatialIndex::findOverlappingBatch. The
+     * output of each retrieval goes to its own partition. Output can
+     * arrive for the partitions in any order. Once the array is
+     * closed, the contents are grouped by partition, so that
+     * OutputArray::at(position) runs through partition 0, then
+     * partition 1, etc.
+     */
+    template <class SOR> class PartitionedOutputArray : public OutputArray<SOR>
+    {
+    public:
+        /*
+         * Returns the number of partitions.
+         */
+        uint32_t partitions() const
+        {
+            return _n_partitions;
+        }
+
+        /*
+         * Returns the number of elements in the given partition.
+         */
+        uint32_t partitionLength(uint32_t partition) const
+        {
+            GEOPHILE_ASSERT(_closed);
+            GEOPHILE_ASSERT(partition < _n_partitions);
+            return _boundaries[partition + 1] - _boundaries[partition];
+        }
+
+        /*
+         * Returns the element at the given position of the given partition.
+         */
+        SOR at(uint32_t partition, uint32_t position) const
+        {
+            GEOPHILE_ASSERT(position < partitionLength(partition));
+            return OutputArray<SOR>::at(_boundaries[partition] + position);
+        }
+
+        using OutputArray<SOR>::at;
+
+    public: // Used internally and in testing
+        /*
+         * Discards the contents and prepares for output to
+         * n_partitions partitions.
+         */
+        void start(uint32_t n_partitions)
+        {
+            this->clear();
+            _partition_ids.clear();
+            if (n_partitions + 1 > _boundaries_capacity) {
+                delete [] _boundaries;
+                _boundaries_capacity = n_partitions + 1;
+                _boundaries = new uint32_t[_boundaries_capacity];
+            }
+            _n_partitions = n_partitions;
+            _closed = false;
+        }
+
+        void append(uint32_t partition, SOR sor)
+        {
+            GEOPHILE_ASSERT(!_closed);
+            GEOPHILE_ASSERT(partition < _n_partitions);
+            OutputArray<SOR>::append(sor);
+            _partition_ids.append(partition);
+        }
+
+        /*
+         * Discards the contents and prepares for output to
+         * n_partitions partitions, where partition p will contain
+         * lengths[p] elements. The array is then closed, and its
+         * contents are filled in by set, (which can be called by
+         * several threads at once, for different positions).
+         */
+        void start(uint32_t n_partitions, const uint32_t* lengths)
+        {
+            start(n_partitions);
+            _boundaries[0] = 0;
+            for (uint32_t p = 0; p < n_partitions; p++) {
+                _boundaries[p + 1] = _boundaries[p] + lengths[p];
+            }
+            uint32_t n = _boundaries[n_partitions];
+            if (n > this->_capacity) {
+                delete [] this->_contents;
+                this->_capacity = n;
+                this->_contents = new SOR[n];
+            }
+            this->_n = n;
+            _closed = true;
+        }
+
+        void set(uint32_t partition, uint32_t position, SOR sor)
+        {
+            GEOPHILE_ASSERT(position < partitionLength(partition));
+            this->_contents[_boundaries[partition] + position] = sor;
+        }
+
+        /*
+         * Groups the contents by partition, (a counting sort, which
+         * preserves the order of output within each partition).
+         */
+        void close()
+        {
+            GEOPHILE_ASSERT(!_closed);
+            uint32_t n = this->_n;
+            memset(_boundaries, 0, (_n_partitions + 1) * sizeof(uint32_t));
+            for (uint32_t i = 0; i < n; i++) {
+                _boundaries[_partition_ids.at(i) + 1]++;
+            }
+            for (uint32_t p = 0; p < _n_partitions; p++) {
+                _boundaries[p + 1] += _boundaries[p];
+            }
+            SOR* sorted = new SOR[this->_capacity];
+            uint32_t* next = new uint32_t[_n_partitions + 1];
+            memcpy(next, _boundaries, (_n_partitions + 1) * sizeof(uint32_t));
+            for (uint32_t i = 0; i < n; i++) {
+                sorted[next[_partition_ids.at(i)]++] = this->_contents[i];
+            }
+            delete [] next;
+            delete [] this->_contents;
+            this->_contents = sorted;
+            _closed = true;
+        }
+
+        virtual ~PartitionedOutputArray()
+        {
+            delete [] _boundaries;
+        }
+
+        PartitionedOutputArray()
+            : OutputArray<SOR>(),
+              _n_partitions(0),
+              _boundaries_capacity(1),
+              _boundaries(new uint32_t[1]),
+              _closed(true)
+        {
+            _boundaries[0] = 0;
+        }
+
+    private:
+        uint32_t _n_partitions;
+        uint32_t _boundaries_capacity;
+        // Partition p occupies positions [_boundaries[p], _boundaries[p + 1]).
+        uint32_t* _boundaries;
+        OutputArray<uint32_t> _partition_ids;
+        int32_t _closed;
+    };
+}
+
+#endif
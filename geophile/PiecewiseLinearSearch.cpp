@@ -0,0 +1,169 @@
+#include <string.h>
+#include "PiecewiseLinearSearch.h"
+#include "util.h"
+
+using namespace geophile;
+
+void PiecewiseLinearSearch::build(const SpatialObjectKey* keys, uint32_t n)
+{
+    clear();
+    _n = n;
+    uint32_t i = 0;
+    while (i < n) {
+        // Keys [i, end) have the same z-value.
+        int64_t z = keys[i].z().asInteger();
+        uint32_t end = i + 1;
+        while (end < n && keys[end].z().asInteger() == z) {
+            end++;
+        }
+        fit(z, i);
+        fit(z + 1, end);
+        i = end;
+    }
+    if (_n_knots > 0 && _last_z != _knots[_n_knots - 1].z) {
+        addKnot(_last_z, _last_position);
+    }
+}
+
+void PiecewiseLinearSearch::clear()
+{
+    _n = 0;
+    _n_knots = 0;
+}
+
+uint32_t PiecewiseLinearSearch::size() const
+{
+    return _n;
+}
+
+void PiecewiseLinearSearch::range(const SpatialObjectKey& key,
+                                  int32_t include_key,
+                                  uint32_t* lo,
+                                  uint32_t* hi) const
+{
+    // The answer is between the first key with z-value >= z, and the first
+    // with z-value > z. The extra position on each side absorbs rounding.
+    int64_t z = key.z().asInteger();
+    double window = _max_error + 1;
+    double first = predict(z) - window;
+    double last = predict(z + 1) + window;
+    *lo = first <= 0 ? 0 : first >= _n ? _n : (uint32_t) first;
+    *hi = last <= 0 ? 0 : last >= _n ? _n : (uint32_t) last + 1;
+    if (*hi > _n) {
+        *hi = _n;
+    }
+}
+
+PiecewiseLinearSearch::~PiecewiseLinearSearch()
+{
+    delete [] _knots;
+}
+
+uint32_t PiecewiseLinearSearch::nSegments() const
+{
+    return _n_knots == 0 ? 0 : _n_knots - 1;
+}
+
+uint64_t PiecewiseLinearSearch::modelSize() const
+{
+    return _n_knots * sizeof(Knot);
+}
+
+PiecewiseLinearSearch::PiecewiseLinearSearch(uint32_t max_error)
+    : _max_error(max_error),
+      _n(0),
+      _knots(new Knot[INITIAL_CAPACITY]),
+      _n_knots(0),
+      _capacity(INITIAL_CAPACITY),
+      _last_z(0),
+      _last_position(0),
+      _upper_slope(0),
+      _lower_slope(0)
+{}
+
+void PiecewiseLinearSearch::fit(int64_t z, double position)
+{
+    if (_n_knots == 0) {
+        addKnot(z, position);
+        _last_z = z;
+        _last_position = position;
+        return;
+    }
+    if (z <= _last_z) {
+        // The corner past a z-value coincides with the next z-value.
+        GEOPHILE_ASSERT(z == _last_z && position == _last_position);
+        return;
+    }
+    const Knot* knot = &_knots[_n_knots - 1];
+    double error = _max_error;
+    if (_last_z == knot->z) {
+        // First point since the knot
+        double dz = (double) (z - knot->z);
+        _upper_slope = (position + error - knot->position) / dz;
+        _lower_slope = (position - error - knot->position) / dz;
+    } else {
+        double dz = (double) (z - knot->z);
+        double slope = (position - knot->position) / dz;
+        if (slope > _upper_slope || slope < _lower_slope) {
+            // The line from the knot to this point would be too far from
+            // an earlier point, so end the segment at the previous point.
+            addKnot(_last_z, _last_position);
+            knot = &_knots[_n_knots - 1];
+            dz = (double) (z - knot->z);
+            _upper_slope = (position + error - knot->position) / dz;
+            _lower_slope = (position - error - knot->position) / dz;
+        } else {
+            double upper = (position + error - knot->position) / dz;
+            double lower = (position - error - knot->position) / dz;
+            if (upper < _upper_slope) {
+                _upper_slope = upper;
+            }
+            if (lower > _lower_slope) {
+                _lower_slope = lower;
+            }
+        }
+    }
+    _last_z = z;
+    _last_position = position;
+}
+
+void PiecewiseLinearSearch::addKnot(int64_t z, double position)
+{
+    if (_n_knots == _capacity) {
+        uint32_t new_capacity = _capacity * 2;
+        Knot* new_knots = new Knot[new_capacity];
+        memcpy(new_knots, _knots, _n_knots * sizeof(Knot));
+        delete [] _knots;
+        _knots = new_knots;
+        _capacity = new_capacity;
+    }
+    Knot* knot = &_knots[_n_knots];
+    knot->z = z;
+    knot->position = position;
+    knot->slope = 0;
+    if (_n_knots > 0) {
+        Knot* previous = &_knots[_n_knots - 1];
+        previous->slope = (position - previous->position) / (double) (z - previous->z);
+    }
+    _n_knots++;
+}
+
+double PiecewiseLinearSearch::predict(int64_t z) const
+{
+    if (_n_knots == 0 || z <= _knots[0].z) {
+        return 0;
+    }
+    // Find the last knot <= z. After the last knot, the slope is 0.
+    uint32_t lo = 0;
+    uint32_t hi = _n_knots - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (_knots[mid].z <= z) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    const Knot* knot = &_knots[lo];
+    return knot->position + (double) (z - knot->z) * knot->slope;
+}
@@ -0,0 +1,87 @@
+#ifndef _PIECEWISE_LINEAR_SEARCH_H
+#define _PIECEWISE_LINEAR_SEARCH_H
+
+#include <stdint.h>
+#include "KeySearch.h"
+#include "SpatialObjectKey.h"
+
+namespace geophile
+{
+    /*
+     * A KeySearch that models the distribution of z-values, (a
+     * learned index). The model is a piecewise linear function from
+     * z-value to position, built by a greedy spline corridor, as in
+     * RadixSpline: Segments are extended until a key would be more
+     * than max_error positions from the line, so the model's size
+     * depends on how smooth the distribution is, not on the number of
+     * keys.
+     *
+     * The function models, for each z-value z, the position of the
+     * first key whose z-value is >= z. It is fitted at both corners of
+     * each step of that function, (at each distinct z-value, and just
+     * past it), so the error bound holds for any z-value, present or
+     * not. range evaluates the model at z and just past z, returning
+     * a window of about 2 * max_error positions, plus the records
+     * whose keys have z-value z.
+     *
+     * A search bisects the segments, (a few KB for smooth data, so
+     * they stay cached), and evaluates one.
+     */
+    class PiecewiseLinearSearch : public KeySearch
+    {
+    public:
+        // KeySearch
+        virtual void build(const SpatialObjectKey* keys, uint32_t n);
+        virtual void clear();
+        virtual uint32_t size() const;
+        virtual void range(const SpatialObjectKey& key,
+                           int32_t include_key,
+                           uint32_t* lo,
+                           uint32_t* hi) const;
+        virtual ~PiecewiseLinearSearch();
+
+        // PiecewiseLinearSearch
+        uint32_t nSegments() const;
+        // Bytes used by the model
+        uint64_t modelSize() const;
+        PiecewiseLinearSearch(uint32_t max_error = DEFAULT_MAX_ERROR);
+
+    public:
+        static const uint32_t DEFAULT_MAX_ERROR = 32;
+
+    private:
+        // A segment starts at each knot, and ends at the next one.
+        struct Knot
+        {
+            int64_t z;
+            double position;
+            double slope;
+        };
+
+    private:
+        // Adds the point (z, position) to the spline.
+        void fit(int64_t z, double position);
+        void addKnot(int64_t z, double position);
+        // Estimate of the position of the first key with z-value >= z.
+        double predict(int64_t z) const;
+
+    private:
+        static const uint32_t INITIAL_CAPACITY = 64;
+
+    private:
+        uint32_t _max_error;
+        uint32_t _n;
+        Knot* _knots;
+        uint32_t _n_knots;
+        uint32_t _capacity;
+        // State of the spline fit, used by build: The last knot, the last
+        // point, and the range of slopes from the last knot that keep every
+        // point since it within _max_error of the line.
+        int64_t _last_z;
+        double _last_position;
+        double _upper_slope;
+        double _lower_slope;
+    };
+}
+
+#endif
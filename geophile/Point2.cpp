@@ -91,6 +91,11 @@ void Point2::copyFrom(const SpatialObject* spatial_object)
     _y = point->_y;
 }
 
+int32_t Point2::isPoint() const
+{
+    return true;
+}
+
 bool Point2::isNull() const
 {
     return isnan(_x);
@@ -23,6 +23,7 @@ namespace geophile
         virtual void copyFrom(const SpatialObject* spatial_object);
         virtual bool isNull() const;
         virtual void setNull();
+        virtual int32_t isPoint() const;
 
     public: // SpatialObject reference interface
         int64_t spatialObjectId() const;
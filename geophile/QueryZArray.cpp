@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+#include "QueryZArray.h"
+#include "util.h"
+
+using namespace geophile;
+
+Z QueryZArray::at(uint32_t i) const
+{
+    GEOPHILE_ASSERT(i < _n);
+    return _query_z[i].z;
+}
+
+uint32_t QueryZArray::query(uint32_t i) const
+{
+    GEOPHILE_ASSERT(i < _n);
+    return _query_z[i].query;
+}
+
+int32_t QueryZArray::interior(uint32_t i) const
+{
+    GEOPHILE_ASSERT(i < _n);
+    return _query_z[i].interior;
+}
+
+void QueryZArray::append(Z z, uint32_t query, int32_t interior)
+{
+    ensureSpace();
+    _query_z[_n].z = z;
+    _query_z[_n].query = query;
+    _query_z[_n].interior = interior;
+    _n++;
+}
+
+uint32_t QueryZArray::length() const
+{
+    return _n;
+}
+
+void QueryZArray::sort()
+{
+    qsort(_query_z, _n, sizeof(QueryZ), queryZCompare);
+}
+
+void QueryZArray::clear()
+{
+    _n = 0;
+}
+
+QueryZArray::~QueryZArray()
+{
+    delete [] _query_z;
+}
+
+QueryZArray::QueryZArray()
+    : _capacity(INITIAL_CAPACITY),
+      _n(0),
+      _query_z(new QueryZ[INITIAL_CAPACITY])
+{}
+
+void QueryZArray::ensureSpace()
+{
+    GEOPHILE_ASSERT(_n <= _capacity);
+    if (_n == _capacity) {
+        uint32_t new_capacity = _capacity * 2;
+        QueryZ* new_query_z = new QueryZ[new_capacity];
+        memcpy(new_query_z, _query_z, _capacity * sizeof(QueryZ));
+        delete [] _query_z;
+        _query_z = new_query_z;
+        _capacity = new_capacity;
+    }
+    GEOPHILE_ASSERT(_n < _capacity);
+}
+
+int32_t QueryZArray::queryZCompare(const void* x, const void* y)
+{
+    const QueryZ* a = (const QueryZ*) x;
+    const QueryZ* b = (const QueryZ*) y;
+    return 
+        a->z < b->z ? -1 : 
+        a->z > b->z ? 1 : 
+        a->query < b->query ? -1 :
+        a->query > b->query ? 1 : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _QUERY_Z_ARRAY_H
+#define _QUERY_Z_ARRAY_H
+
+#include "Z.h"
+#include "Space.h"
+
+namespace geophile
+{
+    /*
+     * An array of (z-value, query id) pairs, used to process a batch
+     * of queries in one pass over a SpatialIndex. Sorting orders the
+     * pairs by z-value, and then by query id. As in ZArray, a z-value
+     * may be marked as interior to its query object.
+     */
+    class QueryZArray
+    {
+    public:
+        Z at(uint32_t i) const;
+        uint32_t query(uint32_t i) const;
+        int32_t interior(uint32_t i) const;
+        void append(Z z, uint32_t query, int32_t interior = false);
+        uint32_t length() const;
+        void sort();
+        void clear();
+        ~QueryZArray();
+        QueryZArray();
+
+    private:
+        void ensureSpace();
+        // For use with qsort
+        static int32_t queryZCompare(const void*, const void*);
+
+    private:
+        typedef struct
+        {
+            Z z;
+            uint32_t query;
+            int32_t interior;
+        } QueryZ;
+
+        static const uint32_t INITIAL_CAPACITY = 100;
+
+        uint32_t _capacity;
+        uint32_t _n;
+        QueryZ* _query_z;
+    };
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "RadixSearch.h"
+#include "util.h"
+
+using namespace geophile;
+
+void RadixSearch::build(const SpatialObjectKey* keys, uint32_t n)
+{
+    clear();
+    if (n == 0) {
+        return;
+    }
+    _n = n;
+    _bits = _requested_bits;
+    if (_bits == 0) {
+        _bits = 64 - __builtin_clzll(n);
+        if (_bits > MAX_BITS) {
+            _bits = MAX_BITS;
+        }
+    }
+    // Bits below the prefix shared by all keys.
+    int64_t first = keys[0].z().asInteger();
+    int64_t last = keys[n - 1].z().asInteger();
+    uint32_t differing = first == last ? 0 : 64 - __builtin_clzll(first ^ last);
+    _shift = differing > _bits ? differing - _bits : 0;
+    _base = first >> _shift;
+    _n_buckets = (uint32_t) ((last >> _shift) - _base + 1);
+    _starts = new uint32_t[_n_buckets + 1];
+    uint32_t p = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t prefix = (uint32_t) ((keys[i].z().asInteger() >> _shift) - _base);
+        while (p <= prefix) {
+            _starts[p++] = i;
+        }
+    }
+    while (p <= _n_buckets) {
+        _starts[p++] = n;
+    }
+}
+
+void RadixSearch::clear()
+{
+    delete [] _starts;
+    _starts = NULL;
+    _n = 0;
+    _n_buckets = 0;
+}
+
+uint32_t RadixSearch::size() const
+{
+    return _n;
+}
+
+void RadixSearch::range(const SpatialObjectKey& key,
+                        int32_t include_key,
+                        uint32_t* lo,
+                        uint32_t* hi) const
+{
+    // Keys with a smaller prefix precede key, and keys with a larger one
+    // follow it, regardless of soid and include_key.
+    int64_t prefix = (key.z().asInteger() >> _shift) - _base;
+    if (_n == 0 || prefix < 0) {
+        *lo = 0;
+        *hi = 0;
+    } else if (prefix >= _n_buckets) {
+        *lo = _n;
+        *hi = _n;
+    } else {
+        *lo = _starts[prefix];
+        *hi = _starts[prefix + 1];
+    }
+}
+
+RadixSearch::~RadixSearch()
+{
+    clear();
+}
+
+uint32_t RadixSearch::bits() const
+{
+    return _bits;
+}
+
+uint32_t RadixSearch::nBuckets() const
+{
+    return _n_buckets;
+}
+
+RadixSearch::RadixSearch(uint32_t bits)
+    : _requested_bits(bits),
+      _bits(0),
+      _n(0),
+      _shift(0),
+      _base(0),
+      _n_buckets(0),
+      _starts(NULL)
+{
+    GEOPHILE_ASSERT(bits <= MAX_BITS);
+}
@@ -0,0 +1,62 @@
+#ifndef _RADIX_SEARCH_H
+#define _RADIX_SEARCH_H
+
+#include <stdint.h>
+#include "KeySearch.h"
+#include "SpatialObjectKey.h"
+
+namespace geophile
+{
+    /*
+     * A KeySearch that is a directory addressed by a z-value prefix. The
+     * directory has an entry for each value of the leading bits of a
+     * z-value, giving the position of the first key with that prefix, or
+     * a later one. range returns the keys with the search key's prefix,
+     * without any search at all. For an empty prefix, the range is a
+     * single position, so the index's records aren't touched.
+     *
+     * The prefix starts below the bits shared by all keys, (the first
+     * and last key), so that the directory isn't wasted on z-values
+     * outside the index. By default, the number of bits is chosen from
+     * the number of keys, giving one or two keys per entry for evenly
+     * distributed z-values, up to MAX_BITS.
+     */
+    class RadixSearch : public KeySearch
+    {
+    public:
+        // KeySearch
+        virtual void build(const SpatialObjectKey* keys, uint32_t n);
+        virtual void clear();
+        virtual uint32_t size() const;
+        virtual void range(const SpatialObjectKey& key,
+                           int32_t include_key,
+                           uint32_t* lo,
+                           uint32_t* hi) const;
+        virtual ~RadixSearch();
+
+        // RadixSearch
+        // Number of prefix bits used by the directory.
+        uint32_t bits() const;
+        // Number of directory entries.
+        uint32_t nBuckets() const;
+        // bits = 0: Choose the number of prefix bits from the number of keys.
+        RadixSearch(uint32_t bits = 0);
+
+    public:
+        static const uint32_t MAX_BITS = 20;
+
+    private:
+        uint32_t _requested_bits;
+        uint32_t _bits;
+        uint32_t _n;
+        // The prefix of a z-value is (z >> _shift) - _base.
+        uint32_t _shift;
+        int64_t _base;
+        uint32_t _n_buckets;
+        // _starts[p] is the position of the first key with prefix >= p,
+        // 0 <= p <= _n_buckets.
+        uint32_t* _starts;
+    };
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef _RECORD_SORT_H
+#define _RECORD_SORT_H
+
+#include <stdint.h>
+#include <string.h>
+#include "Record.h"
+#include "Threads.h"
+#include "util.h"
+
+namespace geophile
+{
+    /*
+     * Sorts records by key, (z-value, soid), using a parallel
+     * least-significant-digit radix sort. Each pass sorts on one
+     * byte of the key. Threads count bytes in their own slices of
+     * the records, the counts are combined into per-thread output
+     * positions, and then each thread moves its slice, stably, to
+     * the output. Passes on a byte that is the same in all records
+     * are skipped, (typically the high bytes of the soids, and the
+     * low bytes of the z-values, which hold the length and padding).
+     *
+     * Records are moved with memcpy, not Record::operator=, which
+     * recomputes the key.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class RecordSort
+    {
+    public:
+        /*
+         * Sorts records[0 .. n-1] using n_threads threads.
+         */
+        static void sort(Record<SOR>* records, uint32_t n, uint32_t n_threads)
+        {
+            if (n < 2) {
+                return;
+            }
+            if (n < MIN_RECORDS_PER_THREAD * n_threads) {
+                n_threads = n / MIN_RECORDS_PER_THREAD;
+                if (n_threads == 0) {
+                    n_threads = 1;
+                }
+            }
+            RecordSort<SOR> record_sort(records, n, n_threads);
+            record_sort.sort();
+        }
+
+    private:
+        void sort()
+        {
+            // Count all the bytes of the keys in one pass over the
+            // records, to find the bytes that vary.
+            _phase = PHASE_COUNT_ALL;
+            Threads::run(_n_threads, run, this);
+            bool first_pass = true;
+            for (uint32_t digit = 0; digit < KEY_BYTES; digit++) {
+                if (uniform(digit)) {
+                    continue;
+                }
+                _digit = digit;
+                if (!first_pass) {
+                    // Moving the records changed the slices, so the
+                    // counts from PHASE_COUNT_ALL no longer apply.
+                    _phase = PHASE_COUNT;
+                    Threads::run(_n_threads, run, this);
+                }
+                computeOffsets(first_pass);
+                _phase = PHASE_MOVE;
+                Threads::run(_n_threads, run, this);
+                Record<SOR>* swap = _source;
+                _source = _target;
+                _target = swap;
+                first_pass = false;
+            }
+            if (_source != _records) {
+                memcpy(_records, _source, _n * sizeof(Record<SOR>));
+            }
+        }
+
+        static void run(void* argument, uint32_t thread)
+        {
+            RecordSort<SOR>* record_sort = (RecordSort<SOR>*) argument;
+            switch (record_sort->_phase) {
+                case PHASE_COUNT_ALL:
+                    record_sort->countAll(thread);
+                    break;
+                case PHASE_COUNT:
+                    record_sort->count(thread);
+                    break;
+                case PHASE_MOVE:
+                    record_sort->move(thread);
+                    break;
+            }
+        }
+
+        void countAll(uint32_t thread)
+        {
+            uint32_t* counts = &_all_counts[thread * KEY_BYTES * BUCKETS];
+            memset(counts, 0, KEY_BYTES * BUCKETS * sizeof(uint32_t));
+            uint32_t end = sliceEnd(thread);
+            for (uint32_t i = sliceStart(thread); i < end; i++) {
+                const SpatialObjectKey& key = _source[i].key();
+                uint64_t soid = soidBits(key);
+                uint64_t z = zBits(key);
+                for (uint32_t b = 0; b < 8; b++) {
+                    counts[b * BUCKETS + ((soid >> (b * 8)) & 0xff)]++;
+                    counts[(b + 8) * BUCKETS + ((z >> (b * 8)) & 0xff)]++;
+                }
+            }
+        }
+
+        void count(uint32_t thread)
+        {
+            uint32_t* counts = &_counts[thread * BUCKETS];
+            memset(counts, 0, BUCKETS * sizeof(uint32_t));
+            uint32_t end = sliceEnd(thread);
+            for (uint32_t i = sliceStart(thread); i < end; i++) {
+                counts[digitOf(_source[i].key())]++;
+            }
+        }
+
+        void move(uint32_t thread)
+        {
+            uint32_t* offsets = &_offsets[thread * BUCKETS];
+            uint32_t end = sliceEnd(thread);
+            for (uint32_t i = sliceStart(thread); i < end; i++) {
+                uint32_t bucket = digitOf(_source[i].key());
+                memcpy(&_target[offsets[bucket]++], &_source[i], sizeof(Record<SOR>));
+            }
+        }
+
+        bool uniform(uint32_t digit) const
+        {
+            for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+                uint32_t total = 0;
+                for (uint32_t t = 0; t < _n_threads; t++) {
+                    total += _all_counts[(t * KEY_BYTES + digit) * BUCKETS + bucket];
+                }
+                if (total != 0) {
+                    return total == _n;
+                }
+            }
+            GEOPHILE_ASSERT(false);
+            return true;
+        }
+
+        // Records with the given digit from thread t's slice go after
+        // those with smaller digits, and after those with the same
+        // digit from slices of threads < t, which keeps the sort
+        // stable.
+        void computeOffsets(bool first_pass)
+        {
+            uint32_t position = 0;
+            for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+                for (uint32_t t = 0; t < _n_threads; t++) {
+                    _offsets[t * BUCKETS + bucket] = position;
+                    position +=
+                        first_pass
+                        ? _all_counts[(t * KEY_BYTES + _digit) * BUCKETS + bucket]
+                        : _counts[t * BUCKETS + bucket];
+                }
+            }
+            GEOPHILE_ASSERT(position == _n);
+        }
+
+        uint32_t digitOf(const SpatialObjectKey& key) const
+        {
+            return
+                _digit < 8
+                ? (soidBits(key) >> (_digit * 8)) & 0xff
+                : (zBits(key) >> ((_digit - 8) * 8)) & 0xff;
+        }
+
+        // z-values and soids are signed. Flipping the sign bit gives
+        // unsigned values with the same ordering.
+        static uint64_t zBits(const SpatialObjectKey& key)
+        {
+            return ((uint64_t) key.z().asInteger()) ^ SIGN_BIT;
+        }
+
+        static uint64_t soidBits(const SpatialObjectKey& key)
+        {
+            return ((uint64_t) key.soid()) ^ SIGN_BIT;
+        }
+
+        uint32_t sliceStart(uint32_t thread) const
+        {
+            return (uint32_t) (((uint64_t) _n * thread) / _n_threads);
+        }
+
+        uint32_t sliceEnd(uint32_t thread) const
+        {
+            return (uint32_t) (((uint64_t) _n * (thread + 1)) / _n_threads);
+        }
+
+        ~RecordSort()
+        {
+            delete [] (uint8_t*) _buffer;
+            delete [] _all_counts;
+            delete [] _counts;
+            delete [] _offsets;
+        }
+
+        RecordSort(Record<SOR>* records, uint32_t n, uint32_t n_threads)
+            : _records(records),
+              _n(n),
+              _n_threads(n_threads),
+              // The buffer is only a target for memcpy, so the Records
+              // don't need to be constructed.
+              _buffer((Record<SOR>*) new uint8_t[n * sizeof(Record<SOR>)]),
+              _all_counts(new uint32_t[n_threads * KEY_BYTES * BUCKETS]),
+              _counts(new uint32_t[n_threads * BUCKETS]),
+              _offsets(new uint32_t[n_threads * BUCKETS]),
+              _source(records),
+              _target(_buffer),
+              _digit(0),
+              _phase(PHASE_COUNT_ALL)
+        {}
+
+    private:
+        typedef enum {
+            PHASE_COUNT_ALL,
+            PHASE_COUNT,
+            PHASE_MOVE
+        } Phase;
+
+        static const uint32_t KEY_BYTES = 16; // 8 bytes of soid, then 8 bytes of z
+        static const uint32_t BUCKETS = 256;
+        static const uint32_t MIN_RECORDS_PER_THREAD = 1 << 14;
+        static const uint64_t SIGN_BIT = 0x8000000000000000ULL;
+
+    private:
+        Record<SOR>* _records;
+        uint32_t _n;
+        uint32_t _n_threads;
+        Record<SOR>* _buffer;
+        // _all_counts[(t * KEY_BYTES + digit) * BUCKETS + b]: Number of
+        // records in thread t's slice of the input with byte b at digit.
+        uint32_t* _all_counts;
+        // _counts[t * BUCKETS + b]: Number of records in thread t's
+        // slice with byte b at _digit.
+        uint32_t* _counts;
+        // _offsets[t * BUCKETS + b]: Next output position for a record
+        // of thread t's slice with byte b at _digit.
+        uint32_t* _offsets;
+        Record<SOR>* _source;
+        Record<SOR>* _target;
+        uint32_t _digit;
+        Phase _phase;
+    };
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef _RECORD_STACK_H
+#define _RECORD_STACK_H
+
+#include <stdint.h>
+#include <string.h>
+#include "Record.h"
+#include "util.h"
+
+namespace geophile
+{
+    /*
+     * A stack of Records, used by SpatialJoin to keep track of the
+     * records whose z-values contain the current position of a
+     * z-order merge. Records are copied in and out by value.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class RecordStack
+    {
+    public:
+        uint32_t size() const
+        {
+            return _n;
+        }
+
+        // Position 0 is the bottom of the stack.
+        const Record<SOR>& at(uint32_t position) const
+        {
+            GEOPHILE_ASSERT(position < _n);
+            return _records[position];
+        }
+
+        const Record<SOR>& top() const
+        {
+            GEOPHILE_ASSERT(_n > 0);
+            return _records[_n - 1];
+        }
+
+        void push(const Record<SOR>& record)
+        {
+            ensureSpace();
+            // Record::operator= recomputes the key from the SOR. A
+            // byte copy is cheaper and preserves the key as is.
+            memcpy(&_records[_n++], &record, sizeof(Record<SOR>));
+        }
+
+        void pop()
+        {
+            GEOPHILE_ASSERT(_n > 0);
+            _n--;
+        }
+
+        // Pops records until the top record's z-value contains z.
+        void popUntilContains(Z z)
+        {
+            while (_n > 0 && !_records[_n - 1].key().z().contains(z)) {
+                _n--;
+            }
+        }
+
+        void clear()
+        {
+            _n = 0;
+        }
+
+        ~RecordStack()
+        {
+            delete [] _records;
+        }
+
+        RecordStack()
+            : _capacity(INITIAL_CAPACITY),
+              _n(0),
+              _records(new Record<SOR>[INITIAL_CAPACITY])
+        {}
+
+    private:
+        void ensureSpace()
+        {
+            if (_n == _capacity) {
+                uint32_t new_capacity = _capacity * 2;
+                Record<SOR>* new_records = new Record<SOR>[new_capacity];
+                memcpy(new_records, _records, _capacity * sizeof(Record<SOR>));
+                delete [] _records;
+                _records = new_records;
+                _capacity = new_capacity;
+            }
+        }
+
+    private:
+        static const uint32_t INITIAL_CAPACITY = 64;
+
+    private:
+        uint32_t _capacity;
+        uint32_t _n;
+        Record<SOR>* _records;
+    };
+}
+
+#endif
@@ -0,0 +1,55 @@
+#include "RegionHeap.h"
+#include "util.h"
+
+using namespace geophile;
+
+void RegionHeap::add(Region* region, double priority)
+{
+    GEOPHILE_ASSERT(_size < _capacity);
+    // Sift up
+    uint32_t i = _size++;
+    while (i > 0 && _entries[(i - 1) / 2].priority < priority) {
+        _entries[i] = _entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    _entries[i].priority = priority;
+    _entries[i].region = region;
+}
+
+Region* RegionHeap::take()
+{
+    GEOPHILE_ASSERT(_size > 0);
+    Region* region = _entries[0].region;
+    Entry last = _entries[--_size];
+    // Sift down
+    uint32_t i = 0;
+    uint32_t child;
+    while ((child = 2 * i + 1) < _size) {
+        if (child + 1 < _size && _entries[child + 1].priority > _entries[child].priority) {
+            child++;
+        }
+        if (_entries[child].priority <= last.priority) {
+            break;
+        }
+        _entries[i] = _entries[child];
+        i = child;
+    }
+    _entries[i] = last;
+    return region;
+}
+
+uint32_t RegionHeap::size()
+{
+    return _size;
+}
+
+RegionHeap::~RegionHeap()
+{
+    delete [] _entries;
+}
+
+RegionHeap::RegionHeap(uint32_t capacity)
+    : _capacity(capacity),
+      _entries(new Entry[capacity]),
+      _size(0)
+{}
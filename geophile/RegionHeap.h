@@ -0,0 +1,37 @@
+#ifndef _REGION_HEAP_H
+#define _REGION_HEAP_H
+
+#include <stdint.h>
+
+namespace geophile
+{
+    class Region;
+
+    /*
+     * A max-heap of regions, for best-first decomposition: take returns
+     * the region with the largest priority.
+     */
+    class RegionHeap
+    {
+    public:
+        void add(Region* region, double priority);
+        Region* take();
+        uint32_t size();
+        ~RegionHeap();
+        RegionHeap(uint32_t capacity);
+
+    private:
+        typedef struct
+        {
+            double priority;
+            Region* region;
+        } Entry;
+
+    private:
+        const uint32_t _capacity;
+        Entry* _entries;
+        uint32_t _size;
+    };
+}
+
+#endif
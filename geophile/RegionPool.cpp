@@ -17,6 +17,16 @@ void RegionPool::returnRegion(Region* region)
     _free[p]= true;
 }
 
+void RegionPool::ensureCapacity(uint32_t capacity)
+{
+    if (capacity > _capacity) {
+        for (uint32_t p = 0; p < _capacity; p++) {
+            GEOPHILE_ASSERT(_free[p]);
+        }
+        grow(capacity);
+    }
+}
+
 RegionPool::~RegionPool()
 {
     delete [] _regions;
@@ -42,20 +52,27 @@ uint32_t RegionPool::useFreePosition()
         }
     }
     if (freePosition == _capacity) {
-        uint32_t new_capacity = _capacity * 2;
-        // Grow _regions
-        Region* new_regions = new Region[new_capacity];
-        memcpy(new_regions, _regions, _capacity * sizeof(Region));
-        delete [] _regions;
-        _regions = new_regions;
-        // Grow _free
-        bool* new_free = new bool[new_capacity];
-        memcpy(new_free, _free, _capacity * sizeof(bool));
-        delete [] _free;
-        _free = new_free;
-        //
-        _capacity = new_capacity;
+        grow(_capacity * 2);
     }
     _free[freePosition] = false;
     return freePosition;
 }
+
+void RegionPool::grow(uint32_t new_capacity)
+{
+    // Grow _regions
+    Region* new_regions = new Region[new_capacity];
+    memcpy(new_regions, _regions, _capacity * sizeof(Region));
+    delete [] _regions;
+    _regions = new_regions;
+    // Grow _free
+    bool* new_free = new bool[new_capacity];
+    memcpy(new_free, _free, _capacity * sizeof(bool));
+    for (uint32_t p = _capacity; p < new_capacity; p++) {
+        new_free[p] = true;
+    }
+    delete [] _free;
+    _free = new_free;
+    //
+    _capacity = new_capacity;
+}
@@ -13,11 +13,16 @@ namespace geophile
     public:
         Region* takeRegion();
         void returnRegion(Region* region);
+        // Growing the pool moves the regions, so this must only be called when
+        // no regions have been taken. Space::decompose calls it to ensure
+        // that the pool won't grow while regions are in use.
+        void ensureCapacity(uint32_t capacity);
         ~RegionPool();
         RegionPool();
 
     private:
         uint32_t useFreePosition();
+        void grow(uint32_t new_capacity);
 
     private:
         static const uint32_t INITIAL_CAPACITY = 20;
@@ -2,6 +2,7 @@
 #define _SESSION_MEMORY_H
 
 #include "OutputArray.h"
+#include "PartitionedOutputArray.h"
 #include "SessionMemoryBase.h"
 
 namespace geophile
@@ -13,7 +14,8 @@ namespace geophile
 
     /*
      * Maintains memory used in various SpatialIndex operations,
-     * avoiding repeated allocation/deallocation..
+     * avoiding repeated allocation/deallocation.. A SessionMemory
+     * must not be used by more than one thread at a time.
      */
     template <class SOR>
         class SessionMemory : public SessionMemoryBase
@@ -36,6 +38,16 @@ namespace geophile
             _output->clear();
         }
 
+        /*
+         * Returns an internally-maintained PartitionedOutputArray that
+         * accumulates output from batched SpatialIndex retrievals,
+         * (SpatialIndex::findOverlappingBatch), one partition per query.
+         */
+        PartitionedOutputArray<SOR>* batchOutput()
+        {
+            return _batch_output;
+        }
+
         /*
          * Destructor
          */
@@ -43,6 +55,8 @@ namespace geophile
         {
             delete _output;
             _output = NULL;
+            delete _batch_output;
+            _batch_output = NULL;
         }
 
         /*
@@ -50,11 +64,13 @@ namespace geophile
          */
         SessionMemory()
             : SessionMemoryBase(),
-              _output(new OutputArray<SOR>())
+              _output(new OutputArray<SOR>()),
+              _batch_output(new PartitionedOutputArray<SOR>())
         {}
 
     private:
         OutputArray<SOR>* _output;
+        PartitionedOutputArray<SOR>* _batch_output;
     };
 }
 
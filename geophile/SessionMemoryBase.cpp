@@ -1,4 +1,5 @@
 #include "SessionMemoryBase.h"
+#include "QueryZArray.h"
 #include "RegionPool.h"
 #include "ZArray.h"
 
@@ -7,11 +8,13 @@ using namespace geophile;
 SessionMemoryBase::~SessionMemoryBase()
 {
     delete _zs;
+    delete _query_zs;
     delete _regions;
 }
 
 SessionMemoryBase::SessionMemoryBase()
     : _zs(new ZArray()),
+      _query_zs(new QueryZArray()),
       _regions(new RegionPool()),
       _buffer(NULL),
       _buffer_size(-1)
@@ -22,6 +25,11 @@ ZArray* SessionMemoryBase::zArray()
     return _zs;
 }
 
+QueryZArray* SessionMemoryBase::queryZArray()
+{
+    return _query_zs;
+}
+
 RegionPool* SessionMemoryBase::regions()
 {
     return _regions;
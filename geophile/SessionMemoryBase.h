@@ -8,6 +8,7 @@ namespace geophile
     class RegionPool;
     class Space;
     class SpatialObject;
+    class QueryZArray;
     class ZArray;
 
     /*
@@ -28,6 +29,7 @@ namespace geophile
     public: // Used internally. 
         // Friend declarations not used because these are also used in testing.
         ZArray* zArray();
+        QueryZArray* queryZArray();
         RegionPool* regions();
         ByteBuffer byteBuffer();
         void ensureByteBufferCapacity(uint32_t minimum);
@@ -35,6 +37,7 @@ namespace geophile
 
     private:
         ZArray* _zs;
+        QueryZArray* _query_zs;
         RegionPool* _regions;
         byte* _buffer;
         uint32_t _buffer_size;
@@ -1,13 +1,255 @@
+#include <math.h>
 #include "Space.h"
+#include "OccupancyMap.h"
 #include "SpatialObject.h"
 #include "Region.h"
+#include "RegionHeap.h"
 #include "RegionPool.h"
 #include "RegionQueue.h"
 #include "SessionMemory.h"
 #include "ZArray.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace geophile;
 
+#if defined(__x86_64__)
+
+// Compiled for BMI2 regardless of the target, and only called if the CPU has
+// it. (PDEP and PEXT are slow on AMD CPUs before Zen 3, microcoded, but still
+// correct.)
+
+__attribute__((target("bmi2")))
+static int64_t depositBMI2(const uint64_t* x, const uint64_t* deposit_mask, uint32_t dimensions)
+{
+    uint64_t z = 0;
+    for (uint32_t d = 0; d < dimensions; d++) {
+        GEOPHILE_ASSERT((int64_t) x[d] >= 0);
+        z |= _pdep_u64(x[d], deposit_mask[d]);
+    }
+    return (int64_t) z;
+}
+
+__attribute__((target("bmi2")))
+static void extractBMI2(uint64_t z, const uint64_t* deposit_mask, uint32_t dimensions, uint64_t* x)
+{
+    for (uint32_t d = 0; d < dimensions; d++) {
+        x[d] = _pext_u64(z, deposit_mask[d]);
+    }
+}
+
+static bool hasBMI2()
+{
+    return __builtin_cpu_supports("bmi2");
+}
+
+// Four coordinates at a time, computed as in Space::appToZ, so the results are
+// identical: IEEE division is exact, (there is no reciprocal approximation),
+// and the conversion to an integer truncates. The conversion adds 2^52 + 2^51,
+// placing the integer in the low bits of the double, which is exact for
+// |value| < 2^51. Lanes outside that range, (coordinates far outside the
+// space), are redone by scalar code.
+__attribute__((target("avx2")))
+static uint32_t appToZAVX2(const double* x,
+                           uint32_t n,
+                           double lo,
+                           double hi,
+                           double width,
+                           uint64_t range,
+                           int64_t* z)
+{
+    const __m256d v_lo = _mm256_set1_pd(lo);
+    const __m256d v_hi = _mm256_set1_pd(hi);
+    const __m256d v_width = _mm256_set1_pd(width);
+    const __m256d v_range = _mm256_set1_pd((double) range);
+    const __m256d v_last = _mm256_set1_pd((double) (int64_t) (range - 1));
+    const __m256d v_magic = _mm256_set1_pd(6755399441055744.0); // 2^52 + 2^51
+    const __m256d v_limit = _mm256_set1_pd(2251799813685248.0); // 2^51
+    const __m256d v_sign = _mm256_set1_pd(-0.0);
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v_x = _mm256_loadu_pd(x + i);
+        __m256d v_z = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(v_x, v_lo), v_width), v_range);
+        v_z = _mm256_round_pd(v_z, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        v_z = _mm256_blendv_pd(v_z, v_last, _mm256_cmp_pd(v_x, v_hi, _CMP_EQ_OQ));
+        __m256d v_in_range = _mm256_cmp_pd(_mm256_andnot_pd(v_sign, v_z), v_limit, _CMP_LT_OQ);
+        if (_mm256_movemask_pd(v_in_range) != 0xf) {
+            break;
+        }
+        __m256i v_bits = _mm256_castpd_si256(_mm256_add_pd(v_z, v_magic));
+        _mm256_storeu_si256((__m256i*) (z + i),
+                            _mm256_sub_epi64(v_bits, _mm256_castpd_si256(v_magic)));
+    }
+    return i;
+}
+
+static bool hasAVX2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static int64_t depositBMI2(const uint64_t* x, const uint64_t* deposit_mask, uint32_t dimensions)
+{
+    GEOPHILE_ASSERT(false);
+    return 0;
+}
+
+static void extractBMI2(uint64_t z, const uint64_t* deposit_mask, uint32_t dimensions, uint64_t* x)
+{
+    GEOPHILE_ASSERT(false);
+}
+
+static bool hasBMI2()
+{
+    return false;
+}
+
+static uint32_t appToZAVX2(const double* x,
+                           uint32_t n,
+                           double lo,
+                           double hi,
+                           double width,
+                           uint64_t range,
+                           int64_t* z)
+{
+    return 0;
+}
+
+static bool hasAVX2()
+{
+    return false;
+}
+
+#endif
+
+// Space::decompose compares regions to an object through one of these.
+
+// Number of grid cells in region.
+static double volume(const Region* region)
+{
+    return ldexp(1.0, region->space()->zBits() - region->level());
+}
+
+// Any SpatialObject, through its virtual functions.
+class ObjectComparison
+{
+public:
+    RegionComparison compare(const Region* region) const
+    {
+        return _spatial_object->compare(region);
+    }
+
+    int32_t containsRegion(const Region* region) const
+    {
+        return _spatial_object->containsRegion(region);
+    }
+
+    // The object's overlap with the region is unknown.
+    double waste(const Region* region) const
+    {
+        return volume(region);
+    }
+
+    ObjectComparison(const SpatialObject* spatial_object)
+        : _spatial_object(spatial_object)
+    {}
+
+private:
+    const SpatialObject* _spatial_object;
+};
+
+// An axis-aligned box, (see SpatialObject::boxBounds), compared using its
+// bounds in the Z space, which are computed once, instead of by appToZ in each
+// call of compare, containedBy and containsRegion. The results are those of
+// Box2, so the z-values are the same.
+class BoxComparison
+{
+public:
+    RegionComparison compare(const Region* region) const
+    {
+        bool inside = true;
+        for (uint32_t d = 0; d < _dimensions; d++) {
+            uint64_t lo = region->lo(d);
+            uint64_t hi = region->hi(d);
+            if (hi < _lo[d] || lo > _hi[d]) {
+                return REGION_OUTSIDE_OBJECT;
+            }
+            inside = inside && _lo[d] <= lo && hi <= _hi[d];
+        }
+        return inside ? REGION_INSIDE_OBJECT : REGION_OVERLAPS_OBJECT;
+    }
+
+    int32_t containsRegion(const Region* region) const
+    {
+        // As in Box2: A cell at the edge of the box may extend beyond it,
+        // unless the box extends to the edge of the space.
+        for (uint32_t d = 0; d < _dimensions; d++) {
+            if (!((region->lo(d) > _lo[d] || _lo_at_edge[d]) &&
+                  (region->hi(d) < _hi[d] || _hi_at_edge[d]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Number of region's cells outside the box.
+    double waste(const Region* region) const
+    {
+        double overlap = 1;
+        for (uint32_t d = 0; d < _dimensions; d++) {
+            uint64_t lo = region->lo(d) > _lo[d] ? region->lo(d) : _lo[d];
+            uint64_t hi = region->hi(d) < _hi[d] ? region->hi(d) : _hi[d];
+            overlap *= (double) (hi - lo + 1);
+        }
+        return volume(region) - overlap;
+    }
+
+    // The smallest region containing the box. The regions containing a cell
+    // are its z-value's prefixes, so this is the region of the longest prefix
+    // shared by the z-values of the box's corners.
+    Region* region(RegionPool* regions) const
+    {
+        int64_t differing = _space->shuffle(_lo).asInteger() ^ _space->shuffle(_hi).asInteger();
+        // The MSB of a z-value is unused.
+        uint32_t level = differing == 0 ? _space->zBits() : __builtin_clzll(differing) - 1;
+        Region* region = regions->takeRegion();
+        region->initialize(_space, _lo, _lo, _space->zBits());
+        while (region->level() > level) {
+            region->up();
+        }
+        return region;
+    }
+
+    // Returns false if the box isn't inside the Z space, (leaving it to the
+    // SpatialObject).
+    bool initialize(const Space* space, const double* lo, const double* hi)
+    {
+        _space = space;
+        _dimensions = space->dimensions();
+        for (uint32_t d = 0; d < _dimensions; d++) {
+            _lo[d] = space->appToZ(d, lo[d]);
+            _hi[d] = space->appToZ(d, hi[d]);
+            if ((int64_t) _lo[d] < 0 || _lo[d] > _hi[d] || _hi[d] > (uint64_t) space->appToZ(d, space->hi(d))) {
+                return false;
+            }
+            _lo_at_edge[d] = lo[d] <= space->lo(d);
+            _hi_at_edge[d] = hi[d] >= space->hi(d);
+        }
+        return true;
+    }
+
+private:
+    const Space* _space;
+    uint32_t _dimensions;
+    uint64_t _lo[Space::MAX_DIMENSIONS];
+    uint64_t _hi[Space::MAX_DIMENSIONS];
+    bool _lo_at_edge[Space::MAX_DIMENSIONS];
+    bool _hi_at_edge[Space::MAX_DIMENSIONS];
+};
+
 int32_t Space::dimensions() const
 {
     return _dimensions;
@@ -25,22 +267,81 @@ double Space::hi(int32_t d) const
 
 void Space::decompose(const SpatialObject* spatial_object, 
                       uint32_t max_z,
-                      SessionMemoryBase* memory) const
+                      SessionMemoryBase* memory,
+                      const OccupancyMap* occupancy) const
 {
     ZArray* zs = memory->zArray();
+    if (spatial_object->isPoint()) {
+        zs->clear();
+        double point[_dimensions];
+        spatial_object->arbitraryPoint(point);
+        zs->append(spatialIndexKey(point));
+        return;
+    }
     RegionPool* regions = memory->regions();
+    // The queue holds up to max_z regions, and a couple more are in use while
+    // a region is being split.
+    regions->ensureCapacity(max_z + 3);
     zs->clear();
-    double app_point[_dimensions];
-    spatial_object->arbitraryPoint(app_point);
-    uint64_t z_point[_dimensions];
-    for (uint32_t d = 0; d < _dimensions; d++) {
-        z_point[d] = appToZ(d, app_point[d]);
+    double box_lo[_dimensions];
+    double box_hi[_dimensions];
+    BoxComparison box_comparison;
+    if (spatial_object->boxBounds(box_lo, box_hi) &&
+        box_comparison.initialize(this, box_lo, box_hi)) {
+        decompose(box_comparison, box_comparison.region(regions), max_z, zs, regions, occupancy);
+    } else {
+        double app_point[_dimensions];
+        spatial_object->arbitraryPoint(app_point);
+        uint64_t z_point[_dimensions];
+        for (uint32_t d = 0; d < _dimensions; d++) {
+            z_point[d] = appToZ(d, app_point[d]);
+        }
+        Region* region = regions->takeRegion();
+        region->initialize(this, z_point, z_point, _z_bits);
+        while (!spatial_object->containedBy(region)) {
+            region->up();
+        }
+        decompose(ObjectComparison(spatial_object), region, max_z, zs, regions, occupancy);
     }
-    Region* region = regions->takeRegion();
-    region->initialize(this, z_point, z_point, _z_bits);
-    while (!spatial_object->containedBy(region)) {
-        region->up();
+    zs->sort();
+    int32_t merge;
+    do {
+        merge = false;
+        for (int i = 1; i < zs->length(); i++) {
+            Z a = zs->at(i - 1);
+            Z b = zs->at(i);
+            if ((merge = a.siblingOf(b))) {
+                zs->set(i - 1, a.parent(), zs->interior(i - 1) && zs->interior(i));
+                zs->remove(i);
+            }
+        }
+    } while (merge);
+}
+
+template <class Comparison>
+void Space::decompose(const Comparison& comparison,
+                      Region* region,
+                      uint32_t max_z,
+                      ZArray* zs,
+                      RegionPool* regions,
+                      const OccupancyMap* occupancy) const
+{
+    if (_decomposition == DATA_AWARE && occupancy != NULL) {
+        decomposeBestFirst(comparison, region, max_z, zs, regions, occupancy);
+    } else if (_decomposition == BEST_FIRST || _decomposition == DATA_AWARE) {
+        decomposeBestFirst(comparison, region, max_z, zs, regions, NULL);
+    } else {
+        decomposeBreadthFirst(comparison, region, max_z, zs, regions);
     }
+}
+
+template <class Comparison>
+void Space::decomposeBreadthFirst(const Comparison& comparison,
+                                  Region* region,
+                                  uint32_t max_z,
+                                  ZArray* zs,
+                                  RegionPool* regions) const
+{
     RegionQueue queue(max_z);
     queue.add(region);
     while (queue.size() > 0) {
@@ -50,10 +351,10 @@ void Space::decompose(const SpatialObject* spatial_object,
             regions->returnRegion(region);
         } else {
             region->downLeft();
-            RegionComparison left_comparison = spatial_object->compare(region);
+            RegionComparison left_comparison = comparison.compare(region);
             region->up();
             region->downRight();
-            RegionComparison right_comparison = spatial_object->compare(region);
+            RegionComparison right_comparison = comparison.compare(region);
             switch (left_comparison) {
                 case REGION_OUTSIDE_OBJECT:
                     switch (right_comparison) {
@@ -61,7 +362,7 @@ void Space::decompose(const SpatialObject* spatial_object,
                             GEOPHILE_ASSERT(false);
                             break;
                         case REGION_INSIDE_OBJECT:
-                            generateZValueFromRegion(zs, region);
+                            generateZValueFromRegion(zs, region, comparison.containsRegion(region));
                             regions->returnRegion(region);
                             break;
                         case REGION_OVERLAPS_OBJECT:
@@ -74,12 +375,12 @@ void Space::decompose(const SpatialObject* spatial_object,
                         case REGION_OUTSIDE_OBJECT:
                             region->up();
                             region->downLeft();
-                            generateZValueFromRegion(zs, region);
+                            generateZValueFromRegion(zs, region, comparison.containsRegion(region));
                             regions->returnRegion(region);
                             break;
                         case REGION_INSIDE_OBJECT:
                             region->up();
-                            generateZValueFromRegion(zs, region);
+                            generateZValueFromRegion(zs, region, comparison.containsRegion(region));
                             regions->returnRegion(region);
                             break;
                         case REGION_OVERLAPS_OBJECT:
@@ -87,7 +388,7 @@ void Space::decompose(const SpatialObject* spatial_object,
                                 queue.add(copyRegion(region, regions));
                                 region->up();
                                 region->downLeft();
-                                generateZValueFromRegion(zs, region);
+                                generateZValueFromRegion(zs, region, comparison.containsRegion(region));
                                 regions->returnRegion(region);
                             } else {
                                 region->up();
@@ -106,7 +407,7 @@ void Space::decompose(const SpatialObject* spatial_object,
                             break;
                         case REGION_INSIDE_OBJECT:
                             if (queue.size() + 1  + zs->length() < max_z) {
-                                generateZValueFromRegion(zs, region);
+                                generateZValueFromRegion(zs, region, comparison.containsRegion(region));
                                 region->up();
                                 region->downLeft();
                                 queue.add(region);
@@ -138,19 +439,106 @@ void Space::decompose(const SpatialObject* spatial_object,
         generateZValueFromRegion(zs, region);
         regions->returnRegion(region);
     }
-    zs->sort();
-    int32_t merge;
-    do {
-        merge = false;
-        for (int i = 1; i < zs->length(); i++) {
-            Z a = zs->at(i - 1);
-            Z b = zs->at(i);
-            if ((merge = a.siblingOf(b))) {
-                zs->set(i - 1, a.parent());
-                zs->remove(i);
+}
+
+// Each region in the heap overlaps the object, (it is neither inside nor
+// outside). The region with the highest priority is replaced by its children
+// that aren't outside the object, if the z-values and regions still fit in
+// max_z. Otherwise, its z-value is generated as is.
+// With occupancy, (DATA_AWARE), regions without records are treated as outside
+// the object, and a region expected to have fewer than SEEK_RECORDS records in
+// its waste isn't split.
+template <class Comparison>
+void Space::decomposeBestFirst(const Comparison& comparison,
+                               Region* region,
+                               uint32_t max_z,
+                               ZArray* zs,
+                               RegionPool* regions,
+                               const OccupancyMap* occupancy) const
+{
+    RegionHeap heap(max_z);
+    if (occupancy && !occupancy->mayOverlap(region->z())) {
+        regions->returnRegion(region);
+        return;
+    }
+    heap.add(region, priority(comparison, region, occupancy));
+    while (heap.size() > 0) {
+        region = heap.take();
+        if (region->isPoint() ||
+            (occupancy && priority(comparison, region, occupancy) < SEEK_RECORDS)) {
+            generateZValueFromRegion(zs, region);
+            regions->returnRegion(region);
+            continue;
+        }
+        region->downLeft();
+        RegionComparison left_comparison = comparison.compare(region);
+        if (occupancy && !occupancy->mayOverlap(region->z())) {
+            left_comparison = REGION_OUTSIDE_OBJECT;
+        }
+        region->up();
+        region->downRight();
+        RegionComparison right_comparison = comparison.compare(region);
+        if (occupancy && !occupancy->mayOverlap(region->z())) {
+            right_comparison = REGION_OUTSIDE_OBJECT;
+        }
+        uint32_t n_children =
+            (left_comparison != REGION_OUTSIDE_OBJECT) +
+            (right_comparison != REGION_OUTSIDE_OBJECT);
+        GEOPHILE_ASSERT(n_children > 0 || occupancy);
+        if (zs->length() + heap.size() + n_children > max_z) {
+            region->up();
+            generateZValueFromRegion(zs, region);
+            regions->returnRegion(region);
+            continue;
+        }
+        Region* children[2];
+        RegionComparison comparisons[2];
+        uint32_t n = 0;
+        if (left_comparison != REGION_OUTSIDE_OBJECT) {
+            Region* left = copyRegion(region, regions);
+            left->up();
+            left->downLeft();
+            children[n] = left;
+            comparisons[n++] = left_comparison;
+        }
+        if (right_comparison != REGION_OUTSIDE_OBJECT) {
+            children[n] = region;
+            comparisons[n++] = right_comparison;
+        } else {
+            regions->returnRegion(region);
+        }
+        for (uint32_t c = 0; c < n; c++) {
+            Region* child = children[c];
+            if (comparisons[c] == REGION_INSIDE_OBJECT) {
+                generateZValueFromRegion(zs, child, comparison.containsRegion(child));
+                regions->returnRegion(child);
+            } else {
+                heap.add(child, priority(comparison, child, occupancy));
             }
         }
-    } while (merge);
+    }
+}
+
+template <class Comparison>
+double Space::priority(const Comparison& comparison,
+                       const Region* region,
+                       const OccupancyMap* occupancy) const
+{
+    double waste = comparison.waste(region);
+    return
+        occupancy
+        ? occupancy->records(region->z()) * (waste / volume(region))
+        : waste;
+}
+
+void Space::decomposition(Decomposition decomposition)
+{
+    _decomposition = decomposition;
+}
+
+Space::Decomposition Space::decomposition() const
+{
+    return _decomposition;
 }
 
 Z Space::spatialIndexKey(const double* point) const
@@ -162,24 +550,54 @@ Z Space::spatialIndexKey(const double* point) const
     return shuffle(z_point, _z_bits);
 }
 
+void Space::spatialIndexKeys(const double* const* coords, uint32_t n, Z* zs) const
+{
+    int64_t x[MAX_DIMENSIONS][BLOCK_SIZE];
+    for (uint32_t start = 0; start < n; start += BLOCK_SIZE) {
+        uint32_t block = n - start < BLOCK_SIZE ? n - start : BLOCK_SIZE;
+        for (uint32_t d = 0; d < _dimensions; d++) {
+            appToZ(d, coords[d] + start, block, x[d]);
+        }
+        for (uint32_t i = 0; i < block; i++) {
+            uint64_t z_point[MAX_DIMENSIONS];
+            for (uint32_t d = 0; d < _dimensions; d++) {
+                z_point[d] = x[d][i];
+            }
+            zs[start + i] = shuffle(z_point, _z_bits);
+        }
+    }
+}
+
 Z Space::shuffle(const uint64_t* x, uint32_t level) const
 {
-    int64_t z = 0;
+    int64_t z = _bmi2 ? depositBMI2(x, _deposit_mask, _dimensions) : shuffleTable(x);
+    return Z(z, level == -1 ? _z_bits : level);
+}
+
+void Space::unshuffle(Z z, uint64_t* x) const
+{
+    uint64_t bits = (uint64_t) z.asInteger();
+    if (_bmi2) {
+        extractBMI2(bits, _deposit_mask, _dimensions, x);
+        return;
+    }
+    // Gather the bits of each dimension's mask, low to high.
     for (uint32_t d = 0; d < _dimensions; d++) {
-        int64_t xd = x[d];
-        GEOPHILE_ASSERT(xd >= 0);
-        switch (_x_bytes[d]) {
-            case 8: z |= _shuffle[7][d][(int)(xd >> 56) & 0xff];
-            case 7: z |= _shuffle[6][d][(int)(xd >> 48) & 0xff];
-            case 6: z |= _shuffle[5][d][(int)(xd >> 40) & 0xff];
-            case 5: z |= _shuffle[4][d][(int)(xd >> 32) & 0xff];
-            case 4: z |= _shuffle[3][d][(int)(xd >> 24) & 0xff];
-            case 3: z |= _shuffle[2][d][(int)(xd >> 16) & 0xff];
-            case 2: z |= _shuffle[1][d][(int)(xd >>  8) & 0xff];
-            case 1: z |= _shuffle[0][d][(int)(xd      ) & 0xff];
+        uint64_t mask = _deposit_mask[d];
+        uint64_t xd = 0;
+        for (uint64_t x_bit = 1; mask != 0; x_bit <<= 1) {
+            if ((bits & mask & -mask) != 0) {
+                xd |= x_bit;
+            }
+            mask &= mask - 1;
         }
+        x[d] = xd;
     }
-    return Z(z, level == -1 ? _z_bits : level);
+}
+
+void Space::useBMI2(bool use_bmi2)
+{
+    _bmi2 = use_bmi2 && hasBMI2();
 }
 
 uint32_t Space::zBits() const
@@ -201,6 +619,22 @@ int64_t Space::appToZ(uint32_t d, double x) const
         : (int64_t) (((x - _app_lo[d]) / _app_width[d]) * _z_range[d]);
 }
 
+void Space::appToZ(uint32_t d, const double* x, uint32_t n, int64_t* z) const
+{
+    uint32_t i = 0;
+    if (_avx2) {
+        i = appToZAVX2(x, n, _app_lo[d], _app_hi[d], _app_width[d], _z_range[d], z);
+    }
+    for (; i < n; i++) {
+        z[i] = appToZ(d, x[i]);
+    }
+}
+
+void Space::useAVX2(bool use_avx2)
+{
+    _avx2 = use_avx2 && hasAVX2();
+}
+
 double Space::zToApp(uint32_t d, uint64_t z) const
 {
     return ((double) z / _z_range[d]) * _app_width[d] + _app_lo[d];
@@ -258,6 +692,9 @@ Space::Space(uint32_t dimensions,
         }
     }
     computeShuffleMasks();
+    _bmi2 = hasBMI2();
+    _avx2 = hasAVX2();
+    _decomposition = BREADTH_FIRST;
 }
 
 Space::~Space()
@@ -271,12 +708,6 @@ Space::~Space()
     delete [] _app_hi;
     delete [] _app_width;
     delete [] _z_range;
-    for (uint32_t x_byte_position = 0; x_byte_position < 8; x_byte_position++) {
-        for (uint32_t d = 0; d < _dimensions; d++) {
-            delete [] _shuffle[x_byte_position][d];
-        }
-        delete [] _shuffle[x_byte_position];
-    }
     delete [] _shuffle;
 }
 
@@ -316,8 +747,9 @@ void Space::computeShuffleMasks()
     // positions are numbered left-to-right starting at 0. x values are right-justified, while z-values 
     // are right-justified.
     //
-    // Then the shuffle masks are computed. shuffle[b][d][x] is a mask representing the bits of the 
-    // bth byte of x[d] that contribute to the z-value.
+    // Then the shuffle masks are computed. The table entry for byte b of x[d] with value x,
+    // (_shuffle[(d * 8 + b) * 256 + x]), is a mask representing the bits of the bth byte of x[d]
+    // that contribute to the z-value. _deposit_mask[d] is the union of all of d's masks.
     uint32_t max_x_bits = 0;
     for (uint32_t d = 0; d < _dimensions; d++) {
         if (_x_bits[d] > max_x_bits) {
@@ -337,34 +769,53 @@ void Space::computeShuffleMasks()
         xz[d][x_bit_count[d]] = z_bit_position;
         x_bit_count[d]++;
     }
-    _shuffle = new int64_t**[8];
-    for (uint32_t x_byte_position = 0; x_byte_position < 8; x_byte_position++) {
-        _shuffle[x_byte_position] = new int64_t*[_dimensions];
-        for (uint32_t d = 0; d < _dimensions; d++) {
-            _shuffle[x_byte_position][d] = new int64_t[256];
-            for (uint32_t mask = 0; mask <= 0xff; mask++) {
-                _shuffle[x_byte_position][d][mask] = 0;
-            }
-        }
+    uint32_t n_shuffle = _dimensions * 8 * 256;
+    _shuffle = new int64_t[n_shuffle];
+    for (uint32_t i = 0; i < n_shuffle; i++) {
+        _shuffle[i] = 0;
     }
     for (int d = 0; d < _dimensions; d++) {
+        _deposit_mask[d] = 0;
         for (uint32_t x_bit_position = 0; x_bit_position < _x_bits[d]; x_bit_position++) {
             int64_t x_mask = 1L << (_x_bits[d] - x_bit_position - 1);
             int64_t z_mask = 1L << (62 - xz[d][x_bit_position]);
             uint32_t x_byte_left_shift = (_x_bits[d] - x_bit_position - 1) / 8;
+            int64_t* shuffle = &_shuffle[(d * 8 + x_byte_left_shift) * 256];
+            _deposit_mask[d] |= z_mask;
             for (uint32_t x_byte = 0; x_byte <= 0xff; x_byte++) {
                 // x_partial explores all 256 values of one byte of a coordinate. Outside this one byte,
                 // everything in x_partial is zero, which is fine for generating shuffle masks.
                 int64_t x_partial = ((int64_t) x_byte) << (8 * x_byte_left_shift);
                 if ((x_partial & x_mask) != 0) {
-                    _shuffle[x_byte_left_shift][d][x_byte] |= z_mask;
+                    shuffle[x_byte] |= z_mask;
                 }
             }
         }
     }
 }
 
-void Space::generateZValueFromRegion(ZArray* zs, Region* region) const
+int64_t Space::shuffleTable(const uint64_t* x) const
+{
+    int64_t z = 0;
+    for (uint32_t d = 0; d < _dimensions; d++) {
+        int64_t xd = x[d];
+        GEOPHILE_ASSERT(xd >= 0);
+        const int64_t* shuffle = &_shuffle[d * 8 * 256];
+        switch (_x_bytes[d]) {
+            case 8: z |= shuffle[7 * 256 + ((xd >> 56) & 0xff)];
+            case 7: z |= shuffle[6 * 256 + ((xd >> 48) & 0xff)];
+            case 6: z |= shuffle[5 * 256 + ((xd >> 40) & 0xff)];
+            case 5: z |= shuffle[4 * 256 + ((xd >> 32) & 0xff)];
+            case 4: z |= shuffle[3 * 256 + ((xd >> 24) & 0xff)];
+            case 3: z |= shuffle[2 * 256 + ((xd >> 16) & 0xff)];
+            case 2: z |= shuffle[1 * 256 + ((xd >>  8) & 0xff)];
+            case 1: z |= shuffle[0 * 256 + ((xd      ) & 0xff)];
+        }
+    }
+    return z;
+}
+
+void Space::generateZValueFromRegion(ZArray* zs, Region* region, int32_t interior) const
 {
 #if 0
     uint64_t rxlo = region->lo(0);
@@ -378,7 +829,7 @@ void Space::generateZValueFromRegion(ZArray* zs, Region* region) const
            zToApp(1, rylo),
            zToApp(1, ryhi));
 #endif
-    zs->append(region->z());
+    zs->append(region->z(), interior);
 }
 
 Region* Space::copyRegion(const Region* region, RegionPool* regions) const
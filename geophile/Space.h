@@ -7,6 +7,7 @@
 
 namespace geophile
 {
+    class OccupancyMap;
     class SessionMemoryBase;
     class SpatialObject;
     class Region;
@@ -24,6 +25,39 @@ namespace geophile
     public:
         static const uint32_t MAX_DIMENSIONS = 6;
 
+        /*
+         * How decompose spends its max_z z-values.
+         * BREADTH_FIRST: Regions are split level by level, until
+         *     max_z is reached.
+         * BEST_FIRST: The region wasting the most space, (its volume
+         *     outside the object), is split first, so that the
+         *     z-values cover less space outside the object, and
+         *     fewer records are filtered out by queries. Waste is
+         *     computed for boxes, (see SpatialObject::boxBounds).
+         *     For other objects it is estimated by the region's
+         *     volume.
+         * DATA_AWARE: For queries of a SpatialIndex with an
+         *     OccupancyMap. Regions containing no records are dropped,
+         *     and the region with the most records in its waste,
+         *     (estimated from the map's counts), is split first. A
+         *     region isn't split if fewer than SEEK_RECORDS records are
+         *     expected in its waste, since scanning them costs less
+         *     than another z-value's seek. Without an OccupancyMap,
+         *     this is BEST_FIRST.
+         */
+        typedef enum
+        {
+            BREADTH_FIRST,
+            BEST_FIRST,
+            DATA_AWARE
+        } Decomposition;
+
+        /*
+         * For DATA_AWARE decomposition: The number of records whose
+         * scanning and filtering costs about as much as a seek.
+         */
+        static const uint32_t SEEK_RECORDS = 8;
+
         /*
          * The number of dimensions of this Space.
          */
@@ -44,16 +78,63 @@ namespace geophile
          * memory->zArray().  The maximum number of z-values is
          * max_z. If fewer are needed, then the unused zArray
          * positions are denoted by -1 at the end of the array.
+         * z-values whose regions lie entirely inside spatial_object,
+         * (see SpatialObject::containsRegion), are marked as
+         * interior. Boxes, (see SpatialObject::boxBounds), are
+         * decomposed from their bounds, without virtual calls.
+         * occupancy: Used by DATA_AWARE decomposition, (see
+         *     decomposition). Regions without records are dropped, so
+         *     only a query's decomposition should be given one.
          */
         void decompose(const SpatialObject* spatial_object, 
                        uint32_t max_z,
-                       SessionMemoryBase* memory) const;
+                       SessionMemoryBase* memory,
+                       const OccupancyMap* occupancy = NULL) const;
+
+        /*
+         * Selects the decomposition used by decompose. The default is
+         * BREADTH_FIRST. Changing it while the Space is in use by
+         * other threads has undefined results.
+         */
+        void decomposition(Decomposition decomposition);
+
+        /*
+         * The decomposition used by decompose.
+         */
+        Decomposition decomposition() const;
+
+        /*
+         * Returns the z-value, at full resolution, of the cell containing point,
+         * (an array with one coordinate per dimension).
+         */
+        Z spatialIndexKey(const double* point) const;
+
+        /*
+         * Computes the z-values of n points, given as columns: The
+         * coordinate of point i in dimension d is coords[d][i]. zs[i]
+         * is set to spatialIndexKey of point i. Coordinates are
+         * converted to the Z space four at a time, using AVX2, if the
+         * CPU has it.
+         */
+        void spatialIndexKeys(const double* const* coords, uint32_t n, Z* zs) const;
 
         /*
          * Returns a coordinate in the Z space, right-justified, not a z-value.
          */
         int64_t appToZ(uint32_t d, double x) const;
 
+        /*
+         * Sets z[i] to appToZ(d, x[i]), for 0 <= i < n.
+         */
+        void appToZ(uint32_t d, const double* x, uint32_t n, int64_t* z) const;
+
+        /*
+         * The inverse of shuffle: Sets x[d], for each dimension d, to the
+         * coordinate, (right-justified, in the Z space, as returned by
+         * appToZ), of the low corner of z's region.
+         */
+        void unshuffle(Z z, uint64_t* x) const;
+
         /*
          * Destructor
          */
@@ -78,17 +159,54 @@ namespace geophile
 
     public: // Not part of the API. Public for testing.
         Z shuffle(const uint64_t* x, uint32_t level = -1) const;
+        // Selects shuffling by PDEP/PEXT, (if the CPU has BMI2), or by table
+        // lookup, so that both can be tested. BMI2 is used by default.
+        void useBMI2(bool use_bmi2);
+        // Selects batch conversion to the Z space using AVX2, (if the CPU has
+        // it), or one coordinate at a time. AVX2 is used by default.
+        void useAVX2(bool use_avx2);
         uint32_t zBits() const;
         const uint32_t* interleave() const;
         // z is a right-justified coordinate in the Z space, not a z-value.
         double zToApp(uint32_t d, uint64_t z) const;
 
     private:
-        // Returns the z-value for a point in the application space.
-        Z spatialIndexKey(const double* point) const;
         void useDefaultInterleaving();
         void computeShuffleMasks();
-        void generateZValueFromRegion(ZArray* zs, Region* region) const;
+        int64_t shuffleTable(const uint64_t* x) const;
+
+    private:
+        // spatialIndexKeys works on blocks of this many points.
+        static const uint32_t BLOCK_SIZE = 256;
+        // Splits region, (which contains the object), until the object is
+        // covered by at most max_z z-values, appended to zs.
+        template <class Comparison>
+        void decompose(const Comparison& comparison,
+                       Region* region,
+                       uint32_t max_z,
+                       ZArray* zs,
+                       RegionPool* regions,
+                       const OccupancyMap* occupancy) const;
+        template <class Comparison>
+        void decomposeBreadthFirst(const Comparison& comparison,
+                                   Region* region,
+                                   uint32_t max_z,
+                                   ZArray* zs,
+                                   RegionPool* regions) const;
+        template <class Comparison>
+        void decomposeBestFirst(const Comparison& comparison,
+                                Region* region,
+                                uint32_t max_z,
+                                ZArray* zs,
+                                RegionPool* regions,
+                                const OccupancyMap* occupancy) const;
+        // The priority of region in best-first decomposition: Its waste, or
+        // with occupancy, the records expected in its waste.
+        template <class Comparison>
+        double priority(const Comparison& comparison,
+                        const Region* region,
+                        const OccupancyMap* occupancy) const;
+        void generateZValueFromRegion(ZArray* zs, Region* region, int32_t interior = false) const;
         Region* copyRegion(const Region* region, RegionPool* regions) const;
 
     private:
@@ -106,8 +224,15 @@ namespace geophile
         double* _app_hi;
         double* _app_width;
         uint64_t* _z_range;
-        // For shuffling
-        int64_t*** _shuffle;
+        // For shuffling: _deposit_mask[d] has the z-value bits taken from
+        // dimension d's coordinate, (a PDEP/PEXT mask). The table used without
+        // BMI2 is one allocation: The 256 entries for byte b of dimension
+        // d's coordinate start at _shuffle[(d * 8 + b) * 256].
+        uint64_t _deposit_mask[MAX_DIMENSIONS];
+        int64_t* _shuffle;
+        bool _bmi2;
+        bool _avx2;
+        Decomposition _decomposition;
     };
 }
 
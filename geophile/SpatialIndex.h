@@ -2,12 +2,19 @@
 #define _SPATIAL_INDEX_H
 
 #include <stdint.h>
+#include <atomic>
+#include "OccupancyMap.h"
 #include "Space.h"
 #include "SpatialIndex.h"
 #include "SpatialObject.h"
 #include "OrderedIndex.h"
 #include "SessionMemory.h"
 #include "SpatialIndexScan.h"
+#include "SpatialIndexBatchScan.h"
+#include "SpatialIndexLoader.h"
+#include "SpatialIndexVisitor.h"
+#include "QueryZArray.h"
+#include "RecordSort.h"
 #include "ZArray.h"
 #include "util.h"
 
@@ -15,6 +22,7 @@ namespace geophile
 {
     template <class SOR> class OrderedIndex;
     template <class SOR> class SpatialIndexScan;
+    template <class SOR> class SpatialIndexBatchScan;
     template <class SOR> class SpatialObjectReferenceManager;
     class Space;
     class SpatialIndexFilter;
@@ -23,6 +31,24 @@ namespace geophile
     /*
      * A SpatialIndex organizes a set of SpatialObjects for the
      * efficient execution of spatial searches.
+     *
+     * Retrieval (findOverlapping, findOverlappingBatch) only reads
+     * the SpatialIndex, and all per-search state is kept in the
+     * caller's SessionMemory. So once the SpatialIndex is frozen,
+     * any number of threads can search it concurrently, provided
+     * each thread has its own SessionMemory, and no thread calls add
+     * or remove. (ParallelQueryExecutor relies on this.)
+     *
+     * If the OrderedIndex supports concurrent updates, (e.g.
+     * ConcurrentSkipList), then add and retrieval can also run
+     * concurrently, with no need to freeze, again provided each
+     * thread has its own SessionMemory. freeze itself must not run
+     * concurrently with retrieval, (see freeze).
+     *
+     * A SpatialIndex can keep an OccupancyMap of the z-value prefixes
+     * occupied by its records, (see the constructor). Retrieval then
+     * drops query z-values overlapping no record before searching the
+     * index, so a query in an empty region does no index seeks at all.
      */
     template <class SOR>
     class SpatialIndex
@@ -36,6 +62,14 @@ namespace geophile
             return _space;
         }
 
+        /*
+         * OrderedIndex containing the records of this SpatialIndex.
+         */
+        OrderedIndex<SOR>* index() const
+        {
+            return _index;
+        }
+
         /*
          * Adds spatial_object to this SpatialIndex. memory contains
          * resources used internally.
@@ -43,15 +77,55 @@ namespace geophile
         void add(const SpatialObject* spatial_object, SessionMemory<SOR>* memory)
         {
             GEOPHILE_ASSERT(spatial_object->id() != SpatialObject::UNINITIALIZED_ID);
+            if (spatial_object->isPoint()) {
+                double point[Space::MAX_DIMENSIONS];
+                spatial_object->arbitraryPoint(point);
+                Z z = _space->spatialIndexKey(point);
+                addZ(z);
+                _index->add(z, _spatial_object_reference_manager->newSpatialObjectReference(spatial_object));
+                return;
+            }
             ZArray* zs = memory->zArray();
             zs->clear();
             _space->decompose(spatial_object, spatial_object->maxZ(), memory);
             for (uint32_t i = 0; i < zs->length(); i++) {
-                _index->add(zs->at(i), 
-                            _spatial_object_reference_manager->newSpatialObjectReference(spatial_object));
+                Z z = zs->at(i);
+                addZ(z);
+                _index->add(z, _spatial_object_reference_manager->newSpatialObjectReference(spatial_object));
             }
         }
 
+        /*
+         * Adds the n spatial_objects to this SpatialIndex, and
+         * prepares it for retrieval, (as freeze does). The result is
+         * the same as calling add for each SpatialObject and then
+         * freeze, but the work is done by n_threads threads: The
+         * SpatialObjects are decomposed in parallel, the resulting
+         * records are sorted by a parallel radix sort (RecordSort),
+         * and the sorted records are passed to OrderedIndex::load.
+         * The SpatialObjectReferenceManager's
+         * newSpatialObjectReference must be safe to call from several
+         * threads at once.
+         */
+        void load(const SpatialObject* const* spatial_objects, uint32_t n, uint32_t n_threads)
+        {
+            SpatialIndexLoader<SOR> loader(_space,
+                                           _spatial_object_reference_manager,
+                                           spatial_objects,
+                                           n,
+                                           n_threads);
+            loader.generateRecords();
+            RecordSort<SOR>::sort(loader.records(), loader.nRecords(), n_threads);
+            // Before the records are visible, (see addZLengths).
+            addZLengths(loader.zLengths());
+            if (_occupancy) {
+                for (uint32_t i = 0; i < loader.nRecords(); i++) {
+                    _occupancy->add(loader.records()[i].key().z());
+                }
+            }
+            _index->load(loader.records(), loader.nRecords());
+        }
+
         /*
          * Removes spatial_object to this SpatialIndex. memory contains
          * resources used internally.
@@ -64,11 +138,17 @@ namespace geophile
         }
 
         /*
-         * Prepares this SpatialIndex for retrieval.
+         * Prepares this SpatialIndex for retrieval. The OccupancyMap,
+         * if any, is rebuilt from the index's records, clearing the
+         * prefixes of removed records. The map is cleared and refilled
+         * in place, so a retrieval running at the same time could find
+         * regions missing, and return incomplete results. freeze must
+         * therefore not run concurrently with retrieval, or with add.
          */
         void freeze()
         {
             _index->freeze();
+            rebuildOccupancy();
         }
 
         /*
@@ -81,44 +161,193 @@ namespace geophile
                              const SpatialIndexFilter* filter,
                              SessionMemory<SOR>* memory) const
         {
-            _space->decompose(query_object, query_object->maxZ(), memory);
+            _space->decompose(query_object, query_object->maxZ(), memory, _occupancy);
             SpatialIndexScan<SOR>* scan = newScan(query_object, filter, memory);
             ZArray* zs = memory->zArray();
             for (uint32_t i = 0; i < zs->length(); i++) {
-                scan->find(zs->at(i));
+                if (mayOverlap(zs->at(i))) {
+                    scan->find(zs->at(i), zs->interior(i));
+                }
             }
             delete scan;
         }
 
+        /*
+         * Find all the SpatialObjects in this SpatialIndex that
+         * overlap spatial_object, as above, but instead of
+         * accumulating results in memory->output(), pass each one to
+         * visitor->visit (see SpatialIndexVisitor.h). If visit
+         * returns VISIT_STOP, the search ends immediately, and
+         * findOverlapping returns false. Otherwise, it returns true
+         * once all results have been visited.
+         */
+        template <class VISITOR>
+        bool findOverlapping(const SpatialObject* query_object, 
+                             const SpatialIndexFilter* filter,
+                             VISITOR* visitor,
+                             SessionMemory<SOR>* memory) const
+        {
+            _space->decompose(query_object, query_object->maxZ(), memory, _occupancy);
+            SpatialIndexScan<SOR> scan(_space,
+                                       _index, 
+                                       _z_lengths.load(),
+                                       query_object, 
+                                       filter, 
+                                       _spatial_object_reference_manager, 
+                                       NULL);
+            ZArray* zs = memory->zArray();
+            for (uint32_t i = 0; i < zs->length(); i++) {
+                if (mayOverlap(zs->at(i)) && !scan.find(zs->at(i), visitor, zs->interior(i))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /*
+         * Find, for each of n_queries query objects, all the
+         * SpatialObjects in this SpatialIndex that overlap it. The
+         * result is the same as calling findOverlapping for each
+         * query object, but the queries are evaluated together in
+         * one pass over the index: All the query objects are
+         * decomposed, the z-values of all queries are sorted, and the
+         * index is then scanned in z-order. The results are returned
+         * in memory->batchOutput(), in which partition q contains the
+         * output for query_objects[q]. 
+         */
+        void findOverlappingBatch(const SpatialObject* const* query_objects,
+                                  uint32_t n_queries,
+                                  const SpatialIndexFilter* filter,
+                                  SessionMemory<SOR>* memory) const
+        {
+            ZArray* zs = memory->zArray();
+            QueryZArray* query_zs = memory->queryZArray();
+            query_zs->clear();
+            for (uint32_t q = 0; q < n_queries; q++) {
+                const SpatialObject* query_object = query_objects[q];
+                _space->decompose(query_object, query_object->maxZ(), memory, _occupancy);
+                for (uint32_t i = 0; i < zs->length(); i++) {
+                    if (mayOverlap(zs->at(i))) {
+                        query_zs->append(zs->at(i), q, zs->interior(i));
+                    }
+                }
+            }
+            query_zs->sort();
+            PartitionedOutputArray<SOR>* output = memory->batchOutput();
+            output->start(n_queries);
+            SpatialIndexBatchScan<SOR> scan(_space, 
+                                            _index, 
+                                            _z_lengths.load(), 
+                                            query_objects, 
+                                            n_queries, 
+                                            filter, 
+                                            output);
+            scan.find(query_zs);
+            output->close();
+        }
+
         /*
          * Constructor.
          *     space: The Space containing the SpatialObjects to be indexed.
          *     index: The OrderedIndex that will contain records of the spatial index.
+         *         Records must be added through this SpatialIndex, which keeps
+         *         track of the lengths of the z-values added, or be reported by
+         *         index->zLengths(), (e.g. for a MappedIndex).
+         *     occupancy_levels: If nonzero, the number of levels of an OccupancyMap,
+         *         (at most OccupancyMap::MAX_LEVELS, and limited to space->zBits()).
+         *         The map has 2^(occupancy_levels + 2) bits. It is maintained by add
+         *         and load, rebuilt by freeze, and built on construction if the index
+         *         already has records. If space->decomposition() is
+         *         Space::DATA_AWARE, queries are decomposed using the map's counts.
          */
         SpatialIndex(const Space* space, 
                      OrderedIndex<SOR>* index,
-                     SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager)
+                     SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                     uint32_t occupancy_levels = 0)
             : _space(space),
               _index(index),
-              _spatial_object_reference_manager(spatial_object_reference_manager)
-            {}
+              _spatial_object_reference_manager(spatial_object_reference_manager),
+              _z_lengths(index->zLengths()),
+              _occupancy(NULL)
+        {
+            if (occupancy_levels > 0) {
+                if (occupancy_levels > space->zBits()) {
+                    occupancy_levels = space->zBits();
+                }
+                _occupancy = new OccupancyMap(occupancy_levels);
+                // If the index is empty, the cursor finds nothing.
+                rebuildOccupancy();
+            }
+        }
+
+        ~SpatialIndex()
+        {
+            delete _occupancy;
+        }
 
     public: // Not part of the API. Public for testing.
         SpatialIndexScan<SOR>* newScan(const SpatialObject* query_object,
                                        const SpatialIndexFilter* filter, 
                                        SessionMemory<SOR>* memory) const
         {
-            return new SpatialIndexScan<SOR>(_index, 
+            return new SpatialIndexScan<SOR>(_space,
+                                             _index, 
+                                             _z_lengths.load(),
                                              query_object, 
                                              filter,
                                              _spatial_object_reference_manager,
                                              (OutputArray<SOR>*) memory->output());
         }
 
+    private:
+        void addZ(Z z)
+        {
+            addZLengths(1ULL << z.length());
+            if (_occupancy) {
+                _occupancy->add(z);
+            }
+        }
+
+        bool mayOverlap(Z z) const
+        {
+            return _occupancy == NULL || _occupancy->mayOverlap(z);
+        }
+
+        void rebuildOccupancy()
+        {
+            if (_occupancy) {
+                _occupancy->clear();
+                Cursor<SOR>* cursor = _index->cursor();
+                cursor->goTo(SpatialObjectKey(Z(Z::Z_MIN, 0)));
+                Record<SOR> record;
+                while (!(record = cursor->next()).eof()) {
+                    _occupancy->add(record.key().z());
+                }
+                delete cursor;
+            }
+        }
+
+        // Lengths, and occupied prefixes, are recorded before the records
+        // are added, so that concurrent retrievals (possible with a
+        // ConcurrentSkipList) probe for them once the records are visible.
+        // (This doesn't hold during freeze, which clears the OccupancyMap
+        // before refilling it.)
+        void addZLengths(uint64_t z_lengths)
+        {
+            if ((_z_lengths.load(std::memory_order_relaxed) & z_lengths) != z_lengths) {
+                _z_lengths.fetch_or(z_lengths);
+            }
+        }
+
     private:
         const Space* _space;
         OrderedIndex<SOR>* _index;
         SpatialObjectReferenceManager<SOR>* _spatial_object_reference_manager;
+        // Bit i is set if a z-value of length i has been added. Retrieval probes for
+        // records containing a query z-value only at these lengths.
+        std::atomic<uint64_t> _z_lengths;
+        // Prefixes of the z-values of records, or NULL.
+        OccupancyMap* _occupancy;
     };
 }
 
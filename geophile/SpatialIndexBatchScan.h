@@ -0,0 +1,243 @@
+#ifndef _SPATIAL_INDEX_BATCH_SCAN_H
+#define _SPATIAL_INDEX_BATCH_SCAN_H
+
+#include <string.h>
+#include "Z.h"
+#include "Space.h"
+#include "OrderedIndex.h"
+#include "Cursor.h"
+#include "Record.h"
+#include "PartitionedOutputArray.h"
+#include "QueryZArray.h"
+#include "SpatialIndexFilter.h"
+#include "SpatialObjectKey.h"
+
+namespace geophile
+{
+    template <class SOR> class Cursor;
+    template <class SOR> class OrderedIndex;
+    template <class SOR> class PartitionedOutputArray;
+    class QueryZArray;
+    class Space;
+    class SpatialIndexFilter;
+    class SpatialObject;
+
+    /*
+     * A SpatialIndexBatchScan evaluates a batch of queries in one
+     * forward pass over an OrderedIndex. The input is the (z-value,
+     * query id) pairs of all the queries' decompositions, in sorted
+     * order. Any two z-values are either disjoint or nested, so the
+     * sorted z-values form groups: a z-value followed by the
+     * z-values it contains. Each group is scanned once, keeping a
+     * stack of the group's z-values that contain the current
+     * record. The query z-values contained by the current record
+     * follow the stack in the sorted input. Records containing the
+     * whole group are found by probing the group's ancestors, as in
+     * SpatialIndexScan. Consecutive groups are disjoint and
+     * increasing, and ancestors sort before their groups, so the
+     * cursor only moves forward. As in SpatialIndexScan, records in
+     * a query's interior z-values are not filtered, unless
+     * duplicates are being eliminated.
+     */
+    template <class SOR> class SpatialIndexBatchScan
+    {
+    public:
+        /*
+         * query_zs must be sorted. Output for query q goes to
+         * partition q of the output array.
+         */
+        void find(const QueryZArray* query_zs)
+        {
+            uint32_t n = query_zs->length();
+            _active = new uint32_t[n];
+            uint32_t* active = _active;
+            uint32_t n_active;
+            _checked = new uint64_t[_n_queries];
+            memset(_checked, 0, _n_queries * sizeof(uint64_t));
+            uint64_t serial = 0;
+            Z previous_group_z;
+            uint32_t group_start = 0;
+            while (group_start < n) {
+                Z group_z = query_zs->at(group_start);
+                uint32_t group_end = group_start + 1;
+                while (group_end < n && group_z.contains(query_zs->at(group_end))) {
+                    group_end++;
+                }
+                // Probe the group's ancestors, skipping those probed for the previous
+                // group. A record at an ancestor overlaps every query with a z-value
+                // in the ancestor, which may include later groups.
+                uint64_t ancestor_lengths = _z_lengths & ((1ULL << group_z.length()) - 1);
+                while (ancestor_lengths != 0) {
+                    uint32_t length = __builtin_ctzll(ancestor_lengths);
+                    ancestor_lengths &= ancestor_lengths - 1;
+                    Z ancestor = group_z.ancestor(length);
+                    if (group_start > 0 && ancestor.contains(previous_group_z)) {
+                        continue;
+                    }
+                    Record<SOR> record = start(ancestor, ancestor.asInteger());
+                    while (!record.eof() && record.key().z() == ancestor) {
+                        serial++;
+                        for (uint32_t i = group_start; 
+                             i < n && ancestor.contains(query_zs->at(i)); 
+                             i++) {
+                            check(query_zs->query(i), record, serial, false);
+                        }
+                        record = _cursor->next();
+                    }
+                }
+                // Scan the group
+                int64_t group_last = group_z.last();
+                Record<SOR> record = start(group_z, group_last);
+                n_active = 0;
+                uint32_t next = group_start;
+                while (!record.eof() && record.key().z().asInteger() <= group_last) {
+                    Z record_z = record.key().z();
+                    // Activate the group's z-values starting at or before the record.
+                    while (next < group_end && query_zs->at(next).lo() <= record_z.asInteger()) {
+                        Z z = query_zs->at(next);
+                        while (n_active > 0 && !query_zs->at(active[n_active - 1]).contains(z)) {
+                            n_active--;
+                        }
+                        active[n_active++] = next++;
+                    }
+                    // Deactivate the ones that end before the record. The remaining active
+                    // z-values are nested, and all of them contain the record.
+                    while (n_active > 0 && !query_zs->at(active[n_active - 1]).contains(record_z)) {
+                        n_active--;
+                    }
+                    serial++;
+                    for (uint32_t i = 0; i < n_active; i++) {
+                        check(query_zs->query(active[i]), 
+                              record, 
+                              serial, 
+                              query_zs->interior(active[i]));
+                    }
+                    for (uint32_t i = next; i < group_end && record_z.contains(query_zs->at(i)); i++) {
+                        check(query_zs->query(i), record, serial, false);
+                    }
+                    record = _cursor->next();
+                }
+                previous_group_z = group_z;
+                group_start = group_end;
+            }
+            delete [] _active;
+            _active = NULL;
+            delete [] _checked;
+            _checked = NULL;
+        }
+
+        ~SpatialIndexBatchScan()
+        {
+            // If the filter threw, find didn't get to delete these.
+            delete [] _active;
+            delete [] _checked;
+            delete _cursor;
+        }
+
+        SpatialIndexBatchScan(const Space* space,
+                              OrderedIndex<SOR>* index, 
+                              uint64_t z_lengths,
+                              const SpatialObject* const* query_objects,
+                              uint32_t n_queries,
+                              const SpatialIndexFilter* filter, 
+                              PartitionedOutputArray<SOR>* output)
+            : _space(space),
+              _index(index),
+              _z_lengths(z_lengths),
+              _query_objects(query_objects),
+              _n_queries(n_queries),
+              _filter(filter),
+              _output(output),
+              _has_reference_point(filter->hasReferencePoint()),
+              _cursor(NULL),
+              _previous_last(Z::Z_MIN),
+              _active(NULL),
+              _checked(NULL)
+        {}
+
+    private:
+        // Returns the first record at or after the start of z, for a scan that
+        // ends at last.
+        Record<SOR> start(Z z, int64_t last)
+        {
+            SpatialObjectKey start(z);
+            Record<SOR> record;
+            if (!_cursor) {
+                _cursor = _index->cursor();
+                _cursor->goTo(start);
+                record = _cursor->next();
+            } else if (z.lo() <= _previous_last) {
+                _cursor->goTo(start);
+                record = _cursor->next();
+            } else {
+                const Record<SOR>& current = _cursor->current();
+                if (!current.eof()) {
+                    if (current.key().z().asInteger() < z.lo()) {
+                        _cursor->skipTo(start);
+                        record = _cursor->next();
+                    } else {
+                        record = current;
+                    }
+                }
+            }
+            _previous_last = last;
+            return record;
+        }
+
+        // Checks record against query, unless that has already been done. serial
+        // identifies the record. interior indicates that the record is contained by
+        // an interior z-value of the query.
+        void check(uint32_t query, const Record<SOR>& record, uint64_t serial, bool interior)
+        {
+            if (_checked[query] != serial) {
+                _checked[query] = serial;
+                SOR spatial_object_reference = record.spatialObjectReference();
+                if ((interior && !_has_reference_point) ||
+                    report(_query_objects[query], 
+                           spatial_object_reference.spatialObject(), 
+                           record.key().z())) {
+                    _output->append(query, spatial_object_reference);
+                }
+            }
+        }
+
+        // A record is checked at most once per query. The reference point, if the filter
+        // provides one, lies in exactly one of spatial_object's z-values, so the pair is
+        // reported only for the record whose z-value, record_z, contains it.
+        bool report(const SpatialObject* query_object, 
+                    const SpatialObject* spatial_object, 
+                    Z record_z) const
+        {
+            if (!_filter->overlap(query_object, spatial_object)) {
+                return false;
+            }
+            if (!_has_reference_point) {
+                return true;
+            }
+            double point[Space::MAX_DIMENSIONS];
+            return 
+                !_filter->referencePoint(query_object, spatial_object, point) ||
+                record_z.contains(_space->spatialIndexKey(point));
+        }
+
+    private:
+        const Space* _space;
+        OrderedIndex<SOR>* _index;
+        uint64_t _z_lengths;
+        const SpatialObject* const* _query_objects;
+        uint32_t _n_queries;
+        const SpatialIndexFilter* _filter;
+        PartitionedOutputArray<SOR>* _output;
+        bool _has_reference_point;
+        Cursor<SOR>* _cursor;
+        // End of the most recent probe or range scanned
+        int64_t _previous_last;
+        // Positions in query_zs of the z-values containing the current record,
+        // during find.
+        uint32_t* _active;
+        // _checked[q] is the serial number of the last record checked against query q.
+        uint64_t* _checked;
+    };
+}
+
+#endif
@@ -8,6 +8,17 @@ namespace geophile
     /*
      * A retrieval from a spatial index may yield a few false
      * positives. A SpatialObjectFilter is used to eliminate them.
+     *
+     * A SpatialObject is usually represented by several z-values, so
+     * a retrieval may find the same SpatialObject more than once. A
+     * filter that implements hasReferencePoint and referencePoint
+     * eliminates these duplicates: Of the places that query_object
+     * and spatial_object meet in the index, only the cell containing
+     * the reference point reports the pair.
+     *
+     * Records found in a region lying entirely inside the query
+     * object, (see SpatialObject::containsRegion), are not
+     * filtered, unless duplicates are being eliminated.
      */
     class SpatialIndexFilter
     {
@@ -20,6 +31,33 @@ namespace geophile
          */
         virtual bool overlap(const SpatialObject* query_object, 
                              const SpatialObject* spatial_object) const = 0;
+
+        /*
+         * Returns true if this filter implements referencePoint. The
+         * default is false.
+         */
+        virtual bool hasReferencePoint() const
+        {
+            return false;
+        }
+
+        /*
+         * Called for objects that overlap, if hasReferencePoint()
+         * returns true. Stores in point a point (an array with one
+         * coordinate per dimension) that lies in both query_object
+         * and spatial_object, and is chosen the same way each time it
+         * is called for the same pair, e.g. the low corner of their
+         * intersection. Returns true if this is done, or false if
+         * duplicates of this pair should not be eliminated.
+         */
+        virtual bool referencePoint(const SpatialObject* query_object,
+                                    const SpatialObject* spatial_object,
+                                    double* point) const
+        {
+            return false;
+        }
+
+        virtual ~SpatialIndexFilter() {}
     };
 }
 
@@ -0,0 +1,261 @@
+#ifndef _SPATIAL_INDEX_LOADER_H
+#define _SPATIAL_INDEX_LOADER_H
+
+#include <stdint.h>
+#include <string.h>
+#include "Record.h"
+#include "SessionMemory.h"
+#include "Space.h"
+#include "SpatialObject.h"
+#include "SpatialObjectReferenceManager.h"
+#include "Threads.h"
+#include "ZArray.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR> class SpatialObjectReferenceManager;
+    class Space;
+    class SpatialObject;
+
+    /*
+     * Used by SpatialIndex::load to generate the records for a set of
+     * SpatialObjects in parallel. Each thread decomposes a contiguous
+     * slice of the SpatialObjects, using its own SessionMemory, and
+     * accumulates records in its own array. The arrays are then
+     * copied, in parallel, into one array, in the order of the
+     * slices. The records are not sorted.
+     *
+     * The coordinates of points are gathered into columns, and their
+     * z-values are computed in batches, by Space::spatialIndexKeys.
+     */
+    template <class SOR> // SOR: Spatial Object Reference
+    class SpatialIndexLoader
+    {
+    public:
+        /*
+         * Generates the records of the SpatialObjects.
+         */
+        void generateRecords()
+        {
+            _phase = PHASE_DECOMPOSE;
+            Threads::run(_n_threads, run, this);
+            _n_records = 0;
+            for (uint32_t t = 0; t < _n_threads; t++) {
+                Slice* slice = &_slices[t];
+                slice->position = _n_records;
+                _n_records += slice->n_records;
+                _z_lengths |= slice->z_lengths;
+            }
+            // The records are only a target for memcpy, so they don't
+            // need to be constructed.
+            _records = (Record<SOR>*) new uint8_t[_n_records * sizeof(Record<SOR>)];
+            _phase = PHASE_COPY;
+            Threads::run(_n_threads, run, this);
+        }
+
+        /*
+         * The records generated, available after generateRecords.
+         */
+        Record<SOR>* records() const
+        {
+            return _records;
+        }
+
+        /*
+         * Number of records generated.
+         */
+        uint32_t nRecords() const
+        {
+            return _n_records;
+        }
+
+        /*
+         * Bit i is set if a record with a z-value of length i was
+         * generated.
+         */
+        uint64_t zLengths() const
+        {
+            return _z_lengths;
+        }
+
+        /*
+         * Destructor
+         */
+        ~SpatialIndexLoader()
+        {
+            delete [] _slices;
+            delete [] (uint8_t*) _records;
+        }
+
+        /*
+         * Constructor.
+         *     space: The Space used to decompose the SpatialObjects.
+         *     spatial_object_reference_manager: Creates the SORs of
+         *         the records. newSpatialObjectReference must be safe
+         *         to call from several threads at once.
+         *     spatial_objects: The SpatialObjects to be loaded.
+         *     n: Number of SpatialObjects.
+         *     n_threads: Number of threads generating records.
+         */
+        SpatialIndexLoader(const Space* space,
+                           const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
+                           const SpatialObject* const* spatial_objects,
+                           uint32_t n,
+                           uint32_t n_threads)
+            : _space(space),
+              _spatial_object_reference_manager(spatial_object_reference_manager),
+              _spatial_objects(spatial_objects),
+              _n(n),
+              _n_threads(n_threads),
+              _slices(new Slice[n_threads]),
+              _records(NULL),
+              _n_records(0),
+              _z_lengths(0),
+              _phase(PHASE_DECOMPOSE)
+        {
+            GEOPHILE_ASSERT(n_threads > 0);
+        }
+
+    private:
+        static const uint32_t POINT_BATCH = 256;
+
+        typedef enum {
+            PHASE_DECOMPOSE,
+            PHASE_COPY
+        } Phase;
+
+        struct Slice
+        {
+            SessionMemory<SOR> memory;
+            Record<SOR>* records;
+            uint32_t n_records;
+            uint32_t capacity;
+            // Position of this slice's records in _records
+            uint32_t position;
+            uint64_t z_lengths;
+
+            void add(Z z, const SOR& sor)
+            {
+                if (n_records == capacity) {
+                    uint32_t new_capacity = capacity == 0 ? INITIAL_CAPACITY : capacity * 2;
+                    Record<SOR>* new_records = new Record<SOR>[new_capacity];
+                    if (records) {
+                        memcpy(new_records, records, n_records * sizeof(Record<SOR>));
+                        delete [] records;
+                    }
+                    records = new_records;
+                    capacity = new_capacity;
+                }
+                records[n_records++].set(z, sor);
+                z_lengths |= 1ULL << z.length();
+            }
+
+            ~Slice()
+            {
+                delete [] records;
+            }
+
+            Slice()
+                : records(NULL),
+                  n_records(0),
+                  capacity(0),
+                  position(0),
+                  z_lengths(0)
+            {}
+        };
+
+        static void run(void* argument, uint32_t thread)
+        {
+            SpatialIndexLoader<SOR>* loader = (SpatialIndexLoader<SOR>*) argument;
+            if (loader->_phase == PHASE_DECOMPOSE) {
+                loader->decompose(thread);
+            } else {
+                loader->copy(thread);
+            }
+        }
+
+        void decompose(uint32_t thread)
+        {
+            Slice* slice = &_slices[thread];
+            uint32_t start = (uint32_t) (((uint64_t) _n * thread) / _n_threads);
+            uint32_t end = (uint32_t) (((uint64_t) _n * (thread + 1)) / _n_threads);
+            ZArray* zs = slice->memory.zArray();
+            uint32_t dimensions = _space->dimensions();
+            // Points waiting for their z-values
+            const SpatialObject* points[POINT_BATCH];
+            double coords[Space::MAX_DIMENSIONS][POINT_BATCH];
+            const double* columns[Space::MAX_DIMENSIONS];
+            for (uint32_t d = 0; d < dimensions; d++) {
+                columns[d] = coords[d];
+            }
+            uint32_t n_points = 0;
+            for (uint32_t i = start; i < end; i++) {
+                const SpatialObject* spatial_object = _spatial_objects[i];
+                GEOPHILE_ASSERT(spatial_object->id() != SpatialObject::UNINITIALIZED_ID);
+                if (spatial_object->isPoint()) {
+                    double point[Space::MAX_DIMENSIONS];
+                    spatial_object->arbitraryPoint(point);
+                    for (uint32_t d = 0; d < dimensions; d++) {
+                        coords[d][n_points] = point[d];
+                    }
+                    points[n_points++] = spatial_object;
+                    if (n_points == POINT_BATCH) {
+                        addPoints(slice, points, columns, n_points);
+                        n_points = 0;
+                    }
+                } else {
+                    zs->clear();
+                    _space->decompose(spatial_object, spatial_object->maxZ(), &slice->memory);
+                    for (uint32_t j = 0; j < zs->length(); j++) {
+                        slice->add(zs->at(j),
+                                   _spatial_object_reference_manager->newSpatialObjectReference(spatial_object));
+                    }
+                }
+            }
+            addPoints(slice, points, columns, n_points);
+        }
+
+        void addPoints(Slice* slice,
+                       const SpatialObject* const* points,
+                       const double* const* columns,
+                       uint32_t n_points)
+        {
+            Z point_zs[POINT_BATCH];
+            _space->spatialIndexKeys(columns, n_points, point_zs);
+            for (uint32_t p = 0; p < n_points; p++) {
+                slice->add(point_zs[p],
+                           _spatial_object_reference_manager->newSpatialObjectReference(points[p]));
+            }
+        }
+
+        void copy(uint32_t thread)
+        {
+            Slice* slice = &_slices[thread];
+            if (slice->n_records > 0) {
+                memcpy(&_records[slice->position], slice->records, slice->n_records * sizeof(Record<SOR>));
+            }
+            delete [] slice->records;
+            slice->records = NULL;
+            slice->n_records = 0;
+            slice->capacity = 0;
+        }
+
+    private:
+        static const uint32_t INITIAL_CAPACITY = 1000;
+
+    private:
+        const Space* _space;
+        const SpatialObjectReferenceManager<SOR>* _spatial_object_reference_manager;
+        const SpatialObject* const* _spatial_objects;
+        uint32_t _n;
+        uint32_t _n_threads;
+        Slice* _slices;
+        Record<SOR>* _records;
+        uint32_t _n_records;
+        uint64_t _z_lengths;
+        Phase _phase;
+    };
+}
+
+#endif
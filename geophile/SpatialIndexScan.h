@@ -2,6 +2,7 @@
 #define _SPATIAL_INDEX_SCAN_H
 
 #include "Z.h"
+#include "Space.h"
 #include "SpatialIndexScan.h"
 #include "OrderedIndex.h"
 #include "Cursor.h"
@@ -10,6 +11,7 @@
 #include "SpatialIndexFilter.h"
 #include "SpatialObjectKey.h"
 #include "OutputArray.h"
+#include "SpatialIndexVisitor.h"
 
 namespace geophile
 {
@@ -17,28 +19,75 @@ namespace geophile
     template <class SOR> class OrderedIndex;
     template <class SOR> class OutputArray;
     template <class SOR> class SpatialObjectReferenceManager;
+    class Space;
     class SpatialIndexFilter;
     class SpatialObject;
 
+    /*
+     * A SpatialIndexScan retrieves the records of an OrderedIndex
+     * whose z-values overlap the z-values of a query object, i.e.,
+     * the records whose z-values contain, or are contained by, a
+     * query z-value.
+     *
+     * Records contained by a query z-value z are found by scanning
+     * z's range of the index. Records containing z are found by
+     * probing for each of z's ancestors. Only the lengths of z-values
+     * present in the index (z_lengths, maintained by SpatialIndex)
+     * are probed, so for an index of points, there are no probes at
+     * all. An ancestor of several query z-values is probed once.
+     *
+     * When find is called with z-values in increasing order, (e.g. as
+     * produced by Space::decompose), the scan is a single forward
+     * pass over the index: An ancestor sorts before the z-values it
+     * contains, so after the first probe or range, the cursor only
+     * moves forward, either not at all, if it is already positioned
+     * at or past the next position, or by Cursor::skipTo. z-values
+     * out of order are handled by repositioning the cursor with goTo.
+     *
+     * Records passing the filter, (including duplicate elimination
+     * by reference point), are either appended to an
+     * OutputArray, or passed to a visitor, which can end the scan
+     * early. Records contained by an interior query z-value (see
+     * ZArray) must overlap the query object, so they are not
+     * filtered, and their spatial objects are not accessed, unless
+     * duplicates are being eliminated.
+     */
     template <class SOR> class SpatialIndexScan
     {
     public:
-        void find(Z z)
+        void find(Z z, bool interior = false)
         {
-            if (!_cursor) {
-                _cursor = _index->cursor();
+            OutputArrayVisitor<SOR> visitor(_output);
+            find(z, &visitor, interior);
+        }
+
+        /*
+         * Passes each record overlapping z, and passing the filter,
+         * to visitor. interior indicates whether z is an interior
+         * z-value of the query object. Returns false if visitor
+         * stopped the scan, true otherwise.
+         */
+        template <class VISITOR>
+        bool find(Z z, VISITOR* visitor, bool interior = false)
+        {
+            if (_previous_z_valid && z.lo() <= _previous_z.last()) {
+                // Out of order. Ancestors shared with the previous z-value can't be
+                // assumed to have been probed already.
+                _previous_z_valid = false;
             }
-            int64_t zhi = z.hi();
-            _cursor->goTo(SpatialObjectKey(z));
-            Record<SOR> record = _cursor->next();
-            while (!record.eof() && record.key().z().asInteger() < zhi) {
-                SOR spatial_object_reference = record.spatialObjectReference();
-                const SpatialObject* spatial_object = spatial_object_reference.spatialObject();
-                if (_filter->overlap(_query_object, spatial_object)) {
-                    _output->append(spatial_object_reference);
+            uint64_t ancestor_lengths = _z_lengths & ((1ULL << z.length()) - 1);
+            while (ancestor_lengths != 0) {
+                uint32_t length = __builtin_ctzll(ancestor_lengths);
+                ancestor_lengths &= ancestor_lengths - 1;
+                Z ancestor = z.ancestor(length);
+                if (!(_previous_z_valid && ancestor.contains(_previous_z)) &&
+                    !scan(ancestor, ancestor.asInteger(), false, visitor)) {
+                    return false;
                 }
-                record = _cursor->next();
             }
+            _previous_z = z;
+            _previous_z_valid = true;
+            return scan(z, z.last(), interior && !_has_reference_point, visitor);
         }
 
         ~SpatialIndexScan()
@@ -46,24 +95,110 @@ namespace geophile
             delete _cursor;
         }
 
-        SpatialIndexScan(OrderedIndex<SOR>* index, 
+        SpatialIndexScan(const Space* space,
+                         OrderedIndex<SOR>* index, 
+                         uint64_t z_lengths,
                          const SpatialObject* query_object,
                          const SpatialIndexFilter* filter, 
                          SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
                          OutputArray<SOR>* output)
-            : _index(index),
+            : _space(space),
+            _index(index),
+            _z_lengths(z_lengths),
             _query_object(query_object),
             _filter(filter),
             _output(output),
-            _cursor(NULL)
+            _has_reference_point(filter->hasReferencePoint()),
+            _cursor(NULL),
+            _previous_last(Z::Z_MIN),
+            _previous_z(),
+            _previous_z_valid(false)
             {}
 
     private:
+        // Visits the records whose z-values are in [start, last]. If unfiltered,
+        // then all of them are known to overlap the query object.
+        template <class VISITOR>
+        bool scan(Z start, int64_t last, bool unfiltered, VISITOR* visitor)
+        {
+            SpatialObjectKey start_key(start);
+            Record<SOR> record;
+            if (!_cursor) {
+                _cursor = _index->cursor();
+                _cursor->goTo(start_key);
+                record = _cursor->next();
+            } else if (start.lo() <= _previous_last) {
+                _cursor->goTo(start_key);
+                record = _cursor->next();
+            } else {
+                // The cursor's current record is the first one after the end of the
+                // previous scan. If there is no such record, then there is nothing
+                // left to find. 
+                const Record<SOR>& current = _cursor->current();
+                if (!current.eof()) {
+                    if (current.key().z().asInteger() < start.lo()) {
+                        _cursor->skipTo(start_key);
+                        record = _cursor->next();
+                    } else {
+                        record = current;
+                    }
+                }
+            }
+            _previous_last = last;
+            if (unfiltered) {
+                while (!record.eof() && record.key().z().asInteger() <= last) {
+                    if (visitor->visit(record.spatialObjectReference()) == VISIT_STOP) {
+                        return false;
+                    }
+                    record = _cursor->next();
+                }
+                return true;
+            }
+            while (!record.eof() && record.key().z().asInteger() <= last) {
+                SOR spatial_object_reference = record.spatialObjectReference();
+                const SpatialObject* spatial_object = spatial_object_reference.spatialObject();
+                if (report(_query_object, spatial_object, record.key().z()) &&
+                    visitor->visit(spatial_object_reference) == VISIT_STOP) {
+                    return false;
+                }
+                record = _cursor->next();
+            }
+            return true;
+        }
+
+        // A record is checked at most once per query. The reference point, if the filter
+        // provides one, lies in exactly one of spatial_object's z-values, so the pair is
+        // reported only for the record whose z-value, record_z, contains it.
+        bool report(const SpatialObject* query_object, 
+                    const SpatialObject* spatial_object, 
+                    Z record_z) const
+        {
+            if (!_filter->overlap(query_object, spatial_object)) {
+                return false;
+            }
+            if (!_has_reference_point) {
+                return true;
+            }
+            double point[Space::MAX_DIMENSIONS];
+            return 
+                !_filter->referencePoint(query_object, spatial_object, point) ||
+                record_z.contains(_space->spatialIndexKey(point));
+        }
+
+    private:
+        const Space* _space;
         OrderedIndex<SOR>* _index;
+        uint64_t _z_lengths;
         const SpatialObject* _query_object;
         const SpatialIndexFilter* _filter;
         OutputArray<SOR>* _output;
+        bool _has_reference_point;
         Cursor<SOR>* _cursor;
+        // End of the most recent probe or range scanned
+        int64_t _previous_last;
+        // Most recent query z-value
+        Z _previous_z;
+        bool _previous_z_valid;
     };
 }
 
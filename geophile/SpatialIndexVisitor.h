@@ -0,0 +1,46 @@
+#ifndef _SPATIAL_INDEX_VISITOR_H
+#define _SPATIAL_INDEX_VISITOR_H
+
+#include "OutputArray.h"
+
+namespace geophile
+{
+    /*
+     * Returned by a visitor passed to SpatialIndex::findOverlapping,
+     * to continue or end the search.
+     */
+    typedef enum
+    {
+        VISIT_CONTINUE,
+        VISIT_STOP
+    } VisitResult;
+
+    /*
+     * A visitor is any class with a method
+     *
+     *     VisitResult visit(const SOR& sor)
+     *
+     * SpatialIndex::findOverlapping takes the visitor's type as a
+     * template parameter, so calls to visit are not virtual and can
+     * be inlined. OutputArrayVisitor is the visitor used to
+     * accumulate results in an OutputArray.
+     */
+    template <class SOR> class OutputArrayVisitor
+    {
+    public:
+        VisitResult visit(const SOR& sor)
+        {
+            _output->append(sor);
+            return VISIT_CONTINUE;
+        }
+
+        OutputArrayVisitor(OutputArray<SOR>* output)
+            : _output(output)
+        {}
+
+    private:
+        OutputArray<SOR>* _output;
+    };
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _SPATIAL_JOIN_H
+#define _SPATIAL_JOIN_H
+
+#include "Z.h"
+#include "Cursor.h"
+#include "Record.h"
+#include "RecordStack.h"
+#include "SpatialIndex.h"
+#include "SpatialJoinFilter.h"
+#include "SpatialJoinOutput.h"
+#include "SpatialObjectKey.h"
+#include "util.h"
+
+namespace geophile
+{
+    template <class SOR> class Cursor;
+    template <class SOR> class SpatialIndex;
+    class SpatialJoinFilter;
+    class SpatialObject;
+
+    /*
+     * A SpatialJoin finds the pairs of overlapping SpatialObjects
+     * from two SpatialIndexes. The two indexes must be layered over
+     * the same Space.
+     *
+     * The join is a merge of the records of the two indexes in
+     * z-order. Two z-values identify overlapping regions exactly
+     * when one contains the other, and a z-value sorts before every
+     * z-value it contains. So as the merge proceeds, it is enough to
+     * keep, for each side, a stack of the records whose z-values
+     * contain the current position. Each record is paired with the
+     * records on the other side's stack, and then pushed on its own
+     * side's stack. Each index is read once, sequentially.
+     *
+     * A SpatialObject with several z-values can overlap another
+     * SpatialObject in more than one place, so a pair may be
+     * reported more than once.
+     */
+    template <class SOR_L, class SOR_R> // SOR: Spatial Object Reference
+    class SpatialJoin
+    {
+    public:
+        /*
+         * Finds all pairs of overlapping spatial objects (left,
+         * right), left from the left SpatialIndex, right from the
+         * right SpatialIndex. False positives are removed by the
+         * filter, and the pairs surviving the filter are passed to
+         * output.
+         */
+        void find(SpatialJoinOutput<SOR_L, SOR_R>* output)
+        {
+            Cursor<SOR_L>* left_cursor = _left->index()->cursor();
+            Cursor<SOR_R>* right_cursor = _right->index()->cursor();
+            SpatialObjectKey start(Z(Z::Z_MIN, 0));
+            left_cursor->goTo(start);
+            right_cursor->goTo(start);
+            _left_stack.clear();
+            _right_stack.clear();
+            Record<SOR_L> left = left_cursor->next();
+            Record<SOR_R> right = right_cursor->next();
+            while (!left.eof() || !right.eof()) {
+                if (right.eof() || (!left.eof() && left.key().z() <= right.key().z())) {
+                    Z z = left.key().z();
+                    _left_stack.popUntilContains(z);
+                    _right_stack.popUntilContains(z);
+                    for (uint32_t i = 0; i < _right_stack.size(); i++) {
+                        check(left.spatialObjectReference(),
+                              _right_stack.at(i).spatialObjectReference(),
+                              output);
+                    }
+                    _left_stack.push(left);
+                    left = left_cursor->next();
+                } else {
+                    Z z = right.key().z();
+                    _left_stack.popUntilContains(z);
+                    _right_stack.popUntilContains(z);
+                    for (uint32_t i = 0; i < _left_stack.size(); i++) {
+                        check(_left_stack.at(i).spatialObjectReference(),
+                              right.spatialObjectReference(),
+                              output);
+                    }
+                    _right_stack.push(right);
+                    right = right_cursor->next();
+                }
+            }
+            delete left_cursor;
+            delete right_cursor;
+        }
+
+        /*
+         * Constructor.
+         *     left, right: The SpatialIndexes to be joined.
+         *     filter: Removes false positives from the join output.
+         */
+        SpatialJoin(const SpatialIndex<SOR_L>* left,
+                    const SpatialIndex<SOR_R>* right,
+                    const SpatialJoinFilter* filter)
+            : _left(left),
+              _right(right),
+              _filter(filter)
+        {
+            GEOPHILE_ASSERT(left->space() == right->space());
+        }
+
+    private:
+        void check(const SOR_L& left,
+                   const SOR_R& right,
+                   SpatialJoinOutput<SOR_L, SOR_R>* output) const
+        {
+            if (_filter->overlap(left.spatialObject(), right.spatialObject())) {
+                output->add(left, right);
+            }
+        }
+
+    private:
+        const SpatialIndex<SOR_L>* _left;
+        const SpatialIndex<SOR_R>* _right;
+        const SpatialJoinFilter* _filter;
+        RecordStack<SOR_L> _left_stack;
+        RecordStack<SOR_R> _right_stack;
+    };
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _SPATIAL_JOIN_FILTER_H
+#define _SPATIAL_JOIN_FILTER_H
+
+namespace geophile
+{
+    class SpatialObject;
+
+    /*
+     * A spatial join pairs up spatial objects whose z-values
+     * overlap. Some of these pairs are false positives, and a
+     * SpatialJoinFilter is used to eliminate them.
+     */
+    class SpatialJoinFilter
+    {
+    public:
+        /*
+         * Returns true if left and right overlap, false
+         * otherwise. left is from the left SpatialIndex of the join,
+         * right is from the right SpatialIndex.
+         */
+        virtual bool overlap(const SpatialObject* left, 
+                             const SpatialObject* right) const = 0;
+
+        virtual ~SpatialJoinFilter()
+        {}
+    };
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _SPATIAL_JOIN_OUTPUT_H
+#define _SPATIAL_JOIN_OUTPUT_H
+
+namespace geophile
+{
+    /*
+     * Receives the pairs of overlapping SpatialObjects found by a
+     * SpatialJoin.
+     */
+    template <class SOR_L, class SOR_R> // SOR: Spatial Object Reference
+    class SpatialJoinOutput
+    {
+    public:
+        /*
+         * Called for each pair of overlapping spatial objects, (left
+         * from the left SpatialIndex, right from the right
+         * SpatialIndex), that passes the SpatialJoinFilter.
+         */
+        virtual void add(const SOR_L& left, const SOR_R& right) = 0;
+
+        virtual ~SpatialJoinOutput()
+        {}
+    };
+}
+
+#endif
@@ -25,6 +25,22 @@ namespace geophile
         virtual void copyFrom(const SpatialObject* spatial_object) = 0;
         virtual bool isNull() const = 0;
         virtual void setNull() = 0;
+        // Returns true only if every point of region, (not just every grid
+        // cell that region shares with this object), lies inside this object.
+        // Space::decompose marks the z-values of such regions as interior,
+        // and retrieval skips filtering of records found in them. The
+        // default, false, is always safe.
+        virtual int32_t containsRegion(const Region* region) const { return false; }
+        // Returns true if this object is a point, located by arbitraryPoint.
+        // The z-value of a point is computed directly, without decomposition.
+        // The default is false.
+        virtual int32_t isPoint() const { return false; }
+        // Returns true if this object is an axis-aligned box, setting lo and
+        // hi to its bounds, (one coordinate per dimension). Space::decompose
+        // then compares regions to the bounds itself, so compare, containedBy
+        // and containsRegion must agree with them, (as in Box2). The default
+        // is false.
+        virtual int32_t boxBounds(double* lo, double* hi) const { return false; }
         virtual ~SpatialObject() {}
 
     public:
@@ -0,0 +1,49 @@
+#include <pthread.h>
+#include "Threads.h"
+
+using namespace geophile;
+
+namespace
+{
+    struct ThreadCall
+    {
+        Threads::Task task;
+        void* argument;
+        uint32_t thread;
+        pthread_t pthread;
+        bool started;
+    };
+
+    void* runThreadCall(void* arg)
+    {
+        ThreadCall* call = (ThreadCall*) arg;
+        call->task(call->argument, call->thread);
+        return NULL;
+    }
+}
+
+void Threads::run(uint32_t n_threads, Task task, void* argument)
+{
+    if (n_threads <= 1) {
+        task(argument, 0);
+        return;
+    }
+    ThreadCall* calls = new ThreadCall[n_threads];
+    for (uint32_t t = 1; t < n_threads; t++) {
+        ThreadCall* call = &calls[t];
+        call->task = task;
+        call->argument = argument;
+        call->thread = t;
+        call->started = pthread_create(&call->pthread, NULL, runThreadCall, call) == 0;
+    }
+    task(argument, 0);
+    for (uint32_t t = 1; t < n_threads; t++) {
+        ThreadCall* call = &calls[t];
+        if (call->started) {
+            pthread_join(call->pthread, NULL);
+        } else {
+            task(argument, t);
+        }
+    }
+    delete [] calls;
+}
@@ -0,0 +1,28 @@
+#ifndef _THREADS_H
+#define _THREADS_H
+
+#include <stdint.h>
+
+namespace geophile
+{
+    /*
+     * Runs a task on several threads, for the phases of parallel
+     * algorithms, (e.g. RecordSort).
+     */
+    class Threads
+    {
+    public:
+        typedef void (*Task)(void* argument, uint32_t thread);
+
+        /*
+         * Calls task(argument, t) for t = 0, ..., n_threads - 1,
+         * each call in its own thread, and returns when all of them
+         * have finished. The call for t = 0 runs in the calling
+         * thread. If a thread can't be started, its call runs in the
+         * calling thread instead.
+         */
+        static void run(uint32_t n_threads, Task task, void* argument);
+    };
+}
+
+#endif
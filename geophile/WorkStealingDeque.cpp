@@ -0,0 +1,87 @@
+#include <string.h>
+#include "WorkStealingDeque.h"
+#include "util.h"
+
+using namespace geophile;
+
+void WorkStealingDeque::push(uint32_t task)
+{
+    pthread_mutex_lock(&_mutex);
+    ensureSpace();
+    _tasks[_back++] = task;
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool WorkStealingDeque::take(uint32_t* task)
+{
+    bool taken = false;
+    pthread_mutex_lock(&_mutex);
+    if (_front < _back) {
+        *task = _tasks[_front++];
+        taken = true;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return taken;
+}
+
+bool WorkStealingDeque::steal(uint32_t* task)
+{
+    bool stolen = false;
+    pthread_mutex_lock(&_mutex);
+    if (_front < _back) {
+        *task = _tasks[--_back];
+        stolen = true;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return stolen;
+}
+
+uint32_t WorkStealingDeque::size()
+{
+    pthread_mutex_lock(&_mutex);
+    uint32_t size = _back - _front;
+    pthread_mutex_unlock(&_mutex);
+    return size;
+}
+
+void WorkStealingDeque::clear()
+{
+    pthread_mutex_lock(&_mutex);
+    _front = 0;
+    _back = 0;
+    pthread_mutex_unlock(&_mutex);
+}
+
+WorkStealingDeque::~WorkStealingDeque()
+{
+    pthread_mutex_destroy(&_mutex);
+    delete [] _tasks;
+}
+
+WorkStealingDeque::WorkStealingDeque()
+    : _capacity(INITIAL_CAPACITY),
+      _tasks(new uint32_t[INITIAL_CAPACITY]),
+      _front(0),
+      _back(0)
+{
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+void WorkStealingDeque::ensureSpace()
+{
+    if (_back == _capacity) {
+        if (_front > 0) {
+            // Reclaim the space freed by take().
+            memmove(_tasks, &_tasks[_front], (_back - _front) * sizeof(uint32_t));
+            _back -= _front;
+            _front = 0;
+        } else {
+            uint32_t new_capacity = _capacity * 2;
+            uint32_t* new_tasks = new uint32_t[new_capacity];
+            memcpy(new_tasks, _tasks, _capacity * sizeof(uint32_t));
+            delete [] _tasks;
+            _tasks = new_tasks;
+            _capacity = new_capacity;
+        }
+    }
+}
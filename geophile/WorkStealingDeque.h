@@ -0,0 +1,45 @@
+#ifndef _WORK_STEALING_DEQUE_H
+#define _WORK_STEALING_DEQUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+namespace geophile
+{
+    /*
+     * A deque of task ids, owned by one worker thread. Tasks are
+     * pushed onto the back. The owner takes tasks from the front.
+     * Other workers, having run out of work, steal tasks from the
+     * back. Tasks are pushed before the workers start, so the owner
+     * works through the tasks in the order given, while thieves take
+     * the tasks the owner would have reached last. Operations are serialized by a mutex, which is
+     * held only for a few instructions.
+     */
+    class WorkStealingDeque
+    {
+    public:
+        void push(uint32_t task);
+        // take and steal return false if the deque is empty.
+        bool take(uint32_t* task);
+        bool steal(uint32_t* task);
+        uint32_t size();
+        void clear();
+        ~WorkStealingDeque();
+        WorkStealingDeque();
+
+    private:
+        void ensureSpace();
+
+    private:
+        static const uint32_t INITIAL_CAPACITY = 64;
+
+        pthread_mutex_t _mutex;
+        uint32_t _capacity;
+        uint32_t* _tasks;
+        // Tasks are in positions [_front, _back).
+        uint32_t _front;
+        uint32_t _back;
+    };
+}
+
+#endif
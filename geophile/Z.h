@@ -57,6 +57,14 @@ namespace geophile
             return _z | (((1L << (MAX_Z_BITS - length())) - 1) << LENGTH_BITS);
         }
 
+        // The largest z-value contained by this z-value: the
+        // longest z-value at the high point. (z-values longer than
+        // this one, at its high point, sort after hi().)
+        int64_t last() const
+        {
+            return (hi() & ~LENGTH_MASK) | MAX_Z_BITS;
+        }
+
         int64_t asInteger() const
         {
             return _z;
@@ -90,6 +98,15 @@ namespace geophile
             return Z(_z & parent_mask, parent_length);
         }
 
+        // The ancestor of this z-value with the given length, (this
+        // z-value if length is this z-value's length).
+        Z ancestor(uint32_t length) const
+        {
+            GEOPHILE_ASSERT(length <= this->length());
+            int64_t mask = ((1L << length) - 1) << (63 - length);
+            return Z(_z & mask, length);
+        }
+
         int32_t contains(Z that) const
         {
             uint32_t this_length = this->length();
@@ -6,19 +6,28 @@ using namespace geophile;
 Z ZArray::at(uint32_t i) const
 {
     GEOPHILE_ASSERT(i < _n);
-    return _z[i];
+    return _z[i].z;
 }
 
-void ZArray::set(uint32_t i, Z z)
+int32_t ZArray::interior(uint32_t i) const
 {
     GEOPHILE_ASSERT(i < _n);
-    _z[i] = z;
+    return _z[i].interior;
 }
 
-void ZArray::append(Z z)
+void ZArray::set(uint32_t i, Z z, int32_t interior)
+{
+    GEOPHILE_ASSERT(i < _n);
+    _z[i].z = z;
+    _z[i].interior = interior;
+}
+
+void ZArray::append(Z z, int32_t interior)
 {
     ensureSpace();
-    _z[_n++] = z;
+    _z[_n].z = z;
+    _z[_n].interior = interior;
+    _n++;
 }
 
 uint32_t ZArray::length() const
@@ -28,13 +37,13 @@ uint32_t ZArray::length() const
 
 void ZArray::sort()
 {
-    qsort(_z, _n, sizeof(Z), zcompare);
+    qsort(_z, _n, sizeof(ZEntry), zcompare);
 }
 
 void ZArray::remove(uint32_t position)
 {
-    memmove(&_z[position], &_z[position + 1], sizeof(Z) * (_n - position - 1));
-    _z[--_n].reset();
+    memmove(&_z[position], &_z[position + 1], sizeof(ZEntry) * (_n - position - 1));
+    _z[--_n].z.reset();
 }
 
 void ZArray::clear()
@@ -50,7 +59,7 @@ ZArray::~ZArray()
 ZArray::ZArray()
     : _capacity(INITIAL_CAPACITY),
       _n(0),
-      _z(new Z[INITIAL_CAPACITY])
+      _z(new ZEntry[INITIAL_CAPACITY])
 {}
 
 void ZArray::ensureSpace()
@@ -58,8 +67,8 @@ void ZArray::ensureSpace()
     GEOPHILE_ASSERT(_n <= _capacity);
     if (_n == _capacity) {
         uint32_t new_capacity = _capacity * 2;
-        Z* new_z = new Z[new_capacity];
-        memcpy(new_z, _z, _capacity * sizeof(Z));
+        ZEntry* new_z = new ZEntry[new_capacity];
+        memcpy(new_z, _z, _capacity * sizeof(ZEntry));
         delete [] _z;
         _z = new_z;
         _capacity = new_capacity;
@@ -69,8 +78,8 @@ void ZArray::ensureSpace()
 
 int32_t ZArray::zcompare(const void* x, const void* y)
 {
-    int64_t a = *(int64_t*)x;
-    int64_t b = *(int64_t*)y;
+    Z a = ((const ZEntry*) x)->z;
+    Z b = ((const ZEntry*) y)->z;
     return a < b ? -1 : a > b ? 1 : 0;
 }
 
@@ -6,12 +6,19 @@
 
 namespace geophile
 {
+    /*
+     * An array of z-values, e.g. the decomposition of a
+     * SpatialObject. Each z-value may be marked as interior, meaning
+     * that the region it represents lies entirely inside the
+     * SpatialObject, (see SpatialObject::containsRegion).
+     */
     class ZArray
     {
     public:
         Z at(uint32_t i) const;
-        void set(uint32_t i, Z z);
-        void append(Z z);
+        int32_t interior(uint32_t i) const;
+        void set(uint32_t i, Z z, int32_t interior = false);
+        void append(Z z, int32_t interior = false);
         uint32_t length() const;
         void sort();
         void remove(uint32_t position);
@@ -25,11 +32,17 @@ namespace geophile
         static int32_t zcompare(const void*, const void*);
 
     private:
+        typedef struct
+        {
+            Z z;
+            int32_t interior;
+        } ZEntry;
+
         static const uint32_t INITIAL_CAPACITY = Space::MAX_DIMENSIONS * 2;
 
         uint32_t _capacity;
         uint32_t _n;
-        Z* _z;
+        ZEntry* _z;
     };
 }
 
@@ -2,23 +2,40 @@
 #define _GEOPHILE_H
 
 #include <geophile/Box2.h>
+#include <geophile/BTree.h>
 #include <geophile/BufferingSpatialObjectReferenceManager.h>
 #include <geophile/ByteBuffer.h>
 #include <geophile/ByteBufferOverflowException.h>
 #include <geophile/ByteBufferUnderflowException.h>
+#include <geophile/ConcurrentSkipList.h>
 #include <geophile/Cursor.h>
+#include <geophile/DiskBTree.h>
+#include <geophile/EytzingerSearch.h>
 #include <geophile/GeophileException.h>
 #include <geophile/InMemorySpatialObjectReferenceManager.h>
 #include <geophile/InlineSpatialObjectReferenceManager.h>
+#include <geophile/KeySearch.h>
+#include <geophile/LSMTree.h>
+#include <geophile/MappedIndex.h>
+#include <geophile/OccupancyMap.h>
 #include <geophile/OrderedIndex.h>
 #include <geophile/OutputArray.h>
+#include <geophile/ParallelQueryExecutor.h>
+#include <geophile/PartitionedOutputArray.h>
+#include <geophile/PiecewiseLinearSearch.h>
 #include <geophile/Point2.h>
+#include <geophile/RadixSearch.h>
 #include <geophile/Record.h>
 #include <geophile/SessionMemory.h>
 #include <geophile/Space.h>
 #include <geophile/SpatialIndex.h>
 #include <geophile/SpatialIndexFilter.h>
+#include <geophile/SpatialIndexBatchScan.h>
 #include <geophile/SpatialIndexScan.h>
+#include <geophile/SpatialIndexVisitor.h>
+#include <geophile/SpatialJoin.h>
+#include <geophile/SpatialJoinFilter.h>
+#include <geophile/SpatialJoinOutput.h>
 #include <geophile/SpatialObject.h>
 #include <geophile/SpatialObjectKey.h>
 #include <geophile/SpatialObjectReferenceManager.h>
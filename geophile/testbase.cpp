@@ -12,6 +12,12 @@
 #include "SpatialIndex.h"
 #include "SpatialIndexFilter.h"
 #include "SpatialIndexScan.h"
+#include "SpatialIndexVisitor.h"
+#include "ZArray.h"
+#include "ParallelQueryExecutor.h"
+#include "SpatialJoin.h"
+#include "SpatialJoinFilter.h"
+#include "SpatialJoinOutput.h"
 #include "Cursor.h"
 #include "IntSet.h"
 #include "IntList.h"
@@ -476,6 +482,20 @@ static void testCursor(OrderedIndex<SpatialObjectPointer>* index, int32_t n)
             }
         }
     }
+    // skipTo, with increasingly long skips
+    if (n > 0) {
+        for (uint32_t stride = 1; stride <= n; stride *= 2) {
+            cursor->goTo(SpatialObjectKey(zvalue(Z::Z_MIN, 0)));
+            ASSERT_EQ(0, z_to_int(key(record = cursor->next())));
+            for (uint32_t i = stride; i < n; i += stride) {
+                // Skip to a key just before record i
+                cursor->skipTo(SpatialObjectKey(int_to_z(i * GAP - GAP / 2)));
+                ASSERT_EQ(i * GAP, z_to_int(key(record = cursor->next())));
+            }
+            cursor->skipTo(SpatialObjectKey(int_to_z(n * GAP)));
+            ASSERT_TRUE(cursor->next().eof());
+        }
+    }
     // Delete spatial objects
     {
         cursor->goTo(SpatialObjectKey(zvalue(Z::Z_MIN, 0)));
@@ -548,6 +568,13 @@ static int32_t comparePoint(const void* x, const void* y)
         p->y() < q->y() ? -1 : p->y() > q->y() ? 1 : 0;
 }
 
+static int32_t compareBox(const void* x, const void* y)
+{
+    int64_t p = (*(const SpatialObject**) x)->id();
+    int64_t q = (*(const SpatialObject**) y)->id();
+    return p < q ? -1 : p > q ? 1 : 0;
+}
+
 static void dump(const char* label, OutputArray<SpatialObjectPointer>* array)
 {
     printf("%s - %d:\n", label, array->length());
@@ -557,6 +584,56 @@ static void dump(const char* label, OutputArray<SpatialObjectPointer>* array)
     }
 }
 
+// A SpatialIndex of Point2s, one every 10 units in each dimension, in a
+// POINT_GRID_MAX x POINT_GRID_MAX space. The index is frozen.
+static const uint32_t POINT_GRID_MAX = 1000;
+static const uint32_t POINT_GRID_N_POINTS = (POINT_GRID_MAX / 10) * (POINT_GRID_MAX / 10);
+
+struct PointGrid
+{
+    Space* space;
+    OrderedIndex<SpatialObjectPointer>* index;
+    SpatialIndex<SpatialObjectPointer>* spatial_index;
+    // points[id] is the point with that id.
+    Point2** points;
+};
+
+static PointGrid newPointGrid(const OrderedIndexFactory<SpatialObjectPointer>* index_factory,
+                              SessionMemory<SpatialObjectPointer>* memory)
+{
+    PointGrid grid;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {POINT_GRID_MAX, POINT_GRID_MAX};
+    uint32_t x_bits[] = {10, 10};
+    grid.space = new Space(2, lo, hi, x_bits);
+    grid.index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    grid.spatial_index = 
+        new SpatialIndex<SpatialObjectPointer>(grid.space, grid.index, &spatial_object_reference_manager);
+    grid.points = new Point2*[POINT_GRID_N_POINTS];
+    int64_t id = 0;
+    for (double x = 0; x < POINT_GRID_MAX; x += 10) {
+        for (double y = 0; y < POINT_GRID_MAX; y += 10) {
+            Point2* point = new Point2(x, y);
+            point->id(id);
+            grid.spatial_index->add(point, memory);
+            grid.points[id++] = point;
+        }
+    }
+    grid.spatial_index->freeze();
+    return grid;
+}
+
+static void deletePointGrid(const PointGrid& grid)
+{
+    delete grid.spatial_index;
+    delete grid.index;
+    delete grid.space;
+    for (uint32_t id = 0; id < POINT_GRID_N_POINTS; id++) {
+        delete grid.points[id];
+    }
+    delete [] grid.points;
+}
+
 static void testRetrieval(SpatialIndex<SpatialObjectPointer>* spatial_index,
                            SessionMemory<SpatialObjectPointer>* memory,
                            int64_t xlo, int64_t xhi, int64_t ylo, int64_t yhi) 
@@ -596,29 +673,11 @@ static void testRetrieval(SpatialIndex<SpatialObjectPointer>* spatial_index,
 
 static void testRetrievalRandomized(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
 {
-    static const uint32_t X_MAX = 1000;
-    static const uint32_t Y_MAX = 1000;
-    static const uint32_t N_RECORDS = (X_MAX / 10) * (Y_MAX / 10);
-    double lo[] = {0.0, 0.0};
-    double hi[] = {X_MAX, Y_MAX};
-    uint32_t x_bits[] = {10, 10};
-    Space* space = new Space(2, lo, hi, x_bits);
-    OrderedIndex<SpatialObjectPointer>* index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
-    SpatialIndex<SpatialObjectPointer>* spatial_index = 
-        new SpatialIndex<SpatialObjectPointer>(space, index, &spatial_object_reference_manager);
+    static const uint32_t X_MAX = POINT_GRID_MAX;
+    static const uint32_t Y_MAX = POINT_GRID_MAX;
     SessionMemory<SpatialObjectPointer> memory;
-    Point2** points = new Point2*[N_RECORDS];
-    int64_t id = 0;
-    for (double x = 0; x < X_MAX; x += 10) {
-        for (double y = 0; y < Y_MAX; y += 10) {
-            Point2* point = new Point2(x, y);
-            point->id(id);
-            spatial_index->add(point, &memory);
-            points[id++] = point;
-        }
-    }
-    // fflush(stdout);
-    spatial_index->freeze();
+    PointGrid grid = newPointGrid(index_factory, &memory);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = grid.spatial_index;
     srand(419419);
     int64_t xlo;
     int64_t xhi;
@@ -636,18 +695,871 @@ static void testRetrievalRandomized(const OrderedIndexFactory<SpatialObjectPoint
         } while (yhi < ylo);
         testRetrieval(spatial_index, &memory, xlo, xhi, ylo, yhi);
     }
+    deletePointGrid(grid);
+}
+
+// Counts the objects visited, stopping once limit have been seen.
+class LimitVisitor
+{
+public:
+    VisitResult visit(const SpatialObjectPointer& sor)
+    {
+        ASSERT_TRUE(_count < _limit);
+        _visited->append(sor);
+        return ++_count == _limit ? VISIT_STOP : VISIT_CONTINUE;
+    }
+
+    uint32_t count() const
+    {
+        return _count;
+    }
+
+    LimitVisitor(uint32_t limit, OutputArray<SpatialObjectPointer>* visited)
+        : _limit(limit),
+          _count(0),
+          _visited(visited)
+    {}
+
+private:
+    uint32_t _limit;
+    uint32_t _count;
+    OutputArray<SpatialObjectPointer>* _visited;
+};
+
+static void testRetrievalVisitor(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = POINT_GRID_MAX;
+    static const uint32_t Y_MAX = POINT_GRID_MAX;
+    static const uint32_t N_QUERIES = 100;
+    SessionMemory<SpatialObjectPointer> memory;
+    PointGrid grid = newPointGrid(index_factory, &memory);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = grid.spatial_index;
+    srand(619619);
+    PointFilter filter;
+    OutputArray<SpatialObjectPointer> visited;
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        int64_t xlo = rand() % X_MAX;
+        int64_t xhi = xlo + (rand() % (X_MAX - xlo));
+        int64_t ylo = rand() % Y_MAX;
+        int64_t yhi = ylo + (rand() % (Y_MAX - ylo));
+        Box2 box(xlo, xhi, ylo, yhi);
+        box.id(q);
+        spatial_index->findOverlapping(&box, &filter, &memory);
+        OutputArray<SpatialObjectPointer>* expected = memory.output();
+        uint32_t n = expected->length();
+        // Without a limit, the visitor sees exactly what the OutputArray gets.
+        visited.clear();
+        LimitVisitor all(UINT32_MAX, &visited);
+        ASSERT_TRUE(spatial_index->findOverlapping(&box, &filter, &all, &memory));
+        expected->sort(comparePoint);
+        visited.sort(comparePoint);
+        compare(expected, &visited);
+        // With a limit, the scan stops early, after visiting a subset of the results.
+        if (n > 0) {
+            uint32_t limit = 1 + rand() % n;
+            visited.clear();
+            LimitVisitor limited(limit, &visited);
+            ASSERT_TRUE(!spatial_index->findOverlapping(&box, &filter, &limited, &memory));
+            ASSERT_EQ(limit, limited.count());
+            for (uint32_t i = 0; i < visited.length(); i++) {
+                ASSERT_TRUE(contains(&box, (const Point2*) visited.at(i).spatialObject()));
+            }
+        }
+        memory.clearOutput();
+    }
+    deletePointGrid(grid);
+}
+
+static void testRetrievalBatch(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = POINT_GRID_MAX;
+    static const uint32_t Y_MAX = POINT_GRID_MAX;
+    static const uint32_t N_QUERIES = 200;
+    SessionMemory<SpatialObjectPointer> memory;
+    PointGrid grid = newPointGrid(index_factory, &memory);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = grid.spatial_index;
+    // Random queries. Include repeated and nested queries, whose z-values
+    // coincide or nest in the sorted batch.
+    srand(419419);
+    Box2** queries = new Box2*[N_QUERIES];
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        if (q % 10 == 1) {
+            const Box2* previous = queries[q - 1];
+            queries[q] = new Box2(previous->xlo(), previous->xhi(), 
+                                  previous->ylo(), previous->yhi());
+        } else if (q % 10 == 2) {
+            const Box2* previous = queries[q - 1];
+            queries[q] = new Box2(previous->xlo(), (previous->xlo() + previous->xhi()) / 2, 
+                                  previous->ylo(), (previous->ylo() + previous->yhi()) / 2);
+        } else {
+            int64_t xlo = rand() % X_MAX;
+            int64_t xhi = xlo + (rand() % (X_MAX - xlo));
+            int64_t ylo = rand() % Y_MAX;
+            int64_t yhi = ylo + (rand() % (Y_MAX - ylo));
+            queries[q] = new Box2(xlo, xhi, ylo, yhi);
+        }
+        queries[q]->id(q);
+    }
+    PointFilter filter;
+    SessionMemory<SpatialObjectPointer> batch_memory;
+    spatial_index->findOverlappingBatch((const SpatialObject* const*) queries, 
+                                        N_QUERIES, 
+                                        &filter, 
+                                        &batch_memory);
+    PartitionedOutputArray<SpatialObjectPointer>* batch_output = batch_memory.batchOutput();
+    ASSERT_EQ(N_QUERIES, batch_output->partitions());
+    OutputArray<SpatialObjectPointer> actual;
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        spatial_index->findOverlapping(queries[q], &filter, &memory);
+        OutputArray<SpatialObjectPointer>* expected = memory.output();
+        actual.clear();
+        for (uint32_t i = 0; i < batch_output->partitionLength(q); i++) {
+            actual.append(batch_output->at(q, i));
+        }
+        expected->sort(comparePoint);
+        actual.sort(comparePoint);
+        compare(expected, &actual);
+        memory.clearOutput();
+    }
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        delete queries[q];
+    }
+    delete [] queries;
+    deletePointGrid(grid);
+}
+
+// Fails on one query, as a filter or the index might.
+class FailingPointFilter : public PointFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* query_object,
+                         const SpatialObject* spatial_object) const
+    {
+        if (query_object->id() == _failing_query_id) {
+            throw GeophileException("FailingPointFilter");
+        }
+        return PointFilter::overlap(query_object, spatial_object);
+    }
+
+    FailingPointFilter(int64_t failing_query_id)
+        : _failing_query_id(failing_query_id)
+    {}
+
+private:
+    int64_t _failing_query_id;
+};
+
+static void testRetrievalParallel(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = POINT_GRID_MAX;
+    static const uint32_t Y_MAX = POINT_GRID_MAX;
+    static const uint32_t N_QUERIES = 500;
+    static const uint32_t N_THREADS = 4;
+    SessionMemory<SpatialObjectPointer> memory;
+    PointGrid grid = newPointGrid(index_factory, &memory);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = grid.spatial_index;
+    // Random queries, mostly small, with an occasional large one, so
+    // that the cost of tasks is uneven.
+    srand(519519);
+    Box2** queries = new Box2*[N_QUERIES];
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        int64_t size = q % 50 == 0 ? X_MAX / 2 : 30;
+        int64_t xlo = rand() % (X_MAX - size);
+        int64_t ylo = rand() % (Y_MAX - size);
+        queries[q] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        queries[q]->id(q);
+    }
+    PointFilter filter;
+    // Default task size, and a task size that doesn't divide N_QUERIES.
+    uint32_t task_sizes[] = {0, 7};
+    for (uint32_t s = 0; s < 2; s++) {
+        ParallelQueryExecutor<SpatialObjectPointer> executor(spatial_index, N_THREADS, task_sizes[s]);
+        PartitionedOutputArray<SpatialObjectPointer> parallel_output;
+        executor.findOverlapping((const SpatialObject* const*) queries, 
+                                 N_QUERIES, 
+                                 &filter, 
+                                 &parallel_output);
+        ASSERT_EQ(N_QUERIES, parallel_output.partitions());
+        OutputArray<SpatialObjectPointer> actual;
+        for (uint32_t q = 0; q < N_QUERIES; q++) {
+            spatial_index->findOverlapping(queries[q], &filter, &memory);
+            OutputArray<SpatialObjectPointer>* expected = memory.output();
+            actual.clear();
+            for (uint32_t i = 0; i < parallel_output.partitionLength(q); i++) {
+                actual.append(parallel_output.at(q, i));
+            }
+            expected->sort(comparePoint);
+            actual.sort(comparePoint);
+            compare(expected, &actual);
+            memory.clearOutput();
+        }
+    }
+    // A failure in a query thread is thrown by findOverlapping, after the
+    // threads finish, and the executor can be used again.
+    {
+        ParallelQueryExecutor<SpatialObjectPointer> executor(spatial_index, N_THREADS);
+        PartitionedOutputArray<SpatialObjectPointer> parallel_output;
+        FailingPointFilter failing_filter(N_QUERIES / 2);
+        bool failed = false;
+        try {
+            executor.findOverlapping((const SpatialObject* const*) queries, 
+                                     N_QUERIES, 
+                                     &failing_filter, 
+                                     &parallel_output);
+        } catch (const GeophileException& e) {
+            failed = strcmp("FailingPointFilter", e.what()) == 0;
+        }
+        ASSERT_TRUE(failed);
+        executor.findOverlapping((const SpatialObject* const*) queries, 
+                                 N_QUERIES, 
+                                 &filter, 
+                                 &parallel_output);
+        ASSERT_EQ(N_QUERIES, parallel_output.partitions());
+    }
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        delete queries[q];
+    }
+    delete [] queries;
+    deletePointGrid(grid);
+}
+
+// Duplicate elimination by reference point
+
+static bool overlap(const Box2* a, const Box2* b)
+{
+    return 
+        a->xlo() <= b->xhi() && b->xlo() <= a->xhi() &&
+        a->ylo() <= b->yhi() && b->ylo() <= a->yhi();
+}
+
+class BoxFilter : public SpatialIndexFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* query_object,
+                         const SpatialObject* spatial_object) const
+    {
+        return ::overlap((const Box2*) query_object, (const Box2*) spatial_object);
+    }
+};
+
+class BoxReferencePointFilter : public BoxFilter
+{
+public:
+    virtual bool hasReferencePoint() const
+    {
+        return true;
+    }
+
+    // The low corner of the intersection
+    virtual bool referencePoint(const SpatialObject* query_object,
+                                const SpatialObject* spatial_object,
+                                double* point) const
+    {
+        const Box2* a = (const Box2*) query_object;
+        const Box2* b = (const Box2*) spatial_object;
+        point[0] = a->xlo() > b->xlo() ? a->xlo() : b->xlo();
+        point[1] = a->ylo() > b->ylo() ? a->ylo() : b->ylo();
+        return true;
+    }
+};
+
+// Checks that output contains objects of expected, each at most once, and returns
+// the number found.
+static uint32_t checkNoDuplicates(const OutputArray<SpatialObjectPointer>* output, 
+                                  const IntSet* expected)
+{
+    IntSet found(output->length() + 1);
+    for (uint32_t i = 0; i < output->length(); i++) {
+        int64_t id = output->at(i).spatialObject()->id();
+        ASSERT_TRUE(!found.contains(id));
+        ASSERT_TRUE(expected->contains(id));
+        found.add(id);
+    }
+    return found.count();
+}
+
+static void testRetrievalMixedSizes(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = 1000;
+    static const uint32_t Y_MAX = 1000;
+    static const uint32_t N_BOXES = 2000;
+    static const uint32_t N_QUERIES = 100;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {X_MAX, Y_MAX};
+    uint32_t x_bits[] = {10, 10};
+    Space* space = new Space(2, lo, hi, x_bits);
+    OrderedIndex<SpatialObjectPointer>* index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = 
+        new SpatialIndex<SpatialObjectPointer>(space, index, &spatial_object_reference_manager);
+    SessionMemory<SpatialObjectPointer> memory;
+    srand(719719);
+    // Mostly small boxes, with some large ones, whose z-values are short, and
+    // contain the z-values of many queries. Box 0 covers the whole space, and
+    // its z-value has length 0.
+    Box2** boxes = new Box2*[N_BOXES];
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        if (b == 0) {
+            boxes[b] = new Box2(0, X_MAX - 1, 0, Y_MAX - 1);
+        } else {
+            int64_t size = b % 20 == 0 ? X_MAX / 2 : 30;
+            int64_t xlo = rand() % (X_MAX - size);
+            int64_t ylo = rand() % (Y_MAX - size);
+            boxes[b] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        }
+        boxes[b]->id(b);
+        spatial_index->add(boxes[b], &memory);
+    }
+    spatial_index->freeze();
+    Box2** queries = new Box2*[N_QUERIES];
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        int64_t size = q % 10 == 0 ? X_MAX : 50;
+        int64_t xlo = rand() % (X_MAX - size + 1);
+        int64_t ylo = rand() % (Y_MAX - size + 1);
+        queries[q] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        queries[q]->id(q);
+    }
+    BoxFilter filter;
+    BoxReferencePointFilter reference_point_filter;
+    SessionMemory<SpatialObjectPointer> batch_memory;
+    SessionMemory<SpatialObjectPointer> reference_point_batch_memory;
+    spatial_index->findOverlappingBatch((const SpatialObject* const*) queries, 
+                                        N_QUERIES, 
+                                        &filter, 
+                                        &batch_memory);
+    spatial_index->findOverlappingBatch((const SpatialObject* const*) queries, 
+                                        N_QUERIES, 
+                                        &reference_point_filter, 
+                                        &reference_point_batch_memory);
+    OutputArray<SpatialObjectPointer> batch_results;
+    uint32_t duplicates = 0;
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        IntSet expected(N_BOXES);
+        for (uint32_t b = 0; b < N_BOXES; b++) {
+            if (overlap(queries[q], boxes[b])) {
+                expected.add(b);
+            }
+        }
+        ASSERT_TRUE(expected.contains(0));
+        // Without duplicate elimination, all the overlapping boxes are found,
+        // possibly more than once.
+        spatial_index->findOverlapping(queries[q], &filter, &memory);
+        OutputArray<SpatialObjectPointer>* output = memory.output();
+        IntSet found(output->length() + 1);
+        for (uint32_t i = 0; i < output->length(); i++) {
+            int64_t id = output->at(i).spatialObject()->id();
+            ASSERT_TRUE(expected.contains(id));
+            found.add(id);
+        }
+        ASSERT_EQ(expected.count(), found.count());
+        duplicates += output->length() - found.count();
+        // The batch finds the same records.
+        PartitionedOutputArray<SpatialObjectPointer>* batch_output = batch_memory.batchOutput();
+        batch_results.clear();
+        for (uint32_t i = 0; i < batch_output->partitionLength(q); i++) {
+            batch_results.append(batch_output->at(q, i));
+        }
+        output->sort(compareBox);
+        batch_results.sort(compareBox);
+        compare(output, &batch_results);
+        memory.clearOutput();
+        // With a reference point, each box is found once.
+        spatial_index->findOverlapping(queries[q], &reference_point_filter, &memory);
+        ASSERT_EQ(expected.count(), checkNoDuplicates(memory.output(), &expected));
+        memory.clearOutput();
+        batch_output = reference_point_batch_memory.batchOutput();
+        batch_results.clear();
+        for (uint32_t i = 0; i < batch_output->partitionLength(q); i++) {
+            batch_results.append(batch_output->at(q, i));
+        }
+        ASSERT_EQ(expected.count(), checkNoDuplicates(&batch_results, &expected));
+    }
+    // Make sure that duplicates were actually eliminated.
+    ASSERT_TRUE(duplicates > 0);
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        delete queries[q];
+    }
+    delete [] queries;
     delete spatial_index;
     delete index;
     delete space;
-    for (int64_t id = 0; id < N_RECORDS; id++) {
-        delete points[id];
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        delete boxes[b];
     }
-    delete [] points;
+    delete [] boxes;
+}
+
+// Counts calls to overlap
+class CountingPointFilter : public PointFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* query_object,
+                         const SpatialObject* spatial_object) const
+    {
+        _calls++;
+        return PointFilter::overlap(query_object, spatial_object);
+    }
+
+    uint32_t calls() const
+    {
+        return _calls;
+    }
+
+    void reset()
+    {
+        _calls = 0;
+    }
+
+    CountingPointFilter()
+        : _calls(0)
+    {}
+
+private:
+    mutable uint32_t _calls;
+};
+
+// A Box2 decomposed more finely, so that most of its area is covered by interior
+// z-values.
+class FineBox2 : public Box2
+{
+public:
+    virtual uint32_t maxZ() const
+    {
+        return 64;
+    }
+
+    FineBox2(double xlo, double xhi, double ylo, double yhi)
+        : Box2(xlo, xhi, ylo, yhi)
+    {}
+};
+
+static void testRetrievalInterior(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = POINT_GRID_MAX;
+    static const uint32_t Y_MAX = POINT_GRID_MAX;
+    SessionMemory<SpatialObjectPointer> memory;
+    PointGrid grid = newPointGrid(index_factory, &memory);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = grid.spatial_index;
+    const Space* space = grid.space;
+    CountingPointFilter filter;
+    // The whole space is one interior z-value, so nothing needs filtering.
+    Box2 everything(0, X_MAX, 0, Y_MAX);
+    everything.id(0);
+    spatial_index->findOverlapping(&everything, &filter, &memory);
+    ASSERT_EQ(POINT_GRID_N_POINTS, memory.output()->length());
+    ASSERT_EQ(0, filter.calls());
+    memory.clearOutput();
+    // A large box whose edges don't line up with the grid. Most of its z-values
+    // are interior, but not the ones along the edges, and points near the edges
+    // are filtered.
+    FineBox2 box(101.5, 898.5, 201.5, 798.5);
+    box.id(1);
+    space->decompose(&box, box.maxZ(), &memory);
+    ZArray* zs = memory.zArray();
+    uint32_t n_interior = 0;
+    for (uint32_t i = 0; i < zs->length(); i++) {
+        if (zs->interior(i)) {
+            n_interior++;
+        }
+    }
+    ASSERT_TRUE(n_interior > 0);
+    ASSERT_TRUE(n_interior < zs->length());
+    filter.reset();
+    spatial_index->findOverlapping(&box, &filter, &memory);
+    uint32_t expected = 0;
+    for (uint32_t i = 0; i < POINT_GRID_N_POINTS; i++) {
+        if (contains(&box, grid.points[i])) {
+            expected++;
+        }
+    }
+    ASSERT_EQ(expected, memory.output()->length());
+    ASSERT_TRUE(filter.calls() > 0);
+    ASSERT_TRUE(filter.calls() < expected);
+    memory.clearOutput();
+    deletePointGrid(grid);
+}
+
+// Occupancy
+
+// Checks that the boxes found by findOverlapping, (as memory->output(), or
+// passed to a visitor), and by findOverlappingBatch, are those overlapping query.
+static void checkOccupancyRetrieval(const SpatialIndex<SpatialObjectPointer>* spatial_index,
+                                    Box2** boxes,
+                                    uint32_t n_boxes,
+                                    const Box2* query,
+                                    SessionMemory<SpatialObjectPointer>* memory)
+{
+    IntSet expected(n_boxes);
+    for (uint32_t b = 0; b < n_boxes; b++) {
+        if (overlap(query, boxes[b])) {
+            expected.add(b);
+        }
+    }
+    BoxReferencePointFilter filter;
+    spatial_index->findOverlapping(query, &filter, memory);
+    ASSERT_EQ(expected.count(), checkNoDuplicates(memory->output(), &expected));
+    memory->clearOutput();
+    OutputArray<SpatialObjectPointer> visited;
+    LimitVisitor visitor(n_boxes + 1, &visited);
+    ASSERT_TRUE(spatial_index->findOverlapping(query, &filter, &visitor, memory));
+    ASSERT_EQ(expected.count(), checkNoDuplicates(&visited, &expected));
+    spatial_index->findOverlappingBatch((const SpatialObject* const*) &query, 1, &filter, memory);
+    PartitionedOutputArray<SpatialObjectPointer>* batch_output = memory->batchOutput();
+    OutputArray<SpatialObjectPointer> batch_results;
+    for (uint32_t i = 0; i < batch_output->partitionLength(0); i++) {
+        batch_results.append(batch_output->at(0, i));
+    }
+    ASSERT_EQ(expected.count(), checkNoDuplicates(&batch_results, &expected));
+}
+
+// Boxes of mixed sizes, all in one corner of the space, so that most query
+// z-values are dropped by the OccupancyMap. Box 0 covers the corner, and its
+// z-value is short, so it contains many query z-values in unoccupied prefixes.
+static void testRetrievalOccupancy(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = 1000;
+    static const uint32_t Y_MAX = 1000;
+    static const uint32_t CORNER = 250;
+    static const uint32_t N_BOXES = 1000;
+    static const uint32_t N_ADDED = 100;
+    static const uint32_t N_QUERIES = 200;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {X_MAX, Y_MAX};
+    uint32_t x_bits[] = {10, 10};
+    Space* space = new Space(2, lo, hi, x_bits);
+    OrderedIndex<SpatialObjectPointer>* index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = 
+        new SpatialIndex<SpatialObjectPointer>(space, index, &spatial_object_reference_manager, 16);
+    SessionMemory<SpatialObjectPointer> memory;
+    srand(19019);
+    Box2** boxes = new Box2*[N_BOXES + N_ADDED];
+    for (uint32_t b = 0; b < N_BOXES + N_ADDED; b++) {
+        if (b == 0) {
+            boxes[b] = new Box2(0, CORNER - 1, 0, CORNER - 1);
+        } else {
+            int64_t size = b % 20 == 0 ? CORNER / 2 : 10;
+            int64_t xlo = rand() % (CORNER - size);
+            int64_t ylo = rand() % (CORNER - size);
+            boxes[b] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        }
+        boxes[b]->id(b);
+        if (b < N_BOXES) {
+            spatial_index->add(boxes[b], &memory);
+        }
+    }
+    spatial_index->freeze();
+    Box2** queries = new Box2*[N_QUERIES];
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        int64_t size = q % 10 == 0 ? X_MAX / 2 : 20;
+        int64_t xlo = rand() % (X_MAX - size + 1);
+        int64_t ylo = rand() % (Y_MAX - size + 1);
+        queries[q] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        queries[q]->id(q);
+    }
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        checkOccupancyRetrieval(spatial_index, boxes, N_BOXES, queries[q], &memory);
+    }
+    // Boxes added after freeze mark the OccupancyMap, which isn't rebuilt, (only
+    // the OrderedIndex is frozen).
+    for (uint32_t b = N_BOXES; b < N_BOXES + N_ADDED; b++) {
+        spatial_index->add(boxes[b], &memory);
+    }
+    index->freeze();
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        checkOccupancyRetrieval(spatial_index, boxes, N_BOXES + N_ADDED, queries[q], &memory);
+    }
+    // Queries decomposed using the OccupancyMap's counts.
+    space->decomposition(Space::DATA_AWARE);
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        checkOccupancyRetrieval(spatial_index, boxes, N_BOXES + N_ADDED, queries[q], &memory);
+    }
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        delete queries[q];
+    }
+    delete [] queries;
+    delete spatial_index;
+    delete index;
+    delete space;
+    for (uint32_t b = 0; b < N_BOXES + N_ADDED; b++) {
+        delete boxes[b];
+    }
+    delete [] boxes;
+}
+
+// Best-first decomposition, of the indexed boxes and of the queries.
+static void testRetrievalBestFirst(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = 1000;
+    static const uint32_t Y_MAX = 1000;
+    static const uint32_t N_BOXES = 1000;
+    static const uint32_t N_QUERIES = 100;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {X_MAX, Y_MAX};
+    uint32_t x_bits[] = {10, 10};
+    Space* space = new Space(2, lo, hi, x_bits);
+    space->decomposition(Space::BEST_FIRST);
+    OrderedIndex<SpatialObjectPointer>* index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    SpatialIndex<SpatialObjectPointer>* spatial_index = 
+        new SpatialIndex<SpatialObjectPointer>(space, index, &spatial_object_reference_manager);
+    SessionMemory<SpatialObjectPointer> memory;
+    srand(24024);
+    Box2** boxes = new Box2*[N_BOXES];
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        int64_t size = b % 20 == 0 ? X_MAX / 2 : 30;
+        int64_t xlo = rand() % (X_MAX - size);
+        int64_t ylo = rand() % (Y_MAX - size);
+        boxes[b] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        boxes[b]->id(b);
+        spatial_index->add(boxes[b], &memory);
+    }
+    spatial_index->freeze();
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        int64_t size = q % 10 == 0 ? X_MAX / 2 : 50;
+        int64_t xlo = rand() % (X_MAX - size + 1);
+        int64_t ylo = rand() % (Y_MAX - size + 1);
+        Box2 query(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        query.id(q);
+        checkOccupancyRetrieval(spatial_index, boxes, N_BOXES, &query, &memory);
+    }
+    delete spatial_index;
+    delete index;
+    delete space;
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        delete boxes[b];
+    }
+    delete [] boxes;
 }
 
 static void testRetrieval(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
 {
     testRetrievalRandomized(index_factory);
+    testRetrievalVisitor(index_factory);
+    testRetrievalBatch(index_factory);
+    testRetrievalParallel(index_factory);
+    testRetrievalMixedSizes(index_factory);
+    testRetrievalInterior(index_factory);
+    testRetrievalOccupancy(index_factory);
+    testRetrievalBestFirst(index_factory);
+}
+
+//----------------------------------------------------------------------
+
+// Bulk load
+
+// Box queries, against boxes and points.
+class BoxOrPointFilter : public SpatialIndexFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* query_object,
+                         const SpatialObject* spatial_object) const
+    {
+        return
+            spatial_object->isPoint()
+            ? contains((const Box2*) query_object, (const Point2*) spatial_object)
+            : ::overlap((const Box2*) query_object, (const Box2*) spatial_object);
+    }
+};
+
+static void testLoad(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = 1000;
+    static const uint32_t Y_MAX = 1000;
+    // Enough records for RecordSort to use several threads.
+    static const uint32_t N_POINTS = 100000;
+    static const uint32_t N_BOXES = 2000;
+    static const uint32_t N_OBJECTS = N_POINTS + N_BOXES;
+    static const uint32_t N_QUERIES = 100;
+    static const uint32_t N_THREADS = 4;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {X_MAX, Y_MAX};
+    uint32_t x_bits[] = {10, 10};
+    Space* space = new Space(2, lo, hi, x_bits);
+    OrderedIndex<SpatialObjectPointer>* added_index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    SpatialIndex<SpatialObjectPointer>* added = 
+        new SpatialIndex<SpatialObjectPointer>(space, added_index, &spatial_object_reference_manager);
+    OrderedIndex<SpatialObjectPointer>* loaded_index = index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    SpatialIndex<SpatialObjectPointer>* loaded = 
+        new SpatialIndex<SpatialObjectPointer>(space, loaded_index, &spatial_object_reference_manager);
+    SessionMemory<SpatialObjectPointer> memory;
+    srand(419419);
+    // Boxes and points, interleaved, with ids not in key order.
+    SpatialObject** objects = new SpatialObject*[N_OBJECTS];
+    for (uint32_t i = 0; i < N_OBJECTS; i++) {
+        if (i % (N_OBJECTS / N_BOXES) == 0) {
+            int64_t size = i % 20 == 0 ? X_MAX / 2 : 30;
+            int64_t xlo = rand() % (X_MAX - size);
+            int64_t ylo = rand() % (Y_MAX - size);
+            objects[i] = new Box2(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        } else {
+            objects[i] = new Point2(rand() % X_MAX, rand() % Y_MAX);
+        }
+        objects[i]->id((i * 7919) % N_OBJECTS);
+        added->add(objects[i], &memory);
+    }
+    added->freeze();
+    loaded->load((const SpatialObject* const*) objects, N_OBJECTS, N_THREADS);
+    // The indexes have the same records, in the same order.
+    Cursor<SpatialObjectPointer>* added_cursor = added_index->cursor();
+    Cursor<SpatialObjectPointer>* loaded_cursor = loaded_index->cursor();
+    SpatialObjectKey start(Z(Z::Z_MIN, 0));
+    added_cursor->goTo(start);
+    loaded_cursor->goTo(start);
+    uint32_t n_records = 0;
+    Record<SpatialObjectPointer> added_record = added_cursor->next();
+    while (!added_record.eof()) {
+        Record<SpatialObjectPointer> loaded_record = loaded_cursor->next();
+        ASSERT_TRUE(!loaded_record.eof());
+        ASSERT_EQ(0, added_record.key().compare(loaded_record.key()));
+        ASSERT_TRUE(added_record.spatialObjectReference().spatialObject() == 
+                    loaded_record.spatialObjectReference().spatialObject());
+        added_record = added_cursor->next();
+        n_records++;
+    }
+    ASSERT_TRUE(loaded_cursor->next().eof());
+    ASSERT_TRUE(n_records > N_OBJECTS);
+    delete added_cursor;
+    delete loaded_cursor;
+    // And retrieval gives the same results.
+    BoxOrPointFilter filter;
+    SessionMemory<SpatialObjectPointer> loaded_memory;
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        int64_t size = q % 10 == 0 ? X_MAX : 50;
+        int64_t xlo = rand() % (X_MAX - size + 1);
+        int64_t ylo = rand() % (Y_MAX - size + 1);
+        Box2 query(xlo, xlo + rand() % size, ylo, ylo + rand() % size);
+        query.id(q);
+        added->findOverlapping(&query, &filter, &memory);
+        loaded->findOverlapping(&query, &filter, &loaded_memory);
+        memory.output()->sort(compareBox);
+        loaded_memory.output()->sort(compareBox);
+        compare(memory.output(), loaded_memory.output());
+        memory.clearOutput();
+        loaded_memory.clearOutput();
+    }
+    delete added;
+    delete added_index;
+    delete loaded;
+    delete loaded_index;
+    delete space;
+    for (uint32_t i = 0; i < N_OBJECTS; i++) {
+        delete objects[i];
+    }
+    delete [] objects;
+}
+
+//----------------------------------------------------------------------
+
+// Spatial join
+
+class BoxPointJoinFilter : public SpatialJoinFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* left,
+                         const SpatialObject* right) const
+    {
+        return 
+            left->typeId() == Box2::TYPE_ID
+            ? contains((const Box2*) left, (const Point2*) right)
+            : contains((const Box2*) right, (const Point2*) left);
+    }
+};
+
+class JoinPairs : public SpatialJoinOutput<SpatialObjectPointer, SpatialObjectPointer>
+{
+public:
+    virtual void add(const SpatialObjectPointer& left, const SpatialObjectPointer& right)
+    {
+        const SpatialObject* box = left.spatialObject();
+        const SpatialObject* point = right.spatialObject();
+        if (box->typeId() != Box2::TYPE_ID) {
+            box = right.spatialObject();
+            point = left.spatialObject();
+        }
+        ASSERT_TRUE(contains((const Box2*) box, (const Point2*) point));
+        _pairs->add(box->id() * _n_points + point->id());
+    }
+
+    uint32_t count() const
+    {
+        return _pairs->count();
+    }
+
+    ~JoinPairs()
+    {
+        delete _pairs;
+    }
+
+    JoinPairs(uint32_t capacity, uint32_t n_points)
+        : _pairs(new IntSet(capacity)),
+          _n_points(n_points)
+    {}
+
+private:
+    IntSet* _pairs;
+    uint32_t _n_points;
+};
+
+static void testSpatialJoin(const OrderedIndexFactory<SpatialObjectPointer>* index_factory)
+{
+    static const uint32_t X_MAX = POINT_GRID_MAX;
+    static const uint32_t Y_MAX = POINT_GRID_MAX;
+    static const uint32_t N_POINTS = POINT_GRID_N_POINTS;
+    static const uint32_t N_BOXES = 100;
+    SessionMemory<SpatialObjectPointer> memory;
+    // Points on a grid
+    PointGrid grid = newPointGrid(index_factory, &memory);
+    const Space* space = grid.space;
+    SpatialIndex<SpatialObjectPointer>* points = grid.spatial_index;
+    Point2** point_array = grid.points;
+    // Random boxes of varying sizes, so that box z-values vary in length
+    OrderedIndex<SpatialObjectPointer>* box_index = 
+        index_factory->newIndex(&SPATIAL_OBJECT_TYPES);
+    SpatialIndex<SpatialObjectPointer>* boxes = 
+        new SpatialIndex<SpatialObjectPointer>(space, box_index, &spatial_object_reference_manager);
+    Box2** box_array = new Box2*[N_BOXES];
+    srand(419419);
+    for (int64_t id = 0; id < N_BOXES; id++) {
+        uint32_t max_width = id % 10 == 0 ? X_MAX / 2 : X_MAX / 20;
+        double xlo = rand() % (X_MAX - max_width);
+        double xhi = xlo + rand() % max_width;
+        double ylo = rand() % (Y_MAX - max_width);
+        double yhi = ylo + rand() % max_width;
+        Box2* box = new Box2(xlo, xhi, ylo, yhi);
+        box->id(id);
+        boxes->add(box, &memory);
+        box_array[id] = box;
+    }
+    boxes->freeze();
+    // Expected
+    uint32_t expected = 0;
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        for (uint32_t p = 0; p < N_POINTS; p++) {
+            if (contains(box_array[b], point_array[p])) {
+                expected++;
+            }
+        }
+    }
+    BoxPointJoinFilter filter;
+    // Boxes on the left
+    {
+        JoinPairs actual(expected + 1, N_POINTS);
+        SpatialJoin<SpatialObjectPointer, SpatialObjectPointer> join(boxes, points, &filter);
+        join.find(&actual);
+        ASSERT_EQ(expected, actual.count());
+    }
+    // Boxes on the right
+    {
+        JoinPairs actual(expected + 1, N_POINTS);
+        SpatialJoin<SpatialObjectPointer, SpatialObjectPointer> join(points, boxes, &filter);
+        join.find(&actual);
+        ASSERT_EQ(expected, actual.count());
+    }
+    delete boxes;
+    delete box_index;
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        delete box_array[b];
+    }
+    delete [] box_array;
+    deletePointGrid(grid);
 }
 
 //----------------------------------------------------------------------
@@ -663,4 +1575,7 @@ int runTests(OrderedIndexFactory<SpatialObjectPointer>* index_factory)
     RUN_TEST(testIndexOperations, index_factory);
     RUN_TEST(testCursor, index_factory);
     RUN_TEST(testRetrieval, index_factory);
+    RUN_TEST(testLoad, index_factory);
+    RUN_TEST(testSpatialJoin, index_factory);
+    return 0;
 }
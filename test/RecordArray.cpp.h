@@ -1,6 +1,7 @@
 #include "geophile/SpatialObjectTypes.h"
 #include "geophile/ByteBuffer.h"
 #include "geophile/ByteBufferOverflowException.h"
+#include "geophile/EytzingerSearch.h"
 #include "RecordArray.h"
 
 using namespace geophile;
@@ -12,7 +13,12 @@ void RecordArray<SOR>::add(Z z, const SOR& sor)
         growArray();
     }
     GEOPHILE_ASSERT(_n < _capacity);
-    _records[_n++].set(z, sor);
+    GEOPHILE_ASSERT(!sor.isNull());
+    _zs[_n] = z;
+    _soids[_n] = sor.spatialObjectId();
+    _sors[_n] = sor;
+    _n++;
+    clearSearch();
 }
 
 template <class SOR>
@@ -24,9 +30,8 @@ SOR RecordArray<SOR>::remove(Z z, int64_t soid)
                                        /* forward_move */ true, 
                                        /* include_key */ true);
     if (remove_position >= 0 && remove_position < _n) {
-        Record<SOR>& remove_record = _records[remove_position];
-        if (key.compare(_records[remove_position].key()) == 0) {
-            removed = remove_record.spatialObjectReference();
+        if (compareKey(remove_position, key) == 0) {
+            removed = _sors[remove_position];
             // Delete the spatial object if we've removed the last key
             // associated with it. THIS DOESN'T WORK IF:
             // - SOR - const SpatialObject*
@@ -36,18 +41,20 @@ SOR RecordArray<SOR>::remove(Z z, int64_t soid)
             // once the last (z, soid) has been removed.
             int32_t after_position = remove_position + 1;
             int32_t before_position = remove_position - 1;
-            if (after_position < _n && _records[after_position].key().soid() == soid) {
+            if (after_position < _n && _soids[after_position] == soid) {
                 // Present after removed record
-            } else if (before_position >= 0 && _records[before_position].key().soid() == soid) {
+            } else if (before_position >= 0 && _soids[before_position] == soid) {
                 // Present before removed record
             } else {
                 // Not present before or after, so delete the spatial object.
             }
             // Remove the record
-            memmove(&_records[remove_position],
-                    &_records[remove_position + 1],
-                    (_n - remove_position - 1) * sizeof(Record<SOR>));
+            int32_t n_after = _n - remove_position - 1;
+            memmove(&_zs[remove_position], &_zs[remove_position + 1], n_after * sizeof(Z));
+            memmove(&_soids[remove_position], &_soids[remove_position + 1], n_after * sizeof(int64_t));
+            memmove(&_sors[remove_position], &_sors[remove_position + 1], n_after * sizeof(SOR));
             _n--;
+            clearSearch();
         }
     }
     return removed;
@@ -56,7 +63,44 @@ SOR RecordArray<SOR>::remove(Z z, int64_t soid)
 template <class SOR>
 void RecordArray<SOR>::freeze()
 {
-    qsort(_records, _n, sizeof(Record<SOR>), recordCompare);
+    if (!sorted()) {
+        // Sort whole records, then split them into columns again.
+        Record<SOR>* records = new Record<SOR>[_n];
+        for (int32_t i = 0; i < _n; i++) {
+            records[i].set(_zs[i], _sors[i]);
+        }
+        qsort(records, _n, sizeof(Record<SOR>), recordCompare);
+        for (int32_t i = 0; i < _n; i++) {
+            _zs[i] = records[i].key().z();
+            _soids[i] = records[i].key().soid();
+            _sors[i] = records[i].spatialObjectReference();
+        }
+        delete [] records;
+    }
+    buildSearch();
+}
+
+template <class SOR>
+void RecordArray<SOR>::load(const Record<SOR>* records, uint32_t n)
+{
+    int32_t new_n = _n + (int32_t) n;
+    if (new_n > _capacity) {
+        resize(new_n);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        _zs[_n + i] = records[i].key().z();
+        _soids[_n + i] = records[i].key().soid();
+        _sors[_n + i] = records[i].spatialObjectReference();
+    }
+    int32_t was_empty = _n == 0;
+    _n = new_n;
+    // The loaded records are already sorted. Anything added earlier
+    // has to be merged in.
+    if (was_empty) {
+        buildSearch();
+    } else {
+        freeze();
+    }
 }
 
 template <class SOR>
@@ -70,10 +114,13 @@ RecordArray<SOR>::~RecordArray()
 {
     for (int i = 0; i < _n; i++) {
         this->_spatial_object_reference_manager
-            ->cleanupSpatialObjectReference(_records[i].spatialObjectReference());
+            ->cleanupSpatialObjectReference(_sors[i]);
     }
-    delete [] _records;
+    delete [] _zs;
+    delete [] _soids;
+    delete [] _sors;
     delete [] _buffer;
+    delete _key_search;
 }
 
 template <class SOR>
@@ -83,9 +130,12 @@ RecordArray<SOR>::RecordArray(const SpatialObjectTypes* spatial_object_types,
 : OrderedIndex<SOR>(spatial_object_types, memory, spatial_object_reference_manager),
       _n(0),
       _capacity(INITIAL_CAPACITY),
-      _records(new Record<SOR>[INITIAL_CAPACITY]),
+      _zs(new Z[INITIAL_CAPACITY]),
+      _soids(new int64_t[INITIAL_CAPACITY]),
+      _sors(new SOR[INITIAL_CAPACITY]),
       _buffer_size(INITIAL_BUFFER_SIZE),
-      _buffer(new byte[INITIAL_BUFFER_SIZE])
+      _buffer(new byte[INITIAL_BUFFER_SIZE]),
+      _key_search(new EytzingerSearch())
 {}
 
 template <class SOR>
@@ -93,16 +143,32 @@ int32_t RecordArray<SOR>::position(const SpatialObjectKey& key,
                                    int32_t forward_move, 
                                    int32_t include_key) const
 {
+    if (_n > 0 && _key_search && _key_search->size() == (uint32_t) _n) {
+        // The first key >= key, or > key. Moving backward, the record
+        // preceding the first key > key, (include_key), or >= key.
+        int32_t include = forward_move ? include_key : !include_key;
+        uint32_t lo;
+        uint32_t hi;
+        _key_search->range(key, include, &lo, &hi);
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            int32_t c = compareKey(mid, key);
+            if (c < 0 || (c == 0 && !include)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return forward_move ? (int32_t) lo : (int32_t) lo - 1;
+    }
     int32_t position;
     int32_t lo = 0;
     int32_t hi = _n - 1;
     int32_t mid;
     int32_t found = false;
-    const SpatialObjectKey* mid_key;
     while (lo <= hi) {
         mid = (lo + hi) / 2;
-        mid_key = &_records[mid].key();
-        int32_t c = mid_key->compare(key);
+        int32_t c = compareKey(mid, key);
         if (c < 0) {
             lo = mid + 1;
         } else if (c > 0) {
@@ -134,6 +200,34 @@ int32_t RecordArray<SOR>::position(const SpatialObjectKey& key,
     return position;
 }
 
+template <class SOR>
+int32_t RecordArray<SOR>::forwardPosition(const SpatialObjectKey& key, int32_t start) const
+{
+    // Gallop: find an interval (lo, hi] containing the target, doubling the
+    // step each time, then binary search within it.
+    int32_t lo = start;
+    int32_t hi = start;
+    int32_t step = 1;
+    while (hi < _n && compareKey(hi, key) < 0) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > _n) {
+        hi = _n;
+    }
+    // First position >= key is in [lo, hi]
+    while (lo < hi) {
+        int32_t mid = (lo + hi) / 2;
+        if (compareKey(mid, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 template <class SOR>
 uint32_t RecordArray<SOR>::nRecords() const
 {
@@ -145,7 +239,16 @@ Record<SOR> RecordArray<SOR>::at(int32_t position) const
 {
     GEOPHILE_ASSERT(position >= 0);
     GEOPHILE_ASSERT(position < _n);
-    return _records[position];
+    Record<SOR> record;
+    record.set(_zs[position], _sors[position]);
+    return record;
+}
+
+template <class SOR>
+void RecordArray<SOR>::keySearch(KeySearch* key_search)
+{
+    delete _key_search;
+    _key_search = key_search;
 }
 
 template <class SOR>
@@ -162,14 +265,73 @@ void RecordArray<SOR>::growBuffer()
 template <class SOR>
 void RecordArray<SOR>::growArray()
 {
-    int32_t new_capacity = _capacity * 2;
-    Record<SOR>* new_records = new Record<SOR>[new_capacity];
-    memcpy(new_records, _records, _capacity * sizeof(Record<SOR>));
-    delete [] _records;
-    _records = new_records;
+    resize(_capacity * 2);
+}
+
+template <class SOR>
+void RecordArray<SOR>::resize(int32_t new_capacity)
+{
+    GEOPHILE_ASSERT(new_capacity >= _n);
+    Z* new_zs = new Z[new_capacity];
+    int64_t* new_soids = new int64_t[new_capacity];
+    SOR* new_sors = new SOR[new_capacity];
+    memcpy(new_zs, _zs, _n * sizeof(Z));
+    memcpy(new_soids, _soids, _n * sizeof(int64_t));
+    memcpy(new_sors, _sors, _n * sizeof(SOR));
+    delete [] _zs;
+    delete [] _soids;
+    delete [] _sors;
+    _zs = new_zs;
+    _soids = new_soids;
+    _sors = new_sors;
     _capacity = new_capacity;
 }
 
+template <class SOR>
+int32_t RecordArray<SOR>::compareKey(int32_t position, const SpatialObjectKey& key) const
+{
+    Z z = _zs[position];
+    int64_t soid = _soids[position];
+    return
+        z < key.z() ? -1 :
+        z > key.z() ? 1 :
+        soid < key.soid() ? -1 :
+        soid > key.soid() ? 1 : 0;
+}
+
+template <class SOR>
+bool RecordArray<SOR>::sorted() const
+{
+    for (int32_t i = 1; i < _n; i++) {
+        if (compareKey(i, SpatialObjectKey(_zs[i - 1], _soids[i - 1])) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <class SOR>
+void RecordArray<SOR>::buildSearch()
+{
+    if (_key_search == NULL) {
+        return;
+    }
+    SpatialObjectKey* keys = new SpatialObjectKey[_n];
+    for (int32_t i = 0; i < _n; i++) {
+        keys[i] = SpatialObjectKey(_zs[i], _soids[i]);
+    }
+    _key_search->build(keys, _n);
+    delete [] keys;
+}
+
+template <class SOR>
+void RecordArray<SOR>::clearSearch()
+{
+    if (_key_search) {
+        _key_search->clear();
+    }
+}
+
 template <class SOR>
 void RecordArray<SOR>::serialize(const SpatialObject* spatial_object)
 {
@@ -224,6 +386,18 @@ void RecordArrayCursor<SOR>::goTo(const SpatialObjectKey& key)
     this->state(NEVER_USED);
 }
 
+template <class SOR>
+void RecordArrayCursor<SOR>::skipTo(const SpatialObjectKey& key)
+{
+    if (this->state() == IN_USE && _forward) {
+        // _position is the position of the next record to be returned by next().
+        _position = _record_array.forwardPosition(key, _position);
+        _start_at = key;
+    } else {
+        goTo(key);
+    }
+}
+
 template <class SOR>
 RecordArrayCursor<SOR>::RecordArrayCursor(RecordArray<SOR>& record_array)
     : _record_array(record_array),
@@ -249,11 +423,15 @@ Record<SOR> RecordArrayCursor<SOR>::neighbor(int32_t forward_move)
             return this->current();
     }
     if (_position >= 0 && _position < _record_array.nRecords()) {
-        Record<SOR> record = _record_array.at(_position);
+        // Read the columns directly, rather than through at(), so that the
+        // SOR is asked for its soid once, by current. That probably misses
+        // the cache, so the cursor's own state is updated first, and the
+        // next call can proceed while the miss is outstanding.
+        int32_t position = _position;
         _position += forward_move ? 1 : -1;
-        this->current(record.key().z(), record.spatialObjectReference());
+        _start_at.set(_record_array._zs[position], _record_array._soids[position]);
+        this->current(_start_at.z(), _record_array._sors[position]);
         this->state(IN_USE);
-        _start_at = record.key();
     } else {
         this->close();
     }
@@ -4,6 +4,7 @@
 #include "geophile/OrderedIndex.h"
 #include "geophile/Record.h"
 #include "geophile/Cursor.h"
+#include "geophile/KeySearch.h"
 #include "geophile/SpatialObjectTypes.h"
 
 namespace geophile
@@ -11,6 +12,14 @@ namespace geophile
     class SpatialObjectKey;
     class SpatialObjectTypes;
 
+    /*
+     * An OrderedIndex kept in an array, sorted by freeze. The records
+     * are stored as columns: z-values, soids, and SORs, each in its
+     * own array. Searches (position, forwardPosition) compare
+     * z-values, and soids only for equal z-values, so they don't drag
+     * the SORs through the cache. A record is assembled from the
+     * columns only when a cursor returns it.
+     */
     template <class SOR> // SOR: Spatial Object Reference
     class RecordArray : public OrderedIndex<SOR>
     {
@@ -19,6 +28,7 @@ namespace geophile
         virtual void add(Z z, const SOR& sor);
         virtual SOR remove(Z z, int64_t soid);
         virtual void freeze();
+        virtual void load(const Record<SOR>* records, uint32_t n);
         virtual Cursor<SOR>* cursor();
         virtual ~RecordArray();
 
@@ -28,19 +38,37 @@ namespace geophile
         int32_t position(const SpatialObjectKey& key, 
                          int32_t forward_move, 
                          int32_t include_key) const;
+        // Returns the position of the first record whose key is >= key,
+        // searching forward from start. Used for short moves, so the
+        // search gallops from start instead of bisecting the whole array.
+        int32_t forwardPosition(const SpatialObjectKey& key, int32_t start) const;
         uint32_t nRecords() const;
         Record<SOR> at(int32_t position) const;
+        // Replaces the KeySearch, (an EytzingerSearch by default), used by
+        // position once the RecordArray is frozen. NULL means that position
+        // bisects the records. The RecordArray owns key_search, which is
+        // built at the next freeze.
+        void keySearch(KeySearch* key_search);
         RecordArray(const SpatialObjectTypes* spatial_object_types,
                     const SpatialObjectReferenceManager<SOR>* spatial_object_reference_manager,
                     SessionMemory<SOR>* memory);
        
     private:
         // serialize and deserialize use _buffer (which is why this class
-        // is not threadsafe).
+        // is not threadsafe for updates). Retrieval from a frozen
+        // RecordArray doesn't touch _buffer, so any number of threads
+        // can read it concurrently, each using its own Cursor.
         void serialize(const SpatialObject* spatial_object);        
         SpatialObject* deserialize();
         void growBuffer();
         void growArray();
+        void resize(int32_t new_capacity);
+        // Compares the key at position with key, (as SpatialObjectKey::compare).
+        int32_t compareKey(int32_t position, const SpatialObjectKey& key) const;
+        // True if the keys are in order, so that freeze needn't sort.
+        bool sorted() const;
+        void buildSearch();
+        void clearSearch();
         
     private:
         static int32_t recordCompare(const void* x, const void* y);
@@ -52,9 +80,16 @@ namespace geophile
     private:
         int32_t _n;
         int32_t _capacity;
-        Record<SOR>* _records;
+        Z* _zs;
+        int64_t* _soids;
+        SOR* _sors;
         uint32_t _buffer_size;
         byte* _buffer;
+        // Built by freeze, and cleared by any modification. position uses
+        // it while it covers all the records.
+        KeySearch* _key_search;
+
+        template <class> friend class RecordArrayCursor;
     };
 
     template <class SOR>
@@ -64,6 +99,7 @@ namespace geophile
         virtual Record<SOR> next();
         virtual Record<SOR> previous();
         virtual void goTo(const SpatialObjectKey& key);
+        virtual void skipTo(const SpatialObjectKey& key);
         RecordArrayCursor(RecordArray<SOR>& record_array);
         
     private:
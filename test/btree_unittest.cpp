@@ -0,0 +1,172 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "geophile/testbase.h"
+#include "geophile/BTree.h"
+#include "geophile/SpatialObjectPointer.h"
+#include "geophile/InMemorySpatialObjectReferenceManager.h"
+#include "TestSpatialObject.h"
+
+using namespace geophile;
+
+#define ASSERT_EQ(x, y) assert((x) == (y))
+
+#define ASSERT_TRUE(x) assert(x)
+
+static SessionMemory<SpatialObjectPointer> memory;
+static SpatialObjectTypes spatial_object_types;
+static InMemorySpatialObjectReferenceManager spatial_object_reference_manager;
+
+class BTreeFactory : public OrderedIndexFactory<SpatialObjectPointer>
+{
+public:
+    virtual OrderedIndex<SpatialObjectPointer>* newIndex
+    (const SpatialObjectTypes* spatial_object_types) const
+    {
+        return new BTree<SpatialObjectPointer>(spatial_object_types, 
+                                               &_spatial_object_reference_manager,
+                                               &memory);
+    }
+
+private:
+    InMemorySpatialObjectReferenceManager _spatial_object_reference_manager;
+};
+
+BTreeFactory BTREE_FACTORY;
+
+//----------------------------------------------------------------------
+
+// Updates during cursor scans
+
+static const uint32_t N_IDS = 2000;
+
+static Z id_to_z(int64_t id)
+{
+    return Z((id * 10) << Z::LENGTH_BITS, Z::MAX_Z_BITS);
+}
+
+static void update(BTree<SpatialObjectPointer>* btree,
+                   TestSpatialObject** objects,
+                   bool* present,
+                   int64_t id)
+{
+    if (present[id]) {
+        SpatialObjectPointer removed = btree->remove(id_to_z(id), id);
+        ASSERT_TRUE(removed.spatialObject() == objects[id]);
+        present[id] = false;
+    } else {
+        btree->add(id_to_z(id), objects[id]);
+        present[id] = true;
+    }
+}
+
+// Scans forward or backward from start, modifying the BTree as the scan
+// proceeds. Each record returned must be present, and there must be no present
+// record between it and the previous one.
+static void scan(BTree<SpatialObjectPointer>* btree,
+                 TestSpatialObject** objects,
+                 bool* present,
+                 int64_t start,
+                 bool forward)
+{
+    Cursor<SpatialObjectPointer>* cursor = btree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(start), start));
+    int64_t previous = forward ? start - 1 : start + 1;
+    Record<SpatialObjectPointer> record;
+    while (!(record = forward ? cursor->next() : cursor->previous()).eof()) {
+        int64_t id = record.key().soid();
+        ASSERT_TRUE(present[id]);
+        ASSERT_TRUE(record.spatialObjectReference().spatialObject() == objects[id]);
+        ASSERT_TRUE(forward ? id > previous : id < previous);
+        for (int64_t skipped = forward ? previous + 1 : id + 1;
+             skipped < (forward ? id : previous);
+             skipped++) {
+            ASSERT_TRUE(!present[skipped]);
+        }
+        previous = id;
+        // Modify the BTree anywhere, including the records just returned.
+        for (uint32_t i = rand() % 4; i > 0; i--) {
+            update(btree, objects, present, rand() % N_IDS);
+        }
+    }
+    for (int64_t skipped = forward ? previous + 1 : 0;
+         skipped < (forward ? N_IDS : previous);
+         skipped++) {
+        ASSERT_TRUE(!present[skipped]);
+    }
+    delete cursor;
+}
+
+static void testUpdatesDuringScans()
+{
+    BTree<SpatialObjectPointer>* btree = 
+        new BTree<SpatialObjectPointer>(&spatial_object_types, 
+                                        &spatial_object_reference_manager, 
+                                        &memory);
+    TestSpatialObject** objects = new TestSpatialObject*[N_IDS];
+    bool* present = new bool[N_IDS];
+    for (int64_t id = 0; id < N_IDS; id++) {
+        objects[id] = new TestSpatialObject(id);
+        present[id] = false;
+    }
+    srand(911);
+    for (uint32_t i = 0; i < 200; i++) {
+        // Grow the BTree, then shrink it, so that nodes split, and then empty.
+        uint32_t n_updates = rand() % (N_IDS / 2);
+        for (uint32_t u = 0; u < n_updates; u++) {
+            int64_t id = rand() % N_IDS;
+            if (present[id] == (i % 40 >= 20)) {
+                update(btree, objects, present, id);
+            }
+        }
+        scan(btree, objects, present, rand() % N_IDS, i % 2 == 0);
+        uint32_t n = 0;
+        for (int64_t id = 0; id < N_IDS; id++) {
+            if (present[id]) {
+                n++;
+            }
+        }
+        ASSERT_EQ(n, btree->nRecords());
+    }
+    // skipTo lands on the first record at or after the key, whether or not
+    // the key is in the current leaf. (The key must not precede the last
+    // record returned.)
+    Cursor<SpatialObjectPointer>* cursor = btree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0), 0));
+    cursor->next();
+    int64_t target = 1;
+    while (target < N_IDS) {
+        cursor->skipTo(SpatialObjectKey(id_to_z(target), target));
+        Record<SpatialObjectPointer> record = cursor->next();
+        int64_t expected = target;
+        while (expected < N_IDS && !present[expected]) {
+            expected++;
+        }
+        if (expected == N_IDS) {
+            ASSERT_TRUE(record.eof());
+            break;
+        }
+        ASSERT_EQ(expected, record.key().soid());
+        target = expected + 1 + rand() % 50;
+    }
+    delete cursor;
+    delete btree;
+    for (int64_t id = 0; id < N_IDS; id++) {
+        delete objects[id];
+    }
+    delete [] objects;
+    delete [] present;
+}
+
+//----------------------------------------------------------------------
+
+// main
+
+#define RUN_TEST(test) { printf("%s\n", #test); test(); }
+
+int main(int32_t argc, const char** argv)
+{
+    RUN_TEST(testUpdatesDuringScans);
+    runTests(&BTREE_FACTORY);
+}
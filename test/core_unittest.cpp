@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 
 #include "geophile/Space.h"
@@ -11,6 +12,11 @@
 #include "geophile/ByteBufferUnderflowException.h"
 #include "geophile/SessionMemory.h"
 #include "geophile/OutputArray.h"
+#include "geophile/WorkStealingDeque.h"
+#include "geophile/EytzingerSearch.h"
+#include "geophile/OccupancyMap.h"
+#include "geophile/PiecewiseLinearSearch.h"
+#include "geophile/RadixSearch.h"
 
 #include "RecordArray.h"
 #include "TestSpatialObject.h"
@@ -113,26 +119,41 @@ static void testSpace()
 
 // Interleave
 
-static void checkInterleave(const Space& space, int64_t expected, uint64_t x)
+// Checks shuffle, by table and by PDEP, (if the CPU has BMI2), and that
+// unshuffle inverts it.
+static void checkShuffle(Space& space, Z expected, const uint64_t* coords)
+{
+    for (int32_t use_bmi2 = 0; use_bmi2 <= 1; use_bmi2++) {
+        space.useBMI2(use_bmi2);
+        ASSERT_EQ(expected, space.shuffle(coords));
+        uint64_t unshuffled[Space::MAX_DIMENSIONS];
+        space.unshuffle(expected, unshuffled);
+        for (int32_t d = 0; d < space.dimensions(); d++) {
+            ASSERT_EQ(coords[d], unshuffled[d]);
+        }
+    }
+}
+
+static void checkInterleave(Space& space, int64_t expected, uint64_t x)
 {
     const uint64_t coords[] = {x};
-    ASSERT_EQ(zvalue(expected, space.zBits()), space.shuffle(coords));
+    checkShuffle(space, zvalue(expected, space.zBits()), coords);
 }
 
-static void checkInterleave(const Space& space, int64_t expected, uint64_t x, uint64_t y)
+static void checkInterleave(Space& space, int64_t expected, uint64_t x, uint64_t y)
 {
     const uint64_t coords[] = {x, y};
-    ASSERT_EQ(zvalue(expected, space.zBits()), space.shuffle(coords));
+    checkShuffle(space, zvalue(expected, space.zBits()), coords);
 }
 
-static void checkInterleave(const Space& space, 
+static void checkInterleave(Space& space, 
                             int64_t expected, 
                             uint64_t x, 
                             uint64_t y, 
                             uint64_t z)
 {
     const uint64_t coords[] = {x, y, z};
-    ASSERT_EQ(zvalue(expected, space.zBits()), space.shuffle(coords));
+    checkShuffle(space, zvalue(expected, space.zBits()), coords);
 }
 
 static void defaultInterleave()
@@ -217,6 +238,37 @@ static void space10x10x10()
     checkInterleave(space, 0xd40d40d400000000L, 0x333, 0x222, 0x111);
 }
 
+// Coordinates spanning several bytes, in six dimensions, and with an interleave
+// that isn't round-robin. Random coordinates must survive a round trip.
+static void shuffleRoundTrip()
+{
+    double lo[] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    double hi[] = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    uint32_t x_bits_2[] = {28, 29};
+    uint32_t x_bits_6[] = {9, 10, 9, 9, 8, 12};
+    uint32_t interleave_2[57];
+    for (uint32_t i = 0; i < 57; i++) {
+        interleave_2[i] = i < 29 ? 1 : 0;
+    }
+    Space space2(2, lo, hi, x_bits_2, interleave_2);
+    Space space6(6, lo, hi, x_bits_6);
+    Space* spaces[] = {&space2, &space6};
+    srand(21021);
+    for (uint32_t s = 0; s < 2; s++) {
+        Space* space = spaces[s];
+        const uint32_t* x_bits = s == 0 ? x_bits_2 : x_bits_6;
+        for (uint32_t i = 0; i < 1000; i++) {
+            uint64_t coords[Space::MAX_DIMENSIONS];
+            for (int32_t d = 0; d < space->dimensions(); d++) {
+                coords[d] = (((uint64_t) rand() << 31) ^ rand()) & ((1ULL << x_bits[d]) - 1);
+            }
+            space->useBMI2(false);
+            Z z = space->shuffle(coords);
+            checkShuffle(*space, z, coords);
+        }
+    }
+}
+
 static void testInterleave()
 {
     defaultInterleave();
@@ -224,6 +276,7 @@ static void testInterleave()
     space10x10();
     space10x12();
     space10x10x10();
+    shuffleRoundTrip();
 }
 
 //----------------------------------------------------------------------
@@ -294,12 +347,42 @@ static void zLoZHi()
     }
 }
 
+static void ancestor()
+{
+    int64_t Z_TEST = 0xaaaaaaaaaaaaaa80L;
+    Z z = zvalue(Z_TEST, Z::MAX_Z_BITS);
+    for (uint32_t bits = 0; bits <= Z::MAX_Z_BITS; bits++) {
+        Z ancestor = zvalue(prefix(Z_TEST, bits), bits);
+        ASSERT_EQ(ancestor, z.ancestor(bits));
+        if (bits > 0) {
+            ASSERT_EQ(ancestor.parent(), z.ancestor(bits - 1));
+        }
+    }
+}
+
+static void zLast()
+{
+    int64_t Z_TEST = 0xaaaaaaaaaaaaaa80L;
+    for (uint32_t bits = 0; bits <= Z::MAX_Z_BITS; bits++) {
+        Z z = zvalue(prefix(Z_TEST, bits), bits);
+        // The longest z-value at the high point of z is the last one z contains.
+        int64_t suffix = bits == 0 ? -1L : (1L << (64 - bits)) - 1;
+        int64_t hi_bits = prefix(Z_TEST, bits) | (suffix & ~0x7fL);
+        Z last = zvalue(hi_bits, Z::MAX_Z_BITS);
+        ASSERT_TRUE(z.contains(last));
+        ASSERT_EQ(last.asInteger(), z.last());
+        ASSERT_TRUE(z.hi() <= z.last());
+    }
+}
+
 static void testZValues()
 {
     siblings();
     parent();
     contains();
     zLoZHi();
+    ancestor();
+    zLast();
 }
 
 //----------------------------------------------------------------------
@@ -416,6 +499,243 @@ static void decomposeFuocorBug()
     space.decompose(&box, 4, &memory);
 }
 
+static void decomposePoint()
+{
+    // A point's z-value, computed directly, matches the decomposition of a
+    // degenerate box at the same location, which goes through regions.
+    double lo[] = {0.0, 0.0};
+    double hi[] = {1024.0, 1024.0};
+    uint32_t x_bits[] = {10, 10};
+    Space space(2, lo, hi, x_bits);
+    SessionMemory<const SpatialObject*> memory;
+    ZArray* zs = memory.zArray();
+    srand(919919);
+    for (uint32_t i = 0; i < 1000; i++) {
+        double x = (rand() % 1024000) / 1000.0;
+        double y = (rand() % 1024000) / 1000.0;
+        Box2 box(x, x, y, y);
+        space.decompose(&box, box.maxZ(), &memory);
+        ASSERT_EQ(1, zs->length());
+        Z expected = zs->at(0);
+        ASSERT_EQ(space.zBits(), expected.length());
+        Point2 point(x, y);
+        ASSERT_TRUE(point.isPoint());
+        space.decompose(&point, point.maxZ(), &memory);
+        ASSERT_EQ(1, zs->length());
+        ASSERT_EQ(expected, zs->at(0));
+        double coords[] = {x, y};
+        ASSERT_EQ(expected, space.spatialIndexKey(coords));
+    }
+}
+
+// A Box2 decomposed through its virtual functions, not its bounds.
+class GenericBox2 : public Box2
+{
+public:
+    virtual int32_t boxBounds(double* lo, double* hi) const
+    {
+        return false;
+    }
+
+    GenericBox2(double xlo, double xhi, double ylo, double yhi)
+        : Box2(xlo, xhi, ylo, yhi)
+    {}
+};
+
+// Boxes decomposed from their bounds get the same z-values, (and interior
+// marks), as by compare and containsRegion.
+static void checkBoxDecomposition(Space& space, double xlo, double xhi, double ylo, double yhi)
+{
+    SessionMemory<const SpatialObject*> box_memory;
+    SessionMemory<const SpatialObject*> generic_memory;
+    ZArray* box_zs = box_memory.zArray();
+    ZArray* generic_zs = generic_memory.zArray();
+    Box2 box(xlo, xhi, ylo, yhi);
+    GenericBox2 generic_box(xlo, xhi, ylo, yhi);
+    for (uint32_t max_z = 1; max_z <= 16; max_z++) {
+        space.decompose(&box, max_z, &box_memory);
+        space.decompose(&generic_box, max_z, &generic_memory);
+        ASSERT_EQ(generic_zs->length(), box_zs->length());
+        for (uint32_t i = 0; i < box_zs->length(); i++) {
+            ASSERT_EQ(generic_zs->at(i), box_zs->at(i));
+            ASSERT_EQ(generic_zs->interior(i), box_zs->interior(i));
+        }
+    }
+}
+
+static void decomposeBoxFromBounds()
+{
+    double lo[] = {0.0, -100.0};
+    double hi[] = {1000.0, 100.0};
+    uint32_t x_bits[] = {10, 9};
+    // y gets more of the high bits.
+    uint32_t interleave[] = {1, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 0, 0};
+    Space default_space(2, lo, hi, x_bits);
+    Space interleaved_space(2, lo, hi, x_bits, interleave);
+    Space* spaces[] = {&default_space, &interleaved_space};
+    srand(23023);
+    for (uint32_t s = 0; s < 2; s++) {
+        Space& space = *spaces[s];
+        checkBoxDecomposition(space, 0.0, 1000.0, -100.0, 100.0);
+        checkBoxDecomposition(space, 0.0, 0.0, -100.0, -100.0);
+        checkBoxDecomposition(space, 500.0, 1000.0, -100.0, 0.0);
+        checkBoxDecomposition(space, 123.4, 123.4, 5.6, 78.9);
+        for (uint32_t i = 0; i < 500; i++) {
+            double x = (rand() % 1000000) / 1000.0;
+            double y = (rand() % 200000) / 1000.0 - 100.0;
+            double w = (rand() % (i % 2 == 0 ? 10000 : 400000)) / 1000.0;
+            double h = (rand() % (i % 2 == 0 ? 2000 : 80000)) / 1000.0;
+            checkBoxDecomposition(space, x, x + w > 1000.0 ? 1000.0 : x + w, y, y + h > 100.0 ? 100.0 : y + h);
+        }
+    }
+}
+
+// Number of grid cells covered by zs.
+static double coveredCells(const Space& space, const ZArray* zs)
+{
+    double cells = 0;
+    for (uint32_t i = 0; i < zs->length(); i++) {
+        cells += ldexp(1.0, space.zBits() - zs->at(i).length());
+    }
+    return cells;
+}
+
+// A best-first decomposition is a valid cover: at most max_z disjoint z-values
+// containing every point of the box.
+static void checkBestFirstCover(Space& space, const SpatialObject& box, uint32_t max_z, const ZArray* zs)
+{
+    ASSERT_TRUE(zs->length() <= max_z);
+    for (uint32_t i = 0; i < zs->length(); i++) {
+        for (uint32_t j = i + 1; j < zs->length(); j++) {
+            ASSERT_TRUE(!zs->at(i).contains(zs->at(j)) && !zs->at(j).contains(zs->at(i)));
+        }
+    }
+    const Box2& box2 = (const Box2&) box;
+    for (uint32_t p = 0; p < 20; p++) {
+        double point[] = {
+            box2.xlo() + (box2.xhi() - box2.xlo()) * ((double) rand() / RAND_MAX),
+            box2.ylo() + (box2.yhi() - box2.ylo()) * ((double) rand() / RAND_MAX)
+        };
+        Z z = space.spatialIndexKey(point);
+        bool covered = false;
+        for (uint32_t i = 0; i < zs->length() && !covered; i++) {
+            covered = zs->at(i).contains(z);
+        }
+        ASSERT_TRUE(covered);
+    }
+}
+
+// Best-first decomposition covers boxes, and covers less space outside them
+// than breadth-first decomposition with the same max_z.
+static void decomposeBestFirst()
+{
+    double lo[] = {0.0, 0.0};
+    double hi[] = {1000.0, 1000.0};
+    uint32_t x_bits[] = {20, 20};
+    Space space(2, lo, hi, x_bits);
+    ASSERT_EQ(Space::BREADTH_FIRST, space.decomposition());
+    SessionMemory<const SpatialObject*> memory;
+    ZArray* zs = memory.zArray();
+    srand(24024);
+    double breadth_first_cells = 0;
+    double best_first_cells = 0;
+    for (uint32_t i = 0; i < 1000; i++) {
+        double x = (rand() % 900000) / 1000.0;
+        double y = (rand() % 900000) / 1000.0;
+        double w = (rand() % 100000) / 1000.0;
+        double h = (rand() % 100000) / 1000.0;
+        Box2 box(x, x + w, y, y + h);
+        GenericBox2 generic_box(x, x + w, y, y + h);
+        uint32_t max_z = 1 + i % 16;
+        space.decomposition(Space::BREADTH_FIRST);
+        space.decompose(&box, max_z, &memory);
+        breadth_first_cells += coveredCells(space, zs);
+        space.decomposition(Space::BEST_FIRST);
+        space.decompose(&box, max_z, &memory);
+        checkBestFirstCover(space, box, max_z, zs);
+        best_first_cells += coveredCells(space, zs);
+        space.decompose(&generic_box, max_z, &memory);
+        checkBestFirstCover(space, generic_box, max_z, zs);
+    }
+    ASSERT_TRUE(best_first_cells < breadth_first_cells);
+}
+
+// Number of keys contained by zs, (records scanned), and of z-values containing
+// no keys, (empty probes).
+static void probeKeys(const ZArray* zs, const Z* keys, uint32_t n_keys, uint32_t* scanned, uint32_t* empty)
+{
+    for (uint32_t i = 0; i < zs->length(); i++) {
+        uint32_t found = 0;
+        for (uint32_t k = 0; k < n_keys; k++) {
+            if (zs->at(i).contains(keys[k])) {
+                found++;
+            }
+        }
+        *scanned += found;
+        if (found == 0) {
+            (*empty)++;
+        }
+    }
+}
+
+// Data-aware decomposition finds every point in a query box, using at most
+// max_z z-values, and scans fewer points and probes fewer empty z-values than
+// breadth-first decomposition. Most points are in one dense cluster.
+static void decomposeDataAware()
+{
+    static const uint32_t N_POINTS = 5000;
+    static const uint32_t N_QUERIES = 200;
+    static const uint32_t MAX_Z = 8;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {1000.0, 1000.0};
+    uint32_t x_bits[] = {20, 20};
+    Space space(2, lo, hi, x_bits);
+    OccupancyMap occupancy_map(16);
+    SessionMemory<const SpatialObject*> memory;
+    ZArray* zs = memory.zArray();
+    srand(25025);
+    double (*points)[2] = new double[N_POINTS][2];
+    Z* keys = new Z[N_POINTS];
+    for (uint32_t p = 0; p < N_POINTS; p++) {
+        bool clustered = p % 10 != 0;
+        points[p][0] = clustered ? 200 + (rand() % 100000) / 1000.0 : (rand() % 1000000) / 1000.0;
+        points[p][1] = clustered ? 300 + (rand() % 100000) / 1000.0 : (rand() % 1000000) / 1000.0;
+        keys[p] = space.spatialIndexKey(points[p]);
+        occupancy_map.add(keys[p]);
+    }
+    uint32_t breadth_first_scanned = 0;
+    uint32_t breadth_first_empty = 0;
+    uint32_t data_aware_scanned = 0;
+    uint32_t data_aware_empty = 0;
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        double x = (rand() % 800000) / 1000.0;
+        double y = (rand() % 800000) / 1000.0;
+        double size = (rand() % 200000) / 1000.0;
+        Box2 box(x, x + size, y, y + size);
+        space.decomposition(Space::BREADTH_FIRST);
+        space.decompose(&box, MAX_Z, &memory, &occupancy_map);
+        probeKeys(zs, keys, N_POINTS, &breadth_first_scanned, &breadth_first_empty);
+        space.decomposition(Space::DATA_AWARE);
+        space.decompose(&box, MAX_Z, &memory, &occupancy_map);
+        probeKeys(zs, keys, N_POINTS, &data_aware_scanned, &data_aware_empty);
+        ASSERT_TRUE(zs->length() <= MAX_Z);
+        for (uint32_t p = 0; p < N_POINTS; p++) {
+            if (box.xlo() <= points[p][0] && points[p][0] <= box.xhi() &&
+                box.ylo() <= points[p][1] && points[p][1] <= box.yhi()) {
+                bool covered = false;
+                for (uint32_t i = 0; i < zs->length() && !covered; i++) {
+                    covered = zs->at(i).contains(keys[p]);
+                }
+                ASSERT_TRUE(covered);
+            }
+        }
+    }
+    ASSERT_TRUE(data_aware_scanned < breadth_first_scanned);
+    ASSERT_TRUE(data_aware_empty < breadth_first_empty);
+    delete [] points;
+    delete [] keys;
+}
+
 static void testDecomposition()
 {
     decomposeEntireSpace();
@@ -425,6 +745,10 @@ static void testDecomposition()
     decomposeTopHalfSpace();
     decomposeTinyBoxInMiddleOfSpace();
     decomposeFuocorBug();
+    decomposePoint();
+    decomposeBoxFromBounds();
+    decomposeBestFirst();
+    decomposeDataAware();
 }
 
 //----------------------------------------------------------------------
@@ -548,6 +872,394 @@ static void testByteBuffer()
 
 //----------------------------------------------------------------------
 
+// WorkStealingDeque
+
+static void workStealingDequeTakeAndSteal()
+{
+    static const uint32_t N = 1000; // Enough to force growth
+    WorkStealingDeque deque;
+    uint32_t task;
+    ASSERT_TRUE(!deque.take(&task));
+    ASSERT_TRUE(!deque.steal(&task));
+    for (uint32_t i = 0; i < N; i++) {
+        deque.push(i);
+    }
+    ASSERT_EQ(N, deque.size());
+    // take runs forward from the first task pushed, steal runs
+    // backward from the last.
+    uint32_t next_taken = 0;
+    uint32_t next_stolen = N - 1;
+    for (uint32_t i = 0; i < N; i++) {
+        if (i % 3 == 0) {
+            ASSERT_TRUE(deque.steal(&task));
+            ASSERT_EQ(next_stolen--, task);
+        } else {
+            ASSERT_TRUE(deque.take(&task));
+            ASSERT_EQ(next_taken++, task);
+        }
+    }
+    ASSERT_EQ(0, deque.size());
+    ASSERT_TRUE(!deque.take(&task));
+    ASSERT_TRUE(!deque.steal(&task));
+}
+
+static void workStealingDequeReuse()
+{
+    WorkStealingDeque deque;
+    uint32_t task;
+    // Alternate pushes and takes, so that space freed by take is reclaimed.
+    for (uint32_t i = 0; i < 1000; i++) {
+        deque.push(2 * i);
+        deque.push(2 * i + 1);
+        ASSERT_TRUE(deque.take(&task));
+        ASSERT_EQ(i, task);
+    }
+    ASSERT_EQ(1000, deque.size());
+    deque.clear();
+    ASSERT_EQ(0, deque.size());
+    ASSERT_TRUE(!deque.take(&task));
+}
+
+static void testWorkStealingDeque()
+{
+    workStealingDequeTakeAndSteal();
+    workStealingDequeReuse();
+}
+
+//----------------------------------------------------------------------
+
+// KeySearch
+
+static Z keySearchZ(int64_t z)
+{
+    return Z(z << Z::LENGTH_BITS, Z::MAX_Z_BITS);
+}
+
+// Checks that the range of key contains the position of the first key >= key
+// (include_key) or > key (!include_key), found by bisection.
+static void checkKeySearchRange(const KeySearch* search,
+                                const SpatialObjectKey* keys,
+                                uint32_t n,
+                                const SpatialObjectKey& key)
+{
+    for (int32_t include_key = 0; include_key <= 1; include_key++) {
+        uint32_t lo = 0;
+        uint32_t hi = n;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            int32_t c = keys[mid].compare(key);
+            if (c < 0 || (c == 0 && !include_key)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        uint32_t range_lo;
+        uint32_t range_hi;
+        search->range(key, include_key, &range_lo, &range_hi);
+        ASSERT_TRUE(range_lo <= lo && lo <= range_hi && range_hi <= n);
+    }
+}
+
+// Checks every key, its neighbors, and z-values between keys.
+static void checkKeySearch(KeySearch* search, const SpatialObjectKey* keys, uint32_t n)
+{
+    search->build(keys, n);
+    ASSERT_EQ(n, search->size());
+    for (uint32_t i = 0; i < n; i++) {
+        int64_t z = keys[i].z().asInteger() >> Z::LENGTH_BITS;
+        int64_t soid = keys[i].soid();
+        checkKeySearchRange(search, keys, n, keys[i]);
+        checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(z), soid - 1));
+        checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(z), soid + 1));
+        checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(z)));
+        checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(z + 1)));
+        if (z > 0) {
+            checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(z - 1), soid));
+        }
+    }
+    checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(0)));
+    checkKeySearchRange(search, keys, n, SpatialObjectKey(keySearchZ(1LL << 50)));
+    search->clear();
+    ASSERT_EQ(0, search->size());
+}
+
+// Sizes up to 100, so that an Eytzinger tree's last level is full and
+// partially full. Pairs of keys share a z-value, so soids are compared too.
+static void keySearchSmall(KeySearch* search)
+{
+    static const uint32_t MAX_N = 100;
+    SpatialObjectKey keys[MAX_N];
+    for (uint32_t n = 0; n <= MAX_N; n++) {
+        for (uint32_t i = 0; i < n; i++) {
+            keys[i] = SpatialObjectKey(keySearchZ(i / 2 * 4 + 4), i % 2 * 2);
+        }
+        checkKeySearch(search, keys, n);
+    }
+}
+
+// Random z-values, dense and sparse regions, and long runs of records
+// sharing a z-value.
+static void keySearchSkewed(KeySearch* search)
+{
+    static const uint32_t N = 20000;
+    SpatialObjectKey* keys = new SpatialObjectKey[N];
+    srand(17017);
+    int64_t z = 1000;
+    uint32_t i = 0;
+    while (i < N) {
+        uint32_t run = rand() % 50 == 0 ? 1 + rand() % 300 : 1;
+        for (uint32_t r = 0; r < run && i < N; r++) {
+            keys[i++] = SpatialObjectKey(keySearchZ(z), r);
+        }
+        z += i < N / 2 ? 1 + rand() % 3 : 1 + rand() % 100000;
+    }
+    checkKeySearch(search, keys, N);
+    delete [] keys;
+}
+
+// A smooth distribution needs few segments.
+static void piecewiseLinearSearchModelSize()
+{
+    static const uint32_t N = 100000;
+    SpatialObjectKey* keys = new SpatialObjectKey[N];
+    for (uint32_t i = 0; i < N; i++) {
+        keys[i] = SpatialObjectKey(keySearchZ(1000000 + (int64_t) i * 37 + i % 5), i);
+    }
+    PiecewiseLinearSearch search;
+    search.build(keys, N);
+    ASSERT_TRUE(search.nSegments() > 0);
+    ASSERT_TRUE(search.modelSize() < 4096);
+    checkKeySearch(&search, keys, N);
+    delete [] keys;
+}
+
+// Keys in a few clusters, far apart, so most prefixes are empty. The range
+// for a z-value with an empty prefix is a single position.
+static void radixSearchEmptyPrefixes()
+{
+    static const uint32_t N = 3000;
+    SpatialObjectKey* keys = new SpatialObjectKey[N];
+    for (uint32_t i = 0; i < N; i++) {
+        keys[i] = SpatialObjectKey(keySearchZ((int64_t) (i / 1000) << 40 | (i % 1000)), i);
+    }
+    RadixSearch search;
+    checkKeySearch(&search, keys, N);
+    search.build(keys, N);
+    ASSERT_TRUE(search.bits() > 0 && search.bits() <= RadixSearch::MAX_BITS);
+    ASSERT_TRUE(search.nBuckets() <= (1u << search.bits()));
+    uint32_t lo;
+    uint32_t hi;
+    search.range(SpatialObjectKey(keySearchZ(1LL << 39)), true, &lo, &hi);
+    ASSERT_EQ(1000, lo);
+    ASSERT_EQ(1000, hi);
+    delete [] keys;
+}
+
+static void testKeySearch()
+{
+    EytzingerSearch eytzinger_search;
+    keySearchSmall(&eytzinger_search);
+    keySearchSkewed(&eytzinger_search);
+    PiecewiseLinearSearch piecewise_linear_search;
+    keySearchSmall(&piecewise_linear_search);
+    keySearchSkewed(&piecewise_linear_search);
+    PiecewiseLinearSearch exact_search(0);
+    keySearchSkewed(&exact_search);
+    piecewiseLinearSearchModelSize();
+    RadixSearch radix_search;
+    keySearchSmall(&radix_search);
+    keySearchSkewed(&radix_search);
+    RadixSearch one_bit_search(1);
+    keySearchSkewed(&one_bit_search);
+    radixSearchEmptyPrefixes();
+}
+
+//----------------------------------------------------------------------
+
+// OccupancyMap
+
+// A random z-value of the given length. If clustered, its first 4 bits are 0011,
+// (for length >= 4).
+static Z occupancyZ(uint32_t length, bool clustered)
+{
+    int64_t bits = (int64_t) (((uint64_t) rand() << 40) ^ ((uint64_t) rand() << 20) ^ rand());
+    if (clustered) {
+        bits = (bits & ~prefix(-1L, 4)) | (3L << 60);
+    }
+    return zvalue(length == 0 ? 0 : prefix(bits, length), length);
+}
+
+// mayOverlap must be true for a query overlapping an added z-value. Checked
+// against all added z-values, of lengths up to, and past, the map's levels.
+static void occupancyMapRandom()
+{
+    static const uint32_t LEVELS = 12;
+    static const uint32_t MAX_LENGTH = 20;
+    static const uint32_t N_ADDED = 200;
+    static const uint32_t N_QUERIES = 20000;
+    OccupancyMap occupancy_map(LEVELS);
+    ASSERT_EQ(LEVELS, occupancy_map.levels());
+    Z added[N_ADDED];
+    srand(19019);
+    for (uint32_t i = 0; i < N_ADDED; i++) {
+        // Mostly long z-values, some shorter than LEVELS.
+        uint32_t length = i % 10 == 0 ? 4 + rand() % (LEVELS - 4) : LEVELS + rand() % (MAX_LENGTH - LEVELS);
+        added[i] = occupancyZ(length, true);
+        occupancy_map.add(added[i]);
+    }
+    uint32_t dropped = 0;
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        Z z = occupancyZ(rand() % (MAX_LENGTH + 1), q % 2 == 0);
+        bool overlap = false;
+        for (uint32_t i = 0; i < N_ADDED && !overlap; i++) {
+            overlap = added[i].contains(z) || z.contains(added[i]);
+        }
+        bool may_overlap = occupancy_map.mayOverlap(z);
+        ASSERT_TRUE(may_overlap || !overlap);
+        if (!may_overlap) {
+            dropped++;
+        }
+    }
+    // Unclustered queries are mostly outside the cluster.
+    ASSERT_TRUE(dropped > N_QUERIES / 4);
+    occupancy_map.clear();
+    for (uint32_t i = 0; i < N_ADDED; i++) {
+        ASSERT_TRUE(!occupancy_map.mayOverlap(added[i]));
+    }
+}
+
+// A z-value of length 0 overlaps everything.
+static void occupancyMapEverything()
+{
+    OccupancyMap occupancy_map(8);
+    ASSERT_TRUE(!occupancy_map.mayOverlap(zvalue(0, 0)));
+    ASSERT_TRUE(!occupancy_map.mayOverlap(zvalue(mask(0), 1)));
+    occupancy_map.add(zvalue(0, 0));
+    ASSERT_TRUE(occupancy_map.mayOverlap(zvalue(0, 0)));
+    ASSERT_TRUE(occupancy_map.mayOverlap(zvalue(mask(0), 1)));
+    ASSERT_TRUE(occupancy_map.mayOverlap(zvalue(mask(0) | mask(5), 20)));
+}
+
+// records counts the added z-values at or below a counted prefix, and scales
+// the count of the deepest counted prefix below that.
+static void occupancyMapRecords()
+{
+    static const uint32_t LEVELS = 16;
+    static const uint32_t N_ADDED = 500;
+    OccupancyMap occupancy_map(LEVELS);
+    Z added[N_ADDED];
+    srand(25025);
+    for (uint32_t i = 0; i < N_ADDED; i++) {
+        added[i] = occupancyZ(2 + rand() % 20, true);
+        occupancy_map.add(added[i]);
+    }
+    for (uint32_t q = 0; q < 1000; q++) {
+        Z z = occupancyZ(rand() % (OccupancyMap::MAX_COUNT_LEVELS + 1), q % 2 == 0);
+        uint32_t expected = 0;
+        for (uint32_t i = 0; i < N_ADDED; i++) {
+            if (z.contains(added[i])) {
+                expected++;
+            }
+        }
+        ASSERT_EQ(expected, occupancy_map.records(z));
+        if (z.length() == OccupancyMap::MAX_COUNT_LEVELS) {
+            Z below = zvalue(prefix(z.asInteger() << 1, z.length()) | mask(z.length()), z.length() + 1);
+            ASSERT_EQ(expected / 2.0, occupancy_map.records(below));
+        }
+    }
+    occupancy_map.clear();
+    ASSERT_EQ(0, occupancy_map.records(zvalue(0, 0)));
+}
+
+static void testOccupancyMap()
+{
+    occupancyMapRandom();
+    occupancyMapEverything();
+    occupancyMapRecords();
+}
+
+//----------------------------------------------------------------------
+
+// Batch conversion
+
+// The batch appToZ, by AVX2 and by scalar code, must match appToZ exactly,
+// at the space's bounds, outside them, and for n not a multiple of 4.
+static void batchAppToZ()
+{
+    static const uint32_t N = 103;
+    double lo[] = {-500.0, 0.0};
+    double hi[] = {1000.0, 1.0};
+    uint32_t x_bits[] = {27, 13};
+    Space space(2, lo, hi, x_bits);
+    srand(22022);
+    for (uint32_t d = 0; d < 2; d++) {
+        double width = hi[d] - lo[d];
+        double x[N];
+        for (uint32_t i = 0; i < N; i++) {
+            x[i] = lo[d] + width * ((double) rand() / RAND_MAX);
+        }
+        x[0] = lo[d];
+        x[1] = hi[d];
+        x[2] = hi[d] - width / 1e9;
+        x[5] = lo[d] - width / 3;
+        x[6] = hi[d] + width;
+        // Past 2^51 in the Z space, (redone by scalar code).
+        x[9] = 1e12;
+        x[N - 1] = hi[d];
+        for (int32_t use_avx2 = 0; use_avx2 <= 1; use_avx2++) {
+            space.useAVX2(use_avx2);
+            for (uint32_t n = 0; n <= N; n += (n < 10 ? 1 : 31)) {
+                int64_t z[N];
+                space.appToZ(d, x, n, z);
+                for (uint32_t i = 0; i < n; i++) {
+                    ASSERT_EQ(space.appToZ(d, x[i]), z[i]);
+                }
+            }
+        }
+    }
+}
+
+// spatialIndexKeys must match spatialIndexKey, across several blocks.
+static void batchSpatialIndexKeys()
+{
+    static const uint32_t N = 1000;
+    double lo[] = {0.0, -1.0, 100.0};
+    double hi[] = {1.0, 1.0, 200.0};
+    uint32_t x_bits[] = {19, 19, 18};
+    Space space(3, lo, hi, x_bits);
+    double* coords[3];
+    for (uint32_t d = 0; d < 3; d++) {
+        coords[d] = new double[N];
+        for (uint32_t i = 0; i < N; i++) {
+            coords[d][i] = lo[d] + (hi[d] - lo[d]) * ((double) rand() / RAND_MAX);
+        }
+        coords[d][0] = lo[d];
+        coords[d][N - 1] = hi[d];
+    }
+    Z* zs = new Z[N];
+    for (int32_t use_avx2 = 0; use_avx2 <= 1; use_avx2++) {
+        space.useAVX2(use_avx2);
+        space.spatialIndexKeys(coords, N, zs);
+        for (uint32_t i = 0; i < N; i++) {
+            double point[] = {coords[0][i], coords[1][i], coords[2][i]};
+            ASSERT_EQ(space.spatialIndexKey(point), zs[i]);
+        }
+    }
+    delete [] zs;
+    for (uint32_t d = 0; d < 3; d++) {
+        delete [] coords[d];
+    }
+}
+
+static void testBatchConversion()
+{
+    batchAppToZ();
+    batchSpatialIndexKeys();
+}
+
+//----------------------------------------------------------------------
+
 // main
 
 #define RUN_TEST(test) { printf("%s\n", #test); test(); }
@@ -559,4 +1271,8 @@ int main(int32_t argc, const char** argv)
     RUN_TEST(testZValues);
     RUN_TEST(testDecomposition);
     RUN_TEST(testByteBuffer);
+    RUN_TEST(testWorkStealingDeque);
+    RUN_TEST(testKeySearch);
+    RUN_TEST(testOccupancyMap);
+    RUN_TEST(testBatchConversion);
 }
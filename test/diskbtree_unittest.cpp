@@ -0,0 +1,581 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "geophile/geophile.h"
+#include "geophile/BufferPool.h"
+#include "geophile/DiskBTree.h"
+
+using namespace geophile;
+
+#define ASSERT_EQ(x, y) assert((x) == (y))
+
+#define ASSERT_TRUE(x) assert(x)
+
+// Records are deserialized, so SORs are Point2s, copied by value.
+static SessionMemory<Point2> memory;
+static SpatialObjectTypes spatial_object_types;
+static InlineSpatialObjectReferenceManager<Point2> spatial_object_reference_manager;
+static char path[] = "/tmp/diskbtree_unittest_XXXXXX";
+
+// The smallest BufferPool, so that tests evict pages.
+static const uint64_t SMALL_MEMORY = BufferPool::MIN_FRAMES * DiskBTree<Point2>::PAGE_SIZE;
+
+static SpatialObject* newPoint()
+{
+    return new Point2();
+}
+
+static SpatialObject* newBox()
+{
+    return new Box2();
+}
+
+static Z id_to_z(int64_t id)
+{
+    return Z((id * 10) << Z::LENGTH_BITS, Z::MAX_Z_BITS);
+}
+
+static Point2 point(int64_t id)
+{
+    Point2 point(id, -id);
+    point.id(id);
+    return point;
+}
+
+static DiskBTree<Point2>* openDiskBTree(uint64_t memory_budget)
+{
+    return new DiskBTree<Point2>(&spatial_object_types,
+                                 &spatial_object_reference_manager,
+                                 &memory,
+                                 path,
+                                 memory_budget);
+}
+
+static void clear()
+{
+    ASSERT_EQ(0, truncate(path, 0));
+}
+
+static void checkRecord(const Record<Point2>& record)
+{
+    int64_t id = record.key().soid();
+    const Point2& p = record.spatialObjectReference();
+    ASSERT_EQ(id, p.id());
+    ASSERT_TRUE(p.x() == id && p.y() == -id);
+    ASSERT_EQ(id_to_z(id).asInteger(), record.key().z().asInteger());
+}
+
+// Checks that the DiskBTree contains exactly the present ids, scanning in
+// both directions.
+static void checkContents(DiskBTree<Point2>* btree, const bool* present, uint32_t n_ids)
+{
+    uint32_t n_present = 0;
+    for (uint32_t id = 0; id < n_ids; id++) {
+        if (present[id]) {
+            n_present++;
+        }
+    }
+    ASSERT_EQ(n_present, btree->nRecords());
+    Cursor<Point2>* cursor = btree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0)));
+    int64_t expected = -1;
+    Record<Point2> record;
+    while (!(record = cursor->next()).eof()) {
+        checkRecord(record);
+        do {
+            expected++;
+        } while (!present[expected]);
+        ASSERT_EQ(expected, record.key().soid());
+    }
+    cursor->goTo(SpatialObjectKey(id_to_z(n_ids)));
+    expected = n_ids;
+    while (!(record = cursor->previous()).eof()) {
+        checkRecord(record);
+        do {
+            expected--;
+        } while (!present[expected]);
+        ASSERT_EQ(expected, record.key().soid());
+    }
+    delete cursor;
+}
+
+//----------------------------------------------------------------------
+
+// Updates during cursor scans, with pages evicted
+
+static const uint32_t N_IDS = 20000;
+
+static void update(DiskBTree<Point2>* btree, bool* present, int64_t id)
+{
+    if (present[id]) {
+        Point2 removed = btree->remove(id_to_z(id), id);
+        ASSERT_EQ(id, removed.id());
+        ASSERT_TRUE(removed.x() == id);
+        present[id] = false;
+    } else {
+        btree->add(id_to_z(id), point(id));
+        present[id] = true;
+    }
+}
+
+// Scans forward or backward from start, modifying the DiskBTree as the scan
+// proceeds. Each record returned must be present, and there must be no present
+// record between it and the previous one.
+static void scan(DiskBTree<Point2>* btree, bool* present, int64_t start, bool forward)
+{
+    Cursor<Point2>* cursor = btree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(start), start));
+    int64_t previous = forward ? start - 1 : start + 1;
+    Record<Point2> record;
+    while (!(record = forward ? cursor->next() : cursor->previous()).eof()) {
+        int64_t id = record.key().soid();
+        ASSERT_TRUE(present[id]);
+        checkRecord(record);
+        for (int64_t skipped = forward ? previous + 1 : previous - 1;
+             skipped != id;
+             skipped += forward ? 1 : -1) {
+            ASSERT_TRUE(!present[skipped]);
+        }
+        previous = id;
+        for (uint32_t i = 0; i < 3; i++) {
+            update(btree, present, rand() % N_IDS);
+        }
+    }
+    delete cursor;
+}
+
+static void testUpdates()
+{
+    clear();
+    DiskBTree<Point2>* btree = openDiskBTree(SMALL_MEMORY);
+    bool* present = new bool[N_IDS];
+    for (uint32_t id = 0; id < N_IDS; id++) {
+        present[id] = false;
+    }
+    srand(15015);
+    for (uint32_t i = 0; i < N_IDS; i++) {
+        update(btree, present, rand() % N_IDS);
+    }
+    checkContents(btree, present, N_IDS);
+    for (uint32_t trial = 0; trial < 10; trial++) {
+        scan(btree, present, rand() % N_IDS, trial % 2 == 0);
+        checkContents(btree, present, N_IDS);
+    }
+    // The index is many times larger than the BufferPool.
+    const BufferPool* pool = btree->bufferPool();
+    ASSERT_EQ(BufferPool::MIN_FRAMES, pool->nFrames());
+    ASSERT_TRUE(pool->nReads() > 10 * pool->nFrames());
+    // Remove everything, (emptying and freeing every node), then start over.
+    for (uint32_t id = 0; id < N_IDS; id++) {
+        if (present[id]) {
+            update(btree, present, id);
+        }
+    }
+    checkContents(btree, present, N_IDS);
+    for (uint32_t id = 0; id < N_IDS; id += 2) {
+        update(btree, present, id);
+    }
+    checkContents(btree, present, N_IDS);
+    // skipTo, within a leaf and across leaves
+    Cursor<Point2>* cursor = btree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0)));
+    ASSERT_EQ(0, cursor->next().key().soid());
+    for (int64_t target = 1; target < N_IDS; target += 1 + rand() % 500) {
+        cursor->skipTo(SpatialObjectKey(id_to_z(target), target));
+        Record<Point2> record = cursor->next();
+        int64_t expected = target + target % 2;
+        if (expected < N_IDS) {
+            ASSERT_EQ(expected, record.key().soid());
+            checkRecord(record);
+        } else {
+            ASSERT_TRUE(record.eof());
+        }
+    }
+    delete cursor;
+    delete btree;
+    delete [] present;
+}
+
+//----------------------------------------------------------------------
+
+// The file persists across DiskBTrees
+
+static void testReopen()
+{
+    static const uint32_t N = 10000;
+    clear();
+    bool* present = new bool[N];
+    DiskBTree<Point2>* btree = openDiskBTree(SMALL_MEMORY);
+    for (uint32_t id = 0; id < N; id++) {
+        btree->add(id_to_z(id), point(id));
+        present[id] = true;
+    }
+    delete btree;
+    btree = openDiskBTree(SMALL_MEMORY);
+    checkContents(btree, present, N);
+    for (uint32_t id = 0; id < N; id += 3) {
+        btree->remove(id_to_z(id), id);
+        present[id] = false;
+    }
+    // freeze saves the DiskBTree, which can then be read by another one.
+    btree->freeze();
+    DiskBTree<Point2>* reader = openDiskBTree(SMALL_MEMORY);
+    checkContents(reader, present, N);
+    delete reader;
+    // Freed pages are reused, so the file stops growing.
+    for (uint32_t id = 0; id < N; id += 3) {
+        btree->add(id_to_z(id), point(id));
+        present[id] = true;
+    }
+    delete btree;
+    off_t size = 0;
+    for (uint32_t round = 0; round < 3; round++) {
+        btree = openDiskBTree(SMALL_MEMORY);
+        checkContents(btree, present, N);
+        for (uint32_t id = 0; id < N; id++) {
+            btree->remove(id_to_z(id), id);
+        }
+        for (uint32_t id = 0; id < N; id++) {
+            btree->add(id_to_z(id), point(id));
+        }
+        delete btree;
+        FILE* file = fopen(path, "rb");
+        fseek(file, 0, SEEK_END);
+        if (round == 0) {
+            size = ftell(file);
+        } else {
+            ASSERT_EQ(size, ftell(file));
+        }
+        fclose(file);
+    }
+    delete [] present;
+}
+
+//----------------------------------------------------------------------
+
+// Bulk load
+
+static void testLoad()
+{
+    static const uint32_t N = 100000;
+    clear();
+    Record<Point2>* records = new Record<Point2>[N];
+    for (uint32_t id = 0; id < N; id++) {
+        records[id].set(id_to_z(id), point(id));
+    }
+    DiskBTree<Point2>* btree = openDiskBTree(SMALL_MEMORY);
+    btree->load(records, N);
+    delete btree;
+    bool* present = new bool[N];
+    for (uint32_t id = 0; id < N; id++) {
+        present[id] = true;
+    }
+    btree = openDiskBTree(SMALL_MEMORY);
+    checkContents(btree, present, N);
+    // Loading a non-empty DiskBTree adds the records.
+    for (uint32_t id = 0; id < N; id++) {
+        present[id] = id % 2 == 0;
+        btree->remove(id_to_z(id), id);
+    }
+    uint32_t n = 0;
+    for (uint32_t id = 0; id < N; id += 2) {
+        records[n++].set(id_to_z(id), point(id));
+    }
+    btree->load(records, n);
+    checkContents(btree, present, N);
+    delete btree;
+    delete [] present;
+    delete [] records;
+}
+
+static void testBadFile()
+{
+    FILE* file = fopen(path, "wb");
+    for (uint32_t i = 0; i < 10000; i++) {
+        fputc(i, file);
+    }
+    fclose(file);
+    bool rejected = false;
+    try {
+        DiskBTree<Point2> btree(&spatial_object_types,
+                                &spatial_object_reference_manager,
+                                &memory,
+                                path,
+                                SMALL_MEMORY);
+    } catch (GeophileException& e) {
+        rejected = true;
+    }
+    ASSERT_TRUE(rejected);
+}
+
+//----------------------------------------------------------------------
+
+// Spatial index over a reopened DiskBTree
+
+static bool overlap(const Box2* a, const Box2* b)
+{
+    return
+        a->xlo() <= b->xhi() && b->xlo() <= a->xhi() &&
+        a->ylo() <= b->yhi() && b->ylo() <= a->yhi();
+}
+
+class BoxFilter : public SpatialIndexFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* query_object,
+                         const SpatialObject* spatial_object) const
+    {
+        return ::overlap((const Box2*) query_object, (const Box2*) spatial_object);
+    }
+};
+
+// Records are deserialized into a reused object, so refer instead to the
+// test's box with the same id.
+class BoxReferenceManager : public SpatialObjectReferenceManager<SpatialObjectPointer>
+{
+public:
+    virtual SpatialObjectPointer newSpatialObjectReference(const SpatialObject* spatial_object) const
+    {
+        return SpatialObjectPointer(_boxes[spatial_object->id()]);
+    }
+
+    virtual void cleanupSpatialObjectReference(const SpatialObjectPointer& sor) const
+    {}
+
+    BoxReferenceManager(Box2** boxes)
+        : _boxes(boxes)
+    {}
+
+private:
+    Box2** _boxes;
+};
+
+// Number of distinct boxes in the output
+static uint32_t nOutputBoxes(SessionMemory<SpatialObjectPointer>* memory, bool* found, uint32_t n_boxes)
+{
+    memset(found, 0, n_boxes * sizeof(bool));
+    uint32_t n = 0;
+    OutputArray<SpatialObjectPointer>* output = memory->output();
+    for (uint32_t i = 0; i < output->length(); i++) {
+        int64_t id = output->at(i).spatialObject()->id();
+        if (!found[id]) {
+            found[id] = true;
+            n++;
+        }
+    }
+    memory->clearOutput();
+    return n;
+}
+
+// The z-value lengths are saved with the records, so that a SpatialIndex
+// over the reopened file finds large boxes, (with short z-values),
+// containing the query, and builds its OccupancyMap.
+static void testSpatialIndex()
+{
+    static const uint32_t X_MAX = 1000;
+    static const uint32_t Y_MAX = 1000;
+    static const uint32_t N_BOXES = 2000;
+    static const uint32_t N_QUERIES = 100;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {X_MAX, Y_MAX};
+    uint32_t x_bits[] = {10, 10};
+    Space space(2, lo, hi, x_bits);
+    SessionMemory<SpatialObjectPointer> box_memory;
+    srand(1515);
+    Box2** boxes = new Box2*[N_BOXES];
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        double size = b % 100 == 0 ? 500 : 10;
+        double xlo = rand() % (uint32_t) (X_MAX - size);
+        double ylo = rand() % (uint32_t) (Y_MAX - size);
+        boxes[b] = new Box2(xlo, xlo + size, ylo, ylo + size);
+        boxes[b]->id(b);
+    }
+    BoxReferenceManager box_reference_manager(boxes);
+    BoxFilter filter;
+    bool* found = new bool[N_BOXES];
+    // Without and with an OccupancyMap
+    uint32_t occupancy_levels[] = {0, 8};
+    for (uint32_t o = 0; o < 2; o++) {
+        clear();
+        DiskBTree<SpatialObjectPointer>* btree =
+            new DiskBTree<SpatialObjectPointer>(&spatial_object_types,
+                                                &box_reference_manager,
+                                                &box_memory,
+                                                path,
+                                                SMALL_MEMORY);
+        SpatialIndex<SpatialObjectPointer>* spatial_index =
+            new SpatialIndex<SpatialObjectPointer>(&space,
+                                                   btree,
+                                                   &box_reference_manager,
+                                                   occupancy_levels[o]);
+        for (uint32_t b = 0; b < N_BOXES; b++) {
+            spatial_index->add(boxes[b], &box_memory);
+        }
+        spatial_index->freeze();
+        delete spatial_index;
+        delete btree;
+        btree = new DiskBTree<SpatialObjectPointer>(&spatial_object_types,
+                                                    &box_reference_manager,
+                                                    &box_memory,
+                                                    path,
+                                                    SMALL_MEMORY);
+        spatial_index = new SpatialIndex<SpatialObjectPointer>(&space,
+                                                               btree,
+                                                               &box_reference_manager,
+                                                               occupancy_levels[o]);
+        Box2 everything(0, X_MAX, 0, Y_MAX);
+        everything.id(N_BOXES);
+        spatial_index->findOverlapping(&everything, &filter, &box_memory);
+        ASSERT_EQ(N_BOXES, nOutputBoxes(&box_memory, found, N_BOXES));
+        for (uint32_t q = 0; q < N_QUERIES; q++) {
+            double xlo = rand() % (X_MAX - 20);
+            double ylo = rand() % (Y_MAX - 20);
+            Box2 query(xlo, xlo + 20, ylo, ylo + 20);
+            query.id(N_BOXES + 1 + q);
+            spatial_index->findOverlapping(&query, &filter, &box_memory);
+            uint32_t n_found = nOutputBoxes(&box_memory, found, N_BOXES);
+            uint32_t n_expected = 0;
+            for (uint32_t b = 0; b < N_BOXES; b++) {
+                if (overlap(&query, boxes[b])) {
+                    ASSERT_TRUE(found[b]);
+                    n_expected++;
+                }
+            }
+            ASSERT_EQ(n_expected, n_found);
+        }
+        delete spatial_index;
+        delete btree;
+    }
+    delete [] found;
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        delete boxes[b];
+    }
+    delete [] boxes;
+}
+
+//----------------------------------------------------------------------
+
+// BufferPool
+
+static const uint32_t POOL_PAGE_SIZE = 4096;
+static const uint32_t POOL_PAGES = 64;
+
+// Each page of the file starts with its page number.
+static void writePoolFile()
+{
+    clear();
+    int fd = open(path, O_WRONLY);
+    ASSERT_TRUE(fd >= 0);
+    uint8_t page[POOL_PAGE_SIZE] = {0};
+    for (uint32_t p = 0; p < POOL_PAGES; p++) {
+        *(uint32_t*) page = p;
+        ASSERT_EQ((ssize_t) POOL_PAGE_SIZE, pwrite(fd, page, POOL_PAGE_SIZE, (off_t) p * POOL_PAGE_SIZE));
+    }
+    close(fd);
+}
+
+static void* pinRandomPages(void* arg)
+{
+    BufferPool* pool = (BufferPool*) arg;
+    uint32_t seed = (uint32_t) (uintptr_t) pthread_self();
+    for (uint32_t i = 0; i < 5000; i++) {
+        uint32_t page = rand_r(&seed) % POOL_PAGES;
+        uint8_t* data = pool->pin(page);
+        ASSERT_EQ(page, *(uint32_t*) data);
+        pool->unpin(page, false);
+    }
+    return NULL;
+}
+
+// Threads pinning pages, (and reading them without the pool's mutex), see
+// the right contents.
+static void bufferPoolConcurrentPins()
+{
+    static const uint32_t N_THREADS = 4;
+    writePoolFile();
+    int fd = open(path, O_RDWR);
+    ASSERT_TRUE(fd >= 0);
+    {
+        BufferPool pool(fd, POOL_PAGE_SIZE, 0);
+        pthread_t threads[N_THREADS];
+        for (uint32_t t = 0; t < N_THREADS; t++) {
+            ASSERT_EQ(0, pthread_create(&threads[t], NULL, pinRandomPages, &pool));
+        }
+        for (uint32_t t = 0; t < N_THREADS; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    close(fd);
+}
+
+// A page that can't be written, (the file is read-only), makes flush and the
+// eviction of the page throw, but the pool can still be used, and its
+// destructor doesn't throw.
+static void bufferPoolWriteFailure()
+{
+    writePoolFile();
+    int fd = open(path, O_RDONLY);
+    ASSERT_TRUE(fd >= 0);
+    {
+        BufferPool pool(fd, POOL_PAGE_SIZE, 0);
+        uint8_t* data = pool.pin(0);
+        data[4] = 1;
+        pool.unpin(0, true);
+        bool failed = false;
+        try {
+            pool.flush();
+        } catch (GeophileException& e) {
+            failed = true;
+        }
+        ASSERT_TRUE(failed);
+        failed = false;
+        for (uint32_t p = 1; p < POOL_PAGES && !failed; p++) {
+            try {
+                ASSERT_EQ(p, *(uint32_t*) pool.pin(p));
+                pool.unpin(p, false);
+            } catch (GeophileException& e) {
+                failed = true;
+            }
+        }
+        ASSERT_TRUE(failed);
+        // Still modified, and in the pool.
+        data = pool.pin(0);
+        ASSERT_EQ(1, data[4]);
+        pool.unpin(0, false);
+    }
+    close(fd);
+}
+
+static void testBufferPool()
+{
+    bufferPoolConcurrentPins();
+    bufferPoolWriteFailure();
+}
+
+//----------------------------------------------------------------------
+
+// main
+
+#define RUN_TEST(test) { printf("%s\n", #test); test(); }
+
+int main(int32_t argc, const char** argv)
+{
+    spatial_object_types.registerType(Point2::TYPE_ID, newPoint);
+    spatial_object_types.registerType(Box2::TYPE_ID, newBox);
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    RUN_TEST(testUpdates);
+    RUN_TEST(testReopen);
+    RUN_TEST(testLoad);
+    RUN_TEST(testBadFile);
+    RUN_TEST(testSpatialIndex);
+    RUN_TEST(testBufferPool);
+    unlink(path);
+    return 0;
+}
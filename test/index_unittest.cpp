@@ -4,6 +4,8 @@
 #include "geophile/testbase.h"
 #include "geophile/SpatialObjectPointer.h"
 #include "geophile/InMemorySpatialObjectReferenceManager.h"
+#include "geophile/PiecewiseLinearSearch.h"
+#include "geophile/RadixSearch.h"
 #include "RecordArray.h"
 
 using namespace geophile;
@@ -27,7 +29,52 @@ private:
 
 RecordArrayFactory RECORD_ARRAY_FACTORY;
 
+// Frozen RecordArrays are searched using a learned model instead of an
+// Eytzinger tree.
+class LearnedRecordArrayFactory : public OrderedIndexFactory<SpatialObjectPointer>
+{
+public:
+    virtual OrderedIndex<SpatialObjectPointer>* newIndex
+    (const SpatialObjectTypes* spatial_object_types) const
+    {
+        RecordArray<SpatialObjectPointer>* record_array =
+            new RecordArray<SpatialObjectPointer>(spatial_object_types,
+                                                  &_spatial_object_reference_manager,
+                                                  &memory);
+        record_array->keySearch(new PiecewiseLinearSearch());
+        return record_array;
+    }
+
+private:
+    InMemorySpatialObjectReferenceManager _spatial_object_reference_manager;
+};
+
+LearnedRecordArrayFactory LEARNED_RECORD_ARRAY_FACTORY;
+
+// Frozen RecordArrays are searched using a z-value prefix directory.
+class RadixRecordArrayFactory : public OrderedIndexFactory<SpatialObjectPointer>
+{
+public:
+    virtual OrderedIndex<SpatialObjectPointer>* newIndex
+    (const SpatialObjectTypes* spatial_object_types) const
+    {
+        RecordArray<SpatialObjectPointer>* record_array =
+            new RecordArray<SpatialObjectPointer>(spatial_object_types,
+                                                  &_spatial_object_reference_manager,
+                                                  &memory);
+        record_array->keySearch(new RadixSearch());
+        return record_array;
+    }
+
+private:
+    InMemorySpatialObjectReferenceManager _spatial_object_reference_manager;
+};
+
+RadixRecordArrayFactory RADIX_RECORD_ARRAY_FACTORY;
+
 int main(int32_t argc, const char** argv)
 {
     runTests(&RECORD_ARRAY_FACTORY);
+    runTests(&LEARNED_RECORD_ARRAY_FACTORY);
+    runTests(&RADIX_RECORD_ARRAY_FACTORY);
 }
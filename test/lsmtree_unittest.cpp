@@ -0,0 +1,185 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "geophile/testbase.h"
+#include "geophile/LSMTree.h"
+#include "geophile/SpatialObjectPointer.h"
+#include "geophile/InMemorySpatialObjectReferenceManager.h"
+#include "TestSpatialObject.h"
+
+using namespace geophile;
+
+#define ASSERT_EQ(x, y) assert((x) == (y))
+
+#define ASSERT_TRUE(x) assert(x)
+
+static SessionMemory<SpatialObjectPointer> memory;
+static SpatialObjectTypes spatial_object_types;
+static InMemorySpatialObjectReferenceManager spatial_object_reference_manager;
+
+// A small memtable, so that the shared tests create many runs and merges.
+static const uint32_t MEMTABLE_CAPACITY = 64;
+
+class LSMTreeFactory : public OrderedIndexFactory<SpatialObjectPointer>
+{
+public:
+    virtual OrderedIndex<SpatialObjectPointer>* newIndex
+    (const SpatialObjectTypes* spatial_object_types) const
+    {
+        return new LSMTree<SpatialObjectPointer>(spatial_object_types,
+                                                 &_spatial_object_reference_manager,
+                                                 &memory,
+                                                 MEMTABLE_CAPACITY);
+    }
+
+private:
+    InMemorySpatialObjectReferenceManager _spatial_object_reference_manager;
+};
+
+LSMTreeFactory LSM_TREE_FACTORY;
+
+//----------------------------------------------------------------------
+
+// Updates and scans across runs
+
+static const uint32_t N_IDS = 2000;
+
+static Z id_to_z(int64_t id)
+{
+    return Z((id * 10) << Z::LENGTH_BITS, Z::MAX_Z_BITS);
+}
+
+static void update(LSMTree<SpatialObjectPointer>* lsm_tree,
+                   TestSpatialObject** objects,
+                   bool* present,
+                   int64_t id)
+{
+    if (present[id]) {
+        SpatialObjectPointer removed = lsm_tree->remove(id_to_z(id), id);
+        ASSERT_TRUE(removed.spatialObject() == objects[id]);
+        present[id] = false;
+    } else {
+        // Removing a missing record finds, at most, a tombstone.
+        ASSERT_TRUE(lsm_tree->remove(id_to_z(id), id).isNull());
+        lsm_tree->add(id_to_z(id), objects[id]);
+        present[id] = true;
+    }
+}
+
+// Scans forward or backward from start, modifying the LSMTree as the scan
+// proceeds. Each record returned must be present, and there must be no present
+// record between it and the previous one.
+static void scan(LSMTree<SpatialObjectPointer>* lsm_tree,
+                 TestSpatialObject** objects,
+                 bool* present,
+                 int64_t start,
+                 bool forward)
+{
+    Cursor<SpatialObjectPointer>* cursor = lsm_tree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(start), start));
+    int64_t previous = forward ? start - 1 : start + 1;
+    Record<SpatialObjectPointer> record;
+    while (!(record = forward ? cursor->next() : cursor->previous()).eof()) {
+        int64_t id = record.key().soid();
+        ASSERT_TRUE(present[id]);
+        ASSERT_TRUE(record.spatialObjectReference().spatialObject() == objects[id]);
+        ASSERT_TRUE(forward ? id > previous : id < previous);
+        for (int64_t skipped = forward ? previous + 1 : id + 1;
+             skipped < (forward ? id : previous);
+             skipped++) {
+            ASSERT_TRUE(!present[skipped]);
+        }
+        previous = id;
+        // Modify the LSMTree anywhere, including the records just returned.
+        for (uint32_t i = rand() % 4; i > 0; i--) {
+            update(lsm_tree, objects, present, rand() % N_IDS);
+        }
+    }
+    for (int64_t skipped = forward ? previous + 1 : 0;
+         skipped < (forward ? N_IDS : previous);
+         skipped++) {
+        ASSERT_TRUE(!present[skipped]);
+    }
+    delete cursor;
+}
+
+static void testUpdatesAcrossRuns()
+{
+    LSMTree<SpatialObjectPointer>* lsm_tree =
+        new LSMTree<SpatialObjectPointer>(&spatial_object_types,
+                                          &spatial_object_reference_manager,
+                                          &memory,
+                                          16);
+    TestSpatialObject** objects = new TestSpatialObject*[N_IDS];
+    bool* present = new bool[N_IDS];
+    for (int64_t id = 0; id < N_IDS; id++) {
+        objects[id] = new TestSpatialObject(id);
+        present[id] = false;
+    }
+    srand(419);
+    for (uint32_t i = 0; i < 200; i++) {
+        // Grow the LSMTree, then shrink it, so that tombstones in newer runs
+        // hide records in older ones.
+        uint32_t n_updates = rand() % (N_IDS / 2);
+        for (uint32_t u = 0; u < n_updates; u++) {
+            int64_t id = rand() % N_IDS;
+            if (present[id] == (i % 40 >= 20)) {
+                update(lsm_tree, objects, present, id);
+            }
+        }
+        scan(lsm_tree, objects, present, rand() % N_IDS, i % 2 == 0);
+    }
+    // After merging, the runs grow geometrically: 16, 64, 256, ... records.
+    lsm_tree->freeze();
+    ASSERT_TRUE(lsm_tree->nRuns() <= 6);
+    // Loaded records replace older versions.
+    uint32_t n_load = 0;
+    Record<SpatialObjectPointer>* records = new Record<SpatialObjectPointer>[N_IDS / 2];
+    for (int64_t id = 0; id < N_IDS; id += 2) {
+        records[n_load++].set(id_to_z(id), SpatialObjectPointer(objects[id]));
+        present[id] = true;
+    }
+    lsm_tree->load(records, n_load);
+    delete [] records;
+    scan(lsm_tree, objects, present, 0, true);
+    // skipTo lands on the first record at or after the key. (The key must not
+    // precede the last record returned.)
+    Cursor<SpatialObjectPointer>* cursor = lsm_tree->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0), 0));
+    cursor->next();
+    int64_t target = 1;
+    while (target < N_IDS) {
+        cursor->skipTo(SpatialObjectKey(id_to_z(target), target));
+        Record<SpatialObjectPointer> record = cursor->next();
+        int64_t expected = target;
+        while (expected < N_IDS && !present[expected]) {
+            expected++;
+        }
+        if (expected == N_IDS) {
+            ASSERT_TRUE(record.eof());
+            break;
+        }
+        ASSERT_EQ(expected, record.key().soid());
+        target = expected + 1 + rand() % 50;
+    }
+    delete cursor;
+    delete lsm_tree;
+    for (int64_t id = 0; id < N_IDS; id++) {
+        delete objects[id];
+    }
+    delete [] objects;
+    delete [] present;
+}
+
+//----------------------------------------------------------------------
+
+// main
+
+#define RUN_TEST(test) { printf("%s\n", #test); test(); }
+
+int main(int32_t argc, const char** argv)
+{
+    RUN_TEST(testUpdatesAcrossRuns);
+    runTests(&LSM_TREE_FACTORY);
+}
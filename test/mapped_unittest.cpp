@@ -0,0 +1,405 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "geophile/geophile.h"
+#include "geophile/MappedIndex.h"
+#include "TestSpatialObject.h"
+
+using namespace geophile;
+
+#define ASSERT_EQ(x, y) assert((x) == (y))
+
+#define ASSERT_TRUE(x) assert(x)
+
+static SessionMemory<SpatialObjectPointer> memory;
+static SpatialObjectTypes spatial_object_types;
+static InMemorySpatialObjectReferenceManager spatial_object_reference_manager;
+static char path[] = "/tmp/mapped_unittest_XXXXXX";
+
+static SpatialObject* newTestSpatialObject()
+{
+    return new TestSpatialObject();
+}
+
+static SpatialObject* newBox()
+{
+    return new Box2();
+}
+
+static Z id_to_z(int64_t id)
+{
+    return Z((id * 10) << Z::LENGTH_BITS, Z::MAX_Z_BITS);
+}
+
+static int64_t z_to_id(Z z)
+{
+    return (z.asInteger() >> Z::LENGTH_BITS) / 10;
+}
+
+static MappedIndex<SpatialObjectPointer>* writeAndOpen(OrderedIndex<SpatialObjectPointer>* index)
+{
+    MappedIndex<SpatialObjectPointer>::write(index, path);
+    return new MappedIndex<SpatialObjectPointer>(&spatial_object_types,
+                                                 &spatial_object_reference_manager,
+                                                 &memory,
+                                                 path);
+}
+
+// Checks that the records of cursor match those of expected: same keys, and
+// spatial objects with the same ids.
+static void checkSame(Cursor<SpatialObjectPointer>* expected,
+                      Cursor<SpatialObjectPointer>* actual,
+                      bool forward)
+{
+    Record<SpatialObjectPointer> e;
+    Record<SpatialObjectPointer> a;
+    do {
+        e = forward ? expected->next() : expected->previous();
+        a = forward ? actual->next() : actual->previous();
+        ASSERT_EQ(e.eof(), a.eof());
+        if (!e.eof()) {
+            ASSERT_EQ(0, e.key().compare(a.key()));
+            ASSERT_EQ(e.spatialObjectReference().spatialObject()->id(),
+                      a.spatialObjectReference().spatialObject()->id());
+        }
+    } while (!e.eof());
+}
+
+//----------------------------------------------------------------------
+
+// Round trip
+
+// Each object has up to 3 z-values, so objects are shared by records, and
+// the keys span several blocks.
+static void testRoundTrip()
+{
+    static const uint32_t N_OBJECTS = 3000;
+    BTree<SpatialObjectPointer>* btree =
+        new BTree<SpatialObjectPointer>(&spatial_object_types,
+                                        &spatial_object_reference_manager,
+                                        &memory);
+    TestSpatialObject** objects = new TestSpatialObject*[N_OBJECTS];
+    for (int64_t id = 0; id < N_OBJECTS; id++) {
+        objects[id] = new TestSpatialObject(id);
+        for (int64_t z = id; z <= id + id % 3; z++) {
+            btree->add(id_to_z(z), objects[id]);
+        }
+    }
+    MappedIndex<SpatialObjectPointer>* mapped = writeAndOpen(btree);
+    ASSERT_EQ(btree->nRecords(), mapped->nRecords());
+    ASSERT_EQ(1ULL << Z::MAX_Z_BITS, mapped->zLengths());
+    Cursor<SpatialObjectPointer>* expected = btree->cursor();
+    Cursor<SpatialObjectPointer>* actual = mapped->cursor();
+    srand(14014);
+    for (uint32_t trial = 0; trial < 500; trial++) {
+        int64_t z = rand() % (N_OBJECTS + 10);
+        int64_t soid = z - 1 + rand() % 3;
+        SpatialObjectKey key(id_to_z(z), soid);
+        bool forward = trial % 2 == 0;
+        expected->goTo(key);
+        actual->goTo(key);
+        // Change direction after a few records.
+        for (uint32_t i = 0; i < 5; i++) {
+            Record<SpatialObjectPointer> e = forward ? expected->next() : expected->previous();
+            Record<SpatialObjectPointer> a = forward ? actual->next() : actual->previous();
+            ASSERT_EQ(e.eof(), a.eof());
+            if (!e.eof()) {
+                ASSERT_EQ(0, e.key().compare(a.key()));
+            }
+        }
+        checkSame(expected, actual, !forward);
+    }
+    // skipTo, short and long distances
+    expected->goTo(SpatialObjectKey(id_to_z(0)));
+    actual->goTo(SpatialObjectKey(id_to_z(0)));
+    expected->next();
+    actual->next();
+    int64_t target = 1;
+    while (target < N_OBJECTS) {
+        SpatialObjectKey key(id_to_z(target), target);
+        expected->skipTo(key);
+        actual->skipTo(key);
+        Record<SpatialObjectPointer> e = expected->next();
+        Record<SpatialObjectPointer> a = actual->next();
+        ASSERT_EQ(e.eof(), a.eof());
+        if (e.eof()) {
+            break;
+        }
+        ASSERT_EQ(0, e.key().compare(a.key()));
+        target = z_to_id(a.key().z()) + 1 + rand() % (rand() % 2 == 0 ? 10 : 1000);
+    }
+    delete expected;
+    delete actual;
+    // Objects are deserialized, not shared with the original index.
+    Cursor<SpatialObjectPointer>* cursor = mapped->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0)));
+    Record<SpatialObjectPointer> record = cursor->next();
+    ASSERT_TRUE(record.spatialObjectReference().spatialObject() != objects[0]);
+    ASSERT_EQ(0, record.spatialObjectReference().spatialObject()->id());
+    delete cursor;
+    // Read-only
+    bool rejected = false;
+    try {
+        mapped->add(id_to_z(0), objects[0]);
+    } catch (GeophileException& e) {
+        rejected = true;
+    }
+    ASSERT_TRUE(rejected);
+    delete mapped;
+    delete btree;
+    for (int64_t id = 0; id < N_OBJECTS; id++) {
+        delete objects[id];
+    }
+    delete [] objects;
+}
+
+static void testEmpty()
+{
+    BTree<SpatialObjectPointer>* btree =
+        new BTree<SpatialObjectPointer>(&spatial_object_types,
+                                        &spatial_object_reference_manager,
+                                        &memory);
+    MappedIndex<SpatialObjectPointer>* mapped = writeAndOpen(btree);
+    ASSERT_EQ(0, mapped->nRecords());
+    Cursor<SpatialObjectPointer>* cursor = mapped->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0)));
+    ASSERT_TRUE(cursor->next().eof());
+    cursor->goTo(SpatialObjectKey(id_to_z(0)));
+    ASSERT_TRUE(cursor->previous().eof());
+    delete cursor;
+    delete mapped;
+    delete btree;
+}
+
+static void testBadFile()
+{
+    FILE* file = fopen(path, "wb");
+    for (uint32_t i = 0; i < 1000; i++) {
+        fputc(i, file);
+    }
+    fclose(file);
+    bool rejected = false;
+    try {
+        MappedIndex<SpatialObjectPointer> mapped(&spatial_object_types,
+                                                 &spatial_object_reference_manager,
+                                                 &memory,
+                                                 path);
+    } catch (GeophileException& e) {
+        rejected = true;
+    }
+    ASSERT_TRUE(rejected);
+}
+
+// Positions of MappedIndex::Header fields, for corrupting a file.
+static const long HEADER_N_OBJECTS = 24;
+static const long HEADER_OBJECTS_OFFSET = 56;
+
+static uint64_t readFile(long position, uint32_t size)
+{
+    uint64_t value = 0;
+    FILE* file = fopen(path, "rb");
+    fseek(file, position, SEEK_SET);
+    ASSERT_EQ(1, fread(&value, size, 1, file));
+    fclose(file);
+    return value;
+}
+
+static void patchFile(long position, uint64_t value, uint32_t size)
+{
+    FILE* file = fopen(path, "r+b");
+    fseek(file, position, SEEK_SET);
+    ASSERT_EQ(1, fwrite(&value, size, 1, file));
+    fclose(file);
+}
+
+// A header whose sizes overflow, and an out-of-range object number, are
+// rejected, not used to read outside the file.
+static void testCorruptFile()
+{
+    static const uint32_t N_OBJECTS = 10;
+    BTree<SpatialObjectPointer>* btree =
+        new BTree<SpatialObjectPointer>(&spatial_object_types,
+                                        &spatial_object_reference_manager,
+                                        &memory);
+    TestSpatialObject** objects = new TestSpatialObject*[N_OBJECTS];
+    for (int64_t id = 0; id < N_OBJECTS; id++) {
+        objects[id] = new TestSpatialObject(id);
+        btree->add(id_to_z(id), objects[id]);
+    }
+    // (n_objects + 1) * 8 overflows to 0.
+    MappedIndex<SpatialObjectPointer>::write(btree, path);
+    patchFile(HEADER_N_OBJECTS, (1ULL << 61) - 1, sizeof(uint64_t));
+    bool rejected = false;
+    try {
+        MappedIndex<SpatialObjectPointer> mapped(&spatial_object_types,
+                                                 &spatial_object_reference_manager,
+                                                 &memory,
+                                                 path);
+    } catch (GeophileException& e) {
+        rejected = true;
+    }
+    ASSERT_TRUE(rejected);
+    // The first record's object number is past the objects.
+    MappedIndex<SpatialObjectPointer>::write(btree, path);
+    patchFile(readFile(HEADER_OBJECTS_OFFSET, sizeof(uint64_t)), 0xffffffff, sizeof(uint32_t));
+    MappedIndex<SpatialObjectPointer>* mapped =
+        new MappedIndex<SpatialObjectPointer>(&spatial_object_types,
+                                              &spatial_object_reference_manager,
+                                              &memory,
+                                              path);
+    Cursor<SpatialObjectPointer>* cursor = mapped->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0)));
+    rejected = false;
+    try {
+        cursor->next();
+    } catch (GeophileException& e) {
+        rejected = true;
+    }
+    ASSERT_TRUE(rejected);
+    delete cursor;
+    delete mapped;
+    delete btree;
+    for (int64_t id = 0; id < N_OBJECTS; id++) {
+        delete objects[id];
+    }
+    delete [] objects;
+}
+
+//----------------------------------------------------------------------
+
+// Spatial index over a MappedIndex
+
+static bool overlap(const Box2* a, const Box2* b)
+{
+    return
+        a->xlo() <= b->xhi() && b->xlo() <= a->xhi() &&
+        a->ylo() <= b->yhi() && b->ylo() <= a->yhi();
+}
+
+class BoxFilter : public SpatialIndexFilter
+{
+public:
+    virtual bool overlap(const SpatialObject* query_object,
+                         const SpatialObject* spatial_object) const
+    {
+        return ::overlap((const Box2*) query_object, (const Box2*) spatial_object);
+    }
+};
+
+static int32_t compareIds(const void* x, const void* y)
+{
+    int64_t p = *(const int64_t*) x;
+    int64_t q = *(const int64_t*) y;
+    return p < q ? -1 : p > q ? 1 : 0;
+}
+
+// Distinct ids of the output, sorted
+static uint32_t outputIds(SessionMemory<SpatialObjectPointer>* memory, int64_t* ids)
+{
+    OutputArray<SpatialObjectPointer>* output = memory->output();
+    for (uint32_t i = 0; i < output->length(); i++) {
+        ids[i] = output->at(i).spatialObject()->id();
+    }
+    qsort(ids, output->length(), sizeof(int64_t), compareIds);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < output->length(); i++) {
+        if (n == 0 || ids[i] != ids[n - 1]) {
+            ids[n++] = ids[i];
+        }
+    }
+    memory->clearOutput();
+    return n;
+}
+
+// The mapped index reports the z-value lengths present, so that retrieval
+// finds large boxes, (with short z-values), containing the query.
+static void testSpatialIndex()
+{
+    static const uint32_t X_MAX = 1000;
+    static const uint32_t Y_MAX = 1000;
+    static const uint32_t N_BOXES = 2000;
+    static const uint32_t N_QUERIES = 100;
+    double lo[] = {0.0, 0.0};
+    double hi[] = {X_MAX, Y_MAX};
+    uint32_t x_bits[] = {10, 10};
+    Space* space = new Space(2, lo, hi, x_bits);
+    BTree<SpatialObjectPointer>* btree =
+        new BTree<SpatialObjectPointer>(&spatial_object_types,
+                                        &spatial_object_reference_manager,
+                                        &memory);
+    SpatialIndex<SpatialObjectPointer>* spatial_index =
+        new SpatialIndex<SpatialObjectPointer>(space, btree, &spatial_object_reference_manager);
+    srand(1414);
+    Box2** boxes = new Box2*[N_BOXES];
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        double size = b % 100 == 0 ? 500 : 10;
+        double xlo = rand() % (uint32_t) (X_MAX - size);
+        double ylo = rand() % (uint32_t) (Y_MAX - size);
+        boxes[b] = new Box2(xlo, xlo + size, ylo, ylo + size);
+        boxes[b]->id(b);
+        spatial_index->add(boxes[b], &memory);
+    }
+    spatial_index->freeze();
+    MappedIndex<SpatialObjectPointer>* mapped = writeAndOpen(btree);
+    SpatialIndex<SpatialObjectPointer>* mapped_spatial_index =
+        new SpatialIndex<SpatialObjectPointer>(space, mapped, &spatial_object_reference_manager);
+    BoxFilter filter;
+    int64_t* expected = new int64_t[N_BOXES * 100];
+    int64_t* actual = new int64_t[N_BOXES * 100];
+    for (uint32_t q = 0; q < N_QUERIES; q++) {
+        double xlo = rand() % (X_MAX - 20);
+        double ylo = rand() % (Y_MAX - 20);
+        Box2 query(xlo, xlo + 20, ylo, ylo + 20);
+        query.id(N_BOXES + q);
+        uint32_t n_brute_force = 0;
+        for (uint32_t b = 0; b < N_BOXES; b++) {
+            if (overlap(&query, boxes[b])) {
+                n_brute_force++;
+            }
+        }
+        spatial_index->findOverlapping(&query, &filter, &memory);
+        uint32_t n_expected = outputIds(&memory, expected);
+        mapped_spatial_index->findOverlapping(&query, &filter, &memory);
+        uint32_t n_actual = outputIds(&memory, actual);
+        ASSERT_EQ(n_brute_force, n_expected);
+        ASSERT_EQ(n_expected, n_actual);
+        for (uint32_t i = 0; i < n_actual; i++) {
+            ASSERT_EQ(expected[i], actual[i]);
+        }
+    }
+    delete [] expected;
+    delete [] actual;
+    delete mapped_spatial_index;
+    delete mapped;
+    delete spatial_index;
+    delete btree;
+    delete space;
+    for (uint32_t b = 0; b < N_BOXES; b++) {
+        delete boxes[b];
+    }
+    delete [] boxes;
+}
+
+//----------------------------------------------------------------------
+
+// main
+
+#define RUN_TEST(test) { printf("%s\n", #test); test(); }
+
+int main(int32_t argc, const char** argv)
+{
+    spatial_object_types.registerType(TestSpatialObject::TYPE_ID, newTestSpatialObject);
+    spatial_object_types.registerType(Box2::TYPE_ID, newBox);
+    int fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0);
+    close(fd);
+    RUN_TEST(testRoundTrip);
+    RUN_TEST(testEmpty);
+    RUN_TEST(testBadFile);
+    RUN_TEST(testCorruptFile);
+    RUN_TEST(testSpatialIndex);
+    unlink(path);
+    return 0;
+}
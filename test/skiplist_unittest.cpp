@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+
+#include "geophile/testbase.h"
+#include "geophile/ConcurrentSkipList.h"
+#include "geophile/Epoch.h"
+#include "geophile/Threads.h"
+#include "geophile/SpatialObjectPointer.h"
+#include "geophile/InMemorySpatialObjectReferenceManager.h"
+#include "TestSpatialObject.h"
+
+using namespace geophile;
+
+#define ASSERT_EQ(x, y) assert((x) == (y))
+
+#define ASSERT_TRUE(x) assert(x)
+
+static SessionMemory<SpatialObjectPointer> memory;
+static SpatialObjectTypes spatial_object_types;
+static InMemorySpatialObjectReferenceManager spatial_object_reference_manager;
+
+class ConcurrentSkipListFactory : public OrderedIndexFactory<SpatialObjectPointer>
+{
+public:
+    virtual OrderedIndex<SpatialObjectPointer>* newIndex
+    (const SpatialObjectTypes* spatial_object_types) const
+    {
+        return new ConcurrentSkipList<SpatialObjectPointer>(spatial_object_types,
+                                                            &_spatial_object_reference_manager,
+                                                            &memory);
+    }
+
+private:
+    InMemorySpatialObjectReferenceManager _spatial_object_reference_manager;
+};
+
+ConcurrentSkipListFactory CONCURRENT_SKIP_LIST_FACTORY;
+
+//----------------------------------------------------------------------
+
+// Concurrent updates and scans
+
+// Ids that are multiples of STABLE are added before the threads start, and
+// are never removed. Writer w adds and removes the other ids congruent to w
+// mod N_WRITERS, ending with the even ones present. Readers scan while the
+// writers run.
+static const uint32_t N_WRITERS = 4;
+static const uint32_t N_READERS = 2;
+static const uint32_t N_IDS = 20000;
+static const uint32_t STABLE = 16;
+static const uint32_t ROUNDS = 5;
+static const uint32_t MAX_SCANS = 10000;
+
+static Z id_to_z(int64_t id)
+{
+    return Z((id * 10) << Z::LENGTH_BITS, Z::MAX_Z_BITS);
+}
+
+struct ConcurrentTest
+{
+    ConcurrentSkipList<SpatialObjectPointer>* skiplist;
+    TestSpatialObject** objects;
+    std::atomic<uint32_t> writers_done;
+    std::atomic<uint32_t> scans;
+};
+
+static void write(ConcurrentTest* test, uint32_t writer)
+{
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        for (int64_t id = writer; id < N_IDS; id += N_WRITERS) {
+            if (id % STABLE != 0) {
+                test->skiplist->add(id_to_z(id), test->objects[id]);
+            }
+        }
+        for (int64_t id = writer; id < N_IDS; id += N_WRITERS) {
+            if (id % STABLE != 0 && (round < ROUNDS - 1 || id % 2 == 1)) {
+                SpatialObjectPointer removed = test->skiplist->remove(id_to_z(id), id);
+                ASSERT_TRUE(removed.spatialObject() == test->objects[id]);
+            }
+        }
+    }
+    test->writers_done++;
+}
+
+static void read(ConcurrentTest* test)
+{
+    uint32_t scans = 0;
+    do {
+        Cursor<SpatialObjectPointer>* cursor = test->skiplist->cursor();
+        cursor->goTo(SpatialObjectKey(id_to_z(0), 0));
+        int64_t previous = -1;
+        int64_t next_stable = 0;
+        Record<SpatialObjectPointer> record;
+        while (!(record = cursor->next()).eof()) {
+            int64_t id = record.key().soid();
+            ASSERT_TRUE(id > previous);
+            ASSERT_TRUE(record.spatialObjectReference().spatialObject() == test->objects[id]);
+            // No stable id is skipped.
+            ASSERT_TRUE(id <= next_stable);
+            if (id == next_stable) {
+                next_stable += STABLE;
+            }
+            previous = id;
+        }
+        ASSERT_TRUE(next_stable >= N_IDS);
+        delete cursor;
+        scans++;
+    } while (test->writers_done.load() < N_WRITERS && scans < MAX_SCANS);
+    test->scans += scans;
+}
+
+static void runConcurrentTest(void* argument, uint32_t thread)
+{
+    ConcurrentTest* test = (ConcurrentTest*) argument;
+    if (thread < N_WRITERS) {
+        write(test, thread);
+    } else {
+        read(test);
+    }
+}
+
+static void testConcurrentUpdatesAndScans()
+{
+    ConcurrentTest test;
+    test.skiplist =
+        new ConcurrentSkipList<SpatialObjectPointer>(&spatial_object_types,
+                                                     &spatial_object_reference_manager,
+                                                     &memory);
+    test.objects = new TestSpatialObject*[N_IDS];
+    test.writers_done = 0;
+    test.scans = 0;
+    for (int64_t id = 0; id < N_IDS; id++) {
+        test.objects[id] = new TestSpatialObject(id);
+        if (id % STABLE == 0) {
+            test.skiplist->add(id_to_z(id), test.objects[id]);
+        }
+    }
+    uint64_t start_epoch = Epoch::current();
+    Threads::run(N_WRITERS + N_READERS, runConcurrentTest, &test);
+    ASSERT_TRUE(test.scans.load() >= N_READERS);
+    // Removed nodes were reclaimed along the way.
+    ASSERT_TRUE(Epoch::current() > start_epoch);
+    // Stable ids and even ids are present, odd ids aren't.
+    Cursor<SpatialObjectPointer>* cursor = test.skiplist->cursor();
+    cursor->goTo(SpatialObjectKey(id_to_z(0), 0));
+    uint32_t n = 0;
+    int64_t expected = 0;
+    Record<SpatialObjectPointer> record;
+    while (!(record = cursor->next()).eof()) {
+        ASSERT_EQ(expected, record.key().soid());
+        expected += 2;
+        n++;
+    }
+    delete cursor;
+    ASSERT_EQ(N_IDS / 2, n);
+    ASSERT_EQ(N_IDS / 2, test.skiplist->nRecords());
+    // Adding a key that is present has no effect.
+    test.skiplist->add(id_to_z(0), test.objects[0]);
+    ASSERT_EQ(N_IDS / 2, test.skiplist->nRecords());
+    delete test.skiplist;
+    for (int64_t id = 0; id < N_IDS; id++) {
+        delete test.objects[id];
+    }
+    delete [] test.objects;
+}
+
+//----------------------------------------------------------------------
+
+// main
+
+#define RUN_TEST(test) { printf("%s\n", #test); test(); }
+
+int main(int32_t argc, const char** argv)
+{
+    RUN_TEST(testConcurrentUpdatesAndScans);
+    runTests(&CONCURRENT_SKIP_LIST_FACTORY);
+}